@@ -0,0 +1,330 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#include <benchmark/benchmark.h>
+
+#include "knightboard.h"
+#include "dynamic_board.h"
+#include "board_generator.h"
+#include "search_workspace.h"
+#include "level1.h"
+#include "level2.h"
+#include "level3.h"
+#include "level4.h"
+#include "level5.h"
+#include "hierarchical.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <unordered_set>
+
+/*
+ * Google Benchmark suite for every level, on the 8x8 board, the 32x32 map
+ * in ~/knightboard.txt, and generated square boards of 256, 1024 and 4096
+ * with a few terrain mixes. Benchmarks are named
+ * <function>/<board>, so that --benchmark_filter can pick either.
+ *
+ * Run the `bench_json` target (or pass --benchmark_out=FILE
+ * --benchmark_out_format=json) to save results, and compare two runs with
+ * bench/compare.py.
+ */
+
+namespace {
+
+// Terrain of the generated boards
+struct TerrainMix {
+    const char *name;
+    TerrainLayer rock;
+    TerrainLayer water;
+    TerrainLayer lava;
+    int wall_spacing;
+};
+
+const TerrainMix TERRAIN_MIXES[] = {
+        {"open",  {0,    0},   {0,    0},   {0,    0},   0},
+        {"mixed", {0.08, 0.5}, {0.1,  0.8}, {0.05, 0.5}, 64},
+        {"dense", {0.15, 0.3}, {0.15, 0.8}, {0.1,  0.5}, 24},
+};
+
+const int GENERATED_SIZES[] = {256, 1024, 4096};
+
+DynamicBoard generate_board(int size, const TerrainMix &mix) {
+    BoardGeneratorOptions options;
+    options.rows = size;
+    options.cols = size;
+    options.seed = 42;
+    options.rock = mix.rock;
+    options.water = mix.water;
+    options.lava = mix.lava;
+    options.wall_spacing = mix.wall_spacing;
+    return BoardGenerator(options).to_dynamic_board();
+}
+
+// A board, with a query that the searches can answer
+template<typename BOARD>
+struct BenchCase {
+    std::unique_ptr<BOARD> board;
+    typename BOARD::Pos begin;
+    typename BOARD::Pos finish;
+    typename BOARD::PosVec path;
+};
+
+/*
+ * Picks the reachable square closest to target as the finish, so that
+ * every search has something to find. Only squares within a bounded BFS
+ * from begin are considered: on the big boards that keeps queries local,
+ * which is what they'd look like in practice.
+ */
+template<typename BOARD>
+BenchCase<BOARD> make_case(std::unique_ptr<BOARD> board, typename BOARD::Pos begin, typename BOARD::Pos target) {
+    const auto begin_sq = board->square(begin);
+    if (begin_sq == BoardSquare::Rock || begin_sq == BoardSquare::Barrier) {
+        throw std::runtime_error("Benchmark queries must start on a free square");
+    }
+
+    auto distance2 = [&target](const typename BOARD::Pos &pos) {
+        return (pos.x - target.x) * (pos.x - target.x) + (pos.y - target.y) * (pos.y - target.y);
+    };
+
+    std::vector<typename BOARD::Pos> queue{begin};
+    std::unordered_set<uint32_t> seen{board->index_of(begin)};
+    auto finish = begin;
+    for (size_t head = 0; head < queue.size() && queue.size() < (1 << 16); head++) {
+        for (const auto &adj : board->adjacent_positions(queue[head])) {
+            if (seen.insert(board->index_of(adj.first)).second) {
+                queue.push_back(adj.first);
+                if (distance2(adj.first) < distance2(finish)) {
+                    finish = adj.first;
+                }
+            }
+        }
+    }
+    if (finish == begin) {
+        throw std::runtime_error("Nothing reachable for the benchmark query");
+    }
+
+    SearchWorkspace workspace;
+    auto path = shortest_path_simple(*board, begin, finish, workspace);
+    return BenchCase<BOARD>{std::move(board), begin, finish, std::move(path)};
+}
+
+// Generated boards take a while to build, so they're only built if a
+// benchmark that uses them runs
+const BenchCase<DynamicBoard> &generated_case(int size, const TerrainMix &mix) {
+    static std::map<std::pair<int, std::string>, BenchCase<DynamicBoard>> cache;
+
+    auto key = std::make_pair(size, std::string(mix.name));
+    auto it = cache.find(key);
+    if (it == cache.end()) {
+        auto board = generate_board(size, mix);
+        // Starting from the middle, or the closest square on the diagonal
+        // that isn't walled in
+        for (int d = 0; d < size / 2 && it == cache.end(); d++) {
+            DynamicBoard::Pos begin(size / 2 + d, size / 2 + d);
+            DynamicBoard::Pos target(begin.x + 24, begin.y + 24);
+            try {
+                std::unique_ptr<DynamicBoard> copy(new DynamicBoard(board));
+                it = cache.emplace(key, make_case(std::move(copy), begin, target)).first;
+            } catch (const std::runtime_error &) {
+            }
+        }
+        if (it == cache.end()) {
+            throw std::runtime_error("No benchmark query on the generated board");
+        }
+    }
+    return it->second;
+}
+
+const BenchCase<Board8> &board8_case() {
+    static auto bench_case = make_case(std::unique_ptr<Board8>(new Board8()), Pos8(0, 0), Pos8(7, 7));
+    return bench_case;
+}
+
+const BenchCase<Board32> &board32_case() {
+    static auto bench_case = [] {
+        std::unique_ptr<Board32> board(new Board32());
+        board->load_from_file();
+        return make_case(std::move(board), Pos32(9, 30), Pos32(26, 0));
+    }();
+    return bench_case;
+}
+
+template<typename BOARD>
+void bm_is_valid_step_sequence(benchmark::State &state, const BenchCase<BOARD> &bench_case) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(is_valid_step_sequence(*bench_case.board, bench_case.path));
+    }
+    state.SetItemsProcessed(state.iterations() * (bench_case.path.size() - 1));
+}
+
+template<typename BOARD>
+void bm_adjacent_positions(benchmark::State &state, const BenchCase<BOARD> &bench_case) {
+    // The squares of a 32x32 window, at most
+    const auto &board = *bench_case.board;
+    const int rows = std::min(board.rows(), 32);
+    const int cols = std::min(board.cols(), 32);
+
+    for (auto _ : state) {
+        for (int r = 0; r < rows; r++) {
+            for (int c = 0; c < cols; c++) {
+                typename BOARD::Pos pos(r, c);
+                if (board.square(pos) != BoardSquare::Teleport) {
+                    benchmark::DoNotOptimize(board.adjacent_positions(pos));
+                }
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * rows * cols);
+}
+
+template<typename BOARD>
+void bm_some_path_simple(benchmark::State &state, const BenchCase<BOARD> &bench_case) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(some_path_simple(*bench_case.board, bench_case.begin, bench_case.finish));
+    }
+}
+
+template<typename BOARD>
+void bm_shortest_path_simple(benchmark::State &state, const BenchCase<BOARD> &bench_case) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(shortest_path_simple(*bench_case.board, bench_case.begin, bench_case.finish));
+    }
+}
+
+template<typename BOARD>
+void bm_shortest_path_simple_workspace(benchmark::State &state, const BenchCase<BOARD> &bench_case) {
+    SearchWorkspace workspace;
+    // Leaves out allocating the workspace
+    shortest_path_simple(*bench_case.board, bench_case.begin, bench_case.finish, workspace);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+                shortest_path_simple(*bench_case.board, bench_case.begin, bench_case.finish, workspace));
+    }
+}
+
+template<typename BOARD>
+void bm_shortest_path_lvl4(benchmark::State &state, const BenchCase<BOARD> &bench_case) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(shortest_path_lvl4(*bench_case.board, bench_case.begin, bench_case.finish));
+    }
+}
+
+template<typename BOARD>
+void bm_shortest_path_lvl4_workspace(benchmark::State &state, const BenchCase<BOARD> &bench_case) {
+    SearchWorkspace workspace;
+    // Leaves out allocating the workspace
+    shortest_path_lvl4(*bench_case.board, bench_case.begin, bench_case.finish, workspace);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+                shortest_path_lvl4(*bench_case.board, bench_case.begin, bench_case.finish, workspace));
+    }
+}
+
+template<typename BOARD>
+void bm_shortest_path_astar(benchmark::State &state, const BenchCase<BOARD> &bench_case) {
+    SearchWorkspace workspace;
+    // Leaves out allocating the workspace
+    shortest_path_astar(*bench_case.board, bench_case.begin, bench_case.finish, workspace);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+                shortest_path_astar(*bench_case.board, bench_case.begin, bench_case.finish, workspace));
+    }
+}
+
+// Only the query: the tables are built before timing
+// Building the abstract graph takes a while, so it's done once per board,
+// like the boards themselves
+HierarchicalPlanner<DynamicBoard> &hierarchical_planner(const BenchCase<DynamicBoard> &bench_case) {
+    static std::map<const DynamicBoard *, std::unique_ptr<HierarchicalPlanner<DynamicBoard>>> cache;
+
+    auto &planner = cache[bench_case.board.get()];
+    if (!planner) {
+        planner.reset(new HierarchicalPlanner<DynamicBoard>(*bench_case.board));
+    }
+    return *planner;
+}
+
+void bm_hierarchical_route(benchmark::State &state, const BenchCase<DynamicBoard> &bench_case) {
+    auto &planner = hierarchical_planner(bench_case);
+    SearchWorkspace workspace;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(planner.route(bench_case.begin, bench_case.finish, workspace));
+    }
+}
+
+void bm_longest_path_dp(benchmark::State &state) {
+    // 2^16 visited sets, the largest board the DP table fits for
+    Board<4> board;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(longest_path_dp(board));
+    }
+}
+
+template<typename BOARD>
+void bm_longest_path_exact(benchmark::State &state, const BenchCase<BOARD> &bench_case) {
+    // A fixed amount of work, on a single thread
+    LongestPathOptions options;
+    options.threads = 1;
+    options.node_budget = 100000;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(longest_path_exact(*bench_case.board, bench_case.begin,
+                                                    std::experimental::nullopt, options));
+    }
+    state.SetItemsProcessed(state.iterations() * options.node_budget);
+}
+
+// Registers every benchmark that runs on a board
+template<typename BOARD>
+void register_board(const std::string &name,
+                    std::function<const BenchCase<BOARD> &()> get_case,
+                    bool with_longest_path) {
+    auto add = [&](const std::string &function, void (*bm)(benchmark::State &, const BenchCase<BOARD> &)) {
+        return benchmark::RegisterBenchmark((function + "/" + name).c_str(), [bm, get_case](benchmark::State &state) {
+            bm(state, get_case());
+        })->Unit(benchmark::kMicrosecond);
+    };
+
+    add("is_valid_step_sequence", bm_is_valid_step_sequence<BOARD>);
+    add("adjacent_positions", bm_adjacent_positions<BOARD>);
+    add("some_path_simple", bm_some_path_simple<BOARD>);
+    add("shortest_path_simple", bm_shortest_path_simple<BOARD>);
+    add("shortest_path_simple_workspace", bm_shortest_path_simple_workspace<BOARD>);
+    add("shortest_path_lvl4", bm_shortest_path_lvl4<BOARD>);
+    add("shortest_path_lvl4_workspace", bm_shortest_path_lvl4_workspace<BOARD>);
+    add("shortest_path_astar", bm_shortest_path_astar<BOARD>);
+    if (with_longest_path) {
+        // Runs on a worker thread, so CPU time of the main one means nothing
+        add("longest_path_exact", bm_longest_path_exact<BOARD>)->UseRealTime();
+    }
+}
+
+}
+
+int main(int argc, char **argv) {
+    register_board<Board8>("8", board8_case, true);
+    register_board<Board32>("knightboard", board32_case, true);
+    for (int size : GENERATED_SIZES) {
+        for (const auto &mix : TERRAIN_MIXES) {
+            auto get_case = [size, &mix]() -> const BenchCase<DynamicBoard> & {
+                return generated_case(size, mix);
+            };
+            const auto name = std::to_string(size) + "_" + mix.name;
+            register_board<DynamicBoard>(name, get_case, false);
+            benchmark::RegisterBenchmark(("hierarchical_route/" + name).c_str(), [get_case](benchmark::State &state) {
+                bm_hierarchical_route(state, get_case());
+            })->Unit(benchmark::kMicrosecond);
+        }
+    }
+    benchmark::RegisterBenchmark("longest_path_dp/4", bm_longest_path_dp)->Unit(benchmark::kMillisecond);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+# Created by Nicolo' Valigi
+# 2016-10-06
+# License: MIT
+
+"""
+Compares two Google Benchmark JSON files (e.g. from the bench_json target),
+benchmark by benchmark, and exits with status 1 if anything got slower than
+the threshold.
+
+    bench/compare.py baseline.json contender.json [--threshold 0.1] [--metric cpu_time]
+
+With --benchmark_repetitions, the mean of each benchmark is compared.
+"""
+
+import argparse
+import json
+import sys
+
+TO_NS = {"ns": 1.0, "us": 1e3, "ms": 1e6, "s": 1e9}
+
+
+def load(path, metric):
+    with open(path) as f:
+        data = json.load(f)
+
+    runs = {}
+    means = {}
+    for bm in data["benchmarks"]:
+        if "error_occurred" in bm and bm["error_occurred"]:
+            continue
+        time = bm[metric] * TO_NS[bm.get("time_unit", "ns")]
+        if bm.get("run_type") == "aggregate":
+            if bm.get("aggregate_name") == "mean":
+                means[bm["run_name"]] = time
+        else:
+            runs.setdefault(bm.get("run_name", bm["name"]), []).append(time)
+
+    # Without repetitions there's a single run per benchmark
+    times = {name: sum(values) / len(values) for name, values in runs.items()}
+    times.update(means)
+    return times
+
+
+def format_ns(ns):
+    for unit in ("s", "ms", "us"):
+        if ns >= TO_NS[unit]:
+            return "%.3g %s" % (ns / TO_NS[unit], unit)
+    return "%.3g ns" % ns
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("baseline")
+    parser.add_argument("contender")
+    parser.add_argument("--threshold", type=float, default=0.1,
+                        help="relative slowdown counted as a regression (default: 0.1)")
+    parser.add_argument("--metric", choices=("real_time", "cpu_time"), default="real_time")
+    args = parser.parse_args()
+
+    baseline = load(args.baseline, args.metric)
+    contender = load(args.contender, args.metric)
+
+    regressions = []
+    width = max([len(name) for name in baseline] + [len("Benchmark")])
+    print("%-*s  %12s  %12s  %8s" % (width, "Benchmark", "Baseline", "Contender", "Change"))
+    for name in baseline:
+        if name not in contender:
+            print("%-*s  %12s  %12s  %8s" % (width, name, format_ns(baseline[name]), "-", "missing"))
+            continue
+        change = contender[name] / baseline[name] - 1
+        flag = ""
+        if change > args.threshold:
+            flag = "  <- slower"
+            regressions.append(name)
+        elif change < -args.threshold:
+            flag = "  <- faster"
+        print("%-*s  %12s  %12s  %+7.1f%%%s" % (width, name, format_ns(baseline[name]), format_ns(contender[name]),
+                                              100 * change, flag))
+
+    for name in contender:
+        if name not in baseline:
+            print("%-*s  %12s  %12s  %8s" % (width, name, "-", format_ns(contender[name]), "new"))
+
+    if regressions:
+        print("\n%d benchmark(s) regressed by more than %d%%" % (len(regressions), 100 * args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
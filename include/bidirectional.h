@@ -0,0 +1,349 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "search_workspace.h"
+#include "search_queues.h"
+#include "search_stats.h"
+
+#include <limits>
+
+/*
+ * Bidirectional variants of the Level 3 and Level 4 searches. Running one
+ * search from each end and stopping when they meet roughly halves the
+ * radius explored by each, which pays off on long routes across big maps.
+ *
+ * The backward search walks edges in reverse, and the knight graph is not
+ * symmetric: barrier scans depend on the starting square, and a portal's
+ * moves are those of its partner (see adjacent_positions).
+ */
+
+template<typename BOARD>
+typename BOARD::GraphEdgeVec reverse_adjacent_positions(const BOARD &board, const typename BOARD::Pos &target) {
+    /* Returns the squares from which `target` can be reached in one move,
+     * i.e. all the `origin`s for which board.adjacent_positions(origin)
+     * contains target. Weights are the same as the forward edges, which
+     * is the cost of landing on target.
+     */
+    typename BOARD::GraphEdgeVec edges;
+
+    const auto sq = board.square(target);
+    if (sq == BoardSquare::Rock || sq == BoardSquare::Barrier) {
+        return edges;
+    }
+    const int weight = move_weight(sq);
+
+    auto x = target.x;
+    auto y = target.y;
+
+    typename BOARD::PosVec candidates = {
+            {x - 2, y - 1},
+            {x - 2, y + 1},
+            {x - 1, y - 2},
+            {x - 1, y + 2},
+            {x + 1, y - 2},
+            {x + 1, y + 2},
+            {x + 2, y - 1},
+            {x + 2, y + 1}
+    };
+
+    for (const auto &pos : candidates) {
+        // Portals don't move from their own square, they're handled below
+        if (board.is_within_bounds(pos) &&
+            board.square(pos) != BoardSquare::Teleport &&
+            board.is_valid_step(pos, target)) {
+            edges.emplace_back(pos, weight);
+        }
+    }
+
+    if (board.teleports) {
+        const auto &t1 = board.teleports->first;
+        const auto &t2 = board.teleports->second;
+        // A portal reaches target if its partner could move there
+        for (const auto &portal : {std::make_pair(t1, t2), std::make_pair(t2, t1)}) {
+            const auto &partner = portal.second;
+            auto dx = std::abs(target.x - partner.x);
+            auto dy = std::abs(target.y - partner.y);
+            bool is_knight_move = (dx == 2 && dy == 1) || (dx == 1 && dy == 2);
+            if (is_knight_move && board.is_valid_step(partner, target)) {
+                edges.emplace_back(portal.first, weight);
+            }
+        }
+    }
+
+    return edges;
+}
+
+namespace bidirectional_detail {
+
+// Joins the two halves of a bidirectional search at the meeting square.
+// Backward parents point towards finish.
+template<typename BOARD>
+typename BOARD::PosVec join_paths(const BOARD &board,
+                                  const SearchWorkspace &forward,
+                                  const SearchWorkspace &backward,
+                                  uint32_t begin_index,
+                                  uint32_t finish_index,
+                                  uint32_t meet_index) {
+    auto path = forward.extract_path(board, begin_index, meet_index);
+    auto tmp = meet_index;
+    while (tmp != finish_index) {
+        tmp = backward.parent(tmp);
+        path.push_back(board.pos_at(tmp));
+    }
+    return path;
+}
+
+}
+
+template<typename BOARD, typename OBSERVER>
+typename BOARD::PosVec shortest_path_bidirectional_bfs(const BOARD &board,
+                                                       const typename BOARD::Pos begin,
+                                                       const typename BOARD::Pos finish,
+                                                       SearchWorkspace &forward,
+                                                       SearchWorkspace &backward,
+                                                       OBSERVER &observer) {
+
+    /* Level 3 (unweighted) bidirectional BFS. Each round expands one full
+     * layer of whichever frontier is smaller. As soon as a layer touches
+     * squares already seen by the other side, the best meeting point in
+     * that layer gives a shortest path: any shorter one would have made
+     * the searches meet in an earlier layer.
+     *
+     * OBSERVER is one of the policies in search_stats.h, and sees the two
+     * searches as one: the open set is both frontiers together.
+     */
+
+    if (begin == finish) {
+        return typename BOARD::PosVec{begin, finish};
+    }
+
+    const auto begin_index = board.index_of(begin);
+    const auto finish_index = board.index_of(finish);
+
+    forward.resize(board.num_squares());
+    backward.resize(board.num_squares());
+    forward.new_query();
+    backward.new_query();
+
+    forward.queue.clear();
+    backward.queue.clear();
+    size_t forward_head = 0;
+    size_t backward_head = 0;
+
+    observer.search_started();
+
+    forward.visit(begin_index, begin_index, 0);
+    forward.queue.push_back(begin_index);
+    backward.visit(finish_index, finish_index, 0);
+    backward.queue.push_back(finish_index);
+    observer.queue_pushed(1);
+    observer.queue_pushed(2);
+
+    int best = std::numeric_limits<int>::max();
+    uint32_t meet_index = SearchWorkspace::NO_PARENT;
+
+    auto check_meeting = [&](uint32_t index) {
+        if (forward.visited(index) && backward.visited(index)) {
+            auto dist = forward.dist(index) + backward.dist(index);
+            if (dist < best) {
+                best = dist;
+                meet_index = index;
+            }
+        }
+    };
+
+    while (forward_head < forward.queue.size() && backward_head < backward.queue.size()) {
+        bool go_forward = (forward.queue.size() - forward_head) <= (backward.queue.size() - backward_head);
+
+        auto &self = go_forward ? forward : backward;
+        auto &head = go_forward ? forward_head : backward_head;
+        const auto layer_end = self.queue.size();
+
+        while (head < layer_end) {
+            auto this_index = self.queue[head++];
+            auto this_pos = board.pos_at(this_index);
+            observer.queue_popped();
+            observer.node_expanded(board, this_index);
+
+            auto visit = [&](const typename BOARD::GraphEdge &adj) {
+                auto adj_index = board.index_of(adj.first);
+                if (!self.visited(adj_index)) {
+                    self.visit(adj_index, this_index, self.dist(this_index) + 1);
+                    observer.edge_relaxed();
+                    self.queue.push_back(adj_index);
+                    observer.queue_pushed(forward.queue.size() - forward_head +
+                                          backward.queue.size() - backward_head);
+                    check_meeting(adj_index);
+                }
+            };
+
+            // The two edge lists can be different types (CompiledGraph hands
+            // out a range going forward), so no ternary here
+            if (go_forward) {
+                for (const auto &adj : board.adjacent_positions(this_pos)) visit(adj);
+            } else {
+                for (const auto &adj : reverse_adjacent_positions(board, this_pos)) visit(adj);
+            }
+        }
+
+        if (meet_index != SearchWorkspace::NO_PARENT) {
+            break;
+        }
+    }
+
+    observer.search_finished(forward.bytes() + backward.bytes());
+
+    if (meet_index == SearchWorkspace::NO_PARENT) {
+        throw std::out_of_range("Finish position was not reached by the search");
+    }
+
+    return bidirectional_detail::join_paths(board, forward, backward, begin_index, finish_index, meet_index);
+}
+
+template<typename BOARD>
+typename BOARD::PosVec shortest_path_bidirectional_bfs(const BOARD &board,
+                                                       const typename BOARD::Pos begin,
+                                                       const typename BOARD::Pos finish,
+                                                       SearchWorkspace &forward,
+                                                       SearchWorkspace &backward,
+                                                       SearchStats *stats = nullptr) {
+    if (stats) {
+        StatsObserver observer(*stats);
+        return shortest_path_bidirectional_bfs(board, begin, finish, forward, backward, observer);
+    }
+    NullSearchObserver observer;
+    return shortest_path_bidirectional_bfs(board, begin, finish, forward, backward, observer);
+}
+
+template<typename QUEUE = BinaryHeapQueue, typename BOARD, typename OBSERVER>
+typename BOARD::PosVec shortest_path_bidirectional_dijkstra(const BOARD &board,
+                                                            const typename BOARD::Pos begin,
+                                                            const typename BOARD::Pos finish,
+                                                            SearchWorkspace &forward,
+                                                            SearchWorkspace &backward,
+                                                            OBSERVER &observer) {
+
+    /* Level 4 bidirectional Dijkstra. The two searches take turns settling
+     * one square from the smaller queue. Whenever an edge reaches a square
+     * the other side has seen, the route through it is a candidate, and we
+     * keep the cheapest one (best).
+     *
+     * Stopping as soon as the searches settle a common square isn't
+     * correct in general. Instead, we stop when the smallest keys in the
+     * two queues add up to at least best: any route not seen yet has to go
+     * through one unsettled square on each side, and can't be cheaper.
+     */
+
+    if (begin == finish) {
+        return typename BOARD::PosVec{begin, finish};
+    }
+
+    // Trivial teleport case
+    if ((board.square(begin) == BoardSquare::Teleport) && (board.square(finish) == BoardSquare::Teleport)) {
+        return typename BOARD::PosVec{begin, finish};
+    }
+
+    const auto begin_index = board.index_of(begin);
+    const auto finish_index = board.index_of(finish);
+
+    forward.resize(board.num_squares());
+    backward.resize(board.num_squares());
+    forward.new_query();
+    backward.new_query();
+
+    QUEUE forward_queue(forward, MAX_MOVE_WEIGHT);
+    QUEUE backward_queue(backward, MAX_MOVE_WEIGHT);
+
+    observer.search_started();
+
+    forward.visit(begin_index, begin_index, 0);
+    forward_queue.push(begin_index, 0);
+    backward.visit(finish_index, finish_index, 0);
+    backward_queue.push(finish_index, 0);
+    observer.queue_pushed(1);
+    observer.queue_pushed(2);
+
+    int best = std::numeric_limits<int>::max();
+    uint32_t meet_index = SearchWorkspace::NO_PARENT;
+
+    while (!forward_queue.empty() && !backward_queue.empty()) {
+        if (meet_index != SearchWorkspace::NO_PARENT &&
+            forward_queue.min_key() + backward_queue.min_key() >= best) {
+            break;
+        }
+
+        bool go_forward = forward_queue.size() <= backward_queue.size();
+
+        auto &self = go_forward ? forward : backward;
+        auto &other = go_forward ? backward : forward;
+        auto &queue = go_forward ? forward_queue : backward_queue;
+
+        auto this_index = queue.pop();
+        observer.queue_popped();
+        if (self.settled(this_index)) {
+            // Stale entry
+            continue;
+        }
+        self.settle(this_index);
+        observer.node_expanded(board, this_index);
+
+        const auto this_pos = board.pos_at(this_index);
+        const auto this_dist = self.dist(this_index);
+
+        // Going backwards, the weight is the one of the edge towards this
+        // square, so it's the same for all of them
+        auto relax = [&](const typename BOARD::GraphEdge &adj) {
+            auto adj_index = board.index_of(adj.first);
+            auto adj_dist = this_dist + adj.second;
+
+            if (!self.visited(adj_index)) {
+                self.visit(adj_index, this_index, adj_dist);
+            } else if (!self.settled(adj_index) && adj_dist < self.dist(adj_index)) {
+                self.relax(adj_index, this_index, adj_dist);
+            } else {
+                return;
+            }
+            observer.edge_relaxed();
+            queue.push(adj_index, adj_dist);
+            observer.queue_pushed(forward_queue.size() + backward_queue.size());
+
+            if (other.visited(adj_index) && adj_dist + other.dist(adj_index) < best) {
+                best = adj_dist + other.dist(adj_index);
+                meet_index = adj_index;
+            }
+        };
+
+        if (go_forward) {
+            for (const auto &adj : board.adjacent_positions(this_pos)) relax(adj);
+        } else {
+            for (const auto &adj : reverse_adjacent_positions(board, this_pos)) relax(adj);
+        }
+    }
+
+    observer.search_finished(forward.bytes() + backward.bytes());
+
+    if (meet_index == SearchWorkspace::NO_PARENT) {
+        throw std::out_of_range("Finish position was not reached by the search");
+    }
+
+    return bidirectional_detail::join_paths(board, forward, backward, begin_index, finish_index, meet_index);
+}
+
+template<typename QUEUE = BinaryHeapQueue, typename BOARD>
+typename BOARD::PosVec shortest_path_bidirectional_dijkstra(const BOARD &board,
+                                                            const typename BOARD::Pos begin,
+                                                            const typename BOARD::Pos finish,
+                                                            SearchWorkspace &forward,
+                                                            SearchWorkspace &backward,
+                                                            SearchStats *stats = nullptr) {
+    if (stats) {
+        StatsObserver observer(*stats);
+        return shortest_path_bidirectional_dijkstra<QUEUE>(board, begin, finish, forward, backward, observer);
+    }
+    NullSearchObserver observer;
+    return shortest_path_bidirectional_dijkstra<QUEUE>(board, begin, finish, forward, backward, observer);
+}
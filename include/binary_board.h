@@ -0,0 +1,190 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "board_rules.h"
+#include "dynamic_board.h"
+#include "mapped_file.h"
+
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+/*
+ * Compact binary map format, meant to be mapped and used in place:
+ *
+ *   BinaryBoardHeader
+ *   uint32_t portals[num_portals]   square indices of the teleport portals
+ *   uint8_t cells[]                 row-major squares, 8 or 4 bits each
+ *
+ * With 4 bits per square, square 2 * k is the low nibble of byte k and
+ * square 2 * k + 1 the high one. Everything is in native byte order.
+ *
+ * Parsing text costs a full pass over the map and a byte per square of
+ * memory. A MappedBoard instead reads squares straight out of the mapped
+ * file: opening it only checks the header, and pages are brought in by the
+ * OS as searches touch them. Squares aren't validated when opening, compare
+ * board_fingerprint() against a known value if the file might be corrupt.
+ */
+
+struct BinaryBoardHeader {
+    char magic[4];
+    uint32_t format_version;
+    int32_t rows;
+    int32_t cols;
+    uint32_t bits_per_square;
+    uint32_t num_portals;
+};
+
+constexpr char BINARY_BOARD_MAGIC[4] = {'K', 'B', 'M', 'P'};
+constexpr uint32_t BINARY_BOARD_FORMAT_VERSION = 1;
+
+template<typename BOARD>
+void save_binary_board(const BOARD &board, std::ostream &out, const uint32_t bits_per_square = 4) {
+    if (bits_per_square != 4 && bits_per_square != 8) {
+        throw std::invalid_argument("Squares can only be stored with 4 or 8 bits");
+    }
+
+    BinaryBoardHeader header{};
+    std::copy(BINARY_BOARD_MAGIC, BINARY_BOARD_MAGIC + 4, header.magic);
+    header.format_version = BINARY_BOARD_FORMAT_VERSION;
+    header.rows = board.rows();
+    header.cols = board.cols();
+    header.bits_per_square = bits_per_square;
+    header.num_portals = board.teleports ? 2 : 0;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    if (board.teleports) {
+        uint32_t portals[2] = {board.index_of(board.teleports->first), board.index_of(board.teleports->second)};
+        out.write(reinterpret_cast<const char *>(portals), sizeof(portals));
+    }
+
+    // Written in chunks, so that huge boards don't need a second copy
+    std::vector<uint8_t> chunk;
+    chunk.reserve(1 << 16);
+    const auto n = board.num_squares();
+    for (uint32_t i = 0; i < n;) {
+        chunk.clear();
+        // A chunk can't end between the two squares of a packed byte
+        for (; i < n && (chunk.size() < chunk.capacity() || (bits_per_square == 4 && i % 2 == 1)); i++) {
+            auto sq = static_cast<uint8_t>(board.square(board.pos_at(i)));
+            if (bits_per_square == 8) {
+                chunk.push_back(sq);
+            } else if (i % 2 == 0) {
+                chunk.push_back(sq);
+            } else {
+                chunk.back() |= sq << 4;
+            }
+        }
+        out.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+    }
+
+    if (!out) {
+        throw std::runtime_error("Failed writing binary board");
+    }
+}
+
+/*
+ * Read-only board backed by a binary map file, with the same interface as
+ * DynamicBoard (and the same Pos type). Copies share the mapping.
+ */
+class MappedBoard {
+public:
+    using Pos = DynamicBoard::Pos;
+    using PosHasher = DynamicBoard::PosHasher;
+    using PosVec = DynamicBoard::PosVec;
+    using GraphEdge = DynamicBoard::GraphEdge;
+    using GraphEdgeVec = DynamicBoard::GraphEdgeVec;
+
+    explicit MappedBoard(const std::string &file_name) : file_(std::make_shared<MappedFile>(file_name)) {
+        if (file_->size() < sizeof(BinaryBoardHeader)) {
+            throw std::runtime_error("Not a binary board file: " + file_name);
+        }
+        BinaryBoardHeader header;
+        std::copy(file_->data(), file_->data() + sizeof(header), reinterpret_cast<char *>(&header));
+
+        if (!std::equal(BINARY_BOARD_MAGIC, BINARY_BOARD_MAGIC + 4, header.magic) ||
+            header.format_version != BINARY_BOARD_FORMAT_VERSION ||
+            (header.bits_per_square != 4 && header.bits_per_square != 8) ||
+            header.rows < 0 || header.cols < 0 ||
+            (header.num_portals != 0 && header.num_portals != 2)) {
+            throw std::runtime_error("Not a binary board file: " + file_name);
+        }
+
+        rows_ = header.rows;
+        cols_ = header.cols;
+        packed_ = header.bits_per_square == 4;
+
+        const uint64_t num_squares = static_cast<uint64_t>(rows_) * static_cast<uint64_t>(cols_);
+        if (num_squares > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("Board dimensions don't fit a 32-bit square index");
+        }
+        const uint64_t cell_bytes = packed_ ? (num_squares + 1) / 2 : num_squares;
+        const uint64_t portal_bytes = header.num_portals * sizeof(uint32_t);
+        if (file_->size() != sizeof(header) + portal_bytes + cell_bytes) {
+            throw std::runtime_error("Truncated binary board file: " + file_name);
+        }
+
+        cells_ = reinterpret_cast<const uint8_t *>(file_->data() + sizeof(header) + portal_bytes);
+
+        if (header.num_portals) {
+            uint32_t portals[2];
+            std::copy(file_->data() + sizeof(header), file_->data() + sizeof(header) + sizeof(portals),
+                      reinterpret_cast<char *>(portals));
+            if (portals[0] >= num_squares || portals[1] >= num_squares ||
+                square(pos_at(portals[0])) != BoardSquare::Teleport ||
+                square(pos_at(portals[1])) != BoardSquare::Teleport) {
+                throw std::runtime_error("Invalid teleport portals in " + file_name);
+            }
+            teleports = std::make_pair(pos_at(portals[0]), pos_at(portals[1]));
+        }
+    }
+
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    uint32_t num_squares() const { return static_cast<uint32_t>(rows_) * static_cast<uint32_t>(cols_); }
+
+    uint32_t index_of(const Pos &pos) const { return row_major_index(*this, pos); }
+
+    Pos pos_at(uint32_t index) const { return row_major_pos(*this, index); }
+
+    BoardSquare square(const Pos &pos) const {
+        auto index = index_of(pos);
+        if (packed_) {
+            return static_cast<BoardSquare>((cells_[index / 2] >> (4 * (index % 2))) & 0xf);
+        }
+        return static_cast<BoardSquare>(cells_[index]);
+    }
+
+    // The map can't change under us
+    uint64_t version() const { return 0; }
+
+    // Optional pair of teleport portals
+    std::experimental::optional<std::pair<Pos, Pos>> teleports;
+
+    bool is_within_bounds(const Pos &pos) const { return is_within_board(*this, pos); }
+
+    GraphEdgeVec adjacent_positions(const Pos &origin, const bool is_teleport_dest = false) const {
+        return knight_adjacent_positions(*this, origin, is_teleport_dest);
+    }
+
+    bool is_valid_step(const Pos &begin, const Pos &end) const {
+        return is_valid_knight_step(*this, begin, end);
+    }
+
+    std::ostream &print(std::ostream &out,
+                        std::experimental::optional<Pos> knight_pos = std::experimental::nullopt) const {
+        return print_board(*this, out, knight_pos);
+    }
+
+private:
+    std::shared_ptr<const MappedFile> file_;
+    const uint8_t *cells_;
+    int rows_;
+    int cols_;
+    bool packed_;
+};
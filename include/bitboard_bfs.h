@@ -0,0 +1,261 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "search_workspace.h"
+#include "bidirectional.h"
+#include "terrain_layers.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/*
+ * Level 3 BFS on bit-planes. Instead of popping one square at a time, each
+ * iteration expands the whole frontier: for every knight move direction,
+ * the frontier plane is masked with the squares from which that move is
+ * valid, shifted by the move, and OR-ed into the next frontier. That's a
+ * handful of word operations per 64 squares, so full distance layers come
+ * out at close to memory bandwidth.
+ *
+ * Planes are stored row by row, each row padded to a whole number of
+ * 64-bit words. Seen as one long bit string, a knight move is then a shift
+ * by (dx * words_per_row * 64 + dy) bits. Moves leaving the board never
+ * make it into the per-direction masks, so nothing wraps around between
+ * rows. The masks come from TerrainLayers::valid_moves_row, which follows
+ * is_valid_step, so barrier, rock and board edge rules are exactly the same
+ * as in adjacent_positions.
+ *
+ * The teleport is handled by swapping the portal bits before expanding:
+ * a portal in the frontier moves like its partner.
+ */
+template<typename BOARD>
+class KnightBitboard {
+public:
+    explicit KnightBitboard(const BOARD &board) : board_(board),
+                                                  rows_(board.rows()),
+                                                  cols_(board.cols()),
+                                                  words_per_row_((board.cols() + 63) / 64) {
+        plane_words_ = static_cast<size_t>(rows_) * words_per_row_ + 2 * PAD;
+
+        const TerrainLayers<BOARD> layers(board);
+        for (int d = 0; d < 8; d++) {
+            valid_[d].assign(plane_words_, 0);
+            for (int r = 0; r < rows_; r++) {
+                layers.valid_moves_row(d, r, valid_[d].data() + word_of(r, 0));
+            }
+        }
+    }
+
+    const BOARD &board() const { return board_; }
+
+    /*
+     * Runs the BFS from begin, recording the distance of each reached
+     * square in the workspace (parents are not recorded). Stops after the
+     * layer that reaches stop_at, if given.
+     *
+     * @returns the distance to stop_at, or -1 if it wasn't reached
+     */
+    int distances(const typename BOARD::Pos &begin,
+                  SearchWorkspace &workspace,
+                  uint32_t stop_at = SearchWorkspace::NO_PARENT) const {
+        workspace.resize(board_.num_squares());
+        workspace.new_query();
+
+        auto &planes = workspace.bitplanes;
+        planes.assign(3 * plane_words_, 0);
+        uint64_t *visited = planes.data();
+        uint64_t *frontier = visited + plane_words_;
+        uint64_t *next = frontier + plane_words_;
+
+        const auto begin_index = board_.index_of(begin);
+        workspace.visit(begin_index, begin_index, 0);
+        set_bit(visited, begin.x, begin.y);
+        set_bit(frontier, begin.x, begin.y);
+
+        if (begin_index == stop_at) {
+            return 0;
+        }
+
+        for (int dist = 1;; dist++) {
+            swap_portals(frontier);
+
+            std::fill(next, next + plane_words_, 0);
+            for (int d = 0; d < 8; d++) {
+                expand(frontier, valid_[d].data(), next, KNIGHT_MOVES[d][0], KNIGHT_MOVES[d][1]);
+            }
+
+            // Keep new squares only, and record their distance
+            bool any_new = false;
+            bool reached = false;
+            for (size_t w = PAD; w < plane_words_ - PAD; w++) {
+                uint64_t bits = next[w] & ~visited[w];
+                next[w] = bits;
+                visited[w] |= bits;
+
+                while (bits) {
+                    any_new = true;
+                    auto index = square_index(w, __builtin_ctzll(bits));
+                    workspace.visit(index, SearchWorkspace::NO_PARENT, dist);
+                    reached |= (index == stop_at);
+                    bits &= bits - 1;
+                }
+            }
+
+            if (reached) {
+                return dist;
+            }
+            if (!any_new) {
+                return -1;
+            }
+            std::swap(frontier, next);
+        }
+    }
+
+private:
+    // Padding words at both ends, so that the shifts can always read the
+    // neighboring word
+    static constexpr size_t PAD = 1;
+
+    size_t word_of(int r, int c) const {
+        return PAD + static_cast<size_t>(r) * words_per_row_ + c / 64;
+    }
+
+    void set_bit(uint64_t *plane, int r, int c) const {
+        plane[word_of(r, c)] |= uint64_t(1) << (c % 64);
+    }
+
+    bool test_bit(const uint64_t *plane, int r, int c) const {
+        return (plane[word_of(r, c)] >> (c % 64)) & 1;
+    }
+
+    void clear_bit(uint64_t *plane, int r, int c) const {
+        plane[word_of(r, c)] &= ~(uint64_t(1) << (c % 64));
+    }
+
+    uint32_t square_index(size_t word, int bit) const {
+        auto r = static_cast<int>((word - PAD) / words_per_row_);
+        auto c = static_cast<int>((word - PAD) % words_per_row_) * 64 + bit;
+        return board_.index_of(typename BOARD::Pos(r, c));
+    }
+
+    void swap_portals(uint64_t *frontier) const {
+        if (!board_.teleports) {
+            return;
+        }
+        const auto &t1 = board_.teleports->first;
+        const auto &t2 = board_.teleports->second;
+        bool has_t1 = test_bit(frontier, t1.x, t1.y);
+        bool has_t2 = test_bit(frontier, t2.x, t2.y);
+        clear_bit(frontier, t1.x, t1.y);
+        clear_bit(frontier, t2.x, t2.y);
+        if (has_t1) {
+            set_bit(frontier, t2.x, t2.y);
+        }
+        if (has_t2) {
+            set_bit(frontier, t1.x, t1.y);
+        }
+    }
+
+    // next |= (frontier & valid) moved by (dx, dy)
+    void expand(const uint64_t *frontier, const uint64_t *valid, uint64_t *next, int dx, int dy) const {
+        const ptrdiff_t offset = static_cast<ptrdiff_t>(dx) * words_per_row_;
+
+        // Only source words whose destination word is on the board
+        size_t first = PAD + (offset < 0 ? -offset : 0);
+        size_t last = plane_words_ - PAD - (offset > 0 ? offset : 0);
+        if (first >= last) {
+            return;
+        }
+
+        const int k = std::abs(dy);
+        // Moving towards higher columns pulls in the top bits of the
+        // previous word, and vice versa
+        const ptrdiff_t carry = dy > 0 ? -1 : 1;
+
+        size_t i = first;
+#ifdef __AVX2__
+        const __m128i shift = _mm_cvtsi32_si128(k);
+        const __m128i carry_shift = _mm_cvtsi32_si128(64 - k);
+        for (; i + 4 <= last; i += 4) {
+            auto src = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(frontier + i)),
+                                        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(valid + i)));
+            auto src_carry = _mm256_and_si256(
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(frontier + i + carry)),
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(valid + i + carry)));
+            __m256i moved;
+            if (dy > 0) {
+                moved = _mm256_or_si256(_mm256_sll_epi64(src, shift), _mm256_srl_epi64(src_carry, carry_shift));
+            } else {
+                moved = _mm256_or_si256(_mm256_srl_epi64(src, shift), _mm256_sll_epi64(src_carry, carry_shift));
+            }
+            auto dst = reinterpret_cast<__m256i *>(next + i + offset);
+            _mm256_storeu_si256(dst, _mm256_or_si256(_mm256_loadu_si256(dst), moved));
+        }
+#endif
+        for (; i < last; i++) {
+            uint64_t src = frontier[i] & valid[i];
+            uint64_t src_carry = frontier[i + carry] & valid[i + carry];
+            if (dy > 0) {
+                next[i + offset] |= (src << k) | (src_carry >> (64 - k));
+            } else {
+                next[i + offset] |= (src >> k) | (src_carry << (64 - k));
+            }
+        }
+    }
+
+    const BOARD &board_;
+    int rows_;
+    int cols_;
+    size_t words_per_row_;
+    size_t plane_words_;
+    // One mask per direction in KNIGHT_MOVES, with the squares from which
+    // that move is valid
+    std::array<std::vector<uint64_t>, 8> valid_;
+};
+
+template<typename BOARD>
+typename BOARD::PosVec shortest_path_bitboard(const KnightBitboard<BOARD> &bitboard,
+                                              const typename BOARD::Pos begin,
+                                              const typename BOARD::Pos finish,
+                                              SearchWorkspace &workspace) {
+
+    /* Same result as shortest_path_simple (a shortest path in number of
+     * moves), computed with the bitboard BFS. Parents aren't tracked while
+     * expanding, so the path is recovered walking back from finish
+     * through squares one layer closer to begin. Among equally short
+     * paths, it might pick a different one than shortest_path_simple.
+     */
+
+    const auto &board = bitboard.board();
+
+    if (begin == finish) {
+        return typename BOARD::PosVec{begin, finish};
+    }
+
+    const auto finish_index = board.index_of(finish);
+    auto dist = bitboard.distances(begin, workspace, finish_index);
+    if (dist < 0) {
+        throw std::out_of_range("Finish position was not reached by the search");
+    }
+
+    typename BOARD::PosVec path{finish};
+    auto tmp = finish;
+    while (dist > 0) {
+        for (const auto &adj : reverse_adjacent_positions(board, tmp)) {
+            auto adj_index = board.index_of(adj.first);
+            if (workspace.visited(adj_index) && workspace.dist(adj_index) == dist - 1) {
+                tmp = adj.first;
+                break;
+            }
+        }
+        path.push_back(tmp);
+        dist--;
+    }
+    std::reverse(path.begin(), path.end());
+
+    return path;
+}
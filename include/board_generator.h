@@ -0,0 +1,237 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "dynamic_board.h"
+
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+// How much of the board a square type covers, and how clumped it is
+struct TerrainLayer {
+    // Fraction of the squares, between 0 and 1
+    double density = 0;
+    // 0 scatters squares independently, 1 makes blobs up to
+    // MAX_CLUSTER_SIZE squares across (lakes, lava fields, boulders)
+    double clustering = 0;
+};
+
+struct BoardGeneratorOptions {
+    int rows = 0;
+    int cols = 0;
+    uint64_t seed = 1;
+
+    // Where layers overlap, rock wins over lava, and lava over water
+    TerrainLayer rock;
+    TerrainLayer lava;
+    TerrainLayer water;
+
+    // Horizontal and vertical barrier walls, on average every wall_spacing
+    // rows (or columns). 0 means no walls. Walls are interrupted by a gap of
+    // wall_gap squares every wall_segment squares.
+    int wall_spacing = 0;
+    int wall_segment = 16;
+    int wall_gap = 2;
+
+    // The boards only support a single pair of portals, so 0 or 1
+    int teleport_pairs = 0;
+};
+
+/*
+ * Procedural boards of any size, fully determined by the options (seed
+ * included): the same options always give the same board.
+ *
+ * Nothing is stored: each square is computed from its coordinates, with
+ * hashed value noise for the terrain layers, and hashed wall rows and
+ * columns. The generator has the read-only part of the board interface
+ * (rows(), square(), teleports, ...), so save_board_text() and
+ * save_binary_board() stream it straight to disk, a chunk at a time, and
+ * huge boards never need to be in memory at all. Otherwise,
+ * to_dynamic_board() builds the whole board.
+ *
+ * Densities are hit approximately: the noise thresholds are estimated from
+ * a sample of squares, and walls and higher priority layers cover part of
+ * the lower ones.
+ */
+class BoardGenerator {
+public:
+    using Pos = DynamicBoard::Pos;
+    using PosVec = DynamicBoard::PosVec;
+
+    static constexpr int MAX_CLUSTER_SIZE = 32;
+
+    explicit BoardGenerator(const BoardGeneratorOptions &options) : options_(options) {
+        if (options.rows < 0 || options.cols < 0 ||
+            static_cast<uint64_t>(options.rows) * static_cast<uint64_t>(options.cols) >
+            std::numeric_limits<uint32_t>::max()) {
+            throw std::invalid_argument("Board dimensions don't fit a 32-bit square index");
+        }
+        if (options.wall_spacing < 0 || options.wall_segment < 1 || options.wall_gap < 0) {
+            throw std::invalid_argument("Invalid wall options");
+        }
+        if (options.teleport_pairs < 0 || options.teleport_pairs > 1) {
+            throw std::invalid_argument("Boards support a single pair of teleport portals");
+        }
+
+        const TerrainLayer *layers[] = {&options.rock, &options.lava, &options.water};
+        for (int l = 0; l < NUM_LAYERS; l++) {
+            if (!(layers[l]->density >= 0 && layers[l]->density <= 1) ||
+                !(layers[l]->clustering >= 0 && layers[l]->clustering <= 1)) {
+                throw std::invalid_argument("Densities and clustering must be between 0 and 1");
+            }
+            scales_[l] = 1 + layers[l]->clustering * (MAX_CLUSTER_SIZE - 1);
+            thresholds_[l] = threshold(l, layers[l]->density);
+        }
+
+        if (options.teleport_pairs && num_squares() >= 2) {
+            // Two distinct squares, picked by hashing
+            const uint64_t n = num_squares();
+            auto first = static_cast<uint32_t>(hash(PORTAL_SALT, 0, 0) % n);
+            auto second = static_cast<uint32_t>(hash(PORTAL_SALT, 1, 0) % (n - 1));
+            if (second >= first) {
+                second++;
+            }
+            teleports = std::make_pair(pos_at(first), pos_at(second));
+        }
+    }
+
+    int rows() const { return options_.rows; }
+    int cols() const { return options_.cols; }
+    uint32_t num_squares() const { return static_cast<uint32_t>(rows()) * static_cast<uint32_t>(cols()); }
+
+    uint32_t index_of(const Pos &pos) const {
+        return static_cast<uint32_t>(pos.x) * static_cast<uint32_t>(cols()) + static_cast<uint32_t>(pos.y);
+    }
+
+    Pos pos_at(uint32_t index) const {
+        return Pos(static_cast<int>(index / cols()), static_cast<int>(index % cols()));
+    }
+
+    bool is_within_bounds(const Pos &pos) const {
+        return ((pos.x >= 0) && (pos.x < rows()) && (pos.y >= 0) && (pos.y < cols()));
+    }
+
+    // The board never changes
+    uint64_t version() const { return 0; }
+
+    std::experimental::optional<std::pair<Pos, Pos>> teleports;
+
+    BoardSquare square(const Pos &pos) const {
+        if (teleports && (pos == teleports->first || pos == teleports->second)) {
+            return BoardSquare::Teleport;
+        }
+        if (is_wall(pos.x, pos.y)) {
+            return BoardSquare::Barrier;
+        }
+
+        static const BoardSquare layer_squares[] = {BoardSquare::Rock, BoardSquare::Lava, BoardSquare::Water};
+        for (int l = 0; l < NUM_LAYERS; l++) {
+            if (thresholds_[l] > 0 && noise(l, pos.x, pos.y) < thresholds_[l]) {
+                return layer_squares[l];
+            }
+        }
+        return BoardSquare::Clear;
+    }
+
+    DynamicBoard to_dynamic_board() const {
+        DynamicBoard board(rows(), cols());
+        // Written directly, so that the change log stays empty
+        for (uint32_t i = 0; i < num_squares(); i++) {
+            board.squares[i] = square(pos_at(i));
+        }
+        board.teleports = teleports;
+        return board;
+    }
+
+private:
+    static constexpr int NUM_LAYERS = 3;
+    static constexpr uint64_t WALL_ROW_SALT = 16;
+    static constexpr uint64_t WALL_COL_SALT = 17;
+    static constexpr uint64_t PORTAL_SALT = 18;
+    static constexpr uint64_t SAMPLE_SALT = 19;
+
+    // splitmix64 over the seed, a salt and the coordinates
+    uint64_t hash(uint64_t salt, int64_t a, int64_t b) const {
+        uint64_t z = options_.seed + 0x9e3779b97f4a7c15ull * (salt + 1);
+        z ^= static_cast<uint64_t>(a) * 0xbf58476d1ce4e5b9ull;
+        z ^= static_cast<uint64_t>(b) * 0x94d049bb133111ebull + 0x2545f4914f6cdd1dull;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in [0, 1)
+    double uniform(uint64_t salt, int64_t a, int64_t b) const {
+        return (hash(salt, a, b) >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // Value noise: random values on a lattice spaced by the layer scale,
+    // smoothly interpolated in between
+    double noise(int layer, int x, int y) const {
+        const double scale = scales_[layer];
+        if (scale <= 1) {
+            return uniform(layer, x, y);
+        }
+
+        const double fx = x / scale;
+        const double fy = y / scale;
+        const auto x0 = static_cast<int64_t>(std::floor(fx));
+        const auto y0 = static_cast<int64_t>(std::floor(fy));
+        auto smooth = [](double t) { return t * t * (3 - 2 * t); };
+        const double tx = smooth(fx - x0);
+        const double ty = smooth(fy - y0);
+
+        const double top = uniform(layer, x0, y0) * (1 - ty) + uniform(layer, x0, y0 + 1) * ty;
+        const double bottom = uniform(layer, x0 + 1, y0) * (1 - ty) + uniform(layer, x0 + 1, y0 + 1) * ty;
+        return top * (1 - tx) + bottom * tx;
+    }
+
+    // Noise value below which a square belongs to the layer
+    double threshold(int layer, double density) const {
+        if (density <= 0 || num_squares() == 0) {
+            return 0;
+        }
+        if (density >= 1) {
+            return 2;
+        }
+        if (scales_[layer] <= 1) {
+            // White noise is already uniform
+            return density;
+        }
+
+        // Smoothed noise bunches up in the middle: take the quantile of a
+        // sample of squares
+        const int num_samples = 4096;
+        std::vector<double> samples;
+        samples.reserve(num_samples);
+        for (int i = 0; i < num_samples; i++) {
+            auto pos = pos_at(static_cast<uint32_t>(hash(SAMPLE_SALT, layer, i) % num_squares()));
+            samples.push_back(noise(layer, pos.x, pos.y));
+        }
+        auto nth = samples.begin() + static_cast<ptrdiff_t>(density * (num_samples - 1));
+        std::nth_element(samples.begin(), nth, samples.end());
+        return *nth;
+    }
+
+    bool on_wall(uint64_t salt, int line, int along) const {
+        if (options_.wall_spacing == 0 || uniform(salt, line, 0) * options_.wall_spacing >= 1) {
+            return false;
+        }
+        const int period = options_.wall_segment + options_.wall_gap;
+        const int offset = static_cast<int>(hash(salt, line, 1) % period);
+        return (along + offset) % period >= options_.wall_gap;
+    }
+
+    bool is_wall(int x, int y) const {
+        return on_wall(WALL_ROW_SALT, x, y) || on_wall(WALL_COL_SALT, y, x);
+    }
+
+    BoardGeneratorOptions options_;
+    double scales_[NUM_LAYERS];
+    double thresholds_[NUM_LAYERS];
+};
@@ -0,0 +1,127 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+
+/*
+ * The move rules of Board<N>, written once against the square() accessor,
+ * for boards that store their squares differently (DynamicBoard's heap
+ * buffer, MappedBoard's packed file, TiledBoard's tiles). Unlike Board<N>,
+ * bounds are checked first: reading past a heap buffer or a mapping is a
+ * lot less forgiving than reading past a nested std::array.
+ *
+ * The rest of what those boards have in common is here too: row-major
+ * indices over rows() x cols(), and printing.
+ */
+
+template<typename BOARD>
+uint32_t row_major_index(const BOARD &board, const typename BOARD::Pos &pos) {
+    return static_cast<uint32_t>(pos.x) * static_cast<uint32_t>(board.cols()) + static_cast<uint32_t>(pos.y);
+}
+
+template<typename BOARD>
+typename BOARD::Pos row_major_pos(const BOARD &board, uint32_t index) {
+    const auto cols = static_cast<uint32_t>(board.cols());
+    return typename BOARD::Pos(static_cast<int>(index / cols), static_cast<int>(index % cols));
+}
+
+template<typename BOARD>
+bool is_within_board(const BOARD &board, const typename BOARD::Pos &pos) {
+    return ((pos.x >= 0) && (pos.x < board.rows()) && (pos.y >= 0) && (pos.y < board.cols()));
+}
+
+// Same output as Board<N>::print. Squares read from files aren't always
+// validated, so codes that aren't squares print as '?'.
+template<typename BOARD>
+std::ostream &print_board(const BOARD &board, std::ostream &out,
+                          std::experimental::optional<typename BOARD::Pos> knight_pos) {
+    static const char square_codes[] = {'.', 'W', 'R', 'B', 'T', 'L'};
+
+    for (int i = 0; i < board.rows(); i++) {
+        for (int j = 0; j < board.cols(); j++) {
+            if (knight_pos && knight_pos->x == i && knight_pos->y == j) {
+                out << "\x1B[31mK \x1B[0m";
+            } else {
+                const auto code = static_cast<size_t>(board.square({i, j}));
+                out << (code < sizeof(square_codes) ? square_codes[code] : '?') << " ";
+            }
+        }
+        out << std::endl;
+    }
+    return out;
+}
+
+template<typename BOARD>
+bool is_valid_knight_step(const BOARD &board, const typename BOARD::Pos &begin, const typename BOARD::Pos &end) {
+    if (!board.is_within_bounds(begin) || !board.is_within_bounds(end)) {
+        return false;
+    }
+
+    auto abs_delta_x = std::abs(end.x - begin.x);
+    auto abs_delta_y = std::abs(end.y - begin.y);
+
+    auto begin_sq = board.square(begin);
+    auto end_sq = board.square(end);
+
+    bool is_teleport = (end_sq == begin_sq) && (begin_sq == BoardSquare::Teleport);
+    if (is_teleport) {
+        return true;
+    }
+
+    bool is_right_shape = (abs_delta_x == 2 && abs_delta_y == 1) || (abs_delta_x == 1 && abs_delta_y == 2);
+    if (!is_right_shape) {
+        return false;
+    }
+
+    bool is_allowed_end = (end_sq != BoardSquare::Rock) && (end_sq != BoardSquare::Barrier);
+    if (!is_allowed_end) {
+        return false;
+    }
+
+    if (abs_delta_x == 2) { // Horizontal move
+        for (int i = std::min(begin.x, end.x); i <= std::max(begin.x, end.x); i++) {
+            if (board.square({i, begin.y}) == BoardSquare::Barrier) {
+                return false;
+            }
+        }
+    } else { // Vertical move
+        for (int i = std::min(begin.y, end.y); i <= std::max(begin.y, end.y); i++) {
+            if (board.square({begin.x, i}) == BoardSquare::Barrier) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+template<typename BOARD>
+typename BOARD::GraphEdgeVec knight_adjacent_positions(const BOARD &board,
+                                                       const typename BOARD::Pos &origin,
+                                                       const bool is_teleport_dest = false) {
+    // Same rules as Board<N>::adjacent_positions
+    auto x = origin.x;
+    auto y = origin.y;
+
+    if (board.square(origin) == BoardSquare::Teleport && !is_teleport_dest) {
+        const auto &teleports = board.teleports;
+        auto dest_portal = (origin == teleports->first) ? teleports->second : teleports->first;
+        return knight_adjacent_positions(board, dest_portal, true);
+    }
+
+    typename BOARD::GraphEdgeVec edges;
+
+    for (const auto &move : KNIGHT_MOVES) {
+        typename BOARD::Pos pos(x + move[0], y + move[1]);
+        if (!is_valid_knight_step(board, origin, pos)) {
+            continue;
+        }
+
+        edges.emplace_back(pos, move_weight(board.square(pos)));
+    }
+
+    return edges;
+}
@@ -0,0 +1,155 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+
+/*
+ * The knight-move graph of a board, precomputed once in CSR form:
+ * offsets[i]..offsets[i + 1] is the range of outgoing edges of square i,
+ * and each edge is a packed (neighbor index, uint8 weight) pair.
+ *
+ * Building the graph on the fly (see the README) is nice for sparse
+ * queries, but when issuing many queries on the same static map, the
+ * candidate generation and barrier scans in adjacent_positions end up
+ * being repeated over and over. The teleport redirect is folded in at build
+ * time, so the edges of a portal are those of its partner.
+ *
+ * CompiledGraph exposes the same interface as the boards (adjacent_positions,
+ * is_valid_step, Pos, PosVec, ...), so all the level templates can run on it
+ * directly. adjacent_positions returns a lightweight range over the CSR
+ * arrays instead of a freshly allocated vector. Only the edges are copied:
+ * square(), version() and the rest still go to the board, so keep it
+ * around for as long as the graph.
+ */
+template<typename BOARD>
+class CompiledGraph {
+public:
+    using Board = BOARD;
+    using Pos = typename BOARD::Pos;
+    using PosVec = typename BOARD::PosVec;
+    using PosHasher = typename BOARD::PosHasher;
+    using GraphEdge = typename BOARD::GraphEdge;
+    using GraphEdgeVec = typename BOARD::GraphEdgeVec;
+
+    explicit CompiledGraph(const BOARD &board) : teleports(board.teleports), board_(board) {
+        const auto n = board.num_squares();
+        offsets_.reserve(n + 1);
+        // Most squares have a full set of moves
+        neighbors_.reserve(static_cast<size_t>(n) * 8);
+        weights_.reserve(static_cast<size_t>(n) * 8);
+
+        offsets_.push_back(0);
+        for (uint32_t i = 0; i < n; i++) {
+            for (const auto &adj : board.adjacent_positions(board.pos_at(i))) {
+                neighbors_.push_back(board.index_of(adj.first));
+                weights_.push_back(static_cast<uint8_t>(adj.second));
+            }
+            if (neighbors_.size() > std::numeric_limits<uint32_t>::max()) {
+                throw std::runtime_error("Too many edges for a 32-bit CSR offset");
+            }
+            offsets_.push_back(static_cast<uint32_t>(neighbors_.size()));
+        }
+
+        neighbors_.shrink_to_fit();
+        weights_.shrink_to_fit();
+    }
+
+    // Iterates over the edges of one square, yielding GraphEdge values
+    class EdgeIterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = GraphEdge;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const GraphEdge *;
+        using reference = GraphEdge;
+
+        EdgeIterator(const CompiledGraph *graph, uint32_t edge) : graph_(graph), edge_(edge) {}
+
+        GraphEdge operator*() const {
+            return GraphEdge(graph_->board_.pos_at(graph_->neighbors_[edge_]), graph_->weights_[edge_]);
+        }
+
+        EdgeIterator &operator++() {
+            edge_++;
+            return *this;
+        }
+
+        bool operator==(const EdgeIterator &other) const { return edge_ == other.edge_; }
+
+        bool operator!=(const EdgeIterator &other) const { return edge_ != other.edge_; }
+
+    private:
+        const CompiledGraph *graph_;
+        uint32_t edge_;
+    };
+
+    class EdgeRange {
+    public:
+        EdgeRange(EdgeIterator b, EdgeIterator e) : b_(b), e_(e) {}
+
+        EdgeIterator begin() const { return b_; }
+
+        EdgeIterator end() const { return e_; }
+
+    private:
+        EdgeIterator b_;
+        EdgeIterator e_;
+    };
+
+    EdgeRange adjacent_positions(const Pos &origin) const {
+        auto i = board_.index_of(origin);
+        return EdgeRange(EdgeIterator(this, offsets_[i]), EdgeIterator(this, offsets_[i + 1]));
+    }
+
+    // Raw CSR access, for index-based algorithms
+    uint32_t edges_begin(uint32_t node) const { return offsets_[node]; }
+
+    uint32_t edges_end(uint32_t node) const { return offsets_[node + 1]; }
+
+    uint32_t neighbor(uint32_t edge) const { return neighbors_[edge]; }
+
+    uint8_t weight(uint32_t edge) const { return weights_[edge]; }
+
+    size_t num_edges() const { return neighbors_.size(); }
+
+    // Everything else is forwarded to the board
+    const std::experimental::optional<std::pair<Pos, Pos>> &teleports;
+
+    const BOARD &board() const { return board_; }
+
+    int rows() const { return board_.rows(); }
+
+    int cols() const { return board_.cols(); }
+
+    uint32_t num_squares() const { return board_.num_squares(); }
+
+    uint32_t index_of(const Pos &pos) const { return board_.index_of(pos); }
+
+    Pos pos_at(uint32_t index) const { return board_.pos_at(index); }
+
+    BoardSquare square(const Pos &pos) const { return board_.square(pos); }
+
+    uint64_t version() const { return board_.version(); }
+
+    bool is_within_bounds(const Pos &pos) const { return board_.is_within_bounds(pos); }
+
+    bool is_valid_step(const Pos &begin, const Pos &end) const { return board_.is_valid_step(begin, end); }
+
+    std::ostream &print(std::ostream &out,
+                        std::experimental::optional<Pos> knight_pos = std::experimental::nullopt) const {
+        return board_.print(out, knight_pos);
+    }
+
+private:
+    const BOARD &board_;
+    std::vector<uint32_t> offsets_;
+    std::vector<uint32_t> neighbors_;
+    std::vector<uint8_t> weights_;
+};
@@ -0,0 +1,801 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "search_workspace.h"
+#include "search_queues.h"
+#include "search_stats.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ContractionOptions {
+    // Threads for the witness searches, 0 for all cores
+    size_t threads = 0;
+    // Squares a witness search settles before giving up. Lower builds
+    // faster, but adds shortcuts that a longer search would have avoided.
+    uint32_t witness_limit = 256;
+    // Squares with more edges than this are never contracted, and make up
+    // the core, see below
+    uint32_t core_degree = 256;
+};
+
+/*
+ * Contraction hierarchy over the knight-move graph, for static maps that
+ * get lots of point-to-point queries.
+ *
+ * Squares are contracted one at a time, from the least to the most
+ * important. Contracting a square removes it from the graph, and adds a
+ * shortcut u -> v (remembering the square in the middle) for each pair of
+ * its neighbours whose shortest path went through it, unless a witness
+ * search finds another path at most as cheap. Every square ends up with
+ * its edges towards squares contracted later ("up"), and a shortest path
+ * always goes up, then down. A query is then a bidirectional Dijkstra that
+ * only follows up edges from begin and (backwards) down edges into finish.
+ *
+ * The order is picked by edge difference (shortcuts that may be needed
+ * minus edges removed), plus the number of neighbours already contracted
+ * and the depth in the hierarchy, which spread contractions evenly. Each
+ * round contracts all the squares whose priority is lower than that of all
+ * their neighbours. Those don't touch each other, so their witness searches
+ * run in parallel; they avoid each other too, which only ever adds
+ * shortcuts.
+ *
+ * Knight graphs are grid-like, so unlike road networks, the squares
+ * contracted last have lots of edges, and the search space grows with the
+ * side of the board (a few hundred squares on 64x64, about a thousand on
+ * 256x256). Squares with more than core_degree edges are left alone: they
+ * form a core where all edges count as up, and queries search it like a
+ * plain bidirectional Dijkstra. That bounds the build time on big maps.
+ *
+ * Edges are those of adjacent_positions, so a portal has the moves of its
+ * partner, and portal to portal is free, as in shortest_path_lvl4. When a
+ * path is unpacked into squares, moves out of a portal go through its
+ * partner first: the jump is free and each step passes is_valid_step, so
+ * path_cost() matches the distance.
+ *
+ * Like LandmarkIndex, the hierarchy can be saved and mapped back from a
+ * file, and is_current() / matches() tell whether it's stale.
+ */
+template<typename BOARD>
+class ContractionHierarchy {
+public:
+    static constexpr uint32_t NO_NODE = std::numeric_limits<uint32_t>::max();
+
+    // An edge of the hierarchy, to or from `node`. Shortcuts stand for the
+    // two edges through `middle`, original moves have NO_NODE.
+    struct Edge {
+        uint32_t node;
+        uint32_t weight;
+        uint32_t middle;
+    };
+
+    ContractionHierarchy() : rows_(0), cols_(0), num_squares_(0), num_up_(0), num_down_(0),
+                             board_version_(0), fingerprint_(0), data_(nullptr) {}
+
+    static ContractionHierarchy build(const BOARD &board, const ContractionOptions &options = ContractionOptions()) {
+        Builder builder(board, options);
+        builder.contract_all();
+
+        ContractionHierarchy hierarchy;
+        hierarchy.rows_ = board.rows();
+        hierarchy.cols_ = board.cols();
+        hierarchy.num_squares_ = board.num_squares();
+        hierarchy.board_version_ = board.version();
+        hierarchy.fingerprint_ = board_fingerprint(board);
+
+        // Same layout as the file, without the header
+        const auto n = hierarchy.num_squares_;
+        for (uint32_t i = 0; i < n; i++) {
+            hierarchy.num_up_ += builder.up[i].size();
+            hierarchy.num_down_ += builder.down[i].size();
+        }
+        if (std::max(hierarchy.num_up_, hierarchy.num_down_) > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("Too many edges for a 32-bit CSR offset");
+        }
+        auto storage = std::make_shared<std::vector<uint32_t>>(hierarchy.data_words());
+        hierarchy.data_ = storage->data();
+        hierarchy.holder_ = storage;
+
+        auto up_offsets = storage->data();
+        auto down_offsets = up_offsets + n + 1;
+        auto edges = reinterpret_cast<Edge *>(down_offsets + n + 1);
+        auto fill = [&](uint32_t *offsets, std::vector<std::vector<Edge>> &lists, Edge *out) {
+            offsets[0] = 0;
+            for (uint32_t i = 0; i < n; i++) {
+                out = std::copy(lists[i].begin(), lists[i].end(), out);
+                offsets[i + 1] = offsets[i] + static_cast<uint32_t>(lists[i].size());
+                std::vector<Edge>().swap(lists[i]);
+            }
+        };
+        fill(up_offsets, builder.up, edges);
+        fill(down_offsets, builder.down, edges + hierarchy.num_up_);
+
+        return hierarchy;
+    }
+
+    // Edges from i to squares contracted after it
+    const Edge *up_begin(uint32_t i) const { return up_edges() + up_offsets()[i]; }
+
+    const Edge *up_end(uint32_t i) const { return up_edges() + up_offsets()[i + 1]; }
+
+    // Edges into i from squares contracted after it, `node` is the source
+    const Edge *down_begin(uint32_t i) const { return down_edges() + down_offsets()[i]; }
+
+    const Edge *down_end(uint32_t i) const { return down_edges() + down_offsets()[i + 1]; }
+
+    size_t num_edges() const { return num_up_ + num_down_; }
+
+    template<typename OBSERVER>
+    typename BOARD::PosVec shortest_path(const BOARD &board,
+                                         const typename BOARD::Pos begin,
+                                         const typename BOARD::Pos finish,
+                                         SearchWorkspace &forward,
+                                         SearchWorkspace &backward,
+                                         OBSERVER &observer) const {
+
+        /* Same costs as shortest_path_lvl4, though not necessarily the same
+         * paths when there are ties. The board must be the one the hierarchy
+         * was built for (see matches()).
+         *
+         * Each side stops once its smallest key reaches the best route
+         * found so far: the meeting square is the highest of the path, so
+         * unlike a plain bidirectional Dijkstra, the two keys can't be
+         * added up. Squares reached more cheaply from above than by their
+         * own parent are stalled, i.e. not expanded: they can't be on a
+         * shortest up path.
+         */
+
+        if (begin == finish) {
+            return typename BOARD::PosVec{begin, finish};
+        }
+
+        // Trivial teleport case
+        if ((board.square(begin) == BoardSquare::Teleport) && (board.square(finish) == BoardSquare::Teleport)) {
+            return typename BOARD::PosVec{begin, finish};
+        }
+
+        const auto begin_index = board.index_of(begin);
+        const auto finish_index = board.index_of(finish);
+
+        forward.resize(num_squares_);
+        backward.resize(num_squares_);
+        forward.new_query();
+        backward.new_query();
+
+        BinaryHeapQueue forward_queue(forward, MAX_MOVE_WEIGHT);
+        BinaryHeapQueue backward_queue(backward, MAX_MOVE_WEIGHT);
+
+        observer.search_started();
+
+        forward.visit(begin_index, begin_index, 0);
+        forward_queue.push(begin_index, 0);
+        backward.visit(finish_index, finish_index, 0);
+        backward_queue.push(finish_index, 0);
+        observer.queue_pushed(1);
+        observer.queue_pushed(2);
+
+        int best = std::numeric_limits<int>::max();
+        uint32_t meet_index = NO_NODE;
+
+        auto forward_done = [&] { return forward_queue.empty() || forward_queue.min_key() >= best; };
+        auto backward_done = [&] { return backward_queue.empty() || backward_queue.min_key() >= best; };
+
+        while (!forward_done() || !backward_done()) {
+            bool go_forward = !forward_done() &&
+                              (backward_done() || forward_queue.size() <= backward_queue.size());
+
+            auto &self = go_forward ? forward : backward;
+            auto &other = go_forward ? backward : forward;
+            auto &queue = go_forward ? forward_queue : backward_queue;
+
+            auto this_index = queue.pop();
+            observer.queue_popped();
+            if (self.settled(this_index)) {
+                // Stale entry
+                continue;
+            }
+            self.settle(this_index);
+            const auto this_dist = self.dist(this_index);
+
+            // Stall on demand, looking at the edges from above
+            bool stalled = false;
+            const auto *stall_begin = go_forward ? down_begin(this_index) : up_begin(this_index);
+            const auto *stall_end = go_forward ? down_end(this_index) : up_end(this_index);
+            for (auto edge = stall_begin; edge != stall_end && !stalled; edge++) {
+                stalled = self.visited(edge->node) &&
+                          self.dist(edge->node) + static_cast<int>(edge->weight) < this_dist;
+            }
+            if (stalled) {
+                continue;
+            }
+            observer.node_expanded(board, this_index);
+
+            const auto *edges_begin = go_forward ? up_begin(this_index) : down_begin(this_index);
+            const auto *edges_end = go_forward ? up_end(this_index) : down_end(this_index);
+            for (auto edge = edges_begin; edge != edges_end; edge++) {
+                const auto adj_index = edge->node;
+                const auto adj_dist = this_dist + static_cast<int>(edge->weight);
+
+                if (!self.visited(adj_index)) {
+                    self.visit(adj_index, this_index, adj_dist);
+                } else if (!self.settled(adj_index) && adj_dist < self.dist(adj_index)) {
+                    self.relax(adj_index, this_index, adj_dist);
+                } else {
+                    continue;
+                }
+                observer.edge_relaxed();
+                queue.push(adj_index, adj_dist);
+                observer.queue_pushed(forward_queue.size() + backward_queue.size());
+
+                if (other.visited(adj_index) && adj_dist + other.dist(adj_index) < best) {
+                    best = adj_dist + other.dist(adj_index);
+                    meet_index = adj_index;
+                }
+            }
+        }
+
+        observer.search_finished(forward.bytes() + backward.bytes());
+
+        if (meet_index == NO_NODE) {
+            throw std::out_of_range("Finish position was not reached by the search");
+        }
+
+        // Squares of the hierarchy path, then each edge unpacked
+        std::vector<uint32_t> nodes;
+        for (auto tmp = meet_index; tmp != begin_index; tmp = forward.parent(tmp)) {
+            nodes.push_back(tmp);
+        }
+        nodes.push_back(begin_index);
+        std::reverse(nodes.begin(), nodes.end());
+        for (auto tmp = meet_index; tmp != finish_index;) {
+            tmp = backward.parent(tmp);
+            nodes.push_back(tmp);
+        }
+
+        typename BOARD::PosVec path{begin};
+        for (size_t i = 1; i < nodes.size(); i++) {
+            unpack(board, nodes[i - 1], nodes[i], path);
+        }
+        return path;
+    }
+
+    typename BOARD::PosVec shortest_path(const BOARD &board,
+                                         const typename BOARD::Pos begin,
+                                         const typename BOARD::Pos finish,
+                                         SearchWorkspace &forward,
+                                         SearchWorkspace &backward,
+                                         SearchStats *stats = nullptr) const {
+        if (stats) {
+            StatsObserver observer(*stats);
+            return shortest_path(board, begin, finish, forward, backward, observer);
+        }
+        NullSearchObserver observer;
+        return shortest_path(board, begin, finish, forward, backward, observer);
+    }
+
+    typename BOARD::PosVec shortest_path(const BOARD &board,
+                                         const typename BOARD::Pos begin,
+                                         const typename BOARD::Pos finish) const {
+        SearchWorkspace forward;
+        SearchWorkspace backward;
+        return shortest_path(board, begin, finish, forward, backward);
+    }
+
+    // O(1): was the board changed through set_square() since the hierarchy was built?
+    bool is_current(const BOARD &board) const {
+        return board.rows() == rows_ && board.cols() == cols_ && board.version() == board_version_;
+    }
+
+    // O(N): was the hierarchy built from a board with the same contents?
+    bool matches(const BOARD &board) const {
+        return board.rows() == rows_ && board.cols() == cols_ && board_fingerprint(board) == fingerprint_;
+    }
+
+    // Bytes of offsets and edges, whether owned or mapped
+    size_t bytes() const { return data_words() * sizeof(uint32_t); }
+
+    /*
+     * Binary format: a fixed header, then the offsets of the up and down
+     * edges (num_squares + 1 each), then the up and down edges as three
+     * uint32_t each, all in native byte order.
+     */
+    void save(std::ostream &out) const {
+        auto header = make_header();
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(data_), bytes());
+        if (!out) {
+            throw std::runtime_error("Failed writing contraction hierarchy");
+        }
+    }
+
+    // Reads a whole hierarchy into memory
+    static ContractionHierarchy load(std::istream &in) {
+        Header header;
+        in.read(reinterpret_cast<char *>(&header), sizeof(header));
+        if (!in) {
+            throw std::runtime_error("Not a contraction hierarchy file");
+        }
+
+        auto hierarchy = from_header(header);
+        auto storage = std::make_shared<std::vector<uint32_t>>(hierarchy.data_words());
+        in.read(reinterpret_cast<char *>(storage->data()), storage->size() * sizeof(uint32_t));
+        if (!in) {
+            throw std::runtime_error("Truncated contraction hierarchy file");
+        }
+
+        hierarchy.data_ = storage->data();
+        hierarchy.holder_ = storage;
+        hierarchy.check_offsets();
+        return hierarchy;
+    }
+
+    // Maps a hierarchy file read-only, without reading it
+    static ContractionHierarchy map_file(const std::string &path) {
+        auto file = std::make_shared<MappedFile>(path);
+        if (file->size() < sizeof(Header)) {
+            throw std::runtime_error("Not a contraction hierarchy file: " + path);
+        }
+
+        Header header;
+        std::copy(file->data(), file->data() + sizeof(Header), reinterpret_cast<char *>(&header));
+        auto hierarchy = from_header(header);
+        if (file->size() != sizeof(Header) + hierarchy.bytes()) {
+            throw std::runtime_error("Truncated contraction hierarchy file " + path);
+        }
+
+        hierarchy.data_ = reinterpret_cast<const uint32_t *>(file->data() + sizeof(Header));
+        hierarchy.holder_ = file;
+        hierarchy.check_offsets();
+        return hierarchy;
+    }
+
+private:
+    static constexpr char MAGIC[4] = {'K', 'B', 'C', 'H'};
+    static constexpr uint32_t FORMAT_VERSION = 1;
+
+    // 48 bytes, so the arrays after it stay aligned when mapped
+    struct Header {
+        char magic[4];
+        uint32_t format_version;
+        int32_t rows;
+        int32_t cols;
+        uint64_t num_up;
+        uint64_t num_down;
+        uint64_t board_version;
+        uint64_t fingerprint;
+    };
+
+    /*
+     * The graph while it's being contracted: in and out edges of each
+     * square, towards squares not contracted yet. Once a square is
+     * contracted its edges don't change anymore, and become its up and
+     * down edges.
+     */
+    class Builder {
+    public:
+        Builder(const BOARD &board, const ContractionOptions &options)
+                : up(board.num_squares()), down(board.num_squares()),
+                  board_(board), options_(options),
+                  pool_(options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency())),
+                  out_(board.num_squares()), in_(board.num_squares()),
+                  state_(board.num_squares(), ACTIVE), deleted_(board.num_squares(), 0),
+                  level_(board.num_squares(), 0),
+                  priority_(board.num_squares(), 0), shortcuts_(board.num_squares()),
+                  workspaces_(pool_.size()) {
+            const auto n = board.num_squares();
+            for (auto &workspace : workspaces_) {
+                workspace.resize(n);
+            }
+
+            pool_.parallel_for(n, [&](size_t i, size_t) {
+                for (const auto &adj : board_.adjacent_positions(board_.pos_at(static_cast<uint32_t>(i)))) {
+                    auto to = board_.index_of(adj.first);
+                    // A portal one knight move away from its partner can
+                    // move onto itself
+                    if (to != i) {
+                        out_[i].push_back(Edge{to, static_cast<uint32_t>(adj.second), NO_NODE});
+                    }
+                }
+            });
+            for (uint32_t i = 0; i < n; i++) {
+                for (const auto &edge : out_[i]) {
+                    in_[edge.node].push_back(Edge{i, edge.weight, NO_NODE});
+                }
+            }
+        }
+
+        void contract_all() {
+            const auto n = board_.num_squares();
+            std::vector<uint32_t> remaining(n);
+            for (uint32_t i = 0; i < n; i++) {
+                remaining[i] = i;
+            }
+            update_priorities(remaining);
+            auto in_core = [&](uint32_t x) { return priority_[x] == CORE; };
+
+            std::vector<uint32_t> batch;
+            std::vector<uint32_t> neighbours;
+            while (true) {
+                batch.clear();
+                for (auto x : remaining) {
+                    if (!in_core(x) && is_local_minimum(x)) {
+                        batch.push_back(x);
+                    }
+                }
+                if (batch.empty()) {
+                    break;
+                }
+                for (auto x : batch) {
+                    state_[x] = IN_BATCH;
+                }
+
+                pool_.parallel_for(batch.size(), [&](size_t i, size_t worker) {
+                    find_shortcuts(batch[i], workspaces_[worker], shortcuts_[batch[i]]);
+                });
+
+                neighbours.clear();
+                for (auto x : batch) {
+                    contract(x, neighbours);
+                }
+
+                remaining.erase(std::remove_if(remaining.begin(), remaining.end(), [&](uint32_t x) {
+                    return state_[x] == CONTRACTED;
+                }), remaining.end());
+
+                std::sort(neighbours.begin(), neighbours.end());
+                neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+                update_priorities(neighbours);
+            }
+
+            // What's left is the core, where every edge goes up
+            for (auto x : remaining) {
+                up[x] = out_[x];
+                down[x] = in_[x];
+            }
+        }
+
+        // Results, by square
+        std::vector<std::vector<Edge>> up;
+        std::vector<std::vector<Edge>> down;
+
+    private:
+        // Priority of the squares too dense to contract
+        static constexpr int CORE = std::numeric_limits<int>::max();
+
+        enum State : uint8_t {
+            ACTIVE, IN_BATCH, CONTRACTED
+        };
+
+        struct Shortcut {
+            uint32_t from;
+            uint32_t to;
+            uint32_t weight;
+        };
+
+        bool is_local_minimum(uint32_t x) const {
+            auto lower = [&](uint32_t y) {
+                return priority_[y] < priority_[x] || (priority_[y] == priority_[x] && y < x);
+            };
+            for (const auto &edge : out_[x]) {
+                if (lower(edge.node)) {
+                    return false;
+                }
+            }
+            for (const auto &edge : in_[x]) {
+                if (lower(edge.node)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void update_priorities(const std::vector<uint32_t> &nodes) {
+            /* Contracting x may need a shortcut for each pair of neighbours
+             * u -> x -> v. Counting them all instead of running the witness
+             * searches orders squares by how much they could fill in, like a
+             * minimum degree ordering. On knight graphs that gives smaller
+             * hierarchies than the usual estimate, and costs next to nothing.
+             */
+            pool_.parallel_for(nodes.size(), [&](size_t i, size_t) {
+                const auto x = nodes[i];
+                const auto degree = static_cast<int>(in_[x].size() + out_[x].size());
+                if (degree > static_cast<int>(options_.core_degree)) {
+                    priority_[x] = CORE;
+                    return;
+                }
+
+                int pairs = static_cast<int>(in_[x].size() * out_[x].size());
+                for (const auto &in_edge : in_[x]) {
+                    for (const auto &out_edge : out_[x]) {
+                        pairs -= (in_edge.node == out_edge.node);
+                    }
+                }
+                priority_[x] = 2 * (pairs - degree) + deleted_[x] + level_[x];
+            });
+        }
+
+        void find_shortcuts(uint32_t x, SearchWorkspace &workspace, std::vector<Shortcut> &shortcuts) const {
+            /* For each edge u -> x, a Dijkstra from u that avoids x (and
+             * anything else leaving in this round), up to the most expensive
+             * u -> x -> v. Every v not reached at most as cheaply needs a
+             * shortcut.
+             */
+            shortcuts.clear();
+            uint32_t max_out = 0;
+            std::vector<uint32_t> targets;
+            for (const auto &edge : out_[x]) {
+                max_out = std::max(max_out, edge.weight);
+                targets.push_back(edge.node);
+            }
+            std::sort(targets.begin(), targets.end());
+
+            for (const auto &in_edge : in_[x]) {
+                const auto u = in_edge.node;
+                const int max_dist = static_cast<int>(in_edge.weight + max_out);
+
+                workspace.new_query();
+                BinaryHeapQueue queue(workspace, MAX_MOVE_WEIGHT);
+                workspace.visit(u, u, 0);
+                queue.push(u, 0);
+
+                // Stop early once all the targets are settled
+                uint32_t settled = 0;
+                size_t targets_left = targets.size() - std::binary_search(targets.begin(), targets.end(), u);
+                while (!queue.empty() && settled < options_.witness_limit && targets_left > 0) {
+                    auto this_index = queue.pop();
+                    if (workspace.settled(this_index)) {
+                        continue;
+                    }
+                    workspace.settle(this_index);
+                    settled++;
+                    const auto this_dist = workspace.dist(this_index);
+                    if (this_dist >= max_dist) {
+                        break;
+                    }
+                    if (this_index != u && std::binary_search(targets.begin(), targets.end(), this_index)) {
+                        targets_left--;
+                    }
+
+                    for (const auto &edge : out_[this_index]) {
+                        if (state_[edge.node] != ACTIVE) {
+                            continue;
+                        }
+                        const auto adj_dist = this_dist + static_cast<int>(edge.weight);
+                        if (!workspace.visited(edge.node)) {
+                            workspace.visit(edge.node, this_index, adj_dist);
+                        } else if (!workspace.settled(edge.node) && adj_dist < workspace.dist(edge.node)) {
+                            workspace.relax(edge.node, this_index, adj_dist);
+                        } else {
+                            continue;
+                        }
+                        queue.push(edge.node, adj_dist);
+                    }
+                }
+
+                for (const auto &out_edge : out_[x]) {
+                    const auto v = out_edge.node;
+                    const auto weight = in_edge.weight + out_edge.weight;
+                    if (v != u && !(workspace.visited(v) && workspace.dist(v) <= static_cast<int>(weight))) {
+                        shortcuts.push_back(Shortcut{u, v, weight});
+                    }
+                }
+            }
+        }
+
+        static void erase_edge(std::vector<Edge> &edges, uint32_t node) {
+            for (size_t i = 0; i < edges.size(); i++) {
+                if (edges[i].node == node) {
+                    edges[i] = edges.back();
+                    edges.pop_back();
+                    return;
+                }
+            }
+        }
+
+        // Adds from -> to, or makes the existing edge cheaper
+        void add_edge(uint32_t from, uint32_t to, uint32_t weight, uint32_t middle) {
+            for (auto &edge : out_[from]) {
+                if (edge.node == to) {
+                    if (weight < edge.weight) {
+                        edge.weight = weight;
+                        edge.middle = middle;
+                        for (auto &reverse : in_[to]) {
+                            if (reverse.node == from) {
+                                reverse.weight = weight;
+                                reverse.middle = middle;
+                            }
+                        }
+                    }
+                    return;
+                }
+            }
+            out_[from].push_back(Edge{to, weight, middle});
+            in_[to].push_back(Edge{from, weight, middle});
+        }
+
+        void contract(uint32_t x, std::vector<uint32_t> &neighbours) {
+            // Nothing else in the batch is a neighbour, so these are final
+            up[x] = out_[x];
+            down[x] = in_[x];
+
+            for (const auto &edge : out_[x]) {
+                erase_edge(in_[edge.node], x);
+                deleted_[edge.node]++;
+                level_[edge.node] = std::max(level_[edge.node], level_[x] + 1);
+                neighbours.push_back(edge.node);
+            }
+            for (const auto &edge : in_[x]) {
+                erase_edge(out_[edge.node], x);
+                deleted_[edge.node]++;
+                level_[edge.node] = std::max(level_[edge.node], level_[x] + 1);
+                neighbours.push_back(edge.node);
+            }
+            for (const auto &shortcut : shortcuts_[x]) {
+                add_edge(shortcut.from, shortcut.to, shortcut.weight, x);
+            }
+
+            std::vector<Edge>().swap(out_[x]);
+            std::vector<Edge>().swap(in_[x]);
+            std::vector<Shortcut>().swap(shortcuts_[x]);
+            state_[x] = CONTRACTED;
+        }
+
+        const BOARD &board_;
+        const ContractionOptions &options_;
+        ThreadPool pool_;
+
+        std::vector<std::vector<Edge>> out_;
+        std::vector<std::vector<Edge>> in_;
+        std::vector<State> state_;
+        std::vector<int> deleted_;
+        std::vector<int> level_;
+        std::vector<int> priority_;
+        // Shortcuts found for the squares of the current round
+        std::vector<std::vector<Shortcut>> shortcuts_;
+        std::vector<SearchWorkspace> workspaces_;
+    };
+
+    // The edge from a to b, which is an up edge of one or a down edge of the other
+    const Edge &find_edge(uint32_t a, uint32_t b) const {
+        for (auto edge = up_begin(a); edge != up_end(a); edge++) {
+            if (edge->node == b) {
+                return *edge;
+            }
+        }
+        for (auto edge = down_begin(b); edge != down_end(b); edge++) {
+            if (edge->node == a) {
+                return *edge;
+            }
+        }
+        throw std::runtime_error("Corrupt contraction hierarchy: missing edge");
+    }
+
+    // Appends the squares after a on the way to b
+    void unpack(const BOARD &board, uint32_t a, uint32_t b, typename BOARD::PosVec &path) const {
+        std::vector<std::pair<uint32_t, uint32_t>> stack{{a, b}};
+        while (!stack.empty()) {
+            auto from = stack.back().first;
+            auto to = stack.back().second;
+            stack.pop_back();
+
+            const auto middle = find_edge(from, to).middle;
+            if (middle != NO_NODE) {
+                // First half on top
+                stack.emplace_back(middle, to);
+                stack.emplace_back(from, middle);
+                continue;
+            }
+
+            // Moves out of a portal start from its partner
+            auto from_pos = board.pos_at(from);
+            if (board.square(from_pos) == BoardSquare::Teleport) {
+                path.push_back(from_pos == board.teleports->first ? board.teleports->second
+                                                                   : board.teleports->first);
+            }
+            path.push_back(board.pos_at(to));
+        }
+    }
+
+    Header make_header() const {
+        Header header{};
+        std::copy(MAGIC, MAGIC + 4, header.magic);
+        header.format_version = FORMAT_VERSION;
+        header.rows = rows_;
+        header.cols = cols_;
+        header.num_up = num_up_;
+        header.num_down = num_down_;
+        header.board_version = board_version_;
+        header.fingerprint = fingerprint_;
+        return header;
+    }
+
+    static ContractionHierarchy from_header(const Header &header) {
+        if (!std::equal(MAGIC, MAGIC + 4, header.magic) || header.format_version != FORMAT_VERSION) {
+            throw std::runtime_error("Not a contraction hierarchy file");
+        }
+        // Squares are indexed by uint32_t (with NO_NODE left over), and so
+        // are edges, which also keeps data_words() from overflowing
+        const uint64_t num_squares = static_cast<uint64_t>(header.rows) * static_cast<uint64_t>(header.cols);
+        if (header.rows <= 0 || header.cols <= 0 || num_squares >= NO_NODE ||
+            header.num_up > std::numeric_limits<uint32_t>::max() ||
+            header.num_down > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("Corrupt contraction hierarchy header");
+        }
+        ContractionHierarchy hierarchy;
+        hierarchy.rows_ = header.rows;
+        hierarchy.cols_ = header.cols;
+        hierarchy.num_squares_ = static_cast<uint32_t>(header.rows) * static_cast<uint32_t>(header.cols);
+        hierarchy.num_up_ = header.num_up;
+        hierarchy.num_down_ = header.num_down;
+        hierarchy.board_version_ = header.board_version;
+        hierarchy.fingerprint_ = header.fingerprint;
+        return hierarchy;
+    }
+
+    // Offsets must start at 0, never decrease, and end at the edge counts,
+    // or searches would read outside the edge arrays. The edges themselves
+    // aren't checked, so that mapping a file doesn't read all of it.
+    void check_offsets() const {
+        auto check = [&](const uint32_t *offsets, uint64_t num_edges) {
+            if (offsets[0] != 0 || offsets[num_squares_] != num_edges) {
+                return false;
+            }
+            for (uint32_t i = 0; i < num_squares_; i++) {
+                if (offsets[i] > offsets[i + 1]) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        if (!check(up_offsets(), num_up_) || !check(down_offsets(), num_down_)) {
+            throw std::runtime_error("Corrupt contraction hierarchy offsets");
+        }
+    }
+
+    size_t data_words() const {
+        return 2 * (static_cast<size_t>(num_squares_) + 1) + (num_up_ + num_down_) * (sizeof(Edge) / sizeof(uint32_t));
+    }
+
+    const uint32_t *up_offsets() const { return data_; }
+
+    const uint32_t *down_offsets() const { return data_ + num_squares_ + 1; }
+
+    const Edge *up_edges() const { return reinterpret_cast<const Edge *>(down_offsets() + num_squares_ + 1); }
+
+    const Edge *down_edges() const { return up_edges() + num_up_; }
+
+    int rows_;
+    int cols_;
+    uint32_t num_squares_;
+    uint64_t num_up_;
+    uint64_t num_down_;
+    uint64_t board_version_;
+    uint64_t fingerprint_;
+
+    // Points into holder_, which is either an owned vector or a file mapping.
+    // Copies share the same data.
+    const uint32_t *data_;
+    std::shared_ptr<const void> holder_;
+};
+
+template<typename BOARD>
+constexpr char ContractionHierarchy<BOARD>::MAGIC[4];
+
+template<typename BOARD>
+constexpr uint32_t ContractionHierarchy<BOARD>::NO_NODE;
+
+template<typename BOARD>
+constexpr uint32_t ContractionHierarchy<BOARD>::FORMAT_VERSION;
@@ -0,0 +1,323 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "bidirectional.h"
+#include "level4.h"
+#include "search_stats.h"
+
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <vector>
+
+/*
+ * Incremental Level 4 planner (D* Lite, Koenig & Likhachev 2002) for boards
+ * whose squares change between queries.
+ *
+ * Like FlowField, the search runs backwards from the goal: g(s) is the cost
+ * from s to the goal, and rhs(s) the one-step lookahead
+ * min(move weight + g(successor)). Squares where the two disagree are
+ * "inconsistent" and sit in the queue, ordered A*-style towards the start.
+ *
+ * When squares change, only the squares whose moves could be affected get
+ * their rhs recomputed, and the search resumes from there: the work is
+ * proportional to the part of the solution that actually changed, instead
+ * of the whole search. The start can move too (e.g. as the knight walks
+ * along its path), which only shifts the queue keys by km.
+ *
+ * Changes are picked up through the board's version() and changed_squares()
+ * (see DynamicBoard). Adding, removing or moving a portal isn't incremental:
+ * the planner then starts over. Costs are always the same as a
+ * from-scratch shortest_path_lvl4, though the path may break ties
+ * differently.
+ */
+template<typename BOARD>
+class DStarLitePlanner {
+public:
+    DStarLitePlanner(const BOARD &board, const typename BOARD::Pos &start, const typename BOARD::Pos &goal)
+            : board_(board),
+              heuristic_(board),
+              start_(board.index_of(start)),
+              goal_(board.index_of(goal)) {
+        reset();
+    }
+
+    // The knight moved: keeps the existing solution, and shifts the keys
+    void move_start(const typename BOARD::Pos &start) {
+        auto new_start = board_.index_of(start);
+        km_ += h(start_, new_start);
+        start_ = new_start;
+    }
+
+    /*
+     * Brings the solution up to date with the board and the start, and
+     * returns a shortest path from start to goal. Throws std::out_of_range
+     * if the goal can't be reached.
+     */
+    typename BOARD::PosVec plan(SearchStats *stats = nullptr) {
+        auto start = board_.pos_at(start_);
+        auto goal = board_.pos_at(goal_);
+
+        if (start_ == goal_) {
+            return typename BOARD::PosVec{start, goal};
+        }
+
+        // Trivial teleport case, same as shortest_path_lvl4
+        if ((board_.square(start) == BoardSquare::Teleport) && (board_.square(goal) == BoardSquare::Teleport)) {
+            return typename BOARD::PosVec{start, goal};
+        }
+
+        sync_with_board();
+        compute_shortest_path(stats);
+
+        // The start itself may be left unexpanded, its lookahead is exact
+        if (rhs_[start_] >= INF) {
+            throw std::out_of_range("Goal is not reachable from the start position");
+        }
+
+        // Walk down the g values
+        typename BOARD::PosVec path{start};
+        auto this_index = start_;
+        while (this_index != goal_) {
+            auto best_index = this_index;
+            int best = INF;
+            for (const auto &adj : board_.adjacent_positions(board_.pos_at(this_index))) {
+                auto adj_index = board_.index_of(adj.first);
+                if (g_[adj_index] < INF && adj.second + g_[adj_index] < best) {
+                    best = adj.second + g_[adj_index];
+                    best_index = adj_index;
+                }
+            }
+            if (best_index == this_index || path.size() > board_.num_squares()) {
+                throw std::runtime_error("Planner state doesn't match the board");
+            }
+            this_index = best_index;
+            path.push_back(board_.pos_at(this_index));
+        }
+
+        return path;
+    }
+
+    // Cost of the current solution, as of the last plan()
+    int cost() const { return rhs_[start_]; }
+
+    size_t bytes() const {
+        return g_.capacity() * sizeof(int) * 2 + keys_.capacity() * sizeof(Key) +
+               in_queue_.capacity() / 8 + queue_.size() * sizeof(QueueEntry);
+    }
+
+private:
+    static constexpr int INF = std::numeric_limits<int>::max() / 2;
+
+    // Compared lexicographically
+    using Key = std::pair<int, int>;
+    using QueueEntry = std::pair<Key, uint32_t>;
+
+    int h(uint32_t from, uint32_t to) const {
+        return heuristic_(board_.pos_at(from), board_.pos_at(to));
+    }
+
+    Key calculate_key(uint32_t s) const {
+        auto g_rhs = std::min(g_[s], rhs_[s]);
+        return Key(g_rhs >= INF ? INF : g_rhs + h(start_, s) + km_, g_rhs);
+    }
+
+    void reset() {
+        const auto n = board_.num_squares();
+        g_.assign(n, INF);
+        rhs_.assign(n, INF);
+        keys_.assign(n, Key(INF, INF));
+        in_queue_.assign(n, false);
+        queue_ = Queue();
+        km_ = 0;
+        rows_ = board_.rows();
+        cols_ = board_.cols();
+        synced_version_ = board_.version();
+        teleports_ = board_.teleports;
+
+        // Squares change, so the cheapest move isn't fixed: the heuristic
+        // has to hold for any board
+        heuristic_ = KnightDistanceHeuristic<BOARD>(board_);
+        heuristic_.min_weight = 1;
+
+        rhs_[goal_] = 0;
+        push(goal_);
+    }
+
+    void push(uint32_t s) {
+        keys_[s] = calculate_key(s);
+        in_queue_[s] = true;
+        queue_.emplace(keys_[s], s);
+    }
+
+    // Pops stale entries, left behind by updates and removals
+    void skip_stale() {
+        while (!queue_.empty()) {
+            const auto &top = queue_.top();
+            auto s = top.second;
+            if (in_queue_[s] && keys_[s] == top.first) {
+                return;
+            }
+            queue_.pop();
+        }
+    }
+
+    Key top_key() {
+        skip_stale();
+        return queue_.empty() ? Key(INF, INF) : queue_.top().first;
+    }
+
+    void update_vertex(uint32_t s) {
+        if (g_[s] != rhs_[s]) {
+            // (Re)insert with the new key, the old entry goes stale
+            push(s);
+        } else {
+            in_queue_[s] = false;
+        }
+    }
+
+    // One-step lookahead over the current moves of s
+    int lookahead(uint32_t s) const {
+        int best = INF;
+        for (const auto &adj : board_.adjacent_positions(board_.pos_at(s))) {
+            auto g = g_[board_.index_of(adj.first)];
+            if (g < INF) {
+                best = std::min(best, adj.second + g);
+            }
+        }
+        return best;
+    }
+
+    void compute_shortest_path(SearchStats *stats) {
+        while (top_key() < calculate_key(start_) || rhs_[start_] > g_[start_]) {
+            auto u = queue_.top().second;
+            auto k_old = queue_.top().first;
+            auto k_new = calculate_key(u);
+
+            if (k_old < k_new) {
+                // The key was computed for an earlier start
+                push(u);
+                continue;
+            }
+
+            queue_.pop();
+            in_queue_[u] = false;
+
+            if (stats) {
+                stats->nodes_expanded++;
+            }
+
+            auto preds = reverse_adjacent_positions(board_, board_.pos_at(u));
+            if (g_[u] > rhs_[u]) {
+                // Overconsistent: the cost went down, settle it
+                g_[u] = rhs_[u];
+                for (const auto &pred : preds) {
+                    auto s = board_.index_of(pred.first);
+                    if (s != goal_ && pred.second + g_[u] < rhs_[s]) {
+                        rhs_[s] = pred.second + g_[u];
+                        update_vertex(s);
+                    }
+                }
+            } else {
+                // Underconsistent: the cost went up, and anything that went
+                // through u has to look for another way
+                auto g_old = g_[u];
+                g_[u] = INF;
+                for (const auto &pred : preds) {
+                    auto s = board_.index_of(pred.first);
+                    if (s != goal_ && rhs_[s] == pred.second + g_old) {
+                        rhs_[s] = lookahead(s);
+                    }
+                    update_vertex(s);
+                }
+                if (u != goal_) {
+                    rhs_[u] = lookahead(u);
+                }
+                update_vertex(u);
+            }
+        }
+    }
+
+    void sync_with_board() {
+        if (board_.version() == synced_version_) {
+            return;
+        }
+
+        changed_.clear();
+        if (board_.rows() != rows_ || board_.cols() != cols_ ||
+            !board_.changed_squares(synced_version_, changed_)) {
+            reset();
+            return;
+        }
+        synced_version_ = board_.version();
+
+        for (auto v : changed_) {
+            if (board_.square(board_.pos_at(v)) == BoardSquare::Teleport ||
+                (teleports_ && (v == board_.index_of(teleports_->first) ||
+                                v == board_.index_of(teleports_->second)))) {
+                reset();
+                return;
+            }
+        }
+
+        for (auto v : changed_) {
+            /* The moves of a square depend on the square it lands on, and on
+             * the barrier scan along the long leg of the L. Both stay within
+             * two rows and columns, so those are the only squares whose rhs
+             * can change, plus a portal whose partner is among them.
+             */
+            auto center = board_.pos_at(v);
+            for (int dx = -2; dx <= 2; dx++) {
+                for (int dy = -2; dy <= 2; dy++) {
+                    typename BOARD::Pos pos(center.x + dx, center.y + dy);
+                    if (!board_.is_within_bounds(pos)) {
+                        continue;
+                    }
+                    refresh(board_.index_of(pos));
+
+                    if (teleports_ && pos == teleports_->first) {
+                        refresh(board_.index_of(teleports_->second));
+                    } else if (teleports_ && pos == teleports_->second) {
+                        refresh(board_.index_of(teleports_->first));
+                    }
+                }
+            }
+        }
+    }
+
+    void refresh(uint32_t s) {
+        if (s != goal_) {
+            rhs_[s] = lookahead(s);
+        }
+        update_vertex(s);
+    }
+
+    using Queue = std::priority_queue<QueueEntry, std::vector<QueueEntry>, std::greater<QueueEntry>>;
+
+    const BOARD &board_;
+    KnightDistanceHeuristic<BOARD> heuristic_;
+    uint32_t start_;
+    uint32_t goal_;
+    int km_;
+
+    std::vector<int> g_;
+    std::vector<int> rhs_;
+    // Key of each square in the queue, to recognize stale entries
+    std::vector<Key> keys_;
+    std::vector<bool> in_queue_;
+    Queue queue_;
+
+    // What the solution was computed against
+    int rows_;
+    int cols_;
+    uint64_t synced_version_;
+    std::experimental::optional<std::pair<typename BOARD::Pos, typename BOARD::Pos>> teleports_;
+    std::vector<uint32_t> changed_;
+};
+
+template<typename BOARD>
+constexpr int DStarLitePlanner<BOARD>::INF;
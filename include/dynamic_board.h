@@ -0,0 +1,224 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "board_rules.h"
+#include "mapped_file.h"
+
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+/*
+ * A board whose dimensions are only known at runtime. Board<N> is great for
+ * the small maps of the exercise, but a 4096x4096 std::array doesn't fit on
+ * the stack and needs recompiling for every map size.
+ *
+ * Squares live in a single row-major heap buffer addressed by a uint32_t
+ * linear index. The public interface mirrors Board<N>, so all the level
+ * templates work unchanged.
+ */
+struct DynamicBoard {
+    struct Pos {
+        /* holds a position in the board. */
+        int x;
+        int y;
+
+        // Construct from row and col index
+        Pos(int x_, int y_) : x(x_), y(y_) {}
+
+        bool operator==(const Pos &other) const {
+            return (other.x == x && other.y == y);
+        }
+
+        bool operator!=(const Pos &other) const {
+            return !(*this == other);
+        }
+
+        friend std::ostream &operator<<(std::ostream &out, const Pos &p) {
+            out << "[x: " << p.x << " y: " << p.y << "]";
+            return out;
+        }
+    };
+
+    /* functor needed to use Pos as key in hashmaps. The board width isn't
+     * known here, so pack both coordinates instead. */
+    struct PosHasher {
+        size_t operator()(const Pos &pos) const {
+            return (static_cast<size_t>(static_cast<uint32_t>(pos.x)) << 32) ^ static_cast<uint32_t>(pos.y);
+        }
+    };
+
+    // Same typedefs as Board<N>
+    using PosVec = std::vector<Pos>;
+    using GraphEdge = std::pair<Pos, int>;
+    using GraphEdgeVec = std::vector<GraphEdge>;
+
+    DynamicBoard() : rows_(0), cols_(0), version_(0), log_version_(0) {}
+
+    explicit DynamicBoard(int size) : DynamicBoard(size, size) {}
+
+    DynamicBoard(int rows, int cols) : version_(0), log_version_(0) {
+        resize(rows, cols);
+    }
+
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    uint32_t num_squares() const { return static_cast<uint32_t>(squares.size()); }
+
+    uint32_t index_of(const Pos &pos) const { return row_major_index(*this, pos); }
+
+    Pos pos_at(uint32_t index) const { return row_major_pos(*this, index); }
+
+    BoardSquare square(const Pos &pos) const { return squares[index_of(pos)]; }
+
+    // Bumps the board version, see Board<N>::set_square, and records the
+    // change in the change log. Portals can't be added or removed here, or
+    // the squares would disagree with teleports: use set_teleports().
+    void set_square(const Pos &pos, BoardSquare sq) {
+        if ((sq == BoardSquare::Teleport) != (square(pos) == BoardSquare::Teleport)) {
+            throw std::invalid_argument("Portals can only be changed through set_teleports()");
+        }
+        change(pos, sq);
+    }
+
+    // Moves the pair of portals, or removes it with nullopt. Squares that
+    // stop being portals become Clear, and every square change is logged.
+    void set_teleports(const std::experimental::optional<std::pair<Pos, Pos>> &portals) {
+        if (portals && portals->first == portals->second) {
+            throw std::invalid_argument("The two portals must be different squares");
+        }
+        auto old = teleports;
+        teleports = std::experimental::nullopt;
+        if (old) {
+            change(old->first, BoardSquare::Clear);
+            change(old->second, BoardSquare::Clear);
+        }
+        if (portals) {
+            change(portals->first, BoardSquare::Teleport);
+            change(portals->second, BoardSquare::Teleport);
+        }
+        teleports = portals;
+    }
+
+    uint64_t version() const { return version_; }
+
+    /*
+     * Appends to out the indices of the squares changed through set_square()
+     * since the board was at version `since`, oldest first (a square shows
+     * up once per change). Returns false if the log doesn't go back that far,
+     * e.g. after a resize() or forget_changes(): everything derived from the
+     * board must then be rebuilt.
+     */
+    bool changed_squares(uint64_t since, std::vector<uint32_t> &out) const {
+        // Each logged change bumped the version by exactly one
+        if (since < log_version_ || since > version_) {
+            return false;
+        }
+        out.insert(out.end(), changes_.begin() + (since - log_version_), changes_.end());
+        return true;
+    }
+
+    // Drops the change log, once all users have caught up with version()
+    void forget_changes() {
+        changes_.clear();
+        log_version_ = version_;
+    }
+
+    // Throws away the current contents and makes an all-Clear board
+    void resize(int rows, int cols) {
+        if (rows < 0 || cols < 0 ||
+            static_cast<uint64_t>(rows) * static_cast<uint64_t>(cols) > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("Board dimensions don't fit a 32-bit square index");
+        }
+        rows_ = rows;
+        cols_ = cols;
+        squares.assign(static_cast<size_t>(rows) * cols, BoardSquare::Clear);
+        teleports = std::experimental::nullopt;
+        version_++;
+        forget_changes();
+    }
+
+    // Holds the square type data for the board, row-major
+    std::vector<BoardSquare> squares;
+    // Optional pair of teleport portals
+    std::experimental::optional<std::pair<Pos, Pos>> teleports;
+
+    std::ostream &print(std::ostream &out,
+                        std::experimental::optional<Pos> knight_pos = std::experimental::nullopt) const {
+        return print_board(*this, out, knight_pos);
+    }
+
+    bool is_within_bounds(const Pos &pos) const { return is_within_board(*this, pos); }
+
+    GraphEdgeVec adjacent_positions(const Pos &origin, const bool is_teleport_dest = false) const {
+        return knight_adjacent_positions(*this, origin, is_teleport_dest);
+    }
+
+    bool is_valid_step(const Pos &begin, const Pos &end) const {
+        return is_valid_knight_step(*this, begin, end);
+    }
+
+    void load_from_file() {
+        load_from_file(std::string(std::getenv("HOME")) + "/knightboard.txt");
+    }
+
+    void load_from_file(const std::string &file_name) {
+        /* Same text format as Board<N>::load_from_file, but the dimensions
+         * are taken from the file: the number of lines, and the number of
+         * squares in the first one. The file is mapped rather than read, so
+         * the only copy of the map in memory is the squares themselves. */
+        MappedFile file(file_name);
+
+        std::vector<BoardSquare> data;
+        // Squares are usually separated by a space
+        data.reserve(file.size() / 2 + 1);
+        std::vector<Pos> portals;
+
+        BoardTextShape shape;
+        try {
+            shape = parse_board_text(file.data(), file.size(), [&](int row, int col, BoardSquare sq) {
+                data.push_back(sq);
+                if (sq == BoardSquare::Teleport) {
+                    portals.push_back({row, col});
+                }
+            });
+        } catch (const std::runtime_error &e) {
+            throw std::runtime_error(file_name + ": " + e.what());
+        }
+
+        resize(shape.rows, shape.cols);
+        squares = std::move(data);
+
+        if (portals.size()) {
+            if (portals.size() != 2) {
+                throw std::runtime_error("Invalid number of teleport portals in the map");
+            }
+            teleports = std::make_pair(portals.at(0), portals.at(1));
+        }
+    }
+
+private:
+    void change(const Pos &pos, BoardSquare sq) {
+        squares[index_of(pos)] = sq;
+        changes_.push_back(index_of(pos));
+        version_++;
+    }
+
+    int rows_;
+    int cols_;
+    uint64_t version_;
+    // Squares changed by set_square() since version log_version_
+    std::vector<uint32_t> changes_;
+    uint64_t log_version_;
+};
+
+inline std::ostream &operator<<(std::ostream &out, const DynamicBoard &board) {
+    return board.print(out);
+}
+
+using DynPos = DynamicBoard::Pos;
+using DynPosVec = DynamicBoard::PosVec;
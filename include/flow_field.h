@@ -0,0 +1,247 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "search_workspace.h"
+#include "search_queues.h"
+#include "bidirectional.h"
+
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+
+/*
+ * Single-target distance field ("flow field"): the cost of the cheapest
+ * route from every square of the board to one goal square.
+ *
+ * When many knights head to the same goal, running one shortest path
+ * search per knight repeats the same work over and over. Instead, a single
+ * Dijkstra from the goal along reversed edges gives the distances for all
+ * of them at once, and each path is then a greedy descent: from any square,
+ * some move leads to a square exactly that move's weight closer to the
+ * goal.
+ *
+ * The field remembers the version() of the board it was built from, to
+ * cheaply check if it's outdated. Saved fields also store the board
+ * fingerprint, to check they're loaded against the right map.
+ */
+template<typename BOARD>
+class FlowField {
+public:
+    static constexpr uint32_t UNREACHABLE = std::numeric_limits<uint32_t>::max();
+
+    FlowField() : rows_(0), cols_(0), goal_(0), board_version_(0), fingerprint_(0) {}
+
+    template<typename QUEUE = BucketQueue>
+    static FlowField build(const BOARD &board, const typename BOARD::Pos &goal) {
+        SearchWorkspace workspace(board);
+        return build<QUEUE>(board, goal, workspace);
+    }
+
+    template<typename QUEUE = BucketQueue>
+    static FlowField build(const BOARD &board, const typename BOARD::Pos &goal, SearchWorkspace &workspace) {
+        FlowField field;
+        field.rows_ = board.rows();
+        field.cols_ = board.cols();
+        field.goal_ = board.index_of(goal);
+        field.board_version_ = board.version();
+        field.fingerprint_ = board_fingerprint(board);
+        field.dists_.assign(board.num_squares(), UNREACHABLE);
+
+        // Dijkstra from the goal along reversed edges, over the whole board
+        workspace.resize(board.num_squares());
+        workspace.new_query();
+        QUEUE queue(workspace, MAX_MOVE_WEIGHT);
+
+        workspace.visit(field.goal_, field.goal_, 0);
+        queue.push(field.goal_, 0);
+
+        while (!queue.empty()) {
+            auto this_index = queue.pop();
+            if (workspace.settled(this_index)) {
+                continue;
+            }
+            workspace.settle(this_index);
+
+            const auto this_dist = workspace.dist(this_index);
+            field.dists_[this_index] = static_cast<uint32_t>(this_dist);
+
+            for (const auto &adj : reverse_adjacent_positions(board, board.pos_at(this_index))) {
+                auto adj_index = board.index_of(adj.first);
+                auto adj_dist = this_dist + adj.second;
+
+                if (!workspace.visited(adj_index)) {
+                    workspace.visit(adj_index, this_index, adj_dist);
+                } else if (!workspace.settled(adj_index) && adj_dist < workspace.dist(adj_index)) {
+                    workspace.relax(adj_index, this_index, adj_dist);
+                } else {
+                    continue;
+                }
+                queue.push(adj_index, adj_dist);
+            }
+        }
+
+        return field;
+    }
+
+    typename BOARD::Pos goal(const BOARD &board) const { return board.pos_at(goal_); }
+
+    uint32_t distance(uint32_t index) const { return dists_[index]; }
+
+    bool is_reachable(uint32_t index) const { return dists_[index] != UNREACHABLE; }
+
+    // O(1): was the board changed through set_square() since the field was built?
+    bool is_current(const BOARD &board) const {
+        return board.rows() == rows_ && board.cols() == cols_ && board.version() == board_version_;
+    }
+
+    // O(N): was the field built from a board with the same contents?
+    bool matches(const BOARD &board) const {
+        return board.rows() == rows_ && board.cols() == cols_ && board_fingerprint(board) == fingerprint_;
+    }
+
+    typename BOARD::PosVec path_from(const BOARD &board, const typename BOARD::Pos &start) const {
+        /* Greedy descent from start to the goal, in O(path length).
+         * Returns the full path like shortest_path_lvl4 does, with the same
+         * cost.
+         */
+        auto goal_pos = board.pos_at(goal_);
+
+        if (start == goal_pos) {
+            return typename BOARD::PosVec{start, goal_pos};
+        }
+
+        // Trivial teleport case, same as shortest_path_lvl4
+        if ((board.square(start) == BoardSquare::Teleport) && (board.square(goal_pos) == BoardSquare::Teleport)) {
+            return typename BOARD::PosVec{start, goal_pos};
+        }
+
+        auto this_index = board.index_of(start);
+        if (!is_reachable(this_index)) {
+            throw std::out_of_range("Goal is not reachable from the start position");
+        }
+
+        typename BOARD::PosVec path{start};
+        while (this_index != goal_) {
+            bool moved = false;
+            for (const auto &adj : board.adjacent_positions(board.pos_at(this_index))) {
+                auto adj_index = board.index_of(adj.first);
+                if (is_reachable(adj_index) &&
+                    dists_[adj_index] + static_cast<uint32_t>(adj.second) == dists_[this_index]) {
+                    this_index = adj_index;
+                    path.push_back(adj.first);
+                    moved = true;
+                    break;
+                }
+            }
+            if (!moved) {
+                throw std::runtime_error("Flow field doesn't match the board");
+            }
+        }
+
+        return path;
+    }
+
+    size_t bytes() const { return dists_.capacity() * sizeof(uint32_t); }
+
+    /*
+     * Binary format: a fixed header followed by the distances as raw
+     * uint32_t, in native byte order.
+     */
+    void save(std::ostream &out) const {
+        Header header{};
+        std::copy(MAGIC, MAGIC + 4, header.magic);
+        header.format_version = FORMAT_VERSION;
+        header.rows = rows_;
+        header.cols = cols_;
+        header.goal = goal_;
+        header.board_version = board_version_;
+        header.fingerprint = fingerprint_;
+
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(dists_.data()), dists_.size() * sizeof(uint32_t));
+        if (!out) {
+            throw std::runtime_error("Failed writing flow field");
+        }
+    }
+
+    static FlowField load(std::istream &in) {
+        Header header;
+        in.read(reinterpret_cast<char *>(&header), sizeof(header));
+        if (!in || !std::equal(MAGIC, MAGIC + 4, header.magic) || header.format_version != FORMAT_VERSION) {
+            throw std::runtime_error("Not a flow field file");
+        }
+
+        const uint64_t num_squares = static_cast<uint64_t>(std::max(header.rows, 0)) * std::max(header.cols, 0);
+        if (header.rows < 0 || header.cols < 0 || num_squares > std::numeric_limits<uint32_t>::max() ||
+            header.goal >= num_squares) {
+            throw std::runtime_error("Invalid flow field dimensions");
+        }
+
+        // Don't trust the header with a huge allocation if the size can be checked
+        const auto start = in.tellg();
+        if (start != std::istream::pos_type(-1)) {
+            in.seekg(0, std::ios::end);
+            const auto end = in.tellg();
+            in.seekg(start);
+            if (static_cast<uint64_t>(end - start) != num_squares * sizeof(uint32_t)) {
+                throw std::runtime_error("Truncated flow field file");
+            }
+        }
+
+        FlowField field;
+        field.rows_ = header.rows;
+        field.cols_ = header.cols;
+        field.goal_ = header.goal;
+        field.board_version_ = header.board_version;
+        field.fingerprint_ = header.fingerprint;
+
+        // Otherwise, memory only grows as distances actually come in
+        const size_t chunk = 1 << 16;
+        while (field.dists_.size() < num_squares) {
+            const auto done = field.dists_.size();
+            field.dists_.resize(std::min<uint64_t>(num_squares, done + chunk));
+            in.read(reinterpret_cast<char *>(field.dists_.data() + done), (field.dists_.size() - done) * sizeof(uint32_t));
+            if (!in) {
+                throw std::runtime_error("Truncated flow field file");
+            }
+        }
+
+        return field;
+    }
+
+private:
+    static constexpr char MAGIC[4] = {'K', 'B', 'F', 'F'};
+    static constexpr uint32_t FORMAT_VERSION = 1;
+
+    struct Header {
+        char magic[4];
+        uint32_t format_version;
+        int32_t rows;
+        int32_t cols;
+        uint32_t goal;
+        uint32_t reserved;
+        uint64_t board_version;
+        uint64_t fingerprint;
+    };
+
+    int rows_;
+    int cols_;
+    uint32_t goal_;
+    uint64_t board_version_;
+    uint64_t fingerprint_;
+    std::vector<uint32_t> dists_;
+};
+
+template<typename BOARD>
+constexpr char FlowField<BOARD>::MAGIC[4];
+
+template<typename BOARD>
+constexpr uint32_t FlowField<BOARD>::UNREACHABLE;
+
+template<typename BOARD>
+constexpr uint32_t FlowField<BOARD>::FORMAT_VERSION;
@@ -0,0 +1,925 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "level4.h"
+#include "bidirectional.h"
+#include "search_workspace.h"
+#include "search_stats.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <queue>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct HierarchicalOptions {
+    // Side of the square chunks the board is cut into, at least 4
+    int chunk_size = 32;
+    // Along each chunk border, one crossing is kept every entrance_spacing
+    // squares
+    int entrance_spacing = 8;
+    // Keep every crossing instead: routes are then exactly as short as
+    // shortest_path_lvl4's, but the tables get a lot bigger
+    bool exact = false;
+    // Threads for building the tables, 0 for all cores
+    size_t threads = 0;
+    // Weighted A* on the abstract graph: above 1, route() expands far fewer
+    // nodes, and returns costs up to heuristic_weight times the best one
+    // the abstract graph has. Around 1.5 is a good trade on big maps
+    double heuristic_weight = 1;
+};
+
+// Route through the abstract graph, see HierarchicalPlanner::route()
+template<typename BOARD>
+struct HierarchicalRoute {
+    // begin, then the squares where the route leaves and enters chunks,
+    // then finish
+    typename BOARD::PosVec waypoints;
+    int cost = 0;
+};
+
+/*
+ * Hierarchical pathfinding (HPA*) for maps too big for a flat search.
+ *
+ * The board is cut into square chunks. Knight moves from one chunk into
+ * another (crossings) only start within two squares of the chunk border,
+ * or from a portal. Crossings are grouped by the neighbouring chunk they
+ * lead to, and along the border into runs without gaps; each run keeps one
+ * crossing every entrance_spacing squares, the cheapest one closest to the
+ * middle. Every gap in a wall thus keeps at least one crossing. Portals
+ * keep all of theirs.
+ *
+ * Each chunk then stores the cost of moving, within the chunk, from each
+ * square where a kept crossing lands (its entries) to each square where
+ * one starts (its exits). A query searches with A* on that small graph:
+ * from begin to the exits of its chunk, along crossings and tables, and
+ * from the entries of the finish chunk to finish. The route only lists the
+ * squares where it changes chunk. refine_segment() turns one leg into
+ * squares with a search within a single chunk, so a knight can start
+ * moving before the rest of the route is refined.
+ *
+ * Suboptimality: each border crossing may be moved to the kept one of its
+ * run, up to entrance_spacing / 2 squares along the border, and pays the
+ * detour on both sides, a few moves per crossing on open ground. Costs are
+ * never lower than shortest_path_lvl4's, and a heuristic_weight above 1
+ * multiplies the bound. With exact (and weight 1), every crossing is
+ * kept, and the costs are the same: any shortest path splits into legs
+ * within a single chunk, joined by crossings. If the kept crossings don't
+ * connect begin to finish (a crossing reachable only from a pocket), route()
+ * falls back to a flat shortest_path_lvl4 over the whole board.
+ *
+ * update() catches up with DynamicBoard::set_square. A changed square only
+ * changes moves that start within two rows and columns of it: its chunk
+ * gets its table rebuilt, and neighbouring chunks are only touched if the
+ * change is close enough to their border to change their crossings (or the
+ * entries where the chunk's own crossings land). Near a portal, that goes
+ * for the partner's chunk as well.
+ *
+ * Queries don't modify the planner, so they can run concurrently, but not
+ * at the same time as update().
+ */
+template<typename BOARD>
+class HierarchicalPlanner {
+public:
+    using Pos = typename BOARD::Pos;
+    using PosVec = typename BOARD::PosVec;
+    using Route = HierarchicalRoute<BOARD>;
+
+    static constexpr int UNREACHABLE = std::numeric_limits<int>::max();
+
+    explicit HierarchicalPlanner(const BOARD &board, const HierarchicalOptions &options = HierarchicalOptions())
+            : board_(board), options_(options), heuristic_(board) {
+        if (options.chunk_size < 4 || options.entrance_spacing < 1) {
+            throw std::invalid_argument("Chunks must be at least 4 squares wide, and entrance spacing at least 1");
+        }
+        rebuild();
+    }
+
+    // Rebuilds all the tables from scratch
+    void rebuild() {
+        rows_ = board_.rows();
+        cols_ = board_.cols();
+        version_ = board_.version();
+        heuristic_ = KnightDistanceHeuristic<BOARD>(board_);
+        chunk_rows_ = (rows_ + options_.chunk_size - 1) / options_.chunk_size;
+        chunk_cols_ = (cols_ + options_.chunk_size - 1) / options_.chunk_size;
+
+        const size_t n = num_chunks();
+        chunks_.assign(n, Chunk());
+
+        ThreadPool pool(options_.threads ? options_.threads : std::max(1u, std::thread::hardware_concurrency()));
+        std::vector<Scratch> scratch(pool.size());
+
+        // Entries need the exits of the neighbours, and tables need both
+        pool.parallel_for(n, [&](size_t c, size_t) {
+            set_exits(static_cast<uint32_t>(c), compute_exits(static_cast<uint32_t>(c)));
+        });
+        pool.parallel_for(n, [&](size_t c, size_t) {
+            chunks_[c].entries = compute_entries(static_cast<uint32_t>(c));
+            set_nodes(static_cast<uint32_t>(c));
+        });
+        number_nodes();
+        pool.parallel_for(n, [&](size_t c, size_t worker) {
+            compute_table(static_cast<uint32_t>(c), nullptr, scratch[worker]);
+        });
+    }
+
+    /*
+     * Catches up with the squares changed since the last build or update,
+     * through the board's change log (see DynamicBoard::changed_squares).
+     * Rebuilds everything if the log doesn't go back that far, or if a
+     * portal changed. Returns the number of chunks whose table was rebuilt,
+     * in full or in part.
+     */
+    size_t update() {
+        if (board_.version() == version_) {
+            return 0;
+        }
+
+        std::vector<uint32_t> changed;
+        if (board_.rows() != rows_ || board_.cols() != cols_ || !board_.changed_squares(version_, changed)) {
+            rebuild();
+            return num_chunks();
+        }
+        for (auto v : changed) {
+            auto pos = board_.pos_at(v);
+            if (board_.square(pos) == BoardSquare::Teleport ||
+                (board_.teleports && (pos == board_.teleports->first || pos == board_.teleports->second))) {
+                rebuild();
+                return num_chunks();
+            }
+        }
+        version_ = board_.version();
+        heuristic_ = KnightDistanceHeuristic<BOARD>(board_);
+
+        /* A portal moves like its partner, so a change next to either
+         * portal changes the moves of both: count them as changed too, for
+         * their chunks to get new exits and tables.
+         */
+        if (board_.teleports) {
+            const auto portals = *board_.teleports;
+            auto near_portal = [&](uint32_t v) {
+                auto pos = board_.pos_at(v);
+                for (const auto &portal : {portals.first, portals.second}) {
+                    if (std::abs(pos.x - portal.x) <= 2 && std::abs(pos.y - portal.y) <= 2) {
+                        return true;
+                    }
+                }
+                return false;
+            };
+            if (std::any_of(changed.begin(), changed.end(), near_portal)) {
+                changed.push_back(board_.index_of(portals.first));
+                changed.push_back(board_.index_of(portals.second));
+            }
+        }
+
+        // The moves that can change start within two rows and columns of a
+        // changed square
+        std::set<uint32_t> changed_chunks;
+        std::set<uint32_t> nearby_chunks;
+        for (auto v : changed) {
+            auto pos = board_.pos_at(v);
+            changed_chunks.insert(chunk_of(pos));
+            const int cs = options_.chunk_size;
+            for (int cr = std::max(0, pos.x - 2) / cs; cr <= std::min(rows_ - 1, pos.x + 2) / cs; cr++) {
+                for (int cc = std::max(0, pos.y - 2) / cs; cc <= std::min(cols_ - 1, pos.y + 2) / cs; cc++) {
+                    nearby_chunks.insert(static_cast<uint32_t>(cr * chunk_cols_ + cc));
+                }
+            }
+        }
+
+        // New crossings move entries in the chunks they land in, old and new
+        std::set<uint32_t> new_exits;
+        std::set<uint32_t> landing_chunks;
+        for (auto c : nearby_chunks) {
+            auto exits = compute_exits(c);
+            if (exits != chunks_[c].exits) {
+                for (const auto &exit : chunks_[c].exits) {
+                    landing_chunks.insert(chunk_of(board_.pos_at(exit.to)));
+                }
+                for (const auto &exit : exits) {
+                    landing_chunks.insert(chunk_of(board_.pos_at(exit.to)));
+                }
+                set_exits(c, std::move(exits));
+                new_exits.insert(c);
+            }
+        }
+
+        // Tables before the change, for the rows that can be kept
+        std::unordered_map<uint32_t, Chunk> new_entries;
+        for (auto c : landing_chunks) {
+            auto entries = compute_entries(c);
+            if (entries != chunks_[c].entries) {
+                new_entries.emplace(c, chunks_[c]);
+                chunks_[c].entries = std::move(entries);
+            }
+        }
+
+        for (auto c : new_exits) {
+            set_nodes(c);
+        }
+        for (const auto &entry : new_entries) {
+            set_nodes(entry.first);
+        }
+        if (!new_exits.empty() || !new_entries.empty()) {
+            number_nodes();
+        }
+
+        // Chunks with changed squares or exits need the whole table, the
+        // others only the rows of their new entries
+        Scratch scratch;
+        std::set<uint32_t> rebuilt;
+        for (auto c : changed_chunks) {
+            rebuilt.insert(c);
+        }
+        for (auto c : new_exits) {
+            rebuilt.insert(c);
+        }
+        for (auto c : rebuilt) {
+            compute_table(c, nullptr, scratch);
+        }
+        for (const auto &entry : new_entries) {
+            if (!rebuilt.count(entry.first)) {
+                compute_table(entry.first, &entry.second, scratch);
+                rebuilt.insert(entry.first);
+            }
+        }
+        return rebuilt.size();
+    }
+
+    // Whether the board changed since the last build or update
+    bool is_current() const {
+        return board_.rows() == rows_ && board_.cols() == cols_ && board_.version() == version_;
+    }
+
+    size_t num_chunks() const { return static_cast<size_t>(chunk_rows_) * static_cast<size_t>(chunk_cols_); }
+
+    // Squares in the abstract graph, i.e. entries and exits of all chunks
+    size_t num_abstract_nodes() const { return node_squares_.size(); }
+
+    /*
+     * Cheapest route from begin to finish in the abstract graph, as
+     * waypoints. Throws std::out_of_range if finish can't be reached, like
+     * the other searches.
+     *
+     * The book-keeping goes in the workspace, indexed by abstract node, so
+     * it's much smaller than for a flat search. Pass the same one to keep
+     * its memory across queries. Expansions, pushes and pops seen by the
+     * observer are those of the abstract graph.
+     */
+    template<typename OBSERVER>
+    Route route(const Pos &begin, const Pos &finish, SearchWorkspace &workspace, OBSERVER &observer) const {
+        Route route;
+        route.waypoints = PosVec{begin, finish};
+        if (begin == finish ||
+            (board_.square(begin) == BoardSquare::Teleport && board_.square(finish) == BoardSquare::Teleport)) {
+            return route;
+        }
+
+        const auto begin_index = board_.index_of(begin);
+        const auto finish_index = board_.index_of(finish);
+        const auto begin_chunk = chunk_of(begin);
+        const auto finish_chunk = chunk_of(finish);
+        const auto &first = chunks_[begin_chunk];
+        const auto &last = chunks_[finish_chunk];
+
+        // From begin to the exits of its chunk (and finish, if it's there
+        // too), and from the entries of the finish chunk to finish
+        Scratch scratch;
+        chunk_search(begin_chunk, begin_index, false, scratch);
+        std::vector<int> from_begin;
+        for (auto exit : first.exit_squares) {
+            from_begin.push_back(scratch.dist[local_index(begin_chunk, board_.pos_at(exit))]);
+        }
+        const int direct = begin_chunk == finish_chunk ? scratch.dist[local_index(begin_chunk, finish)] : UNREACHABLE;
+
+        chunk_search(finish_chunk, finish_index, true, scratch);
+        std::vector<int> to_finish;
+        for (auto entry : last.entries) {
+            to_finish.push_back(scratch.dist[local_index(finish_chunk, board_.pos_at(entry))]);
+        }
+
+        // A* on the abstract graph. begin and finish get the two ids after
+        // the nodes, since they usually aren't nodes themselves.
+        const auto num_nodes = static_cast<uint32_t>(node_squares_.size());
+        const uint32_t begin_id = num_nodes;
+        const uint32_t finish_id = num_nodes + 1;
+        workspace.resize(num_nodes + 2);
+        workspace.new_query();
+        BinaryHeapQueue queue(workspace, 0);
+
+        observer.search_started();
+
+        auto square_of = [&](uint32_t id) {
+            return id == begin_id ? begin_index : (id == finish_id ? finish_index : node_squares_[id]);
+        };
+
+        auto relax = [&](uint32_t from, uint32_t to, int dist) {
+            if (!workspace.visited(to)) {
+                workspace.visit(to, from, dist);
+            } else if (!workspace.settled(to) && dist < workspace.dist(to)) {
+                workspace.relax(to, from, dist);
+            } else {
+                return;
+            }
+            observer.edge_relaxed();
+            const auto estimate = heuristic_(board_.pos_at(square_of(to)), finish);
+            queue.push(to, dist + static_cast<int>(options_.heuristic_weight * estimate));
+            observer.queue_pushed(queue.size());
+        };
+
+        workspace.visit(begin_id, begin_id, 0);
+        queue.push(begin_id, heuristic_(begin, finish));
+        observer.queue_pushed(queue.size());
+
+        while (!queue.empty()) {
+            auto this_id = queue.pop();
+            observer.queue_popped();
+
+            if (workspace.settled(this_id)) {
+                continue;
+            }
+            workspace.settle(this_id);
+
+            const auto this_index = square_of(this_id);
+            observer.node_expanded(board_, this_index);
+
+            if (this_id == finish_id) {
+                break;
+            }
+
+            const auto this_dist = workspace.dist(this_id);
+            const auto this_chunk = chunk_of(board_.pos_at(this_index));
+            const auto &chunk = chunks_[this_chunk];
+            const auto base = node_base_[this_chunk];
+
+            if (this_id == begin_id) {
+                // The exits of the first chunk are nodes like the others,
+                // so crossings from begin are taken from there
+                for (size_t j = 0; j < first.exit_squares.size(); j++) {
+                    if (from_begin[j] != UNREACHABLE) {
+                        relax(this_id, base + first.exit_nodes[j], this_dist + from_begin[j]);
+                    }
+                }
+                if (direct != UNREACHABLE) {
+                    relax(this_id, finish_id, this_dist + direct);
+                }
+                continue;
+            }
+
+            // Within the chunk
+            const auto row = chunk.rows[this_id - base];
+            if (row != NO_ROW) {
+                const auto num_exits = chunk.exit_squares.size();
+                const int *costs = chunk.table.data() + static_cast<size_t>(row) * num_exits;
+                for (size_t j = 0; j < num_exits; j++) {
+                    if (costs[j] != UNREACHABLE) {
+                        relax(this_id, base + chunk.exit_nodes[j], this_dist + costs[j]);
+                    }
+                }
+                if (this_chunk == finish_chunk && to_finish[row] != UNREACHABLE) {
+                    relax(this_id, finish_id, this_dist + to_finish[row]);
+                }
+            }
+
+            // Out of the chunk
+            auto exits = std::equal_range(chunk.exits.begin(), chunk.exits.end(), Crossing{this_index, 0, 0},
+                                          [](const Crossing &a, const Crossing &b) { return a.from < b.from; });
+            for (auto it = exits.first; it != exits.second; ++it) {
+                relax(this_id, node_id(it->to), this_dist + it->weight);
+            }
+        }
+
+        observer.search_finished(workspace.bytes());
+
+        if (!workspace.settled(finish_id)) {
+            if (options_.exact) {
+                throw std::out_of_range("Finish position was not reached by the search");
+            }
+            // The kept crossings missed the way: search the whole board
+            route.waypoints = shortest_path_lvl4(board_, begin, finish, workspace);
+            route.cost = path_cost(board_, route.waypoints);
+            return route;
+        }
+
+        route.cost = workspace.dist(finish_id);
+        route.waypoints.clear();
+        for (auto id = finish_id; ; id = workspace.parent(id)) {
+            // A node on begin or finish shows up twice
+            auto pos = board_.pos_at(square_of(id));
+            if (route.waypoints.empty() || route.waypoints.back() != pos) {
+                route.waypoints.push_back(pos);
+            }
+            if (id == begin_id) {
+                break;
+            }
+        }
+        std::reverse(route.waypoints.begin(), route.waypoints.end());
+        return route;
+    }
+
+    Route route(const Pos &begin, const Pos &finish, SearchWorkspace &workspace,
+                SearchStats *stats = nullptr) const {
+        if (stats) {
+            StatsObserver observer(*stats);
+            return route(begin, finish, workspace, observer);
+        }
+        NullSearchObserver observer;
+        return route(begin, finish, workspace, observer);
+    }
+
+    Route route(const Pos &begin, const Pos &finish) const {
+        SearchWorkspace workspace;
+        return route(begin, finish, workspace);
+    }
+
+    // Squares from waypoints[i] to waypoints[i + 1] of the route
+    PosVec refine_segment(const Route &route, size_t i) const {
+        const auto &from = route.waypoints.at(i);
+        const auto &to = route.waypoints.at(i + 1);
+
+        // Crossings are a single move
+        const auto chunk = chunk_of(from);
+        if (from == to || chunk != chunk_of(to) ||
+            (board_.square(from) == BoardSquare::Teleport && board_.square(to) == BoardSquare::Teleport)) {
+            return PosVec{from, to};
+        }
+
+        Scratch scratch;
+        const auto to_index = board_.index_of(to);
+        chunk_search(chunk, board_.index_of(from), false, scratch, to_index);
+        if (scratch.dist[local_index(chunk, to)] == UNREACHABLE) {
+            throw std::runtime_error("Route segment not found, the board changed since the route was planned");
+        }
+
+        PosVec path;
+        for (auto index = to_index; index != NO_SQUARE; index = scratch.parent[local_index(chunk, board_.pos_at(index))]) {
+            path.push_back(board_.pos_at(index));
+        }
+        std::reverse(path.begin(), path.end());
+        return path;
+    }
+
+    // All the squares of the route, like the flat searches return them
+    PosVec refine(const Route &route) const {
+        PosVec path = refine_segment(route, 0);
+        for (size_t i = 1; i + 1 < route.waypoints.size(); i++) {
+            auto segment = refine_segment(route, i);
+            path.insert(path.end(), segment.begin() + 1, segment.end());
+        }
+        return path;
+    }
+
+    PosVec shortest_path(const Pos &begin, const Pos &finish, SearchWorkspace &workspace) const {
+        return refine(route(begin, finish, workspace));
+    }
+
+    PosVec shortest_path(const Pos &begin, const Pos &finish) const {
+        return refine(route(begin, finish));
+    }
+
+private:
+    static constexpr uint32_t NO_SQUARE = std::numeric_limits<uint32_t>::max();
+    static constexpr uint32_t NO_ROW = std::numeric_limits<uint32_t>::max();
+
+    // A kept move from a square of the chunk into another one
+    struct Crossing {
+        uint32_t from;
+        uint32_t to;
+        int weight;
+
+        bool operator==(const Crossing &other) const {
+            return from == other.from && to == other.to && weight == other.weight;
+        }
+
+        bool operator!=(const Crossing &other) const { return !(*this == other); }
+    };
+
+    struct Chunk {
+        // Sorted by from, then to
+        std::vector<Crossing> exits;
+        // The distinct `from`s of the exits, sorted
+        std::vector<uint32_t> exit_squares;
+        // Squares of this chunk where the exits of others land, sorted
+        std::vector<uint32_t> entries;
+        // Cost within the chunk from each entry (rows) to each exit square
+        std::vector<int> table;
+
+        // Entries and exit squares together, sorted: the abstract nodes of
+        // the chunk, numbered from node_base_[chunk] on
+        std::vector<uint32_t> nodes;
+        // Table row of each node, NO_ROW if it's not an entry
+        std::vector<uint32_t> rows;
+        // Node of each exit square (table column)
+        std::vector<uint32_t> exit_nodes;
+    };
+
+    // Buffers of the searches within a chunk
+    struct Scratch {
+        std::vector<int> dist;
+        std::vector<uint32_t> parent;
+        std::vector<std::pair<int, uint32_t>> heap;
+
+        // Moves within the chunk being tabled, in CSR form by local index
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> targets;
+        std::vector<int> weights;
+    };
+
+    uint32_t chunk_of(const Pos &pos) const {
+        return static_cast<uint32_t>((pos.x / options_.chunk_size) * chunk_cols_ + pos.y / options_.chunk_size);
+    }
+
+    Pos chunk_origin(uint32_t chunk) const {
+        return Pos(static_cast<int>(chunk / chunk_cols_) * options_.chunk_size,
+                   static_cast<int>(chunk % chunk_cols_) * options_.chunk_size);
+    }
+
+    // Index of a square of the chunk in the Scratch buffers
+    size_t local_index(uint32_t chunk, const Pos &pos) const {
+        auto origin = chunk_origin(chunk);
+        return static_cast<size_t>((pos.x - origin.x) * options_.chunk_size + (pos.y - origin.y));
+    }
+
+    /*
+     * Calls f(to, weight) for each move out of pos, or f(from, weight) for
+     * each move into it if reverse. Same moves as adjacent_positions and
+     * reverse_adjacent_positions, without building a vector each time:
+     * the chunk searches are most of the time of a query.
+     */
+    template<typename F>
+    void for_each_move(const Pos &pos, bool reverse, F &&f) const {
+        if (!reverse) {
+            if (board_.square(pos) == BoardSquare::Teleport) {
+                for (const auto &adj : board_.adjacent_positions(pos)) {
+                    f(adj.first, adj.second);
+                }
+                return;
+            }
+            for (const auto &move : KNIGHT_MOVES) {
+                const Pos to(pos.x + move[0], pos.y + move[1]);
+                if (board_.is_within_bounds(to) && board_.is_valid_step(pos, to)) {
+                    f(to, move_weight(board_.square(to)));
+                }
+            }
+            return;
+        }
+
+        // Moves from a portal start at its partner
+        if (board_.teleports) {
+            for (const auto &partner : {board_.teleports->first, board_.teleports->second}) {
+                const auto dx = std::abs(pos.x - partner.x);
+                const auto dy = std::abs(pos.y - partner.y);
+                if ((dx == 2 && dy == 1) || (dx == 1 && dy == 2)) {
+                    for (const auto &adj : reverse_adjacent_positions(board_, pos)) {
+                        f(adj.first, adj.second);
+                    }
+                    return;
+                }
+            }
+        }
+        const auto sq = board_.square(pos);
+        if (sq == BoardSquare::Rock || sq == BoardSquare::Barrier) {
+            return;
+        }
+        for (const auto &move : KNIGHT_MOVES) {
+            const Pos from(pos.x - move[0], pos.y - move[1]);
+            if (board_.is_within_bounds(from) && board_.square(from) != BoardSquare::Teleport &&
+                board_.is_valid_step(from, pos)) {
+                f(from, move_weight(sq));
+            }
+        }
+    }
+
+    /*
+     * Dijkstra from source, moving only within the chunk, backwards along
+     * the moves if reverse. Stops once target is settled, if given.
+     */
+    void chunk_search(uint32_t chunk, uint32_t source, bool reverse, Scratch &scratch,
+                      uint32_t target = NO_SQUARE) const {
+        const size_t size = static_cast<size_t>(options_.chunk_size) * options_.chunk_size;
+        scratch.dist.assign(size, UNREACHABLE);
+        scratch.parent.assign(size, NO_SQUARE);
+        auto &heap = scratch.heap;
+        heap.clear();
+
+        const auto greater = std::greater<std::pair<int, uint32_t>>();
+        scratch.dist[local_index(chunk, board_.pos_at(source))] = 0;
+        heap.emplace_back(0, source);
+
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            const auto this_dist = heap.back().first;
+            const auto this_index = heap.back().second;
+            heap.pop_back();
+
+            const auto this_pos = board_.pos_at(this_index);
+            if (this_dist > scratch.dist[local_index(chunk, this_pos)]) {
+                // Stale entry
+                continue;
+            }
+            if (this_index == target) {
+                break;
+            }
+
+            for_each_move(this_pos, reverse, [&](const Pos &adj, int weight) {
+                if (chunk_of(adj) != chunk) {
+                    return;
+                }
+                const auto adj_local = local_index(chunk, adj);
+                const auto adj_dist = this_dist + weight;
+                if (adj_dist < scratch.dist[adj_local]) {
+                    scratch.dist[adj_local] = adj_dist;
+                    scratch.parent[adj_local] = this_index;
+                    heap.emplace_back(adj_dist, board_.index_of(adj));
+                    std::push_heap(heap.begin(), heap.end(), greater);
+                }
+            });
+        }
+    }
+
+    // Abstract node of a square that is an entry or an exit square
+    uint32_t node_id(uint32_t square) const {
+        const auto chunk = chunk_of(board_.pos_at(square));
+        const auto &nodes = chunks_[chunk].nodes;
+        return node_base_[chunk] + static_cast<uint32_t>(std::lower_bound(nodes.begin(), nodes.end(), square) -
+                                                         nodes.begin());
+    }
+
+    void set_nodes(uint32_t chunk) {
+        auto &c = chunks_[chunk];
+        c.nodes.clear();
+        std::set_union(c.entries.begin(), c.entries.end(), c.exit_squares.begin(), c.exit_squares.end(),
+                       std::back_inserter(c.nodes));
+
+        c.rows.assign(c.nodes.size(), NO_ROW);
+        for (size_t i = 0; i < c.entries.size(); i++) {
+            auto it = std::lower_bound(c.nodes.begin(), c.nodes.end(), c.entries[i]);
+            c.rows[it - c.nodes.begin()] = static_cast<uint32_t>(i);
+        }
+        c.exit_nodes.clear();
+        for (auto exit : c.exit_squares) {
+            auto it = std::lower_bound(c.nodes.begin(), c.nodes.end(), exit);
+            c.exit_nodes.push_back(static_cast<uint32_t>(it - c.nodes.begin()));
+        }
+    }
+
+    // Numbers the nodes of all chunks in a row, once their lists are final
+    void number_nodes() {
+        node_base_.assign(num_chunks() + 1, 0);
+        for (size_t c = 0; c < num_chunks(); c++) {
+            node_base_[c + 1] = node_base_[c] + static_cast<uint32_t>(chunks_[c].nodes.size());
+        }
+        node_squares_.clear();
+        node_squares_.reserve(node_base_.back());
+        for (const auto &chunk : chunks_) {
+            node_squares_.insert(node_squares_.end(), chunk.nodes.begin(), chunk.nodes.end());
+        }
+    }
+
+    // The crossings kept for the moves out of the chunk
+    std::vector<Crossing> compute_exits(uint32_t chunk) const {
+        const auto origin = chunk_origin(chunk);
+        const int height = std::min(options_.chunk_size, rows_ - origin.x);
+        const int width = std::min(options_.chunk_size, cols_ - origin.y);
+
+        // Candidates by destination chunk, with their position along the
+        // border between the two
+        std::unordered_map<uint32_t, std::vector<std::pair<int, Crossing>>> candidates;
+        std::vector<Crossing> kept;
+
+        for (int r = 0; r < height; r++) {
+            for (int c = 0; c < width; c++) {
+                const Pos from(origin.x + r, origin.y + c);
+                const bool near_border = r < 2 || c < 2 || r >= height - 2 || c >= width - 2;
+                const bool is_portal = board_.square(from) == BoardSquare::Teleport;
+                if (!near_border && !is_portal) {
+                    continue;
+                }
+
+                for_each_move(from, false, [&](const Pos &to, int weight) {
+                    const auto to_chunk = chunk_of(to);
+                    if (to_chunk == chunk) {
+                        return;
+                    }
+                    Crossing crossing{board_.index_of(from), board_.index_of(to), weight};
+                    if (is_portal || options_.exact) {
+                        kept.push_back(crossing);
+                    } else {
+                        // Left and right neighbours share a column border
+                        const bool same_chunk_row = to_chunk / chunk_cols_ == chunk / chunk_cols_;
+                        candidates[to_chunk].emplace_back(same_chunk_row ? from.x : from.y, crossing);
+                    }
+                });
+            }
+        }
+
+        for (auto &entry : candidates) {
+            auto &group = entry.second;
+            std::stable_sort(group.begin(), group.end(),
+                             [](const std::pair<int, Crossing> &a, const std::pair<int, Crossing> &b) {
+                                 return a.first < b.first;
+                             });
+
+            // Pieces of at most entrance_spacing squares along the border,
+            // split at gaps
+            size_t start = 0;
+            for (size_t i = 1; i <= group.size(); i++) {
+                if (i < group.size() && group[i].first - group[i - 1].first <= 1 &&
+                    group[i].first - group[start].first < options_.entrance_spacing) {
+                    continue;
+                }
+
+                // The cheapest crossing closest to the middle of the piece
+                const int middle2 = group[start].first + group[i - 1].first;
+                size_t best = start;
+                for (size_t j = start + 1; j < i; j++) {
+                    const auto &a = group[j];
+                    const auto &b = group[best];
+                    if (a.second.weight < b.second.weight ||
+                        (a.second.weight == b.second.weight &&
+                         std::abs(2 * a.first - middle2) < std::abs(2 * b.first - middle2))) {
+                        best = j;
+                    }
+                }
+                kept.push_back(group[best].second);
+                start = i;
+            }
+        }
+
+        std::sort(kept.begin(), kept.end(), [](const Crossing &a, const Crossing &b) {
+            return a.from < b.from || (a.from == b.from && a.to < b.to);
+        });
+        return kept;
+    }
+
+    void set_exits(uint32_t chunk, std::vector<Crossing> exits) {
+        auto &c = chunks_[chunk];
+        c.exits = std::move(exits);
+        c.exit_squares.clear();
+        for (const auto &exit : c.exits) {
+            if (c.exit_squares.empty() || c.exit_squares.back() != exit.from) {
+                c.exit_squares.push_back(exit.from);
+            }
+        }
+    }
+
+    // Where the crossings of the neighbours (and portals) land in the chunk
+    std::vector<uint32_t> compute_entries(uint32_t chunk) const {
+        const int chunk_row = static_cast<int>(chunk / chunk_cols_);
+        const int chunk_col = static_cast<int>(chunk % chunk_cols_);
+
+        std::vector<uint32_t> sources;
+        for (int cr = std::max(0, chunk_row - 1); cr <= std::min(chunk_rows_ - 1, chunk_row + 1); cr++) {
+            for (int cc = std::max(0, chunk_col - 1); cc <= std::min(chunk_cols_ - 1, chunk_col + 1); cc++) {
+                sources.push_back(static_cast<uint32_t>(cr * chunk_cols_ + cc));
+            }
+        }
+        if (board_.teleports) {
+            sources.push_back(chunk_of(board_.teleports->first));
+            sources.push_back(chunk_of(board_.teleports->second));
+        }
+        std::sort(sources.begin(), sources.end());
+        sources.erase(std::unique(sources.begin(), sources.end()), sources.end());
+
+        std::vector<uint32_t> entries;
+        for (auto source : sources) {
+            if (source == chunk) {
+                continue;
+            }
+            for (const auto &exit : chunks_[source].exits) {
+                if (chunk_of(board_.pos_at(exit.to)) == chunk) {
+                    entries.push_back(exit.to);
+                }
+            }
+        }
+        std::sort(entries.begin(), entries.end());
+        entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+        return entries;
+    }
+
+    /*
+     * Dijkstra from a local index over the moves compiled into scratch,
+     * for the table rows: a chunk has a few dozens of them, and computing
+     * the moves (and their barrier scans) once per chunk makes up most of
+     * the build time otherwise.
+     */
+    void table_search(size_t source, Scratch &scratch) const {
+        const size_t size = static_cast<size_t>(options_.chunk_size) * options_.chunk_size;
+        scratch.dist.assign(size, UNREACHABLE);
+        auto &heap = scratch.heap;
+        heap.clear();
+
+        const auto greater = std::greater<std::pair<int, uint32_t>>();
+        scratch.dist[source] = 0;
+        heap.emplace_back(0, static_cast<uint32_t>(source));
+
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            const auto this_dist = heap.back().first;
+            const auto this_local = heap.back().second;
+            heap.pop_back();
+            if (this_dist > scratch.dist[this_local]) {
+                continue;
+            }
+
+            for (auto e = scratch.offsets[this_local]; e < scratch.offsets[this_local + 1]; e++) {
+                const auto adj_local = scratch.targets[e];
+                const auto adj_dist = this_dist + scratch.weights[e];
+                if (adj_dist < scratch.dist[adj_local]) {
+                    scratch.dist[adj_local] = adj_dist;
+                    heap.emplace_back(adj_dist, adj_local);
+                    std::push_heap(heap.begin(), heap.end(), greater);
+                }
+            }
+        }
+    }
+
+    // Fills the table of the chunk, reusing the rows of old for the entries
+    // it already had (with the same exits)
+    void compute_table(uint32_t chunk, const Chunk *old, Scratch &scratch) {
+        auto &c = chunks_[chunk];
+        const auto num_exits = c.exit_squares.size();
+        c.table.assign(c.entries.size() * num_exits, UNREACHABLE);
+
+        // The moves within the chunk, compiled once for all the rows
+        const auto origin = chunk_origin(chunk);
+        const int height = std::min(options_.chunk_size, rows_ - origin.x);
+        const int width = std::min(options_.chunk_size, cols_ - origin.y);
+        const size_t size = static_cast<size_t>(options_.chunk_size) * options_.chunk_size;
+        scratch.offsets.assign(size + 1, 0);
+        scratch.targets.clear();
+        scratch.weights.clear();
+        bool compiled = false;
+
+        for (size_t i = 0; i < c.entries.size(); i++) {
+            auto row = c.table.begin() + static_cast<ptrdiff_t>(i * num_exits);
+
+            if (old) {
+                auto it = std::lower_bound(old->entries.begin(), old->entries.end(), c.entries[i]);
+                if (it != old->entries.end() && *it == c.entries[i]) {
+                    auto old_row = old->table.begin() + (it - old->entries.begin()) * static_cast<ptrdiff_t>(num_exits);
+                    std::copy(old_row, old_row + static_cast<ptrdiff_t>(num_exits), row);
+                    continue;
+                }
+            }
+
+            if (!compiled) {
+                for (size_t local = 0; local < size; local++) {
+                    scratch.offsets[local] = static_cast<uint32_t>(scratch.targets.size());
+                    const int r = static_cast<int>(local) / options_.chunk_size;
+                    const int col = static_cast<int>(local) % options_.chunk_size;
+                    if (r >= height || col >= width) {
+                        continue;
+                    }
+                    for_each_move(Pos(origin.x + r, origin.y + col), false, [&](const Pos &adj, int weight) {
+                        if (chunk_of(adj) == chunk) {
+                            scratch.targets.push_back(static_cast<uint32_t>(local_index(chunk, adj)));
+                            scratch.weights.push_back(weight);
+                        }
+                    });
+                }
+                scratch.offsets[size] = static_cast<uint32_t>(scratch.targets.size());
+                compiled = true;
+            }
+
+            table_search(local_index(chunk, board_.pos_at(c.entries[i])), scratch);
+            for (size_t j = 0; j < num_exits; j++) {
+                row[j] = scratch.dist[local_index(chunk, board_.pos_at(c.exit_squares[j]))];
+            }
+        }
+    }
+
+    const BOARD &board_;
+    HierarchicalOptions options_;
+    KnightDistanceHeuristic<BOARD> heuristic_;
+    int rows_;
+    int cols_;
+    uint64_t version_;
+    int chunk_rows_;
+    int chunk_cols_;
+    std::vector<Chunk> chunks_;
+    // First node of each chunk, and one past the last
+    std::vector<uint32_t> node_base_;
+    // Square of each node
+    std::vector<uint32_t> node_squares_;
+};
+
+template<typename BOARD>
+constexpr int HierarchicalPlanner<BOARD>::UNREACHABLE;
+
+template<typename BOARD>
+constexpr uint32_t HierarchicalPlanner<BOARD>::NO_SQUARE;
+
+template<typename BOARD>
+constexpr uint32_t HierarchicalPlanner<BOARD>::NO_ROW;
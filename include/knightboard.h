@@ -1,6 +1,8 @@
 #pragma once
 
 #include <array>
+#include <cmath>
+#include <cstdint>
 #include <vector>
 #include <utility>
 #include <iostream>
@@ -13,9 +15,12 @@
 #include <experimental/optional>
 #include <sstream>
 #include <fstream>
+#include <stdexcept>
+#include <string>
 
-// I really like C++11's enum class, that cleanly namespaces enums
-enum class BoardSquare {
+// I really like C++11's enum class, that cleanly namespaces enums.
+// One byte per square is plenty, and keeps large boards small.
+enum class BoardSquare : uint8_t {
     Clear,
     Water,
     Rock,
@@ -24,6 +29,181 @@ enum class BoardSquare {
     Lava
 };
 
+// Cost of moving onto a square. Weights are small integers, which some of
+// the search algorithms take advantage of.
+constexpr int MAX_MOVE_WEIGHT = 5;
+
+constexpr int move_weight(BoardSquare sq) {
+    switch (sq) {
+        case BoardSquare::Water:
+            return 2;
+        case BoardSquare::Lava:
+            return MAX_MOVE_WEIGHT;
+        default:
+            return 1;
+    }
+}
+
+// The eight knight moves as (delta x, delta y), in the same order as
+// adjacent_positions() generates them
+constexpr int KNIGHT_MOVES[8][2] = {
+        {-2, -1},
+        {-2, 1},
+        {-1, -2},
+        {-1, 2},
+        {1, -2},
+        {1, 2},
+        {2, -1},
+        {2, 1}
+};
+
+// Shape of a map in the text format, as found by parse_board_text
+struct BoardTextShape {
+    int rows;
+    int cols;
+};
+
+template<typename SINK>
+BoardTextShape parse_board_text(const char *data, size_t size, SINK &&sink) {
+    /* Parses the text map format in a single pass over a buffer (usually a
+     * MappedFile), calling sink(row, col, square) for each square in
+     * row-major order. Squares may be separated by whitespace, blank lines
+     * are skipped, and all rows must have the same number of squares.
+     *
+     * Characters are decoded through a lookup table: no per-line string or
+     * stream is ever built.
+     */
+    enum : int8_t { SPACE = -1, INVALID = -2 };
+
+    static const std::array<int8_t, 256> codes = [] {
+        std::array<int8_t, 256> table;
+        table.fill(INVALID);
+        for (char c : {' ', '\t', '\r', '\v', '\f'}) {
+            table[static_cast<uint8_t>(c)] = SPACE;
+        }
+        table['.'] = static_cast<int8_t>(BoardSquare::Clear);
+        table['W'] = static_cast<int8_t>(BoardSquare::Water);
+        table['R'] = static_cast<int8_t>(BoardSquare::Rock);
+        table['B'] = static_cast<int8_t>(BoardSquare::Barrier);
+        table['T'] = static_cast<int8_t>(BoardSquare::Teleport);
+        table['L'] = static_cast<int8_t>(BoardSquare::Lava);
+        return table;
+    }();
+
+    int row_cnt = 0;
+    int col_cnt = 0;
+    int num_cols = -1;
+
+    auto end_row = [&]() {
+        if (col_cnt == 0) {
+            return;
+        }
+        if (num_cols < 0) {
+            num_cols = col_cnt;
+        } else if (col_cnt != num_cols) {
+            throw std::runtime_error("Row " + std::to_string(row_cnt) +
+                                     " has a different number of squares than the first one");
+        }
+        row_cnt++;
+        col_cnt = 0;
+    };
+
+    for (size_t i = 0; i < size; i++) {
+        const char c = data[i];
+        if (c == '\n') {
+            end_row();
+            continue;
+        }
+        const auto code = codes[static_cast<uint8_t>(c)];
+        if (code == SPACE) {
+            continue;
+        }
+        if (code == INVALID) {
+            throw std::runtime_error("Unknown square '" + std::string(1, c) + "' in row " +
+                                     std::to_string(row_cnt));
+        }
+        sink(row_cnt, col_cnt, static_cast<BoardSquare>(code));
+        col_cnt++;
+    }
+    end_row();
+
+    return BoardTextShape{row_cnt, std::max(num_cols, 0)};
+}
+
+template<typename BOARD>
+void save_board_text(const BOARD &board, std::ostream &out) {
+    /* Writes a board in the text format (squares separated by spaces, one
+     * row per line), a row at a time: the board can be generated on the fly,
+     * it's never copied as a whole.
+     */
+    static const char square_codes[] = {'.', 'W', 'R', 'B', 'T', 'L'};
+
+    std::string line;
+    for (int r = 0; r < board.rows(); r++) {
+        line.clear();
+        for (int c = 0; c < board.cols(); c++) {
+            line += square_codes[static_cast<int>(board.square(typename BOARD::Pos(r, c)))];
+            line += (c + 1 < board.cols()) ? ' ' : '\n';
+        }
+        out.write(line.data(), line.size());
+    }
+
+    if (!out) {
+        throw std::runtime_error("Failed writing text board");
+    }
+}
+
+/*
+ * Per-square knight move tables for a BOARD_SIZE x BOARD_SIZE board, all
+ * computed at compile time. For square s and direction d of KNIGHT_MOVES:
+ * bit d of in_bounds[s] tells whether the move stays on the board, target
+ * is the linear index of the landing square, and mid and corner are the two
+ * other squares of the long leg of the L, which mustn't be barriers. Moves
+ * off the board point back to s itself.
+ */
+template<int BOARD_SIZE>
+struct KnightMoveTable {
+    static_assert(BOARD_SIZE <= 256, "Square indices are stored in 16 bits");
+
+    uint8_t in_bounds[BOARD_SIZE * BOARD_SIZE];
+    uint16_t target[BOARD_SIZE * BOARD_SIZE][8];
+    uint16_t mid[BOARD_SIZE * BOARD_SIZE][8];
+    uint16_t corner[BOARD_SIZE * BOARD_SIZE][8];
+
+    static constexpr KnightMoveTable make() {
+        KnightMoveTable table{};
+        for (int x = 0; x < BOARD_SIZE; x++) {
+            for (int y = 0; y < BOARD_SIZE; y++) {
+                const int s = x * BOARD_SIZE + y;
+                for (int d = 0; d < 8; d++) {
+                    const int dx = KNIGHT_MOVES[d][0];
+                    const int dy = KNIGHT_MOVES[d][1];
+                    const int to_x = x + dx;
+                    const int to_y = y + dy;
+                    if (to_x < 0 || to_x >= BOARD_SIZE || to_y < 0 || to_y >= BOARD_SIZE) {
+                        table.target[s][d] = table.mid[s][d] = table.corner[s][d] = static_cast<uint16_t>(s);
+                        continue;
+                    }
+                    table.in_bounds[s] |= 1 << d;
+                    table.target[s][d] = static_cast<uint16_t>(to_x * BOARD_SIZE + to_y);
+                    // The long leg runs along x for dx = +-2, along y otherwise
+                    const bool along_x = dx == 2 || dx == -2;
+                    table.mid[s][d] = static_cast<uint16_t>(along_x ? (x + dx / 2) * BOARD_SIZE + y
+                                                                    : x * BOARD_SIZE + y + dy / 2);
+                    table.corner[s][d] = static_cast<uint16_t>(along_x ? to_x * BOARD_SIZE + y
+                                                                       : x * BOARD_SIZE + to_y);
+                }
+            }
+        }
+        return table;
+    }
+
+    static const KnightMoveTable value;
+};
+
+template<int BOARD_SIZE>
+constexpr KnightMoveTable<BOARD_SIZE> KnightMoveTable<BOARD_SIZE>::value = KnightMoveTable<BOARD_SIZE>::make();
+
 // Templating wasn't strictly necessary here, but in principle I like having compile-time
 // checked dimensions and static allocation when possible. std::array is great because it
 // has the STL interface that we know and love (?!) from std::vector.
@@ -79,11 +259,55 @@ struct Board {
                 b[i][j] = BoardSquare::Clear;
             }
         }
+        refresh_terrain();
     }
 
     static constexpr int size = BOARD_SIZE;
-    // Holds the square type data for the board
-    std::array<std::array<BoardSquare, BOARD_SIZE>, BOARD_SIZE> b;
+
+    // Dimension and linear index accessors shared with DynamicBoard, so that
+    // algorithms can address dense per-square arrays without caring about
+    // how the board is stored.
+    static constexpr int rows() { return BOARD_SIZE; }
+    static constexpr int cols() { return BOARD_SIZE; }
+    static constexpr uint32_t num_squares() { return BOARD_SIZE * BOARD_SIZE; }
+
+    static uint32_t index_of(const Pos &pos) { return pos.as_int(); }
+    static Pos pos_at(uint32_t index) { return Pos(static_cast<int>(index)); }
+
+    BoardSquare square(const Pos &pos) const { return b[pos.x][pos.y]; }
+
+    // Changing squares through set_square() bumps the board version, which
+    // lets precomputed data (e.g. FlowField) check whether it's outdated.
+    // It's also the only way in, so that the terrain bits adjacent_positions()
+    // reads always agree with is_valid_step(). Portals can't be added or
+    // removed here, or the squares would disagree with teleports: use
+    // set_teleports(), like on DynamicBoard.
+    void set_square(const Pos &pos, BoardSquare sq) {
+        if ((sq == BoardSquare::Teleport) != (square(pos) == BoardSquare::Teleport)) {
+            throw std::invalid_argument("Portals can only be changed through set_teleports()");
+        }
+        change(pos, sq);
+    }
+
+    // Moves the pair of portals, or removes it with nullopt. Squares that
+    // stop being portals become Clear.
+    void set_teleports(const std::experimental::optional<std::pair<Pos, Pos>> &portals) {
+        if (portals && portals->first == portals->second) {
+            throw std::invalid_argument("The two portals must be different squares");
+        }
+        if (teleports) {
+            change(teleports->first, BoardSquare::Clear);
+            change(teleports->second, BoardSquare::Clear);
+        }
+        if (portals) {
+            change(portals->first, BoardSquare::Teleport);
+            change(portals->second, BoardSquare::Teleport);
+        }
+        teleports = portals;
+    }
+
+    uint64_t version() const { return version_; }
+
     // Optional pair of teleport portals (can easily be extended to multiple pairs)
     std::experimental::optional<std::pair<Pos, Pos>> teleports;
 
@@ -135,42 +359,36 @@ struct Board {
             return adjacent_positions(dest_portal, true);
         }
 
-        PosVec candidates = {
-                {x - 2, y - 1},
-                {x - 2, y + 1},
-                {x - 1, y - 2},
-                {x - 1, y + 2},
-                {x + 1, y - 2},
-                {x + 1, y + 2},
-                {x + 2, y - 1},
-                {x + 2, y + 1}
-        };
+        /* Same rules as is_valid_step, but the geometry all comes from the
+         * compile-time move table, and the squares from the terrain bits: a
+         * move lands if the target has a weight and no square of the long
+         * leg is a barrier, or if it goes from a portal to a portal. */
+        const auto &moves = KnightMoveTable<BOARD_SIZE>::value;
+        const auto from = index_of(origin);
+        const auto from_bits = terrain_[from];
 
         GraphEdgeVec edges;
-
-        for (const auto &pos: candidates) {
-            if (!is_valid_step(origin, pos)) {
-                continue;
+        edges.reserve(8);
+
+        for (unsigned mask = moves.in_bounds[from]; mask; mask &= mask - 1) {
+            const auto d = __builtin_ctz(mask);
+            const auto to_bits = terrain_[moves.target[from][d]];
+            const auto leg_bits = from_bits | terrain_[moves.mid[from][d]] | terrain_[moves.corner[from][d]];
+            const bool lands = (to_bits & WEIGHT_BITS) && !(leg_bits & BARRIER_BIT);
+            if (lands || (from_bits & to_bits & TELEPORT_BIT)) {
+                edges.emplace_back(Pos(x + KNIGHT_MOVES[d][0], y + KNIGHT_MOVES[d][1]), to_bits & WEIGHT_BITS);
             }
-
-            // Assign weights to (valid) moves
-            int weight = 1;
-            switch (b[pos.x][pos.y]) {
-                case BoardSquare::Water:
-                    weight = 2;
-                    break;
-                case BoardSquare::Lava:
-                    weight = 5;
-                    break;
-            }
-
-            edges.emplace_back(pos, weight);
         }
 
         return edges;
     }
 
     bool is_valid_step(const Pos &begin, const Pos &end) const {
+        // Squares off the board can't be read, let alone stepped on
+        if (!is_within_bounds(begin) || !is_within_bounds(end)) {
+            return false;
+        }
+
         // The knight moves "L-wise"
         auto abs_delta_x = std::abs(end.x - begin.x);
         auto abs_delta_y = std::abs(end.y - begin.y);
@@ -180,76 +398,54 @@ struct Board {
         bool is_right_shape = (abs_delta_x == 2 && abs_delta_y == 1) || (abs_delta_x == 1 && abs_delta_y == 2);
         bool is_allowed_end = (b[end.x][end.y] != BoardSquare::Rock) && (b[end.x][end.y] != BoardSquare::Barrier);
 
-        bool is_allowed_cross = true;
-        if (abs_delta_x == 2) { // Horizontal move
-            for (int i = std::min(begin.x, end.x); i <= std::max(begin.x, end.x); i++) {
-                if (b[i][begin.y] == BoardSquare::Barrier) {
-                    is_allowed_cross = false;
-                }
-            }
-        } else { // Vertical move
-            for (int i = std::min(begin.y, end.y); i <= std::max(begin.y, end.y); i++) {
-                if (b[begin.x][i] == BoardSquare::Barrier) {
-                    is_allowed_cross = false;
-                }
-            }
+        // The long leg of the L covers begin, end and the square halfway
+        // along it. That's only a valid square for the right shape.
+        bool is_allowed_cross = false;
+        if (is_right_shape) {
+            auto mid = (abs_delta_x == 2) ? b[(begin.x + end.x) / 2][begin.y] : b[begin.x][(begin.y + end.y) / 2];
+            auto corner = (abs_delta_x == 2) ? b[end.x][begin.y] : b[begin.x][end.y];
+            is_allowed_cross = (b[begin.x][begin.y] != BoardSquare::Barrier) &&
+                               (mid != BoardSquare::Barrier) &&
+                               (corner != BoardSquare::Barrier);
         }
 
         // For level-1, this was enough
         // return is_within_bounds(end) && is_right_shape;
 
-        return is_teleport || (
-                is_within_bounds(end)
-                && is_right_shape
-                && is_allowed_end
-                && is_allowed_cross);
+        return is_teleport || (is_right_shape && is_allowed_end && is_allowed_cross);
     }
 
     void load_from_file() {
-        std::string file_name = std::string(std::getenv("HOME")) + "/knightboard.txt";
+        load_from_file(std::string(std::getenv("HOME")) + "/knightboard.txt");
+    }
+
+    void load_from_file(const std::string &file_name) {
+        /* Replaces the board with the map in file_name, which must fit in
+         * BOARD_SIZE x BOARD_SIZE. Smaller maps leave the remaining squares
+         * Clear. These maps are tiny, so a plain read does (see
+         * DynamicBoard::load_from_file for the mapped version). */
+        std::ifstream in(file_name, std::ios::binary);
+        if (!in.is_open()) {
+            throw std::runtime_error("Failed opening file at " + file_name);
+        }
+        const std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
 
-        std::ifstream ifile(file_name);
-        if (!ifile.is_open()) {
-            std::cerr << "Failed opening file at " << file_name << std::endl;
-            exit(1);
+        for (auto &row : b) {
+            row.fill(BoardSquare::Clear);
         }
+        teleports = std::experimental::nullopt;
 
-        std::string line;
         std::vector<Pos> portals;
-        int row_cnt = 0;
-
-        while (std::getline(ifile, line)) {
-            // Tokenize using stringstream
-            std::istringstream iss(line);
-            char sq;
-            int col_cnt = 0;
-
-            while (iss >> sq) {
-                switch (sq) {
-                    case '.':
-                        b[row_cnt][col_cnt] = BoardSquare::Clear;
-                        break;
-                    case 'W':
-                        b[row_cnt][col_cnt] = BoardSquare::Water;
-                        break;
-                    case 'R':
-                        b[row_cnt][col_cnt] = BoardSquare::Rock;
-                        break;
-                    case 'B':
-                        b[row_cnt][col_cnt] = BoardSquare::Barrier;
-                        break;
-                    case 'T':
-                        b[row_cnt][col_cnt] = BoardSquare::Teleport;
-                        portals.push_back({row_cnt, col_cnt});
-                        break;
-                    case 'L':
-                        b[row_cnt][col_cnt] = BoardSquare::Lava;
-                        break;
-                }
-                col_cnt += 1;
+        parse_board_text(text.data(), text.size(), [&](int row, int col, BoardSquare sq) {
+            if (row >= BOARD_SIZE || col >= BOARD_SIZE) {
+                throw std::runtime_error("Map in " + file_name + " doesn't fit a board of size " +
+                                         std::to_string(BOARD_SIZE));
             }
-            row_cnt += 1;
-        }
+            b[row][col] = sq;
+            if (sq == BoardSquare::Teleport) {
+                portals.push_back({row, col});
+            }
+        });
 
         if (portals.size()) {
             if (portals.size() != 2) {
@@ -257,14 +453,90 @@ struct Board {
             }
             teleports = std::make_pair(portals.at(0), portals.at(1));
         }
+
+        refresh_terrain();
+        version_++;
+    }
+
+private:
+    void change(const Pos &pos, BoardSquare sq) {
+        b[pos.x][pos.y] = sq;
+        terrain_[index_of(pos)] = terrain_bits(sq);
+        version_++;
+    }
+
+    // Rebuilds the per-square terrain bits that adjacent_positions() reads
+    void refresh_terrain() {
+        for (int i = 0; i < BOARD_SIZE; i++) {
+            for (int j = 0; j < BOARD_SIZE; j++) {
+                terrain_[i * BOARD_SIZE + j] = terrain_bits(b[i][j]);
+            }
+        }
+    }
+
+    // Terrain bits of a square: the weight of moving onto it (0 for Rock and
+    // Barrier, which can't be landed on), plus barrier and teleport flags
+    static constexpr uint8_t WEIGHT_BITS = 0x7;
+    static constexpr uint8_t BARRIER_BIT = 1 << 3;
+    static constexpr uint8_t TELEPORT_BIT = 1 << 4;
+
+    static constexpr uint8_t terrain_bits(BoardSquare sq) {
+        return sq == BoardSquare::Rock ? 0 :
+               sq == BoardSquare::Barrier ? BARRIER_BIT :
+               sq == BoardSquare::Teleport ? static_cast<uint8_t>(TELEPORT_BIT | move_weight(sq)) :
+               static_cast<uint8_t>(move_weight(sq));
     }
+
+    // Holds the square type data for the board
+    std::array<std::array<BoardSquare, BOARD_SIZE>, BOARD_SIZE> b;
+    // terrain_bits() of each square, row-major, kept in sync by set_square()
+    // and load_from_file()
+    std::array<uint8_t, BOARD_SIZE * BOARD_SIZE> terrain_;
+    uint64_t version_ = 0;
 };
 
+template<int BOARD_SIZE>
+constexpr uint8_t Board<BOARD_SIZE>::WEIGHT_BITS;
+
+template<int BOARD_SIZE>
+constexpr uint8_t Board<BOARD_SIZE>::BARRIER_BIT;
+
+template<int BOARD_SIZE>
+constexpr uint8_t Board<BOARD_SIZE>::TELEPORT_BIT;
+
 template<int BOARD_SIZE>
 std::ostream &operator<<(std::ostream &out, const Board<BOARD_SIZE> &board) {
     return board.print(out);
 }
 
+template<typename BOARD>
+uint64_t board_fingerprint(const BOARD &board) {
+    /* FNV-1a hash of the dimensions, squares and portals of a board. Unlike
+     * version(), it identifies the same map across processes, so it's stored
+     * alongside data saved to disk.
+     */
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](uint64_t value) {
+        for (int i = 0; i < 8; i++) {
+            hash ^= (value >> (8 * i)) & 0xff;
+            hash *= 1099511628211ull;
+        }
+    };
+
+    mix(static_cast<uint64_t>(board.rows()));
+    mix(static_cast<uint64_t>(board.cols()));
+    for (uint32_t i = 0; i < board.num_squares(); i++) {
+        hash ^= static_cast<uint8_t>(board.square(board.pos_at(i)));
+        hash *= 1099511628211ull;
+    }
+    if (board.teleports) {
+        mix(board.index_of(board.teleports->first));
+        mix(board.index_of(board.teleports->second));
+    }
+
+    return hash;
+}
+
 // Some convenience definitions
 using Board8 = Board<8>;
 using Pos8 = Board8::Pos;
@@ -273,4 +545,5 @@ using GraphEdgeVec8 = Board8::GraphEdgeVec;
 
 using Board32 = Board<32>;
 using Pos32 = Board32::Pos;
-using PosVec32 = Board32::PosVec;
\ No newline at end of file
+using PosVec32 = Board32::PosVec;
+using GraphEdgeVec32 = Board32::GraphEdgeVec;
\ No newline at end of file
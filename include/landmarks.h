@@ -0,0 +1,378 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "search_workspace.h"
+#include "search_queues.h"
+#include "bidirectional.h"
+#include "mapped_file.h"
+
+#include <istream>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+/*
+ * Landmark ("ALT") index: exact distances from and to a handful of landmark
+ * squares, precomputed once for a static map. By the triangle inequality,
+ * for any landmark L:
+ *
+ *   d(v, t) >= d(L, t) - d(L, v)
+ *   d(v, t) >= d(v, L) - d(t, L)
+ *
+ * and the best of these bounds is a consistent A* heuristic that knows about
+ * walls, rocks and lakes, unlike the plain knight distance.
+ *
+ * Landmarks are picked by farthest-point selection: each new landmark is the
+ * reachable square farthest from all the previous ones, so that they end up
+ * spread along the edges of the map, "behind" most queries.
+ *
+ * Distances are stored square-major (all the landmarks of a square next to
+ * each other), which keeps a heuristic evaluation within a cache line or
+ * two. The index can be saved to a file and mapped back with mmap(), so
+ * a routing service starts up without redoing (or even reading) the
+ * preprocessing: pages are faulted in as queries touch them.
+ */
+template<typename BOARD>
+class LandmarkIndex {
+public:
+    static constexpr uint32_t UNREACHABLE = std::numeric_limits<uint32_t>::max();
+
+    LandmarkIndex() : rows_(0), cols_(0), num_squares_(0), num_landmarks_(0),
+                      board_version_(0), fingerprint_(0), data_(nullptr) {}
+
+    template<typename QUEUE = BucketQueue>
+    static LandmarkIndex build(const BOARD &board, uint32_t num_landmarks) {
+        LandmarkIndex index;
+        index.rows_ = board.rows();
+        index.cols_ = board.cols();
+        index.num_squares_ = board.num_squares();
+        index.board_version_ = board.version();
+        index.fingerprint_ = board_fingerprint(board);
+
+        const auto n = index.num_squares_;
+        SearchWorkspace workspace(board);
+
+        // Start from the first square a knight can stand on. The first
+        // landmark is the square farthest from it.
+        uint32_t start = 0;
+        while (start < n && !is_passable(board.square(board.pos_at(start)))) {
+            start++;
+        }
+        if (start == n) {
+            throw std::runtime_error("Can't place landmarks on a board without free squares");
+        }
+
+        // Distance from the closest landmark so far, to pick the next one
+        std::vector<uint32_t> closest(n, UNREACHABLE);
+        std::vector<uint32_t> dists(n);
+        all_distances<QUEUE>(board, start, false, workspace, dists);
+        auto next = farthest(dists);
+
+        std::vector<uint32_t> landmarks;
+        std::vector<std::vector<uint32_t>> forward;
+        std::vector<std::vector<uint32_t>> backward;
+
+        while (landmarks.size() < num_landmarks) {
+            landmarks.push_back(next);
+
+            forward.emplace_back(n);
+            all_distances<QUEUE>(board, next, false, workspace, forward.back());
+            backward.emplace_back(n);
+            all_distances<QUEUE>(board, next, true, workspace, backward.back());
+
+            for (uint32_t i = 0; i < n; i++) {
+                closest[i] = std::min(closest[i], forward.back()[i]);
+            }
+            next = farthest(closest);
+            if (closest[next] == 0) {
+                // Every reachable square is a landmark already
+                break;
+            }
+        }
+
+        // Same layout as the file, without the header
+        const uint32_t k = static_cast<uint32_t>(landmarks.size());
+        auto storage = std::make_shared<std::vector<uint32_t>>(k + 2 * static_cast<size_t>(n) * k);
+        std::copy(landmarks.begin(), landmarks.end(), storage->begin());
+        auto forward_out = storage->data() + k;
+        auto backward_out = forward_out + static_cast<size_t>(n) * k;
+        for (uint32_t i = 0; i < n; i++) {
+            for (uint32_t l = 0; l < k; l++) {
+                forward_out[static_cast<size_t>(i) * k + l] = forward[l][i];
+                backward_out[static_cast<size_t>(i) * k + l] = backward[l][i];
+            }
+        }
+
+        index.num_landmarks_ = k;
+        index.data_ = storage->data();
+        index.holder_ = storage;
+        return index;
+    }
+
+    uint32_t num_landmarks() const { return num_landmarks_; }
+
+    typename BOARD::Pos landmark(const BOARD &board, uint32_t l) const { return board.pos_at(data_[l]); }
+
+    // Exact distance from landmark l to square i, or UNREACHABLE
+    uint32_t distance_from(uint32_t l, uint32_t i) const { return forward()[static_cast<size_t>(i) * num_landmarks_ + l]; }
+
+    // Exact distance from square i to landmark l, or UNREACHABLE
+    uint32_t distance_to(uint32_t l, uint32_t i) const { return backward()[static_cast<size_t>(i) * num_landmarks_ + l]; }
+
+    // Lower bound on the distance between two squares
+    int lower_bound(uint32_t from, uint32_t to) const {
+        const auto k = num_landmarks_;
+        const uint32_t *forward_from = forward() + static_cast<size_t>(from) * k;
+        const uint32_t *forward_to = forward() + static_cast<size_t>(to) * k;
+        const uint32_t *backward_from = backward() + static_cast<size_t>(from) * k;
+        const uint32_t *backward_to = backward() + static_cast<size_t>(to) * k;
+
+        // Bounds involving unreachable squares tell us nothing, skip them
+        int best = 0;
+        for (uint32_t l = 0; l < k; l++) {
+            if (forward_from[l] != UNREACHABLE && forward_to[l] != UNREACHABLE) {
+                best = std::max(best, static_cast<int>(forward_to[l]) - static_cast<int>(forward_from[l]));
+            }
+            if (backward_from[l] != UNREACHABLE && backward_to[l] != UNREACHABLE) {
+                best = std::max(best, static_cast<int>(backward_from[l]) - static_cast<int>(backward_to[l]));
+            }
+        }
+        return best;
+    }
+
+    // O(1): was the board changed through set_square() since the index was built?
+    bool is_current(const BOARD &board) const {
+        return board.rows() == rows_ && board.cols() == cols_ && board.version() == board_version_;
+    }
+
+    // O(N): was the index built from a board with the same contents?
+    bool matches(const BOARD &board) const {
+        return board.rows() == rows_ && board.cols() == cols_ && board_fingerprint(board) == fingerprint_;
+    }
+
+    // Bytes of distance data, whether owned or mapped
+    size_t bytes() const { return data_words() * sizeof(uint32_t); }
+
+    /*
+     * Binary format: a fixed header, then the landmark square indices,
+     * the forward distances and the backward distances, all as raw uint32_t
+     * in native byte order.
+     */
+    void save(std::ostream &out) const {
+        auto header = make_header();
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(data_), bytes());
+        if (!out) {
+            throw std::runtime_error("Failed writing landmark index");
+        }
+    }
+
+    // Reads a whole index into memory
+    static LandmarkIndex load(std::istream &in) {
+        Header header;
+        in.read(reinterpret_cast<char *>(&header), sizeof(header));
+        if (!in) {
+            throw std::runtime_error("Not a landmark index file");
+        }
+
+        auto index = from_header(header);
+        auto storage = std::make_shared<std::vector<uint32_t>>(index.data_words());
+        in.read(reinterpret_cast<char *>(storage->data()), storage->size() * sizeof(uint32_t));
+        if (!in) {
+            throw std::runtime_error("Truncated landmark index file");
+        }
+
+        index.data_ = storage->data();
+        index.holder_ = storage;
+        return index;
+    }
+
+    // Maps an index file read-only, without reading it
+    static LandmarkIndex map_file(const std::string &path) {
+        auto file = std::make_shared<MappedFile>(path);
+        if (file->size() < sizeof(Header)) {
+            throw std::runtime_error("Not a landmark index file: " + path);
+        }
+
+        Header header;
+        std::copy(file->data(), file->data() + sizeof(Header), reinterpret_cast<char *>(&header));
+        auto index = from_header(header);
+        if (file->size() != sizeof(Header) + index.bytes()) {
+            throw std::runtime_error("Truncated landmark index file " + path);
+        }
+
+        index.data_ = reinterpret_cast<const uint32_t *>(file->data() + sizeof(Header));
+        index.holder_ = file;
+        return index;
+    }
+
+private:
+    static constexpr char MAGIC[4] = {'K', 'B', 'L', 'M'};
+    static constexpr uint32_t FORMAT_VERSION = 1;
+
+    // 40 bytes, so the uint32_t arrays after it stay aligned when mapped
+    struct Header {
+        char magic[4];
+        uint32_t format_version;
+        int32_t rows;
+        int32_t cols;
+        uint32_t num_landmarks;
+        uint32_t reserved;
+        uint64_t board_version;
+        uint64_t fingerprint;
+    };
+
+    static bool is_passable(BoardSquare sq) {
+        return sq != BoardSquare::Rock && sq != BoardSquare::Barrier;
+    }
+
+    template<typename QUEUE>
+    static void all_distances(const BOARD &board, uint32_t source, bool reverse,
+                              SearchWorkspace &workspace, std::vector<uint32_t> &dists) {
+        /* Full Dijkstra from (or, walking edges backwards, to) source, as in
+         * FlowField::build.
+         */
+        std::fill(dists.begin(), dists.end(), UNREACHABLE);
+
+        workspace.new_query();
+        QUEUE queue(workspace, MAX_MOVE_WEIGHT);
+        workspace.visit(source, source, 0);
+        queue.push(source, 0);
+
+        while (!queue.empty()) {
+            auto this_index = queue.pop();
+            if (workspace.settled(this_index)) {
+                continue;
+            }
+            workspace.settle(this_index);
+
+            const auto this_dist = workspace.dist(this_index);
+            dists[this_index] = static_cast<uint32_t>(this_dist);
+
+            auto relax = [&](const typename BOARD::GraphEdge &adj) {
+                auto adj_index = board.index_of(adj.first);
+                auto adj_dist = this_dist + adj.second;
+
+                if (!workspace.visited(adj_index)) {
+                    workspace.visit(adj_index, this_index, adj_dist);
+                } else if (!workspace.settled(adj_index) && adj_dist < workspace.dist(adj_index)) {
+                    workspace.relax(adj_index, this_index, adj_dist);
+                } else {
+                    return;
+                }
+                queue.push(adj_index, adj_dist);
+            };
+
+            // Edge containers differ between boards and CompiledGraph
+            auto this_pos = board.pos_at(this_index);
+            if (reverse) {
+                for (const auto &adj : reverse_adjacent_positions(board, this_pos)) {
+                    relax(adj);
+                }
+            } else {
+                for (const auto &adj : board.adjacent_positions(this_pos)) {
+                    relax(adj);
+                }
+            }
+        }
+    }
+
+    // Index of the largest reachable distance
+    static uint32_t farthest(const std::vector<uint32_t> &dists) {
+        uint32_t best = 0;
+        uint32_t best_dist = 0;
+        for (uint32_t i = 0; i < dists.size(); i++) {
+            if (dists[i] != UNREACHABLE && dists[i] >= best_dist) {
+                best = i;
+                best_dist = dists[i];
+            }
+        }
+        return best;
+    }
+
+    Header make_header() const {
+        Header header{};
+        std::copy(MAGIC, MAGIC + 4, header.magic);
+        header.format_version = FORMAT_VERSION;
+        header.rows = rows_;
+        header.cols = cols_;
+        header.num_landmarks = num_landmarks_;
+        header.board_version = board_version_;
+        header.fingerprint = fingerprint_;
+        return header;
+    }
+
+    static LandmarkIndex from_header(const Header &header) {
+        if (!std::equal(MAGIC, MAGIC + 4, header.magic) || header.format_version != FORMAT_VERSION) {
+            throw std::runtime_error("Not a landmark index file");
+        }
+        // Squares are indexed by uint32_t, and landmarks are distinct squares,
+        // which also keeps data_words() from overflowing
+        const uint64_t num_squares = static_cast<uint64_t>(header.rows) * static_cast<uint64_t>(header.cols);
+        if (header.rows <= 0 || header.cols <= 0 || num_squares > std::numeric_limits<uint32_t>::max() ||
+            header.num_landmarks > num_squares) {
+            throw std::runtime_error("Corrupt landmark index header");
+        }
+        LandmarkIndex index;
+        index.rows_ = header.rows;
+        index.cols_ = header.cols;
+        index.num_squares_ = static_cast<uint32_t>(num_squares);
+        index.num_landmarks_ = header.num_landmarks;
+        index.board_version_ = header.board_version;
+        index.fingerprint_ = header.fingerprint;
+        return index;
+    }
+
+    size_t data_words() const {
+        return num_landmarks_ + 2 * static_cast<size_t>(num_squares_) * num_landmarks_;
+    }
+
+    const uint32_t *forward() const { return data_ + num_landmarks_; }
+
+    const uint32_t *backward() const { return forward() + static_cast<size_t>(num_squares_) * num_landmarks_; }
+
+    int rows_;
+    int cols_;
+    uint32_t num_squares_;
+    uint32_t num_landmarks_;
+    uint64_t board_version_;
+    uint64_t fingerprint_;
+
+    // Points into holder_, which is either an owned vector or a file mapping.
+    // Copies share the same data.
+    const uint32_t *data_;
+    std::shared_ptr<const void> holder_;
+};
+
+template<typename BOARD>
+constexpr char LandmarkIndex<BOARD>::MAGIC[4];
+
+template<typename BOARD>
+constexpr uint32_t LandmarkIndex<BOARD>::UNREACHABLE;
+
+template<typename BOARD>
+constexpr uint32_t LandmarkIndex<BOARD>::FORMAT_VERSION;
+
+template<typename BOARD>
+struct LandmarkHeuristic {
+    /* Adapter to use a LandmarkIndex with shortest_path_astar. The bounds
+     * can grow by more than one move weight along a single move, so use it
+     * with the default BinaryHeapQueue rather than BucketQueue.
+     *
+     * The index must have been built for this board (see matches()).
+     */
+    LandmarkHeuristic(const BOARD &board, const LandmarkIndex<BOARD> &index) : board(board), index(index) {}
+
+    int operator()(const typename BOARD::Pos &from, const typename BOARD::Pos &finish) const {
+        return index.lower_bound(board.index_of(from), board.index_of(finish));
+    }
+
+    const BOARD &board;
+    const LandmarkIndex<BOARD> &index;
+};
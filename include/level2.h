@@ -5,12 +5,15 @@
 #pragma once
 
 #include "knightboard.h"
+#include "search_stats.h"
 
-template<typename BOARD>
+namespace level2_detail {
+
+template<typename BOARD, typename OBSERVER>
 typename BOARD::PosVec some_path_simple(const BOARD &board,
                                         const typename BOARD::Pos begin,
                                         const typename BOARD::Pos finish,
-                                        bool verbose = false) {
+                                        OBSERVER &observer) {
 
     /* **read the README!**
      * We can use DFS to find *a* path from the start to the endpoint. I
@@ -29,31 +32,36 @@ typename BOARD::PosVec some_path_simple(const BOARD &board,
     // We're going to use a vector as a stack
     std::vector<typename BOARD::Pos> stack;
 
+    observer.search_started();
+
     parents.insert({begin, begin});
     stack.push_back(begin);
+    observer.queue_pushed(1);
 
     while (!stack.empty()) {
         auto this_pos = stack.back();
-
-        if (verbose) {
-            std::cout << "Processing " << this_pos << ", finish is " << finish << std::endl;
-        }
+        observer.node_expanded(board, board.index_of(this_pos));
 
         if (this_pos == finish) {
             break;
         }
 
         stack.pop_back();
+        observer.queue_popped();
 
         for (const auto &adj : board.adjacent_positions(this_pos)) {
             bool was_visited = parents.find(adj.first) != parents.end();
             if (!was_visited) {
                 stack.push_back(adj.first);
                 parents.insert({adj.first, this_pos});
+                observer.edge_relaxed();
+                observer.queue_pushed(stack.size());
             }
         }
     }
 
+    observer.search_finished(parents.size() * sizeof(typename decltype(parents)::value_type));
+
     // Follow backpointers to find the path
     // We get O(N) in this operation by appending to a vector: N * O(1)
     // then reversing it in one pass: O(N)
@@ -72,4 +80,20 @@ typename BOARD::PosVec some_path_simple(const BOARD &board,
     path.push_back(finish);
 
     return path;
+}
+
+}
+
+template<typename BOARD>
+typename BOARD::PosVec some_path_simple(const BOARD &board,
+                                        const typename BOARD::Pos begin,
+                                        const typename BOARD::Pos finish,
+                                        bool verbose = false) {
+    // The flag picks the observer once, instead of being tested in the loop
+    if (verbose) {
+        VerboseSearchObserver observer;
+        return level2_detail::some_path_simple(board, begin, finish, observer);
+    }
+    NullSearchObserver observer;
+    return level2_detail::some_path_simple(board, begin, finish, observer);
 }
\ No newline at end of file
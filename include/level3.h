@@ -5,12 +5,16 @@
 #pragma once
 
 #include "knightboard.h"
+#include "search_workspace.h"
+#include "search_stats.h"
 
-template<typename BOARD>
+namespace level3_detail {
+
+template<typename BOARD, typename OBSERVER>
 typename BOARD::PosVec shortest_path_simple(const BOARD &board,
                                             const typename BOARD::Pos begin,
                                             const typename BOARD::Pos finish,
-                                            const bool verbose = false) {
+                                            OBSERVER &observer) {
 
     /* **read the README!**
      * This is just BFS. I use a map instead of a vector to keep visited status
@@ -31,17 +35,18 @@ typename BOARD::PosVec shortest_path_simple(const BOARD &board,
 
     std::queue<typename BOARD::Pos> queue;
 
+    observer.search_started();
+
     // Enqueue starting point
     parents.insert({begin, begin});
     // parents[begin] = begin;
     queue.push(begin);
+    observer.queue_pushed(1);
 
     while (!queue.empty()) {
         auto this_pos = queue.front();
-
-        if (verbose) {
-            std::cout << "Processing " << this_pos << std::endl;
-        }
+        observer.queue_popped();
+        observer.node_expanded(board, board.index_of(this_pos));
 
         if (this_pos == finish) {
             break;
@@ -54,11 +59,15 @@ typename BOARD::PosVec shortest_path_simple(const BOARD &board,
             if (!was_visited) {
                 // set parent pointer
                 parents.insert({adj.first, this_pos});
+                observer.edge_relaxed();
                 queue.push(adj.first);
+                observer.queue_pushed(queue.size());
             }
         }
     }
 
+    observer.search_finished(parents.size() * sizeof(typename decltype(parents)::value_type));
+
     // Recover the path, same code as the Level 2 solution
     typename BOARD::PosVec path;
     auto tmp = parents.at(finish);
@@ -71,4 +80,95 @@ typename BOARD::PosVec shortest_path_simple(const BOARD &board,
     path.push_back(finish);
 
     return path;
+}
+
+}
+
+template<typename BOARD>
+typename BOARD::PosVec shortest_path_simple(const BOARD &board,
+                                            const typename BOARD::Pos begin,
+                                            const typename BOARD::Pos finish,
+                                            const bool verbose = false) {
+    // The flag picks the observer once, instead of being tested in the loop
+    if (verbose) {
+        VerboseSearchObserver observer;
+        return level3_detail::shortest_path_simple(board, begin, finish, observer);
+    }
+    NullSearchObserver observer;
+    return level3_detail::shortest_path_simple(board, begin, finish, observer);
+}
+
+template<typename BOARD, typename OBSERVER>
+typename BOARD::PosVec shortest_path_simple(const BOARD &board,
+                                            const typename BOARD::Pos begin,
+                                            const typename BOARD::Pos finish,
+                                            SearchWorkspace &workspace,
+                                            OBSERVER &observer) {
+
+    /* Same BFS as above, but book-keeping goes into a reusable workspace
+     * instead of a per-query hashmap. Visits squares in the same order, so
+     * it returns the same paths. OBSERVER is one of the policies in
+     * search_stats.h.
+     */
+
+    if (begin == finish) {
+        return typename BOARD::PosVec{begin, finish};
+    }
+
+    workspace.resize(board.num_squares());
+    workspace.new_query();
+
+    // The workspace queue is a plain vector, consumed from the front
+    auto &queue = workspace.queue;
+    queue.clear();
+    size_t queue_head = 0;
+
+    const auto begin_index = board.index_of(begin);
+    const auto finish_index = board.index_of(finish);
+
+    observer.search_started();
+
+    workspace.visit(begin_index, begin_index, 0);
+    queue.push_back(begin_index);
+    observer.queue_pushed(1);
+
+    while (queue_head < queue.size()) {
+        auto this_index = queue[queue_head];
+        observer.queue_popped();
+        observer.node_expanded(board, this_index);
+
+        if (this_index == finish_index) {
+            break;
+        }
+
+        queue_head++;
+
+        for (const auto &adj : board.adjacent_positions(board.pos_at(this_index))) {
+            auto adj_index = board.index_of(adj.first);
+            if (!workspace.visited(adj_index)) {
+                workspace.visit(adj_index, this_index, workspace.dist(this_index) + 1);
+                observer.edge_relaxed();
+                queue.push_back(adj_index);
+                observer.queue_pushed(queue.size() - queue_head);
+            }
+        }
+    }
+
+    observer.search_finished(workspace.bytes());
+    return workspace.extract_path(board, begin_index, finish_index);
+}
+
+template<typename BOARD>
+typename BOARD::PosVec shortest_path_simple(const BOARD &board,
+                                            const typename BOARD::Pos begin,
+                                            const typename BOARD::Pos finish,
+                                            SearchWorkspace &workspace,
+                                            const bool verbose = false) {
+    // The flag picks the observer once, instead of being tested in the loop
+    if (verbose) {
+        VerboseSearchObserver observer;
+        return shortest_path_simple(board, begin, finish, workspace, observer);
+    }
+    NullSearchObserver observer;
+    return shortest_path_simple(board, begin, finish, workspace, observer);
 }
\ No newline at end of file
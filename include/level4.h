@@ -5,12 +5,17 @@
 #pragma once
 
 #include "knightboard.h"
+#include "search_workspace.h"
+#include "search_stats.h"
+#include "search_queues.h"
 
-template <typename BOARD>
+namespace level4_detail {
+
+template <typename BOARD, typename OBSERVER>
 typename BOARD::PosVec shortest_path_lvl4(const BOARD &board,
                                           const typename BOARD::Pos begin,
                                           const typename BOARD::Pos finish,
-                                          const bool verbose = false) {
+                                          OBSERVER &observer) {
 
     /* **read the README!**
      * This is just Dijkstra.
@@ -24,7 +29,7 @@ typename BOARD::PosVec shortest_path_lvl4(const BOARD &board,
     }
 
     // Trivial teleport case
-    if ((board.b[begin.x][begin.y] == BoardSquare::Teleport) && (board.b[finish.x][finish.y] == BoardSquare::Teleport)) {
+    if ((board.square(begin) == BoardSquare::Teleport) && (board.square(finish) == BoardSquare::Teleport)) {
         return typename BOARD::PosVec{begin, finish};
     }
 
@@ -32,6 +37,8 @@ typename BOARD::PosVec shortest_path_lvl4(const BOARD &board,
     struct DijkstraData {
         typename BOARD::Pos parent;
         int dist;
+        // Set once the square is popped, when its distance becomes final
+        bool settled;
     };
 
     using DijkstraMap = std::unordered_map<typename BOARD::Pos, DijkstraData, typename BOARD::PosHasher>;
@@ -52,45 +59,64 @@ typename BOARD::PosVec shortest_path_lvl4(const BOARD &board,
 
     DijkstraQueue queue;
 
+    observer.search_started();
+
     // The starting point has distance 0 to itself
-    explored.insert({begin, {begin, 0}});
+    explored.insert({begin, {begin, 0, false}});
     // ...and.. we start
     queue.push({begin, 0});
+    observer.queue_pushed(1);
 
     while (!queue.empty()) {
         auto this_edge = queue.top();
         auto this_pos = this_edge.first;
-
-        if (verbose) {
-            std::cout << "Processing " << this_pos << std::endl;
-        }
+        observer.queue_popped();
 
         if (this_pos == finish) {
+            observer.node_expanded(board, board.index_of(this_pos));
             break;
         }
 
         queue.pop();
 
+        auto &this_data = explored.find(this_pos)->second;
+        if (this_data.settled) {
+            // Stale entry, this square was already popped with a shorter distance
+            continue;
+        }
+        this_data.settled = true;
+        observer.node_expanded(board, board.index_of(this_pos));
+        const auto this_dist = this_data.dist;
+
         for (const auto &adj : board.adjacent_positions(this_pos)) {
-            bool was_visited = explored.find(adj.first) != explored.end();
+            auto curr_dist = this_dist + adj.second;
+            auto adj_data = explored.find(adj.first);
 
-            if (!was_visited) {
+            if (adj_data == explored.end()) {
                 // Enque any unexplored edges, that will be queued up
                 // according to their distance to the origin
-                auto curr_dist = explored.find(this_pos)->second.dist + adj.second;
-                explored.insert({adj.first, {this_pos, curr_dist}});
+                explored.insert({adj.first, {this_pos, curr_dist, false}});
+                queue.push({adj.first, curr_dist});
+                observer.edge_relaxed();
+                observer.queue_pushed(queue.size());
+            } else if (!adj_data->second.settled && curr_dist < adj_data->second.dist) {
+                // Found a shorter route to a square that's still in the queue.
+                // The old queue entry will be skipped when popped.
+                adj_data->second.parent = this_pos;
+                adj_data->second.dist = curr_dist;
                 queue.push({adj.first, curr_dist});
+                observer.edge_relaxed();
+                observer.queue_pushed(queue.size());
             }
         }
     }
 
+    observer.search_finished(explored.size() * sizeof(typename DijkstraMap::value_type));
+
     // See other problems for notes on reconstructing the path
     typename BOARD::PosVec path;
     auto tmp = explored.at(finish);
     while (tmp.parent != begin) {
-        if (verbose) {
-            std::cout << "Pushing " << tmp.parent << std::endl;
-        }
         path.push_back(tmp.parent);
         tmp = explored.at(tmp.parent);
     }
@@ -100,3 +126,275 @@ typename BOARD::PosVec shortest_path_lvl4(const BOARD &board,
 
     return path;
 }
+
+}
+
+template <typename BOARD>
+typename BOARD::PosVec shortest_path_lvl4(const BOARD &board,
+                                          const typename BOARD::Pos begin,
+                                          const typename BOARD::Pos finish,
+                                          const bool verbose = false) {
+    // The flag picks the observer once, instead of being tested in the loop
+    if (verbose) {
+        VerboseSearchObserver observer;
+        return level4_detail::shortest_path_lvl4(board, begin, finish, observer);
+    }
+    NullSearchObserver observer;
+    return level4_detail::shortest_path_lvl4(board, begin, finish, observer);
+}
+
+/*
+ * Number of knight moves between two squares that are (dx, dy) apart on an
+ * infinite, obstacle-free board. Obstacles and board edges can only make
+ * paths longer, so this is a lower bound for the real distance.
+ */
+inline int knight_distance(int dx, int dy) {
+    dx = std::abs(dx);
+    dy = std::abs(dy);
+    if (dx < dy) {
+        std::swap(dx, dy);
+    }
+
+    // The two special cases of the closed form
+    if (dx == 1 && dy == 0) {
+        return 3;
+    }
+    if (dx == 2 && dy == 2) {
+        return 4;
+    }
+
+    int delta = dx - dy;
+    if (dy > delta) {
+        // delta - dy is negative here, and we need to round towards -inf
+        return delta + 2 * ((dy - delta + 2) / 3);
+    } else {
+        return delta - 2 * ((delta - dy) / 4);
+    }
+}
+
+template<typename BOARD>
+struct KnightDistanceHeuristic {
+    /* Admissible (and consistent) A* heuristic: the obstacle-free knight
+     * distance, scaled by the cheapest move on the board.
+     *
+     * The teleport breaks the geometry, since moving from a portal is like
+     * moving from its partner. The heuristic thus also considers the routes
+     * through either portal, and takes the minimum.
+     */
+    explicit KnightDistanceHeuristic(const BOARD &board) : teleports(board.teleports), min_weight(5) {
+        // Scan for the cheapest square we could land on. Most boards have a
+        // Clear square right at the start, so this is quick in practice.
+        for (uint32_t i = 0; i < board.num_squares() && min_weight > 1; i++) {
+            switch (board.square(board.pos_at(i))) {
+                case BoardSquare::Clear:
+                case BoardSquare::Teleport:
+                    min_weight = 1;
+                    break;
+                case BoardSquare::Water:
+                    min_weight = std::min(min_weight, 2);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    int operator()(const typename BOARD::Pos &from, const typename BOARD::Pos &finish) const {
+        int moves = knight_distance(finish.x - from.x, finish.y - from.y);
+
+        if (teleports) {
+            const auto &t1 = teleports->first;
+            const auto &t2 = teleports->second;
+            moves = std::min(moves,
+                             knight_distance(t1.x - from.x, t1.y - from.y) +
+                             knight_distance(finish.x - t2.x, finish.y - t2.y));
+            moves = std::min(moves,
+                             knight_distance(t2.x - from.x, t2.y - from.y) +
+                             knight_distance(finish.x - t1.x, finish.y - t1.y));
+        }
+
+        return moves * min_weight;
+    }
+
+    std::experimental::optional<std::pair<typename BOARD::Pos, typename BOARD::Pos>> teleports;
+    int min_weight;
+};
+
+template <typename QUEUE, typename BOARD, typename HEURISTIC, typename OBSERVER>
+typename BOARD::PosVec best_first_search(const BOARD &board,
+                                         const typename BOARD::Pos begin,
+                                         const typename BOARD::Pos finish,
+                                         SearchWorkspace &workspace,
+                                         const HEURISTIC &heuristic,
+                                         OBSERVER &observer) {
+
+    /* Shared engine of the workspace-based Dijkstra and A*: squares are popped
+     * from the QUEUE (see search_queues.h) by distance so far plus the
+     * heuristic estimate of the distance to go. Dijkstra is just A* with a
+     * zero heuristic.
+     *
+     * Distances are relaxed when a shorter route to an already discovered
+     * square turns up, and only become final when the square is popped.
+     * Outdated queue entries are simply skipped.
+     *
+     * HEURISTIC must be consistent, and can't grow by more than
+     * MAX_MOVE_WEIGHT along a single move (KnightDistanceHeuristic grows by
+     * at most the cheapest move weight), which keeps keys within range of
+     * the BucketQueue.
+     *
+     * OBSERVER is one of the policies in search_stats.h. Trivial queries
+     * return before the search starts, without calling it at all.
+     */
+
+    if (begin == finish) {
+        return typename BOARD::PosVec{begin, finish};
+    }
+
+    // Trivial teleport case
+    if ((board.square(begin) == BoardSquare::Teleport) && (board.square(finish) == BoardSquare::Teleport)) {
+        return typename BOARD::PosVec{begin, finish};
+    }
+
+    workspace.resize(board.num_squares());
+    workspace.new_query();
+
+    QUEUE queue(workspace, 2 * MAX_MOVE_WEIGHT);
+
+    const auto begin_index = board.index_of(begin);
+    const auto finish_index = board.index_of(finish);
+
+    observer.search_started();
+
+    workspace.visit(begin_index, begin_index, 0);
+    queue.push(begin_index, heuristic(begin, finish));
+    observer.queue_pushed(queue.size());
+
+    while (!queue.empty()) {
+        auto this_index = queue.pop();
+        observer.queue_popped();
+
+        if (workspace.settled(this_index)) {
+            // Stale entry, this square was already reached more cheaply
+            continue;
+        }
+        workspace.settle(this_index);
+        observer.node_expanded(board, this_index);
+
+        if (this_index == finish_index) {
+            break;
+        }
+
+        const auto this_dist = workspace.dist(this_index);
+
+        for (const auto &adj : board.adjacent_positions(board.pos_at(this_index))) {
+            auto adj_index = board.index_of(adj.first);
+            auto adj_dist = this_dist + adj.second;
+
+            if (!workspace.visited(adj_index)) {
+                workspace.visit(adj_index, this_index, adj_dist);
+            } else if (!workspace.settled(adj_index) && adj_dist < workspace.dist(adj_index)) {
+                workspace.relax(adj_index, this_index, adj_dist);
+            } else {
+                continue;
+            }
+            observer.edge_relaxed();
+
+            queue.push(adj_index, adj_dist + heuristic(adj.first, finish));
+            observer.queue_pushed(queue.size());
+        }
+    }
+
+    observer.search_finished(workspace.bytes());
+    return workspace.extract_path(board, begin_index, finish_index);
+}
+
+template <typename QUEUE = BinaryHeapQueue, typename BOARD, typename OBSERVER>
+typename BOARD::PosVec shortest_path_lvl4(const BOARD &board,
+                                          const typename BOARD::Pos begin,
+                                          const typename BOARD::Pos finish,
+                                          SearchWorkspace &workspace,
+                                          OBSERVER &observer) {
+
+    /* Same Dijkstra as above, with dense book-keeping in a reusable
+     * workspace. With the default BinaryHeapQueue, the heap is ordered
+     * exactly like the std::priority_queue above, so it returns the same
+     * paths. BucketQueue is faster, but may break ties differently.
+     */
+
+    auto zero_heuristic = [](const typename BOARD::Pos &, const typename BOARD::Pos &) { return 0; };
+    return best_first_search<QUEUE>(board, begin, finish, workspace, zero_heuristic, observer);
+}
+
+template <typename QUEUE = BinaryHeapQueue, typename BOARD>
+typename BOARD::PosVec shortest_path_lvl4(const BOARD &board,
+                                          const typename BOARD::Pos begin,
+                                          const typename BOARD::Pos finish,
+                                          SearchWorkspace &workspace,
+                                          const bool verbose = false) {
+    // The flag picks the observer once, instead of being tested in the loop
+    if (verbose) {
+        VerboseSearchObserver observer;
+        return shortest_path_lvl4<QUEUE>(board, begin, finish, workspace, observer);
+    }
+    NullSearchObserver observer;
+    return shortest_path_lvl4<QUEUE>(board, begin, finish, workspace, observer);
+}
+
+template <typename QUEUE = BinaryHeapQueue, typename BOARD, typename HEURISTIC, typename OBSERVER>
+typename BOARD::PosVec shortest_path_astar(const BOARD &board,
+                                           const typename BOARD::Pos begin,
+                                           const typename BOARD::Pos finish,
+                                           SearchWorkspace &workspace,
+                                           const HEURISTIC &heuristic,
+                                           OBSERVER &observer) {
+
+    /* A* search, i.e. Dijkstra with the queue ordered by (distance so far +
+     * estimated distance to go). With a consistent heuristic, it settles
+     * squares in a "cone" pointing towards finish, instead of a disk around
+     * begin, and still returns the same path cost as Dijkstra.
+     */
+
+    return best_first_search<QUEUE>(board, begin, finish, workspace, heuristic, observer);
+}
+
+template <typename QUEUE = BinaryHeapQueue, typename BOARD, typename HEURISTIC>
+typename BOARD::PosVec shortest_path_astar(const BOARD &board,
+                                           const typename BOARD::Pos begin,
+                                           const typename BOARD::Pos finish,
+                                           SearchWorkspace &workspace,
+                                           const HEURISTIC &heuristic,
+                                           SearchStats *stats = nullptr) {
+    if (stats) {
+        StatsObserver observer(*stats);
+        return shortest_path_astar<QUEUE>(board, begin, finish, workspace, heuristic, observer);
+    }
+    NullSearchObserver observer;
+    return shortest_path_astar<QUEUE>(board, begin, finish, workspace, heuristic, observer);
+}
+
+template <typename QUEUE = BinaryHeapQueue, typename BOARD>
+typename BOARD::PosVec shortest_path_astar(const BOARD &board,
+                                           const typename BOARD::Pos begin,
+                                           const typename BOARD::Pos finish,
+                                           SearchWorkspace &workspace,
+                                           SearchStats *stats = nullptr) {
+    return shortest_path_astar<QUEUE>(board, begin, finish, workspace, KnightDistanceHeuristic<BOARD>(board), stats);
+}
+
+template <typename BOARD>
+int path_cost(const BOARD &board, const typename BOARD::PosVec &path) {
+    /* Total weight of a path, as computed by the searches: each step costs
+     * the weight of the square it lands on, and jumping between the two
+     * portals is free.
+     */
+    int cost = 0;
+    for (size_t i = 1; i < path.size(); i++) {
+        auto from_sq = board.square(path[i - 1]);
+        auto to_sq = board.square(path[i]);
+        if (from_sq == BoardSquare::Teleport && to_sq == BoardSquare::Teleport) {
+            continue;
+        }
+        cost += move_weight(to_sq);
+    }
+    return cost;
+}
@@ -5,9 +5,19 @@
 #pragma once
 
 #include "knightboard.h"
+#include "thread_pool.h"
 
+#include <algorithm>
 #include <memory>
 #include <bitset>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <thread>
 
 template<typename BOARD>
 struct BoardDPTypes {
@@ -116,4 +126,789 @@ int longest_path_dp(const BOARD &board) {
     }
 
     return longest_any_end;
-}
\ No newline at end of file
+}
+/*
+ * Exact Level 5 by branch and bound. The DP above needs n * 2^n entries,
+ * which doesn't even fit for a 6x6 board. Instead, a depth-first search
+ * extends one path at a time, with the visited squares in a std::bitset,
+ * and gives up on a branch as soon as it provably can't beat the best path
+ * found so far (the incumbent):
+ *
+ *  - the path can only continue through the unvisited squares that are
+ *    still reachable from its end (a flood fill), and
+ *  - knight moves alternate square colors, so it can't use more than about
+ *    twice as many squares of one color as there are of the other.
+ *
+ * Moves are tried in Warnsdorff order (squares with the fewest onward moves
+ * first), which finds long paths early and makes the bounds bite sooner.
+ * The first few levels of the tree are split into independent subtrees,
+ * which are searched in parallel, sharing the incumbent length.
+ *
+ * The search is exponential in the worst case, so it takes node and time
+ * budgets. When it runs out, it returns the best path found so far, with
+ * proven_optimal unset.
+ *
+ * Paths are sequences of valid steps (see is_valid_step), and count moves
+ * as in Level 3. In particular, hopping from a portal onto its partner is a
+ * step of its own.
+ */
+
+struct LongestPathOptions {
+    // 0 uses all cores
+    size_t threads = 0;
+    // Nodes of the search tree, over all threads. 0 means no limit.
+    uint64_t node_budget = 0;
+    // 0 means no limit
+    std::chrono::milliseconds time_budget{0};
+};
+
+template<typename BOARD>
+struct LongestPathResult {
+    // Empty if there's no path at all
+    typename BOARD::PosVec path;
+    // Whether no longer path exists
+    bool proven_optimal = false;
+    // Nodes of the search tree that were visited
+    uint64_t nodes = 0;
+
+    int moves() const { return static_cast<int>(path.size()) - 1; }
+};
+
+namespace level5_detail {
+
+// Squares that can follow each square in a path, i.e. all the valid steps
+template<typename BOARD>
+std::vector<std::vector<uint32_t>> step_successors(const BOARD &board) {
+    std::vector<std::vector<uint32_t>> successors(board.num_squares());
+
+    for (uint32_t i = 0; i < board.num_squares(); i++) {
+        auto pos = board.pos_at(i);
+        auto sq = board.square(pos);
+        if (sq == BoardSquare::Rock || sq == BoardSquare::Barrier) {
+            // Can't stand there in the first place
+            continue;
+        }
+        for (const auto &move : KNIGHT_MOVES) {
+            typename BOARD::Pos next(pos.x + move[0], pos.y + move[1]);
+            if (board.is_within_bounds(next) && board.is_valid_step(pos, next)) {
+                successors[i].push_back(board.index_of(next));
+            }
+        }
+        if (sq == BoardSquare::Teleport && board.teleports) {
+            auto partner = (pos == board.teleports->first) ? board.teleports->second : board.teleports->first;
+            successors[i].push_back(board.index_of(partner));
+        }
+    }
+
+    return successors;
+}
+
+template<typename BOARD>
+bool is_light(const BOARD &board, uint32_t index) {
+    auto pos = board.pos_at(index);
+    return (pos.x + pos.y) % 2 == 0;
+}
+
+}
+
+template<size_t MAX_SQUARES = 1024, typename BOARD>
+LongestPathResult<BOARD> longest_path_exact(const BOARD &board,
+                                            const typename BOARD::Pos begin,
+                                            std::experimental::optional<typename BOARD::Pos> finish,
+                                            const LongestPathOptions &options = LongestPathOptions()) {
+
+    /* Longest path from begin, visiting each square at most once. With a
+     * finish, the path has to end there (that's Level 5), otherwise it can
+     * end anywhere.
+     */
+
+    using Clock = std::chrono::steady_clock;
+    using VisitedMask = std::bitset<MAX_SQUARES>;
+
+    const uint32_t n = board.num_squares();
+    if (n > MAX_SQUARES) {
+        throw std::invalid_argument("Board has more squares than MAX_SQUARES");
+    }
+
+    const auto successors = level5_detail::step_successors(board);
+    const uint32_t begin_index = board.index_of(begin);
+    const uint32_t finish_index = finish ? board.index_of(*finish) : std::numeric_limits<uint32_t>::max();
+
+    // The color bound only holds if every step changes color, which a hop
+    // between two portals of the same color doesn't
+    bool alternating = !board.teleports ||
+                       level5_detail::is_light(board, board.index_of(board.teleports->first)) !=
+                       level5_detail::is_light(board, board.index_of(board.teleports->second));
+
+    const auto deadline = Clock::now() + options.time_budget;
+    std::atomic<uint64_t> nodes(0);
+    std::atomic<bool> out_of_budget(false);
+
+    // Incumbent, in moves. -1 means no path found yet.
+    std::atomic<int> best_moves(-1);
+    std::mutex best_mutex;
+    std::vector<uint32_t> best_path;
+
+    auto record = [&](const std::vector<uint32_t> &path) {
+        int moves = static_cast<int>(path.size()) - 1;
+        if (moves <= best_moves.load()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(best_mutex);
+        if (moves > best_moves.load()) {
+            best_path = path;
+            best_moves = moves;
+        }
+    };
+
+    // Per-thread search state
+    struct Searcher {
+        VisitedMask visited;
+        std::vector<uint32_t> path;
+        // Flood fill scratch
+        std::vector<uint32_t> stamps;
+        std::vector<uint32_t> queue;
+        uint32_t stamp = 0;
+        uint64_t local_nodes = 0;
+    };
+
+    // Upper bound on the number of moves that can still be added to the
+    // path ending at `from`, or -1 if the finish can't be reached anymore
+    auto remaining_bound = [&](Searcher &s, uint32_t from) {
+        if (++s.stamp == 0) {
+            std::fill(s.stamps.begin(), s.stamps.end(), 0);
+            s.stamp = 1;
+        }
+        s.queue.clear();
+        s.queue.push_back(from);
+        s.stamps[from] = s.stamp;
+
+        bool from_light = level5_detail::is_light(board, from);
+        int same = 0;
+        int other = 0;
+        bool reaches_finish = false;
+
+        for (size_t head = 0; head < s.queue.size(); head++) {
+            auto i = s.queue[head];
+            // The finish ends the path, so it doesn't lead anywhere
+            if (i == finish_index) {
+                continue;
+            }
+            for (auto next : successors[i]) {
+                if (s.visited.test(next) || s.stamps[next] == s.stamp) {
+                    continue;
+                }
+                s.stamps[next] = s.stamp;
+                s.queue.push_back(next);
+                (level5_detail::is_light(board, next) == from_light ? same : other)++;
+                reaches_finish |= (next == finish_index);
+            }
+        }
+
+        if (finish && !reaches_finish) {
+            return -1;
+        }
+        int bound = same + other;
+        if (alternating) {
+            // Moves alternate other, same, other, ... colors
+            bound = std::min(bound, std::min(2 * other, 2 * same + 1));
+        }
+        return bound;
+    };
+
+    auto check_budgets = [&](Searcher &s) {
+        // Flush the node count every so often, rather than contending on it
+        if (++s.local_nodes < 1024) {
+            return !out_of_budget.load(std::memory_order_relaxed);
+        }
+        auto total = nodes.fetch_add(s.local_nodes) + s.local_nodes;
+        s.local_nodes = 0;
+        if ((options.node_budget && total >= options.node_budget) ||
+            (options.time_budget.count() && Clock::now() >= deadline)) {
+            out_of_budget = true;
+        }
+        return !out_of_budget.load(std::memory_order_relaxed);
+    };
+
+    // Unvisited successors of a square, fewest onward moves first. There
+    // are at most 8 knight moves, plus the portal hop.
+    struct Moves {
+        uint32_t next[9];
+        int count;
+    };
+    auto ordered_moves = [&](const Searcher &s, uint32_t from) {
+        Moves moves;
+        int keys[9];
+        moves.count = 0;
+        for (auto next : successors[from]) {
+            if (s.visited.test(next)) {
+                continue;
+            }
+            int onward = 0;
+            for (auto after : successors[next]) {
+                onward += !s.visited.test(after);
+            }
+            // Heading into the finish early would end the path
+            int key = (next == finish_index) ? std::numeric_limits<int>::max() : onward;
+
+            // Insertion sort, stable
+            int j = moves.count++;
+            for (; j > 0 && keys[j - 1] > key; j--) {
+                keys[j] = keys[j - 1];
+                moves.next[j] = moves.next[j - 1];
+            }
+            keys[j] = key;
+            moves.next[j] = next;
+        }
+        return moves;
+    };
+
+    std::function<void(Searcher &)> search = [&](Searcher &s) {
+        if (!check_budgets(s)) {
+            return;
+        }
+
+        const auto from = s.path.back();
+        const int moves_so_far = static_cast<int>(s.path.size()) - 1;
+
+        if (!finish || from == finish_index) {
+            record(s.path);
+        }
+        if (from == finish_index) {
+            return;
+        }
+
+        auto bound = remaining_bound(s, from);
+        if (bound < 0 || moves_so_far + bound <= best_moves.load()) {
+            return;
+        }
+
+        auto moves = ordered_moves(s, from);
+        for (int m = 0; m < moves.count; m++) {
+            auto next = moves.next[m];
+            s.visited.set(next);
+            s.path.push_back(next);
+            search(s);
+            s.path.pop_back();
+            s.visited.reset(next);
+        }
+    };
+
+    auto make_searcher = [&]() {
+        Searcher s;
+        s.stamps.assign(n, 0);
+        return s;
+    };
+
+    /* Split the top of the tree into prefixes, breadth first, until there
+     * are enough to keep all threads busy. Short prefixes that can't be
+     * extended are kept too: they're valid paths on their own.
+     */
+    ThreadPool pool(options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency()));
+    const size_t wanted_prefixes = 16 * pool.size();
+
+    std::vector<std::vector<uint32_t>> prefixes{{begin_index}};
+    for (bool grew = true; grew && prefixes.size() < wanted_prefixes;) {
+        grew = false;
+        std::vector<std::vector<uint32_t>> next_prefixes;
+        Searcher s = make_searcher();
+        for (const auto &prefix : prefixes) {
+            s.visited.reset();
+            for (auto i : prefix) {
+                s.visited.set(i);
+            }
+            Moves moves{{}, 0};
+            if (prefix.back() != finish_index) {
+                moves = ordered_moves(s, prefix.back());
+            }
+            if (moves.count == 0) {
+                next_prefixes.push_back(prefix);
+                continue;
+            }
+            for (int m = 0; m < moves.count; m++) {
+                next_prefixes.push_back(prefix);
+                next_prefixes.back().push_back(moves.next[m]);
+            }
+            // The prefix itself is a path too
+            if (!finish) {
+                record(prefix);
+            }
+            grew = true;
+        }
+        prefixes = std::move(next_prefixes);
+    }
+
+    std::vector<Searcher> searchers;
+    for (size_t w = 0; w < pool.size(); w++) {
+        searchers.push_back(make_searcher());
+    }
+
+    pool.parallel_for(prefixes.size(), [&](size_t p, size_t worker) {
+        auto &s = searchers[worker];
+        s.visited.reset();
+        for (auto i : prefixes[p]) {
+            s.visited.set(i);
+        }
+        s.path = prefixes[p];
+        search(s);
+    });
+
+    LongestPathResult<BOARD> result;
+    for (const auto &s : searchers) {
+        nodes += s.local_nodes;
+    }
+    result.nodes = nodes;
+    result.proven_optimal = !out_of_budget;
+    for (auto i : best_path) {
+        result.path.push_back(board.pos_at(i));
+    }
+    return result;
+}
+
+/*
+ * Anytime Level 5 for boards where the exact search is hopeless: a
+ * randomized local search that keeps improving a path until a deadline.
+ *
+ * Each thread builds paths with randomized Warnsdorff rollouts (move to the
+ * square with the fewest onward moves, breaking ties at random, and
+ * sometimes not at all). When a rollout gets stuck, Posa rotations reverse
+ * the tail of the path to get a new end to extend from. Then, detours
+ * through unvisited squares are spliced between consecutive steps. To
+ * escape local optima, the current path is cut at a random point and
+ * regrown, and the new one is kept unless it's worse.
+ *
+ * The best path over all threads (the incumbent) is guarded by an atomic
+ * score, so paths that don't beat it are dropped without copying them, and
+ * improvements are swapped in through an atomic pointer. Each improvement
+ * is passed to a callback as it's found (calls are serialized and strictly
+ * improving), which is the only place where threads wait for each other.
+ *
+ * Paths follow the same rules as longest_path_exact. By default they're
+ * scored in moves; with `weighted`, by path_cost() instead, so that lava
+ * and water count for more. When a path in moves visits every reachable
+ * square, it's reported as proven optimal and the search stops early.
+ * Unlike longest_path_exact, a path always has at least one step (see
+ * is_valid_step_sequence), so there's none from a square to itself, or
+ * out of a walled-in one.
+ */
+
+struct AnytimeLongestPathOptions {
+    // 0 uses all cores
+    size_t threads = 0;
+    uint64_t seed = 1;
+    // Score paths by path_cost() rather than moves
+    bool weighted = false;
+};
+
+namespace level5_detail {
+
+template<typename BOARD>
+class AnytimeSearch {
+public:
+    using Path = std::vector<uint32_t>;
+
+    AnytimeSearch(const BOARD &board,
+                  const std::vector<std::vector<uint32_t>> &successors,
+                  uint32_t begin,
+                  uint32_t finish,
+                  bool weighted,
+                  uint64_t seed) : board_(board),
+                                   successors_(successors),
+                                   begin_(begin),
+                                   finish_(finish),
+                                   weighted_(weighted),
+                                   rng_(seed),
+                                   in_path_(board.num_squares(), 0) {}
+
+    static constexpr uint32_t NO_FINISH = std::numeric_limits<uint32_t>::max();
+
+    int64_t score(const Path &path) const {
+        if (!weighted_) {
+            return static_cast<int64_t>(path.size()) - 1;
+        }
+        int64_t total = 0;
+        for (size_t i = 1; i < path.size(); i++) {
+            total += step_weight(path[i - 1], path[i]);
+        }
+        return total;
+    }
+
+    // A fresh path from begin. Empty if the finish can't be reached.
+    Path rollout() {
+        Path path{begin_};
+        set_path(path);
+        grow(path);
+        return path;
+    }
+
+    // Cuts the path at a random point and regrows it
+    Path perturb(const Path &current) {
+        Path path = current;
+        if (finish_ != NO_FINISH && path.size() > 1) {
+            path.pop_back();
+        }
+        std::uniform_int_distribution<size_t> cut(1, path.size());
+        path.resize(cut(rng_));
+        set_path(path);
+        grow(path);
+        return path;
+    }
+
+    // Splices detours through unvisited squares between consecutive steps
+    void insert_detours(Path &path) {
+        set_path(path);
+        for (bool improved = true; improved;) {
+            improved = false;
+            for (size_t i = 0; i + 1 < path.size(); i++) {
+                uint32_t detour[2];
+                int length = find_detour(path[i], path[i + 1], detour);
+                if (length > 0) {
+                    path.insert(path.begin() + i + 1, detour, detour + length);
+                    for (int k = 0; k < length; k++) {
+                        in_path_[detour[k]] = 1;
+                    }
+                    improved = true;
+                }
+            }
+        }
+    }
+
+private:
+    bool is_step(uint32_t from, uint32_t to) const {
+        const auto &next = successors_[from];
+        return std::find(next.begin(), next.end(), to) != next.end();
+    }
+
+    int64_t step_weight(uint32_t from, uint32_t to) const {
+        auto to_sq = board_.square(board_.pos_at(to));
+        if (board_.square(board_.pos_at(from)) == BoardSquare::Teleport && to_sq == BoardSquare::Teleport) {
+            return 0;
+        }
+        return move_weight(to_sq);
+    }
+
+    bool is_free(uint32_t i) const { return !in_path_[i] && i != finish_; }
+
+    void set_path(const Path &path) {
+        std::fill(in_path_.begin(), in_path_.end(), 0);
+        for (auto i : path) {
+            in_path_[i] = 1;
+        }
+    }
+
+    int onward_moves(uint32_t from) const {
+        int count = 0;
+        for (auto next : successors_[from]) {
+            count += is_free(next);
+        }
+        return count;
+    }
+
+    // Randomized Warnsdorff choice, or NO_FINISH when stuck
+    uint32_t pick_move(uint32_t from) {
+        uint32_t best = NO_FINISH;
+        int best_onward = std::numeric_limits<int>::max();
+        int ties = 0;
+        int candidates = 0;
+        uint32_t any = NO_FINISH;
+
+        for (auto next : successors_[from]) {
+            if (!is_free(next)) {
+                continue;
+            }
+            // Reservoir sampling for the occasional random move
+            if (std::uniform_int_distribution<int>(0, candidates++)(rng_) == 0) {
+                any = next;
+            }
+            int onward = onward_moves(next);
+            if (onward < best_onward) {
+                best = next;
+                best_onward = onward;
+                ties = 1;
+            } else if (onward == best_onward && std::uniform_int_distribution<int>(0, ties++)(rng_) == 0) {
+                best = next;
+            }
+        }
+
+        if (candidates > 1 && std::uniform_int_distribution<int>(0, 15)(rng_) == 0) {
+            return any;
+        }
+        return best;
+    }
+
+    // Reverses the tail after a square the end can step back to, so that
+    // the path ends somewhere else. Returns false if no rotation is possible.
+    bool rotate(Path &path) {
+        const auto end = path.back();
+        std::vector<size_t> pivots;
+        for (size_t i = 0; i + 2 < path.size(); i++) {
+            if (is_step(path[i], end)) {
+                pivots.push_back(i);
+            }
+        }
+        std::shuffle(pivots.begin(), pivots.end(), rng_);
+
+        for (auto i : pivots) {
+            // The steps of the reversed tail have to be valid backwards too
+            bool reversible = true;
+            for (size_t k = i + 1; k + 1 < path.size() && reversible; k++) {
+                reversible = is_step(path[k + 1], path[k]);
+            }
+            if (reversible) {
+                std::reverse(path.begin() + i + 1, path.end());
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Extends the path as far as possible, then ends it at the finish
+    void grow(Path &path) {
+        int rotations = 0;
+        while (true) {
+            auto next = pick_move(path.back());
+            if (next != NO_FINISH) {
+                path.push_back(next);
+                in_path_[next] = 1;
+                continue;
+            }
+            if (rotations++ < 8 && path.size() > 2 && rotate(path)) {
+                continue;
+            }
+            break;
+        }
+
+        if (finish_ != NO_FINISH && path.back() != finish_) {
+            // Back off to the last square that can step onto the finish
+            size_t i = path.size();
+            while (i > 0 && !is_step(path[i - 1], finish_)) {
+                i--;
+            }
+            if (i == 0) {
+                path.clear();
+                return;
+            }
+            path.resize(i);
+            path.push_back(finish_);
+        }
+    }
+
+    // One or two free squares that fit between from and to
+    int find_detour(uint32_t from, uint32_t to, uint32_t *detour) const {
+        for (auto u : successors_[from]) {
+            if (!is_free(u)) {
+                continue;
+            }
+            if (is_step(u, to)) {
+                detour[0] = u;
+                return 1;
+            }
+            for (auto w : successors_[u]) {
+                if (w != u && is_free(w) && is_step(w, to)) {
+                    detour[0] = u;
+                    detour[1] = w;
+                    return 2;
+                }
+            }
+        }
+        return 0;
+    }
+
+    const BOARD &board_;
+    const std::vector<std::vector<uint32_t>> &successors_;
+    uint32_t begin_;
+    uint32_t finish_;
+    bool weighted_;
+    std::mt19937_64 rng_;
+    std::vector<char> in_path_;
+};
+
+template<typename BOARD>
+constexpr uint32_t AnytimeSearch<BOARD>::NO_FINISH;
+
+}
+
+template<typename BOARD, typename CALLBACK>
+LongestPathResult<BOARD> longest_path_anytime(const BOARD &board,
+                                              const typename BOARD::Pos begin,
+                                              std::experimental::optional<typename BOARD::Pos> finish,
+                                              const std::chrono::steady_clock::time_point deadline,
+                                              CALLBACK &&on_improvement,
+                                              const AnytimeLongestPathOptions &options = AnytimeLongestPathOptions()) {
+
+    /* Searches until the deadline, calling on_improvement(path) with each
+     * new best path. Returns the best one, with `nodes` counting the
+     * candidate paths that were tried.
+     */
+
+    using Search = level5_detail::AnytimeSearch<BOARD>;
+    using Path = typename Search::Path;
+
+    LongestPathResult<BOARD> result;
+    if (finish && *finish == begin) {
+        result.proven_optimal = true;
+        return result;
+    }
+
+    struct Incumbent {
+        int64_t score;
+        Path path;
+    };
+
+    const auto successors = level5_detail::step_successors(board);
+    const uint32_t begin_index = board.index_of(begin);
+    const uint32_t finish_index = finish ? board.index_of(*finish) : Search::NO_FINISH;
+
+    // Visiting everything reachable from begin can't be beaten
+    int64_t reachable = 0;
+    {
+        std::vector<char> seen(board.num_squares(), 0);
+        std::vector<uint32_t> queue{begin_index};
+        seen[begin_index] = 1;
+        for (size_t head = 0; head < queue.size(); head++) {
+            for (auto next : successors[queue[head]]) {
+                if (!seen[next]) {
+                    seen[next] = 1;
+                    queue.push_back(next);
+                }
+            }
+        }
+        reachable = static_cast<int64_t>(queue.size());
+    }
+    // Walled in: not even a single step
+    if (reachable < 2) {
+        result.proven_optimal = true;
+        return result;
+    }
+
+    ThreadPool pool(options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency()));
+
+    std::atomic<int64_t> best_score(-1);
+    std::atomic<const Incumbent *> best(nullptr);
+    std::atomic<bool> optimal(false);
+    std::atomic<uint64_t> nodes(0);
+    std::mutex callback_mutex;
+    int64_t reported = -1;
+
+    // Incumbents that were swapped out, by the thread that did it. They're
+    // only deleted when no other thread is publishing, so that nobody can
+    // still be holding one for a compare and swap.
+    std::atomic<int> publishing(0);
+    std::vector<std::vector<const Incumbent *>> retired(pool.size());
+
+    auto publish = [&](size_t thread, const Search &search, const Path &path) {
+        // A single square isn't a path, see above
+        if (path.size() < 2) {
+            return;
+        }
+        auto score = search.score(path);
+        auto current = best_score.load();
+        do {
+            if (current >= score) {
+                return;
+            }
+        } while (!best_score.compare_exchange_weak(current, score));
+
+        if (!options.weighted && static_cast<int64_t>(path.size()) == reachable) {
+            optimal = true;
+        }
+
+        /* The score is ours, so swap the path in unless a better one claims
+         * the score meanwhile: that one is published by its own thread.
+         */
+        publishing++;
+        auto candidate = new Incumbent{score, path};
+        auto shown = best.load();
+        while (true) {
+            if (best_score.load() != score) {
+                delete candidate;
+                break;
+            }
+            if (best.compare_exchange_weak(shown, candidate)) {
+                if (shown) {
+                    retired[thread].push_back(shown);
+                }
+                break;
+            }
+        }
+        if (publishing.fetch_sub(1) == 1) {
+            for (auto old : retired[thread]) {
+                delete old;
+            }
+            retired[thread].clear();
+        }
+
+        std::lock_guard<std::mutex> lock(callback_mutex);
+        // Another thread may have published something better meanwhile
+        if (score > reported && best_score.load() == score) {
+            reported = score;
+            typename BOARD::PosVec positions;
+            for (auto i : path) {
+                positions.push_back(board.pos_at(i));
+            }
+            on_improvement(positions);
+        }
+    };
+
+    pool.parallel_for(pool.size(), [&](size_t thread, size_t) {
+        Search search(board, successors, begin_index, finish_index, options.weighted,
+                      options.seed * 0x9e3779b97f4a7c15ull + thread);
+        Path current;
+        int64_t current_score = -1;
+        int stagnation = 0;
+
+        while (!optimal && std::chrono::steady_clock::now() < deadline) {
+            nodes++;
+
+            // Start over once perturbing stops paying off
+            bool restart = current.empty() || stagnation > 200;
+            auto candidate = restart ? search.rollout() : search.perturb(current);
+            if (candidate.empty()) {
+                // The finish isn't reachable this way
+                stagnation++;
+                continue;
+            }
+            search.insert_detours(candidate);
+
+            auto candidate_score = search.score(candidate);
+            if (restart || candidate_score > current_score) {
+                stagnation = (candidate_score > current_score) ? 0 : stagnation + 1;
+                current = std::move(candidate);
+                current_score = candidate_score;
+                publish(thread, search, current);
+            } else if (candidate_score == current_score) {
+                // Drift along plateaus
+                current = std::move(candidate);
+                stagnation++;
+            } else {
+                stagnation++;
+            }
+            if (restart) {
+                stagnation = 0;
+            }
+        }
+    });
+
+    result.nodes = nodes;
+    result.proven_optimal = optimal;
+    std::unique_ptr<const Incumbent> incumbent(best.load());
+    if (incumbent) {
+        for (auto i : incumbent->path) {
+            result.path.push_back(board.pos_at(i));
+        }
+    }
+    for (const auto &list : retired) {
+        for (auto old : list) {
+            delete old;
+        }
+    }
+    return result;
+}
+
+template<typename BOARD>
+LongestPathResult<BOARD> longest_path_anytime(const BOARD &board,
+                                              const typename BOARD::Pos begin,
+                                              std::experimental::optional<typename BOARD::Pos> finish,
+                                              const std::chrono::steady_clock::time_point deadline) {
+    return longest_path_anytime(board, begin, finish, deadline, [](const typename BOARD::PosVec &) {});
+}
@@ -0,0 +1,203 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "search_workspace.h"
+#include "search_queues.h"
+#include "thread_pool.h"
+
+#include <limits>
+#include <mutex>
+
+/*
+ * Many-to-many distance tables, e.g. for precomputing dispatch routing
+ * tables. Each source runs its own single-source Dijkstra on the thread
+ * pool, with one SearchWorkspace per worker, and stops as soon as all the
+ * targets are settled.
+ *
+ * Rows are handed to a caller-supplied sink as soon as they're ready, so
+ * the full matrix never needs to be in memory:
+ *
+ *   sink(size_t source, const uint32_t *dists, const uint32_t *next_hops)
+ *
+ * where dists[j] is the cost from sources[source] to targets[j], and
+ * next_hops[j] the square index of the first move of that route (or nullptr
+ * if next hops weren't requested). Rows come in no particular order, and
+ * the arrays are only valid during the call. Calls to the sink are
+ * serialized, so it needn't be thread safe.
+ *
+ * Costs are the same as path_cost(shortest_path_lvl4(...)), except that
+ * the distance from a square to itself is 0.
+ */
+
+constexpr uint32_t UNREACHABLE_DISTANCE = std::numeric_limits<uint32_t>::max();
+
+template<typename QUEUE = BucketQueue, typename BOARD, typename SINK>
+void many_to_many(const BOARD &board,
+                  const typename BOARD::PosVec &sources,
+                  const typename BOARD::PosVec &targets,
+                  ThreadPool &pool,
+                  SINK &&sink,
+                  const bool with_next_hops = false) {
+
+    const auto num_squares = board.num_squares();
+
+    // Read-only target lookup shared by all workers: one bit per square
+    std::vector<bool> is_target(num_squares, false);
+    size_t num_distinct_targets = 0;
+    for (const auto &target : targets) {
+        auto index = board.index_of(target);
+        if (!is_target[index]) {
+            is_target[index] = true;
+            num_distinct_targets++;
+        }
+    }
+
+    // Per-worker state, allocated once and reused across sources
+    struct WorkerState {
+        SearchWorkspace workspace;
+        std::vector<uint32_t> first_hop;
+        std::vector<uint32_t> dists;
+        std::vector<uint32_t> next_hops;
+    };
+    std::vector<WorkerState> workers(pool.size());
+
+    std::mutex sink_mutex;
+
+    pool.parallel_for(sources.size(), [&](size_t source, size_t worker) {
+        auto &state = workers[worker];
+        auto &workspace = state.workspace;
+        workspace.resize(num_squares);
+        workspace.new_query();
+        if (with_next_hops) {
+            state.first_hop.resize(num_squares);
+        }
+
+        const auto source_index = board.index_of(sources[source]);
+        const bool source_is_portal = board.square(sources[source]) == BoardSquare::Teleport;
+        size_t targets_left = num_distinct_targets;
+
+        // Trivial teleport case, same as shortest_path_lvl4: the partner
+        // portal is at distance 0, but the search may never settle it
+        auto partner_index = source_index;
+        if (source_is_portal && board.teleports) {
+            const auto &portals = *board.teleports;
+            partner_index = board.index_of(sources[source] == portals.first ? portals.second : portals.first);
+            if (partner_index != source_index && is_target[partner_index]) {
+                targets_left--;
+            }
+        }
+
+        QUEUE queue(workspace, MAX_MOVE_WEIGHT);
+        workspace.visit(source_index, source_index, 0);
+        queue.push(source_index, 0);
+
+        while (!queue.empty() && targets_left > 0) {
+            auto this_index = queue.pop();
+            if (workspace.settled(this_index)) {
+                continue;
+            }
+            workspace.settle(this_index);
+
+            if (is_target[this_index] && (this_index != partner_index || partner_index == source_index)) {
+                targets_left--;
+            }
+
+            const auto this_dist = workspace.dist(this_index);
+            for (const auto &adj : board.adjacent_positions(board.pos_at(this_index))) {
+                auto adj_index = board.index_of(adj.first);
+                auto adj_dist = this_dist + adj.second;
+
+                if (!workspace.visited(adj_index)) {
+                    workspace.visit(adj_index, this_index, adj_dist);
+                } else if (!workspace.settled(adj_index) && adj_dist < workspace.dist(adj_index)) {
+                    workspace.relax(adj_index, this_index, adj_dist);
+                } else {
+                    continue;
+                }
+                if (with_next_hops) {
+                    state.first_hop[adj_index] = (this_index == source_index) ? adj_index
+                                                                              : state.first_hop[this_index];
+                }
+                queue.push(adj_index, adj_dist);
+            }
+        }
+
+        // Fill in the row
+        state.dists.resize(targets.size());
+        state.next_hops.resize(with_next_hops ? targets.size() : 0);
+
+        for (size_t j = 0; j < targets.size(); j++) {
+            auto target_index = board.index_of(targets[j]);
+            uint32_t dist = UNREACHABLE_DISTANCE;
+            uint32_t next_hop = UNREACHABLE_DISTANCE;
+
+            if (target_index == source_index) {
+                dist = 0;
+                next_hop = target_index;
+            } else if (source_is_portal && board.square(targets[j]) == BoardSquare::Teleport) {
+                // Trivial teleport case, same as shortest_path_lvl4
+                dist = 0;
+                next_hop = target_index;
+            } else if (workspace.settled(target_index)) {
+                dist = static_cast<uint32_t>(workspace.dist(target_index));
+                if (with_next_hops) {
+                    next_hop = state.first_hop[target_index];
+                }
+            }
+
+            state.dists[j] = dist;
+            if (with_next_hops) {
+                state.next_hops[j] = next_hop;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(sink_mutex);
+        sink(source, state.dists.data(), with_next_hops ? state.next_hops.data() : nullptr);
+    });
+}
+
+/*
+ * Convenience wrapper that collects the whole table in memory, row-major
+ * (sources x targets).
+ */
+struct DistanceTable {
+    size_t num_sources;
+    size_t num_targets;
+    std::vector<uint32_t> dists;
+    // Empty unless requested
+    std::vector<uint32_t> next_hops;
+
+    uint32_t dist(size_t source, size_t target) const { return dists[source * num_targets + target]; }
+
+    uint32_t next_hop(size_t source, size_t target) const { return next_hops[source * num_targets + target]; }
+};
+
+template<typename QUEUE = BucketQueue, typename BOARD>
+DistanceTable distance_table(const BOARD &board,
+                             const typename BOARD::PosVec &sources,
+                             const typename BOARD::PosVec &targets,
+                             ThreadPool &pool,
+                             const bool with_next_hops = false) {
+    DistanceTable table{sources.size(), targets.size(), {}, {}};
+    table.dists.resize(sources.size() * targets.size());
+    if (with_next_hops) {
+        table.next_hops.resize(sources.size() * targets.size());
+    }
+
+    many_to_many<QUEUE>(board, sources, targets, pool,
+                        [&table](size_t source, const uint32_t *dists, const uint32_t *next_hops) {
+                            std::copy(dists, dists + table.num_targets,
+                                      table.dists.begin() + source * table.num_targets);
+                            if (next_hops) {
+                                std::copy(next_hops, next_hops + table.num_targets,
+                                          table.next_hops.begin() + source * table.num_targets);
+                            }
+                        },
+                        with_next_hops);
+
+    return table;
+}
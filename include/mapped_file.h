@@ -0,0 +1,66 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+/*
+ * A whole file mapped read-only into memory. Pages are only read from disk
+ * when touched, and are shared with the OS page cache, so large maps and
+ * precomputed indices "load" in constant time and without extra copies.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path) : data_(nullptr), size_(0) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed opening file at " + path);
+        }
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed reading the size of " + path);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+
+        // mmap() refuses empty mappings, an empty file is just no data
+        if (size_ > 0) {
+            void *addr = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Failed mapping " + path);
+            }
+            data_ = static_cast<const char *>(addr);
+        }
+        // The mapping stays valid after closing the descriptor
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (data_) {
+            ::munmap(const_cast<char *>(data_), size_);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const { return data_; }
+
+    size_t size() const { return size_; }
+
+private:
+    const char *data_;
+    size_t size_;
+};
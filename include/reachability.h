@@ -0,0 +1,487 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "search_workspace.h"
+#include "search_queues.h"
+#include "thread_pool.h"
+#include "level2.h"
+#include "level3.h"
+#include "level4.h"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+/*
+ * Answers "is there a route at all?" in O(1), so that queries that can
+ * never succeed don't flood the whole reachable region before giving up.
+ *
+ * Moves aren't symmetric (barrier scans depend on where the move starts,
+ * and a portal moves like its partner), so this works on the directed
+ * graph of adjacent_positions, over the squares a knight can stand on:
+ *
+ * - weakly connected components, with a lock-free union-find filled in
+ *   parallel: different components never reach each other.
+ * - strongly connected components, with Tarjan's algorithm, one weak
+ *   component per task: the same component always reaches itself.
+ *   Tarjan finishes a component after all the ones it reaches, so a
+ *   component with a higher number is never reachable from a lower one.
+ * - for the rest, the transitive closure between the strong components of
+ *   each weak one, as bitsets. On most maps there's one big component
+ *   with a handful of one-way pockets, so that's tiny; weak components
+ *   with more than closure_limit strong ones skip it, and reachable() can
+ *   then say yes to a pair with no route (see is_exact()).
+ *
+ * A knight on a rock or barrier can still move off it (the searches don't
+ * check the starting square), so such a begin is checked through its
+ * moves, still in O(1). That, the bounds and the portal check in
+ * reachable() read the board, so it can't go away before the index.
+ */
+template<typename BOARD>
+class ReachabilityIndex {
+public:
+    using Pos = typename BOARD::Pos;
+
+    static constexpr uint32_t NO_COMPONENT = std::numeric_limits<uint32_t>::max();
+
+    explicit ReachabilityIndex(const BOARD &board, size_t threads = 0, uint32_t closure_limit = 4096)
+            : board_(board), version_(board.version()), num_weak_(0), num_strong_(0) {
+        ThreadPool pool(threads ? threads : std::max(1u, std::thread::hardware_concurrency()));
+        compile(pool);
+        label_weak(pool);
+        label_strong(pool, closure_limit);
+    }
+
+    // Whether some path from begin to finish exists (the searches would
+    // find one). Exact if is_exact(), otherwise false is still a sure no.
+    bool reachable(const Pos &begin, const Pos &finish) const {
+        if (!board_.is_within_bounds(begin) || !board_.is_within_bounds(finish)) {
+            return false;
+        }
+        if (begin == finish) {
+            return true;
+        }
+        // Trivial teleport case, same as shortest_path_lvl4
+        if (board_.square(begin) == BoardSquare::Teleport && board_.square(finish) == BoardSquare::Teleport) {
+            return true;
+        }
+
+        const auto finish_index = board_.index_of(finish);
+        if (weak_[finish_index] == NO_COMPONENT) {
+            return false;
+        }
+
+        const auto begin_index = board_.index_of(begin);
+        if (weak_[begin_index] != NO_COMPONENT) {
+            return reachable(begin_index, finish_index);
+        }
+        for (uint32_t e = offsets_[begin_index]; e < offsets_[begin_index + 1]; e++) {
+            if (reachable(targets_[e], finish_index)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Between two squares a knight can stand on
+    bool reachable(uint32_t from, uint32_t to) const {
+        if (weak_[from] != weak_[to]) {
+            return false;
+        }
+        const auto from_strong = strong_[from];
+        const auto to_strong = strong_[to];
+        if (from_strong == to_strong) {
+            return true;
+        }
+        if (to_strong > from_strong) {
+            return false;
+        }
+
+        const auto weak = weak_[from];
+        const auto &closure = closures_[weak];
+        if (closure.empty()) {
+            // Too many strong components to tell
+            return true;
+        }
+        const auto words = (weak_sizes_[weak] + 63) / 64;
+        const auto row = from_strong - first_strong_[weak];
+        const auto column = to_strong - first_strong_[weak];
+        return (closure[row * words + column / 64] >> (column % 64)) & 1;
+    }
+
+    // Whether reachable() never says yes for a pair with no route
+    bool is_exact() const { return exact_; }
+
+    // Weak component of a square, NO_COMPONENT on rocks and barriers
+    uint32_t weak_component(uint32_t i) const { return weak_[i]; }
+
+    uint32_t strong_component(uint32_t i) const { return strong_[i]; }
+
+    uint32_t num_weak_components() const { return num_weak_; }
+
+    uint32_t num_strong_components() const { return num_strong_; }
+
+    bool is_current() const { return board_.version() == version_; }
+
+private:
+    static bool is_passable(BoardSquare sq) {
+        return sq != BoardSquare::Rock && sq != BoardSquare::Barrier;
+    }
+
+    // Squares are compiled and linked in blocks of this many
+    static constexpr uint32_t BLOCK = 4096;
+
+    void compile(ThreadPool &pool) {
+        /* The moves as a CSR graph, built one block of squares per task
+         * and then stitched together. Squares a knight can't stand on keep
+         * their moves too, for reachable() from them.
+         */
+        const auto n = board_.num_squares();
+        const uint32_t num_blocks = (n + BLOCK - 1) / BLOCK;
+        std::vector<std::vector<uint32_t>> block_targets(num_blocks);
+        std::vector<uint32_t> degrees(n);
+
+        pool.parallel_for(num_blocks, [&](size_t b, size_t) {
+            const uint32_t first = static_cast<uint32_t>(b) * BLOCK;
+            const uint32_t last = std::min(n, first + BLOCK);
+            for (uint32_t i = first; i < last; i++) {
+                const auto edges = board_.adjacent_positions(board_.pos_at(i));
+                degrees[i] = static_cast<uint32_t>(edges.size());
+                for (const auto &adj : edges) {
+                    block_targets[b].push_back(board_.index_of(adj.first));
+                }
+            }
+        });
+
+        offsets_.assign(n + 1, 0);
+        for (uint32_t i = 0; i < n; i++) {
+            offsets_[i + 1] = offsets_[i] + degrees[i];
+        }
+        targets_.resize(offsets_[n]);
+        pool.parallel_for(num_blocks, [&](size_t b, size_t) {
+            std::copy(block_targets[b].begin(), block_targets[b].end(),
+                      targets_.begin() + offsets_[static_cast<uint32_t>(b) * BLOCK]);
+        });
+    }
+
+    void label_weak(ThreadPool &pool) {
+        /* Lock-free union-find: roots are linked to smaller roots with a
+         * compare and swap, and finds halve the paths as they go. Each
+         * task links the moves out of one block of squares.
+         */
+        const auto n = board_.num_squares();
+        std::vector<std::atomic<uint32_t>> parents(n);
+        std::vector<uint8_t> passable(n);
+        for (uint32_t i = 0; i < n; i++) {
+            parents[i].store(i, std::memory_order_relaxed);
+            passable[i] = is_passable(board_.square(board_.pos_at(i)));
+        }
+
+        auto find = [&](uint32_t x) {
+            while (true) {
+                auto parent = parents[x].load();
+                if (parent == x) {
+                    return x;
+                }
+                auto grandparent = parents[parent].load();
+                parents[x].compare_exchange_weak(parent, grandparent);
+                x = grandparent;
+            }
+        };
+
+        auto unite = [&](uint32_t a, uint32_t b) {
+            while (true) {
+                a = find(a);
+                b = find(b);
+                if (a == b) {
+                    return;
+                }
+                if (a < b) {
+                    std::swap(a, b);
+                }
+                // Fails if a isn't a root anymore, then try again
+                auto expected = a;
+                if (parents[a].compare_exchange_strong(expected, b)) {
+                    return;
+                }
+            }
+        };
+
+        const uint32_t num_blocks = (n + BLOCK - 1) / BLOCK;
+        pool.parallel_for(num_blocks, [&](size_t b, size_t) {
+            const uint32_t first = static_cast<uint32_t>(b) * BLOCK;
+            const uint32_t last = std::min(n, first + BLOCK);
+            for (uint32_t i = first; i < last; i++) {
+                if (passable[i]) {
+                    for (uint32_t e = offsets_[i]; e < offsets_[i + 1]; e++) {
+                        unite(i, targets_[e]);
+                    }
+                }
+            }
+        });
+
+        // Roots are the smallest square of their component, so numbering
+        // them in order keeps components sorted by their first square
+        weak_.assign(n, NO_COMPONENT);
+        for (uint32_t i = 0; i < n; i++) {
+            if (passable[i]) {
+                const auto root = find(i);
+                if (root == i) {
+                    weak_[i] = num_weak_++;
+                } else {
+                    weak_[i] = weak_[root];
+                }
+            }
+        }
+    }
+
+    void label_strong(ThreadPool &pool, uint32_t closure_limit) {
+        const auto n = board_.num_squares();
+
+        // Squares of each weak component, by counting sort
+        std::vector<uint32_t> weak_offsets(num_weak_ + 1, 0);
+        for (uint32_t i = 0; i < n; i++) {
+            if (weak_[i] != NO_COMPONENT) {
+                weak_offsets[weak_[i] + 1]++;
+            }
+        }
+        for (uint32_t w = 0; w < num_weak_; w++) {
+            weak_offsets[w + 1] += weak_offsets[w];
+        }
+        std::vector<uint32_t> squares(weak_offsets[num_weak_]);
+        {
+            auto next = weak_offsets;
+            for (uint32_t i = 0; i < n; i++) {
+                if (weak_[i] != NO_COMPONENT) {
+                    squares[next[weak_[i]]++] = i;
+                }
+            }
+        }
+
+        // Numbered within each weak component first
+        strong_.assign(n, NO_COMPONENT);
+        weak_sizes_.assign(num_weak_, 0);
+        closures_.assign(num_weak_, std::vector<uint64_t>());
+        std::vector<uint32_t> order(n);
+        std::vector<uint32_t> low(n);
+
+        pool.parallel_for(num_weak_, [&](size_t w, size_t) {
+            const auto first = weak_offsets[w];
+            const auto last = weak_offsets[w + 1];
+            if (last - first == 1) {
+                strong_[squares[first]] = 0;
+                weak_sizes_[w] = 1;
+                return;
+            }
+            auto count = tarjan(squares, first, last, order, low);
+            weak_sizes_[w] = count;
+            if (count > 1 && count <= closure_limit) {
+                closures_[w] = closure(squares, first, last, count);
+            }
+        });
+
+        // Then globally
+        first_strong_.assign(num_weak_, 0);
+        exact_ = true;
+        for (uint32_t w = 0; w < num_weak_; w++) {
+            first_strong_[w] = num_strong_;
+            num_strong_ += weak_sizes_[w];
+            exact_ = exact_ && (weak_sizes_[w] == 1 || !closures_[w].empty());
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            if (weak_[i] != NO_COMPONENT) {
+                strong_[i] += first_strong_[weak_[i]];
+            }
+        }
+    }
+
+    uint32_t tarjan(const std::vector<uint32_t> &squares, uint32_t first, uint32_t last,
+                    std::vector<uint32_t> &order, std::vector<uint32_t> &low) {
+        /* Iterative Tarjan over the squares [first, last) of a weak
+         * component. order and low are shared between tasks, but each
+         * task only touches its own squares. Returns the number of strong
+         * components, numbered from 0 in the order they're finished.
+         */
+        const uint32_t UNSEEN = NO_COMPONENT;
+        for (auto s = first; s < last; s++) {
+            order[squares[s]] = UNSEEN;
+        }
+
+        std::vector<uint32_t> stack;
+        // Square, and the next of its moves to look at
+        std::vector<std::pair<uint32_t, uint32_t>> calls;
+        uint32_t next_order = 0;
+        uint32_t count = 0;
+
+        for (auto s = first; s < last; s++) {
+            if (order[squares[s]] != UNSEEN) {
+                continue;
+            }
+            calls.emplace_back(squares[s], offsets_[squares[s]]);
+            order[squares[s]] = low[squares[s]] = next_order++;
+            stack.push_back(squares[s]);
+
+            while (!calls.empty()) {
+                const auto v = calls.back().first;
+                auto &e = calls.back().second;
+
+                if (e < offsets_[v + 1]) {
+                    const auto w = targets_[e++];
+                    if (order[w] == UNSEEN) {
+                        order[w] = low[w] = next_order++;
+                        stack.push_back(w);
+                        calls.emplace_back(w, offsets_[w]);
+                    } else if (strong_[w] == NO_COMPONENT) {
+                        // Still on the stack
+                        low[v] = std::min(low[v], order[w]);
+                    }
+                    continue;
+                }
+
+                calls.pop_back();
+                if (!calls.empty()) {
+                    const auto parent = calls.back().first;
+                    low[parent] = std::min(low[parent], low[v]);
+                }
+                if (low[v] == order[v]) {
+                    uint32_t w;
+                    do {
+                        w = stack.back();
+                        stack.pop_back();
+                        strong_[w] = count;
+                    } while (w != v);
+                    count++;
+                }
+            }
+        }
+        return count;
+    }
+
+    std::vector<uint64_t> closure(const std::vector<uint32_t> &squares, uint32_t first, uint32_t last,
+                                  uint32_t count) const {
+        /* Row c has a bit set for each strong component c reaches. Moves
+         * only lead to components numbered lower, so rows can be filled
+         * in order, each one or-ing in the rows it has moves into.
+         */
+        const uint32_t words = (count + 63) / 64;
+        std::vector<uint64_t> rows(static_cast<size_t>(count) * words, 0);
+
+        std::vector<uint32_t> by_component(last - first);
+        std::vector<uint32_t> component_offsets(count + 1, 0);
+        for (auto s = first; s < last; s++) {
+            component_offsets[strong_[squares[s]] + 1]++;
+        }
+        for (uint32_t c = 0; c < count; c++) {
+            component_offsets[c + 1] += component_offsets[c];
+        }
+        auto next = component_offsets;
+        for (auto s = first; s < last; s++) {
+            by_component[next[strong_[squares[s]]]++] = squares[s];
+        }
+
+        for (uint32_t c = 0; c < count; c++) {
+            auto row = rows.data() + static_cast<size_t>(c) * words;
+            row[c / 64] |= uint64_t(1) << (c % 64);
+            for (auto k = component_offsets[c]; k < component_offsets[c + 1]; k++) {
+                const auto v = by_component[k];
+                for (uint32_t e = offsets_[v]; e < offsets_[v + 1]; e++) {
+                    const auto d = strong_[targets_[e]];
+                    if (d != c) {
+                        const auto other = rows.data() + static_cast<size_t>(d) * words;
+                        for (uint32_t word = 0; word < words; word++) {
+                            row[word] |= other[word];
+                        }
+                    }
+                }
+            }
+        }
+        return rows;
+    }
+
+    const BOARD &board_;
+    uint64_t version_;
+
+    // Moves of each square, as in CompiledGraph
+    std::vector<uint32_t> offsets_;
+    std::vector<uint32_t> targets_;
+
+    std::vector<uint32_t> weak_;
+    std::vector<uint32_t> strong_;
+    uint32_t num_weak_;
+    uint32_t num_strong_;
+    bool exact_;
+
+    // By weak component: number of strong components, the global number of
+    // the first one, and the closure (empty if not computed)
+    std::vector<uint32_t> weak_sizes_;
+    std::vector<uint32_t> first_strong_;
+    std::vector<std::vector<uint64_t>> closures_;
+};
+
+template<typename BOARD>
+constexpr uint32_t ReachabilityIndex<BOARD>::NO_COMPONENT;
+
+template<typename BOARD>
+constexpr uint32_t ReachabilityIndex<BOARD>::BLOCK;
+
+/*
+ * The searches, checking the index first: unreachable queries return an
+ * empty optional straight away, instead of searching everything before
+ * throwing std::out_of_range. If the index isn't exact, the search can
+ * still come up empty. These have their own names, since an index passed
+ * where the searches take an OBSERVER would be taken for one.
+ */
+
+template<typename BOARD>
+std::experimental::optional<typename BOARD::PosVec> try_some_path_simple(const BOARD &board,
+                                                                         const typename BOARD::Pos begin,
+                                                                         const typename BOARD::Pos finish,
+                                                                         const ReachabilityIndex<BOARD> &reachability) {
+    if (!reachability.reachable(begin, finish)) {
+        return std::experimental::nullopt;
+    }
+    try {
+        return some_path_simple(board, begin, finish);
+    } catch (const std::out_of_range &) {
+        return std::experimental::nullopt;
+    }
+}
+
+template<typename BOARD>
+std::experimental::optional<typename BOARD::PosVec> try_shortest_path_simple(const BOARD &board,
+                                                                             const typename BOARD::Pos begin,
+                                                                             const typename BOARD::Pos finish,
+                                                                             SearchWorkspace &workspace,
+                                                                             const ReachabilityIndex<BOARD> &reachability) {
+    if (!reachability.reachable(begin, finish)) {
+        return std::experimental::nullopt;
+    }
+    try {
+        return shortest_path_simple(board, begin, finish, workspace);
+    } catch (const std::out_of_range &) {
+        return std::experimental::nullopt;
+    }
+}
+
+template<typename QUEUE = BinaryHeapQueue, typename BOARD>
+std::experimental::optional<typename BOARD::PosVec> try_shortest_path_lvl4(const BOARD &board,
+                                                                           const typename BOARD::Pos begin,
+                                                                           const typename BOARD::Pos finish,
+                                                                           SearchWorkspace &workspace,
+                                                                           const ReachabilityIndex<BOARD> &reachability) {
+    if (!reachability.reachable(begin, finish)) {
+        return std::experimental::nullopt;
+    }
+    try {
+        return shortest_path_lvl4<QUEUE>(board, begin, finish, workspace);
+    } catch (const std::out_of_range &) {
+        return std::experimental::nullopt;
+    }
+}
@@ -0,0 +1,125 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "search_workspace.h"
+
+#include <stdexcept>
+
+/*
+ * Priority queue policies for the Dijkstra and A* templates in level4.h.
+ * Both keep their storage in the SearchWorkspace, so that it's reused across
+ * queries, and share the same tiny interface:
+ *
+ *   QUEUE queue(workspace, max_key_step);
+ *   queue.push(index, key);
+ *   auto index = queue.pop(); // one of the entries with the smallest key
+ *   auto key = queue.min_key(); // smallest key, without popping
+ *
+ * max_key_step bounds how much larger than the last popped key a pushed key
+ * can be. It's only needed by BucketQueue.
+ */
+
+// Binary heap on top of std::push_heap/std::pop_heap, the default
+class BinaryHeapQueue {
+public:
+    BinaryHeapQueue(SearchWorkspace &workspace, int /* max_key_step */) : heap_(workspace.heap) {
+        heap_.clear();
+    }
+
+    bool empty() const { return heap_.empty(); }
+
+    size_t size() const { return heap_.size(); }
+
+    void push(uint32_t index, int key) {
+        heap_.emplace_back(index, key);
+        std::push_heap(heap_.begin(), heap_.end(), order);
+    }
+
+    int min_key() const { return heap_.front().second; }
+
+    uint32_t pop() {
+        auto index = heap_.front().first;
+        std::pop_heap(heap_.begin(), heap_.end(), order);
+        heap_.pop_back();
+        return index;
+    }
+
+private:
+    static bool order(const std::pair<uint32_t, int> &e1, const std::pair<uint32_t, int> &e2) {
+        return e1.second > e2.second;
+    }
+
+    std::vector<std::pair<uint32_t, int>> &heap_;
+};
+
+/*
+ * Dial's bucket queue. Move weights are small integers (see MAX_MOVE_WEIGHT),
+ * and keys are monotone during the search: each pushed key is at most
+ * max_key_step larger than the last popped one. We can thus keep a circular
+ * array of max_key_step + 1 buckets (rounded up to a power of two), one per
+ * key, and both push and pop are O(1).
+ */
+class BucketQueue {
+public:
+    BucketQueue(SearchWorkspace &workspace, int max_key_step) : buckets_(workspace.buckets),
+                                                                current_key_(0),
+                                                                has_key_(false),
+                                                                size_(0) {
+        size_t num_buckets = 1;
+        while (num_buckets <= static_cast<size_t>(max_key_step)) {
+            num_buckets *= 2;
+        }
+        mask_ = num_buckets - 1;
+
+        buckets_.resize(num_buckets);
+        for (auto &bucket : buckets_) {
+            bucket.clear();
+        }
+    }
+
+    bool empty() const { return size_ == 0; }
+
+    size_t size() const { return size_; }
+
+    void push(uint32_t index, int key) {
+        if (!has_key_) {
+            // First push, start the circular array from here
+            current_key_ = key;
+            has_key_ = true;
+        } else if (key < current_key_ || static_cast<size_t>(key - current_key_) > mask_) {
+            throw std::logic_error("Key outside of the range of the bucket queue");
+        }
+        buckets_[key & mask_].push_back(index);
+        size_++;
+    }
+
+    // Not const, as it moves forward to the first non-empty bucket
+    int min_key() {
+        // Only valid on a non-empty queue, so this terminates within one
+        // lap around the buckets
+        while (buckets_[current_key_ & mask_].empty()) {
+            current_key_++;
+        }
+        return current_key_;
+    }
+
+    uint32_t pop() {
+        min_key();
+        auto &bucket = buckets_[current_key_ & mask_];
+        auto index = bucket.back();
+        bucket.pop_back();
+        size_--;
+        return index;
+    }
+
+private:
+    std::vector<std::vector<uint32_t>> &buckets_;
+    size_t mask_;
+    // Smallest key that can still be in the queue, i.e. the last popped one
+    int current_key_;
+    bool has_key_;
+    size_t size_;
+};
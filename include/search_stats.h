@@ -0,0 +1,171 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+
+/*
+ * Counters filled in by the search functions that accept a SearchStats
+ * pointer (or a StatsObserver). Handy for comparing how much work different
+ * algorithms do on the same query, and for finding out why a query was slow.
+ * Counters add up over several searches, peak_open_set takes the maximum.
+ */
+struct SearchStats {
+    // Squares popped from the open set and expanded
+    size_t nodes_expanded = 0;
+    // Moves that gave a square a new (or shorter) distance
+    size_t edges_relaxed = 0;
+    size_t queue_pushes = 0;
+    size_t queue_pops = 0;
+    // Largest number of entries in the open set(s), stale ones included
+    size_t peak_open_set = 0;
+    // Memory held by the workspace(s) when the search ended
+    size_t workspace_bytes = 0;
+    std::chrono::nanoseconds elapsed{0};
+
+    SearchStats &operator+=(const SearchStats &other) {
+        nodes_expanded += other.nodes_expanded;
+        edges_relaxed += other.edges_relaxed;
+        queue_pushes += other.queue_pushes;
+        queue_pops += other.queue_pops;
+        peak_open_set = std::max(peak_open_set, other.peak_open_set);
+        workspace_bytes = std::max(workspace_bytes, other.workspace_bytes);
+        elapsed += other.elapsed;
+        return *this;
+    }
+};
+
+/*
+ * Observer policies for the search templates. These are template
+ * parameters, called at each step of the search:
+ *
+ *   search_started()                  before anything else
+ *   node_expanded(board, index)       a square is expanded
+ *   edge_relaxed()                    a move improved the distance of a square
+ *   queue_pushed(open_set_size)       after each push
+ *   queue_popped()                    after each pop
+ *   search_finished(workspace_bytes)  once the search loop is over
+ *
+ * NullSearchObserver does nothing, and compiles away entirely: that's the
+ * default, so plain searches pay nothing for the hooks.
+ */
+struct NullSearchObserver {
+    void search_started() {}
+
+    template<typename BOARD>
+    void node_expanded(const BOARD &, uint32_t) {}
+
+    void edge_relaxed() {}
+
+    void queue_pushed(size_t) {}
+
+    void queue_popped() {}
+
+    void search_finished(size_t) {}
+};
+
+// Adds up the search into a SearchStats
+class StatsObserver {
+public:
+    explicit StatsObserver(SearchStats &stats) : stats_(stats) {}
+
+    void search_started() { start_ = std::chrono::steady_clock::now(); }
+
+    template<typename BOARD>
+    void node_expanded(const BOARD &, uint32_t) { stats_.nodes_expanded++; }
+
+    void edge_relaxed() { stats_.edges_relaxed++; }
+
+    void queue_pushed(size_t open_set_size) {
+        stats_.queue_pushes++;
+        stats_.peak_open_set = std::max(stats_.peak_open_set, open_set_size);
+    }
+
+    void queue_popped() { stats_.queue_pops++; }
+
+    void search_finished(size_t workspace_bytes) {
+        stats_.workspace_bytes = std::max(stats_.workspace_bytes, workspace_bytes);
+        stats_.elapsed += std::chrono::steady_clock::now() - start_;
+    }
+
+private:
+    SearchStats &stats_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// What the old `verbose` flags printed, for following a search by eye
+struct VerboseSearchObserver : NullSearchObserver {
+    template<typename BOARD>
+    void node_expanded(const BOARD &board, uint32_t index) {
+        std::cout << "Processing " << board.pos_at(index) << std::endl;
+    }
+};
+
+/*
+ * Thread-safe aggregate of SearchStats by name (e.g. one per algorithm),
+ * for services that run lots of searches and want to dump where the time
+ * went. Recording takes a lock, so record once per query, not per step.
+ */
+class SearchMetrics {
+public:
+    struct Summary {
+        size_t searches = 0;
+        // Sum over all searches
+        SearchStats total;
+        // Worst single search, counter by counter
+        SearchStats worst;
+    };
+
+    void record(const std::string &name, const SearchStats &stats) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto &summary = summaries_[name];
+        summary.searches++;
+        summary.total += stats;
+
+        auto &worst = summary.worst;
+        worst.nodes_expanded = std::max(worst.nodes_expanded, stats.nodes_expanded);
+        worst.edges_relaxed = std::max(worst.edges_relaxed, stats.edges_relaxed);
+        worst.queue_pushes = std::max(worst.queue_pushes, stats.queue_pushes);
+        worst.queue_pops = std::max(worst.queue_pops, stats.queue_pops);
+        worst.peak_open_set = std::max(worst.peak_open_set, stats.peak_open_set);
+        worst.workspace_bytes = std::max(worst.workspace_bytes, stats.workspace_bytes);
+        worst.elapsed = std::max(worst.elapsed, stats.elapsed);
+    }
+
+    std::map<std::string, Summary> snapshot() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return summaries_;
+    }
+
+    // One line per name, with the mean and worst of each counter
+    void dump(std::ostream &out) const {
+        for (const auto &entry : snapshot()) {
+            const auto &summary = entry.second;
+            const double n = static_cast<double>(summary.searches);
+            auto us = [](std::chrono::nanoseconds t) { return t.count() / 1e3; };
+
+            out << entry.first << ": " << summary.searches << " searches"
+                << ", expanded " << summary.total.nodes_expanded / n << " (max " << summary.worst.nodes_expanded << ")"
+                << ", relaxed " << summary.total.edges_relaxed / n << " (max " << summary.worst.edges_relaxed << ")"
+                << ", pushes " << summary.total.queue_pushes / n << " (max " << summary.worst.queue_pushes << ")"
+                << ", pops " << summary.total.queue_pops / n << " (max " << summary.worst.queue_pops << ")"
+                << ", peak open set " << summary.worst.peak_open_set
+                << ", workspace " << summary.worst.workspace_bytes << " bytes"
+                << ", time " << us(summary.total.elapsed) / n << " us (max " << us(summary.worst.elapsed) << " us)"
+                << std::endl;
+        }
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::map<std::string, Summary> summaries_;
+};
@@ -0,0 +1,142 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+
+/*
+ * Dense book-keeping for graph searches, indexed by the linear square index
+ * of the board (see index_of()).
+ *
+ * The level templates keep parents in a hashmap, which is nice when paths
+ * only touch a small part of a huge map. When running many queries, though,
+ * allocating and hashing into a fresh map for each of them quickly becomes
+ * the dominant cost. A workspace is allocated once, and then reused by
+ * passing it to the search functions.
+ *
+ * Instead of clearing the arrays between queries, each square carries the
+ * generation number of the last query that visited it: bumping the
+ * generation "forgets" all squares in O(1). Generations are even numbers,
+ * and the odd number right after flags squares that were settled (i.e. whose
+ * distance is final), so a single stamp array tracks both.
+ *
+ * Workspaces aren't thread safe: use one per thread.
+ */
+class SearchWorkspace {
+public:
+    static constexpr uint32_t NO_PARENT = std::numeric_limits<uint32_t>::max();
+
+    SearchWorkspace() : generation_(0) {}
+
+    explicit SearchWorkspace(uint32_t num_squares) : generation_(0) {
+        resize(num_squares);
+    }
+
+    template<typename BOARD, typename = typename std::enable_if<!std::is_arithmetic<BOARD>::value>::type>
+    explicit SearchWorkspace(const BOARD &board) : SearchWorkspace(board.num_squares()) {}
+
+    // Makes room for a board with num_squares squares. Free when the size
+    // doesn't change, so search functions just call it on every query.
+    void resize(uint32_t num_squares) {
+        if (num_squares == stamps_.size()) {
+            return;
+        }
+        stamps_.assign(num_squares, 0);
+        parents_.resize(num_squares);
+        dists_.resize(num_squares);
+        generation_ = 0;
+    }
+
+    uint32_t size() const { return static_cast<uint32_t>(stamps_.size()); }
+
+    // Starts a new query, forgetting the state of the previous one
+    void new_query() {
+        generation_ += 2;
+        if (generation_ == 0) {
+            // The counter wrapped around: this happens once every 2 billion
+            // queries, so we can afford a real clear.
+            std::fill(stamps_.begin(), stamps_.end(), 0);
+            generation_ = 2;
+        }
+    }
+
+    bool visited(uint32_t index) const { return (stamps_[index] | 1) == (generation_ | 1); }
+
+    bool settled(uint32_t index) const { return stamps_[index] == (generation_ | 1); }
+
+    void visit(uint32_t index, uint32_t parent, int dist) {
+        stamps_[index] = generation_;
+        parents_[index] = parent;
+        dists_[index] = dist;
+    }
+
+    // Updates a visited square with a shorter distance
+    void relax(uint32_t index, uint32_t parent, int dist) {
+        parents_[index] = parent;
+        dists_[index] = dist;
+    }
+
+    void settle(uint32_t index) { stamps_[index] = generation_ | 1; }
+
+    uint32_t parent(uint32_t index) const { return parents_[index]; }
+
+    int dist(uint32_t index) const { return dists_[index]; }
+
+    // Memory used by the dense arrays and the scratch containers
+    size_t bytes() const {
+        return stamps_.capacity() * sizeof(uint32_t) +
+               parents_.capacity() * sizeof(uint32_t) +
+               dists_.capacity() * sizeof(int) +
+               queue.capacity() * sizeof(uint32_t) +
+               heap.capacity() * sizeof(std::pair<uint32_t, int>) +
+               bitplanes.capacity() * sizeof(uint64_t) +
+               buckets_bytes();
+    }
+
+    // Follows parent pointers back from finish, and returns the full
+    // path from begin to finish (both included), like the level templates.
+    template<typename BOARD>
+    typename BOARD::PosVec extract_path(const BOARD &board, uint32_t begin, uint32_t finish) const {
+        if (!visited(finish)) {
+            throw std::out_of_range("Finish position was not reached by the search");
+        }
+
+        typename BOARD::PosVec path;
+        auto tmp = finish;
+        while (tmp != begin) {
+            path.push_back(board.pos_at(tmp));
+            tmp = parents_[tmp];
+        }
+        path.push_back(board.pos_at(begin));
+        std::reverse(path.begin(), path.end());
+
+        return path;
+    }
+
+    // Scratch containers for the search functions. Keeping them here means
+    // their capacity survives across queries.
+    std::vector<uint32_t> queue;
+    std::vector<std::pair<uint32_t, int>> heap;
+    std::vector<std::vector<uint32_t>> buckets;
+    std::vector<uint64_t> bitplanes;
+
+private:
+    size_t buckets_bytes() const {
+        size_t bytes = buckets.capacity() * sizeof(std::vector<uint32_t>);
+        for (const auto &bucket : buckets) {
+            bytes += bucket.capacity() * sizeof(uint32_t);
+        }
+        return bytes;
+    }
+
+    uint32_t generation_;
+    std::vector<uint32_t> stamps_;
+    std::vector<uint32_t> parents_;
+    std::vector<int> dists_;
+};
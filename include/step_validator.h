@@ -0,0 +1,256 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "terrain_layers.h"
+
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/*
+ * Constant time step checks, for validating lots of submitted paths against
+ * the same map.
+ *
+ * is_valid_step works out the move shape, checks the landing square and
+ * scans the long leg of the L for barriers on every call. Here, all of that
+ * is done once per square: each square gets a mask with one bit per
+ * direction in KNIGHT_MOVES, set if that move is valid (the same
+ * per-direction masks as KnightBitboard, stored the other way around), and
+ * a bit flagging teleport squares. Checking a step is then bounds checks, a
+ * lookup of the direction from (dx, dy) and a bit test.
+ *
+ * Steps follow is_valid_step, plus one more rule for teleports: the searches
+ * return paths that go from a portal straight to a move of its partner
+ * (the move out of the portal is made from the partner, see
+ * adjacent_positions), so that's accepted too. Paths returned by the
+ * searches are then always valid.
+ *
+ * first_invalid_steps() checks whole batches of sequences, 8 steps at a
+ * time with AVX2 gathers when available (see KNIGHTBOARD_NATIVE).
+ *
+ * Portals are still looked up on the board, so the validator doesn't
+ * outlive it. Use is_current() to check it hasn't been changed since.
+ */
+template<typename BOARD>
+class StepValidator {
+public:
+    using Pos = typename BOARD::Pos;
+    using PosVec = typename BOARD::PosVec;
+
+    // Returned by first_invalid_step() when every step is valid
+    static constexpr int ALL_STEPS_VALID = -1;
+
+    explicit StepValidator(const BOARD &board) : board_(board),
+                                                 rows_(board.rows()),
+                                                 cols_(board.cols()),
+                                                 version_(board.version()),
+                                                 // Padded, so that 32-bit gathers can read past the last square
+                                                 masks_(board.num_squares() + 1, 0) {
+        // Valid moves a row at a time, then spread out to the squares
+        const TerrainLayers<BOARD> layers(board);
+        std::vector<uint64_t> row(layers.words_per_row());
+        for (int r = 0; r < rows_; r++) {
+            for (int d = 0; d < 8; d++) {
+                layers.valid_moves_row(d, r, row.data());
+                for (size_t w = 0; w < row.size(); w++) {
+                    for (auto bits = row[w]; bits; bits &= bits - 1) {
+                        masks_[index(r, static_cast<int>(w * 64) + __builtin_ctzll(bits))] |= 1 << d;
+                    }
+                }
+            }
+            for (int c = 0; c < cols_; c++) {
+                if (board.square(Pos(r, c)) == BoardSquare::Teleport) {
+                    masks_[index(r, c)] |= TELEPORT_BIT;
+                }
+            }
+        }
+    }
+
+    bool is_current() const {
+        return board_.rows() == rows_ && board_.cols() == cols_ && board_.version() == version_;
+    }
+
+    // board.is_valid_step(begin, end), or a move out of the partner portal
+    bool is_valid_step(const Pos &begin, const Pos &end) const {
+        if (!in_bounds(begin.x, begin.y) || !in_bounds(end.x, end.y)) {
+            return false;
+        }
+        auto begin_mask = masks_[index(begin.x, begin.y)];
+        auto end_mask = masks_[index(end.x, end.y)];
+        if ((begin_mask & direction_bit(end.x - begin.x, end.y - begin.y)) |
+            (begin_mask & end_mask & TELEPORT_BIT)) {
+            return true;
+        }
+
+        if ((begin_mask & TELEPORT_BIT) && board_.teleports) {
+            const auto &portals = *board_.teleports;
+            const auto &partner = (begin == portals.first) ? portals.second : portals.first;
+            return (masks_[index(partner.x, partner.y)] & direction_bit(end.x - partner.x, end.y - partner.y)) != 0;
+        }
+        return false;
+    }
+
+    /*
+     * Index i of the first invalid step (from steps[i] to steps[i + 1]), or
+     * ALL_STEPS_VALID. Like is_valid_step_sequence, a sequence with fewer
+     * than two positions isn't valid: that's reported as step 0.
+     */
+    int first_invalid_step(const PosVec &steps) const {
+        if (steps.size() < 2) {
+            return 0;
+        }
+        for (size_t i = 0; i + 1 < steps.size(); i++) {
+            if (!is_valid_step(steps[i], steps[i + 1])) {
+                return static_cast<int>(i);
+            }
+        }
+        return ALL_STEPS_VALID;
+    }
+
+    // first_invalid_step() of every sequence, in order
+    std::vector<int> first_invalid_steps(const std::vector<PosVec> &sequences) const {
+        std::vector<int> result;
+        result.reserve(sequences.size());
+
+        // Coordinates are split into separate arrays, so that 8 steps can be
+        // loaded at once
+        std::vector<int> xs;
+        std::vector<int> ys;
+        for (const auto &steps : sequences) {
+            if (steps.size() < 2) {
+                result.push_back(0);
+                continue;
+            }
+            xs.resize(steps.size());
+            ys.resize(steps.size());
+            for (size_t i = 0; i < steps.size(); i++) {
+                xs[i] = steps[i].x;
+                ys[i] = steps[i].y;
+            }
+            result.push_back(first_invalid(xs.data(), ys.data(), steps.size() - 1));
+        }
+
+        return result;
+    }
+
+private:
+    static constexpr uint16_t TELEPORT_BIT = 1 << 8;
+
+    // Bit of KNIGHT_MOVES for each (dx + 2) * 5 + (dy + 2), 0 for anything
+    // that isn't a knight move
+    static const std::array<uint32_t, 25> &direction_table() {
+        static const auto table = [] {
+            std::array<uint32_t, 25> t{};
+            for (int d = 0; d < 8; d++) {
+                t[(KNIGHT_MOVES[d][0] + 2) * 5 + KNIGHT_MOVES[d][1] + 2] = 1u << d;
+            }
+            return t;
+        }();
+        return table;
+    }
+
+    static uint32_t direction_bit(int dx, int dy) {
+        if (dx < -2 || dx > 2 || dy < -2 || dy > 2) {
+            return 0;
+        }
+        return direction_table()[(dx + 2) * 5 + dy + 2];
+    }
+
+    bool in_bounds(int x, int y) const {
+        // Negative values wrap around to huge unsigned ones
+        return static_cast<unsigned>(x) < static_cast<unsigned>(rows_) &&
+               static_cast<unsigned>(y) < static_cast<unsigned>(cols_);
+    }
+
+    uint32_t index(int x, int y) const {
+        return static_cast<uint32_t>(x) * static_cast<uint32_t>(cols_) + static_cast<uint32_t>(y);
+    }
+
+    // First invalid step among the num_steps steps of xs/ys
+    int first_invalid(const int *xs, const int *ys, size_t num_steps) const {
+        size_t i = 0;
+#ifdef __AVX2__
+        const __m256i rows = _mm256_set1_epi32(rows_);
+        const __m256i cols = _mm256_set1_epi32(cols_);
+        const __m256i minus_one = _mm256_set1_epi32(-1);
+        const __m256i two = _mm256_set1_epi32(2);
+        const __m256i five = _mm256_set1_epi32(5);
+        const __m256i low_mask = _mm256_set1_epi32(0xffff);
+        const __m256i teleport = _mm256_set1_epi32(TELEPORT_BIT);
+        const __m256i zero = _mm256_setzero_si256();
+        const auto masks = reinterpret_cast<const int *>(masks_.data());
+
+        auto in_bounds_lanes = [&](__m256i x, __m256i y) {
+            return _mm256_and_si256(_mm256_and_si256(_mm256_cmpgt_epi32(x, minus_one), _mm256_cmpgt_epi32(rows, x)),
+                                    _mm256_and_si256(_mm256_cmpgt_epi32(y, minus_one), _mm256_cmpgt_epi32(cols, y)));
+        };
+
+        for (; i + 8 <= num_steps; i += 8) {
+            auto bx = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(xs + i));
+            auto by = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ys + i));
+            auto ex = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(xs + i + 1));
+            auto ey = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ys + i + 1));
+
+            auto inside = _mm256_and_si256(in_bounds_lanes(bx, by), in_bounds_lanes(ex, ey));
+
+            // Square masks, reading square 0 for lanes off the board
+            auto begin_index = _mm256_and_si256(_mm256_add_epi32(_mm256_mullo_epi32(bx, cols), by), inside);
+            auto end_index = _mm256_and_si256(_mm256_add_epi32(_mm256_mullo_epi32(ex, cols), ey), inside);
+            // The masks are 16 bits wide, gathered as 32 bits at 2 byte steps
+            auto begin_mask = _mm256_and_si256(_mm256_i32gather_epi32(masks, begin_index, 2), low_mask);
+            auto end_mask = _mm256_and_si256(_mm256_i32gather_epi32(masks, end_index, 2), low_mask);
+
+            // Direction bit, through the table for deltas within 2 squares
+            auto dx = _mm256_add_epi32(_mm256_sub_epi32(ex, bx), two);
+            auto dy = _mm256_add_epi32(_mm256_sub_epi32(ey, by), two);
+            auto near = _mm256_and_si256(
+                    _mm256_and_si256(_mm256_cmpgt_epi32(dx, minus_one), _mm256_cmpgt_epi32(five, dx)),
+                    _mm256_and_si256(_mm256_cmpgt_epi32(dy, minus_one), _mm256_cmpgt_epi32(five, dy)));
+            auto code = _mm256_and_si256(_mm256_add_epi32(_mm256_mullo_epi32(dx, five), dy), near);
+            auto direction = _mm256_and_si256(
+                    _mm256_i32gather_epi32(reinterpret_cast<const int *>(direction_table().data()), code, 4), near);
+
+            auto allowed = _mm256_or_si256(_mm256_and_si256(begin_mask, direction),
+                                           _mm256_and_si256(_mm256_and_si256(begin_mask, end_mask), teleport));
+            auto valid = _mm256_andnot_si256(_mm256_cmpeq_epi32(allowed, zero), inside);
+
+            // Moves out of a portal are rare, those lanes are checked again
+            // one by one for the teleport rule
+            auto invalid_lanes = ~_mm256_movemask_ps(_mm256_castsi256_ps(valid)) & 0xff;
+            while (invalid_lanes) {
+                auto step = i + __builtin_ctz(invalid_lanes);
+                if (!is_valid_step(Pos(xs[step], ys[step]), Pos(xs[step + 1], ys[step + 1]))) {
+                    return static_cast<int>(step);
+                }
+                invalid_lanes &= invalid_lanes - 1;
+            }
+        }
+#endif
+        for (; i < num_steps; i++) {
+            if (!is_valid_step(Pos(xs[i], ys[i]), Pos(xs[i + 1], ys[i + 1]))) {
+                return static_cast<int>(i);
+            }
+        }
+        return ALL_STEPS_VALID;
+    }
+
+    const BOARD &board_;
+    int rows_;
+    int cols_;
+    uint64_t version_;
+    // Bit d set if move KNIGHT_MOVES[d] is valid from the square, plus
+    // TELEPORT_BIT
+    std::vector<uint16_t> masks_;
+};
+
+template<typename BOARD>
+constexpr int StepValidator<BOARD>::ALL_STEPS_VALID;
+
+template<typename BOARD>
+constexpr uint16_t StepValidator<BOARD>::TELEPORT_BIT;
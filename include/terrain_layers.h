@@ -0,0 +1,203 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+
+#include <vector>
+
+/*
+ * The terrain of a board, split into struct-of-arrays layers that bulk
+ * kernels can stream through a row at a time:
+ *
+ *   cost      uint8_t per square: move_weight() of landing there, 0 for
+ *             Rock and Barrier, which can't be landed on
+ *   portal    uint8_t per square: 1 or 2 for the first and second teleport
+ *             portal, 0 elsewhere
+ *   passable  one bit per square, set where cost is non-zero
+ *   barrier   one bit per square, set on Barrier squares
+ *
+ * Byte planes have rows padded to cost_stride() bytes (a multiple of 32, so
+ * that a row is a whole number of AVX2 registers), bit-planes to
+ * words_per_row() 64-bit words, like KnightBitboard. Padding is always zero,
+ * so squares off the right edge read as impassable and barrier-free.
+ *
+ * valid_moves_row() puts the layers to use: it works out the squares of a
+ * row from which a knight move is valid, 64 at a time, with the same rules
+ * as is_valid_step. KnightBitboard and StepValidator build their masks with
+ * it.
+ *
+ * update() catches up with a DynamicBoard through its change log, other
+ * boards are re-read with rebuild().
+ */
+template<typename BOARD>
+class TerrainLayers {
+public:
+    using Pos = typename BOARD::Pos;
+
+    explicit TerrainLayers(const BOARD &board) : board_(board) {
+        rebuild();
+    }
+
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    size_t cost_stride() const { return cost_stride_; }
+    size_t words_per_row() const { return words_per_row_; }
+
+    const uint8_t *cost_row(int r) const { return cost_.data() + r * cost_stride_; }
+    const uint8_t *portal_row(int r) const { return portal_.data() + r * cost_stride_; }
+    const uint64_t *passable_row(int r) const { return passable_.data() + r * words_per_row_; }
+    const uint64_t *barrier_row(int r) const { return barrier_.data() + r * words_per_row_; }
+
+    uint8_t cost(const Pos &pos) const { return cost_row(pos.x)[pos.y]; }
+    uint8_t portal(const Pos &pos) const { return portal_row(pos.x)[pos.y]; }
+    bool passable(const Pos &pos) const { return (passable_row(pos.x)[pos.y / 64] >> (pos.y % 64)) & 1; }
+    bool barrier(const Pos &pos) const { return (barrier_row(pos.x)[pos.y / 64] >> (pos.y % 64)) & 1; }
+
+    bool is_current() const {
+        return board_.rows() == rows_ && board_.cols() == cols_ && board_.version() == version_;
+    }
+
+    // Bytes of all four layers
+    size_t bytes() const {
+        return (cost_.size() + portal_.size()) * sizeof(uint8_t) +
+               (passable_.size() + barrier_.size()) * sizeof(uint64_t);
+    }
+
+    // Reads the whole board again
+    void rebuild() {
+        rows_ = board_.rows();
+        cols_ = board_.cols();
+        version_ = board_.version();
+        teleports_ = board_.teleports;
+        cost_stride_ = (static_cast<size_t>(cols_) + 31) / 32 * 32;
+        words_per_row_ = (static_cast<size_t>(cols_) + 63) / 64;
+
+        cost_.assign(rows_ * cost_stride_, 0);
+        portal_.assign(rows_ * cost_stride_, 0);
+        passable_.assign(rows_ * words_per_row_, 0);
+        barrier_.assign(rows_ * words_per_row_, 0);
+
+        for (int r = 0; r < rows_; r++) {
+            for (int c = 0; c < cols_; c++) {
+                set(Pos(r, c));
+            }
+        }
+    }
+
+    /*
+     * Catches up with the squares changed since the last build or update,
+     * through the board's change log (see DynamicBoard::changed_squares).
+     * Rebuilds everything if the log doesn't go back that far, or if the
+     * portals moved. Returns the number of squares re-read.
+     */
+    size_t update() {
+        if (board_.version() == version_) {
+            return 0;
+        }
+
+        std::vector<uint32_t> changed;
+        if (board_.rows() != rows_ || board_.cols() != cols_ || board_.teleports != teleports_ ||
+            !board_.changed_squares(version_, changed)) {
+            rebuild();
+            return board_.num_squares();
+        }
+        for (auto v : changed) {
+            set(board_.pos_at(v));
+        }
+        version_ = board_.version();
+        return changed.size();
+    }
+
+    /*
+     * Writes words_per_row() words to out, with bit c of the row set if
+     * the knight move KNIGHT_MOVES[d] from square (r, c) is valid, as in
+     * is_valid_step: the target is on the board and passable, and none of
+     * the three squares on the long leg of the L is a barrier, or the move
+     * goes from a portal to the other one.
+     */
+    void valid_moves_row(int d, int r, uint64_t *out) const {
+        const int dx = KNIGHT_MOVES[d][0];
+        const int dy = KNIGHT_MOVES[d][1];
+        const int to_r = r + dx;
+        if (to_r < 0 || to_r >= rows_) {
+            std::fill(out, out + words_per_row_, 0);
+            return;
+        }
+
+        const bool along_x = dx == 2 || dx == -2;
+        const uint64_t *target = passable_row(to_r);
+        const uint64_t *begin = barrier_row(r);
+        // The other two squares of the long leg, as (row, column offset)
+        const uint64_t *mid = along_x ? barrier_row(r + dx / 2) : barrier_row(r);
+        const uint64_t *corner = along_x ? barrier_row(to_r) : barrier_row(r);
+        const int mid_dy = along_x ? 0 : dy / 2;
+        const int corner_dy = along_x ? 0 : dy;
+
+        for (size_t w = 0; w < words_per_row_; w++) {
+            out[w] = shifted_word(target, w, dy) &
+                     ~(begin[w] | shifted_word(mid, w, mid_dy) | shifted_word(corner, w, corner_dy));
+        }
+        // Padding squares can only have picked up bits from the row itself
+        if (cols_ % 64) {
+            out[words_per_row_ - 1] &= (uint64_t(1) << (cols_ % 64)) - 1;
+        }
+
+        // Portal to portal is always valid, barriers or not
+        if (teleports_) {
+            const auto &first = teleports_->first;
+            const auto &second = teleports_->second;
+            if (first.x == r && second.x == to_r && second.y == first.y + dy) {
+                out[first.y / 64] |= uint64_t(1) << (first.y % 64);
+            }
+            if (second.x == r && first.x == to_r && first.y == second.y + dy) {
+                out[second.y / 64] |= uint64_t(1) << (second.y % 64);
+            }
+        }
+    }
+
+private:
+    void set(const Pos &pos) {
+        const auto sq = board_.square(pos);
+        const bool can_land = sq != BoardSquare::Rock && sq != BoardSquare::Barrier;
+        const auto bit = uint64_t(1) << (pos.y % 64);
+        const auto word = pos.x * words_per_row_ + pos.y / 64;
+
+        cost_[pos.x * cost_stride_ + pos.y] = can_land ? static_cast<uint8_t>(move_weight(sq)) : 0;
+        passable_[word] = can_land ? passable_[word] | bit : passable_[word] & ~bit;
+        barrier_[word] = sq == BoardSquare::Barrier ? barrier_[word] | bit : barrier_[word] & ~bit;
+
+        uint8_t portal = 0;
+        if (sq == BoardSquare::Teleport && teleports_) {
+            portal = pos == teleports_->first ? 1 : pos == teleports_->second ? 2 : 0;
+        }
+        portal_[pos.x * cost_stride_ + pos.y] = portal;
+    }
+
+    // Bits c + k of a row, for the 64 columns c of word w (zero off the row)
+    uint64_t shifted_word(const uint64_t *row, size_t w, int k) const {
+        if (k > 0) {
+            const uint64_t next = w + 1 < words_per_row_ ? row[w + 1] : 0;
+            return (row[w] >> k) | (next << (64 - k));
+        }
+        if (k < 0) {
+            const uint64_t prev = w > 0 ? row[w - 1] : 0;
+            return (row[w] << -k) | (prev >> (64 + k));
+        }
+        return row[w];
+    }
+
+    const BOARD &board_;
+    int rows_;
+    int cols_;
+    uint64_t version_;
+    std::experimental::optional<std::pair<Pos, Pos>> teleports_;
+    size_t cost_stride_;
+    size_t words_per_row_;
+    std::vector<uint8_t> cost_;
+    std::vector<uint8_t> portal_;
+    std::vector<uint64_t> passable_;
+    std::vector<uint64_t> barrier_;
+};
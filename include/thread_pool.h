@@ -0,0 +1,194 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A small work-stealing thread pool.
+ *
+ * Each worker has its own task deque: it pops from the front of its own,
+ * and when that's empty, steals from the back of the others. Tasks receive
+ * the index of the worker running them, so that callers can keep per-worker
+ * state (e.g. one SearchWorkspace per worker) without any locking.
+ *
+ * Deques are protected by a plain mutex each. Tasks here are whole graph
+ * searches, so contention on the deques is negligible.
+ */
+class ThreadPool {
+public:
+    using Task = std::function<void(size_t worker)>;
+
+    explicit ThreadPool(size_t num_threads = std::max(1u, std::thread::hardware_concurrency()))
+            : queues_(std::max<size_t>(1, num_threads)),
+              queued_(0),
+              pending_(0),
+              next_queue_(0),
+              stopping_(false) {
+        for (size_t i = 0; i < queues_.size(); i++) {
+            queues_[i].reset(new WorkerQueue());
+        }
+        for (size_t i = 0; i < queues_.size(); i++) {
+            threads_.emplace_back([this, i] { worker_loop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto &thread : threads_) {
+            thread.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t size() const { return threads_.size(); }
+
+    // Queues a task, spreading tasks round-robin across the workers
+    void submit(Task task) {
+        // Count the task first, so that the counters never go below the
+        // number of tasks actually in the deques
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            queued_++;
+            pending_++;
+        }
+        auto queue = next_queue_.fetch_add(1) % queues_.size();
+        {
+            std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+            queues_[queue]->tasks.push_back(std::move(task));
+        }
+        wake_.notify_one();
+    }
+
+    // Blocks until all submitted tasks have completed
+    void wait_idle() {
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        idle_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+    /*
+     * Runs f(i, worker) for each i in [0, n) and waits for all of them.
+     * Indices are handed out dynamically, so uneven tasks balance out.
+     * The first exception thrown by f is rethrown here, once all workers
+     * are done. Must not be called from inside a task.
+     */
+    template<typename F>
+    void parallel_for(size_t n, F f) {
+        std::atomic<size_t> next(0);
+        std::mutex error_mutex;
+        std::exception_ptr error;
+
+        auto num_tasks = std::min(n, size());
+        for (size_t t = 0; t < num_tasks; t++) {
+            submit([&](size_t worker) {
+                for (size_t i = next.fetch_add(1); i < n; i = next.fetch_add(1)) {
+                    try {
+                        f(i, worker);
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(error_mutex);
+                        if (!error) {
+                            error = std::current_exception();
+                        }
+                        // Skip whatever is left
+                        next = n;
+                    }
+                }
+            });
+        }
+        wait_idle();
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool try_pop(size_t worker, Task &task) {
+        // Own queue first, from the front...
+        {
+            auto &own = *queues_[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.front());
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        // ...then steal from the back of the others
+        for (size_t i = 1; i < queues_.size(); i++) {
+            auto &other = *queues_[(worker + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(other.mutex);
+            if (!other.tasks.empty()) {
+                task = std::move(other.tasks.back());
+                other.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker_loop(size_t worker) {
+        while (true) {
+            Task task;
+            if (try_pop(worker, task)) {
+                {
+                    std::lock_guard<std::mutex> lock(wake_mutex_);
+                    queued_--;
+                }
+
+                task(worker);
+
+                std::lock_guard<std::mutex> lock(wake_mutex_);
+                if (--pending_ == 0) {
+                    idle_.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            // If queued_ is positive, a task is in a deque or about to be:
+            // just retry.
+            wake_.wait(lock, [this] { return stopping_ || queued_ > 0; });
+            if (stopping_ && queued_ == 0) {
+                return;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues_;
+    std::vector<std::thread> threads_;
+
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    // Tasks waiting in the deques
+    size_t queued_;
+    // Tasks submitted and not completed yet
+    size_t pending_;
+
+    std::atomic<size_t> next_queue_;
+    bool stopping_;
+};
@@ -0,0 +1,447 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#pragma once
+
+#include "knightboard.h"
+#include "board_rules.h"
+#include "dynamic_board.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Sparse board storage for huge, mostly empty maps.
+ *
+ * The board is cut into square tiles of 2^tile_shift squares per side, and
+ * each tile holds its squares row-major at 4 bits each. Tiles made of a
+ * single kind of square (all Clear, most of the time) aren't stored at all:
+ * they point to one shared uniform tile per square kind. A 95% clear map
+ * then only pays for the tiles that actually have something in them.
+ *
+ * Tiled files have the same layout, so TiledBoard::map_file() uses them in
+ * place like MappedBoard: opening one only reads the header and the tile
+ * directory, and the tiles themselves are paged in by the OS when a search
+ * first touches them.
+ *
+ *   TiledBoardHeader
+ *   uint32_t portals[num_portals]    square indices of the teleport portals
+ *   uint32_t directory[num_tiles]    UNIFORM_TILE | square, or stored tile index
+ *   uint8_t tiles[num_stored][bytes] 4-bit packed tiles, padded with Clear
+ *
+ * Everything is in native byte order.
+ */
+
+struct TiledBoardHeader {
+    char magic[4];
+    uint32_t format_version;
+    int32_t rows;
+    int32_t cols;
+    uint32_t tile_shift;
+    uint32_t num_portals;
+    uint32_t num_stored_tiles;
+    uint32_t reserved;
+};
+
+constexpr char TILED_BOARD_MAGIC[4] = {'K', 'B', 'T', 'L'};
+constexpr uint32_t TILED_BOARD_FORMAT_VERSION = 1;
+
+// Directory entries with this bit set are uniform tiles of the square kind in the low bits
+constexpr uint32_t UNIFORM_TILE = 1u << 31;
+
+// 8x8 to 256x256 squares per tile
+constexpr unsigned MIN_TILE_SHIFT = 3;
+constexpr unsigned MAX_TILE_SHIFT = 8;
+constexpr unsigned DEFAULT_TILE_SHIFT = 5;
+
+namespace tiled_detail {
+
+inline void check_tile_shift(unsigned tile_shift) {
+    if (tile_shift < MIN_TILE_SHIFT || tile_shift > MAX_TILE_SHIFT) {
+        throw std::invalid_argument("Tiles must be 8 to 256 squares wide");
+    }
+}
+
+inline void check_dimensions(int rows, int cols) {
+    if (rows < 0 || cols < 0 ||
+        static_cast<uint64_t>(rows) * static_cast<uint64_t>(cols) > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("Board dimensions don't fit a 32-bit square index");
+    }
+}
+
+inline uint32_t tiles_along(int squares, unsigned tile_shift) {
+    return (static_cast<uint32_t>(squares) + (1u << tile_shift) - 1) >> tile_shift;
+}
+
+/*
+ * Calls f(tile_row, tile_col, uniform, first, packed) for every tile of
+ * board, row-major, with packed holding the tile squares (Clear past the
+ * board edges). uniform tells whether all the squares within the board are
+ * the same as the first one.
+ */
+template<typename BOARD, typename F>
+void for_each_tile(const BOARD &board, unsigned tile_shift, F f) {
+    const uint32_t side = 1u << tile_shift;
+    std::vector<uint8_t> packed(side * side / 2);
+
+    for (uint32_t tr = 0; tr < tiles_along(board.rows(), tile_shift); tr++) {
+        for (uint32_t tc = 0; tc < tiles_along(board.cols(), tile_shift); tc++) {
+            std::fill(packed.begin(), packed.end(), 0);
+            // Only squares within the board count towards uniformity
+            const auto first = board.square({static_cast<int>(tr << tile_shift), static_cast<int>(tc << tile_shift)});
+            bool uniform = true;
+            for (uint32_t i = 0; i < side; i++) {
+                const auto x = static_cast<int>((tr << tile_shift) + i);
+                if (x >= board.rows()) {
+                    break;
+                }
+                for (uint32_t j = 0; j < side; j++) {
+                    const auto y = static_cast<int>((tc << tile_shift) + j);
+                    if (y >= board.cols()) {
+                        break;
+                    }
+                    const auto sq = board.square({x, y});
+                    uniform = uniform && sq == first;
+                    const auto k = (i << tile_shift) | j;
+                    packed[k / 2] |= static_cast<uint8_t>(sq) << (4 * (k % 2));
+                }
+            }
+            f(tr, tc, uniform, first, packed);
+        }
+    }
+}
+
+}
+
+template<typename BOARD>
+void save_tiled_board(const BOARD &board, std::ostream &out, const unsigned tile_shift = DEFAULT_TILE_SHIFT) {
+    /* Two passes over the board, one for the directory and one for the
+     * stored tiles, so that only a single tile is ever in memory. Worth it
+     * for BoardGenerator, whose squares are cheap to recompute. */
+    tiled_detail::check_tile_shift(tile_shift);
+
+    std::vector<uint32_t> directory;
+    directory.reserve(static_cast<size_t>(tiled_detail::tiles_along(board.rows(), tile_shift)) *
+                      tiled_detail::tiles_along(board.cols(), tile_shift));
+    uint32_t num_stored = 0;
+    tiled_detail::for_each_tile(board, tile_shift, [&](uint32_t, uint32_t, bool uniform, BoardSquare first,
+                                                       const std::vector<uint8_t> &) {
+        directory.push_back(uniform ? UNIFORM_TILE | static_cast<uint32_t>(first) : num_stored++);
+    });
+
+    TiledBoardHeader header{};
+    std::copy(TILED_BOARD_MAGIC, TILED_BOARD_MAGIC + 4, header.magic);
+    header.format_version = TILED_BOARD_FORMAT_VERSION;
+    header.rows = board.rows();
+    header.cols = board.cols();
+    header.tile_shift = tile_shift;
+    header.num_portals = board.teleports ? 2 : 0;
+    header.num_stored_tiles = num_stored;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    if (board.teleports) {
+        uint32_t portals[2] = {board.index_of(board.teleports->first), board.index_of(board.teleports->second)};
+        out.write(reinterpret_cast<const char *>(portals), sizeof(portals));
+    }
+    out.write(reinterpret_cast<const char *>(directory.data()), directory.size() * sizeof(uint32_t));
+
+    tiled_detail::for_each_tile(board, tile_shift, [&](uint32_t, uint32_t, bool uniform, BoardSquare,
+                                                       const std::vector<uint8_t> &packed) {
+        if (!uniform) {
+            out.write(reinterpret_cast<const char *>(packed.data()), packed.size());
+        }
+    });
+
+    if (!out) {
+        throw std::runtime_error("Failed writing tiled board");
+    }
+}
+
+/*
+ * Board made of 4-bit packed tiles, with the read-only interface of
+ * DynamicBoard (and the same Pos type), so all the level templates work
+ * with it, plus set_square() and set_teleports(). There's no change log,
+ * so it can't be followed incrementally like a DynamicBoard.
+ *
+ * set_square() copies a tile before the first write to it, whether it was a
+ * uniform tile, a tile of a mapped file or one shared with a copy of the
+ * board, so copies are cheap and mapped files are never written to. compact()
+ * gives back the tiles that became uniform again.
+ */
+class TiledBoard {
+public:
+    using Pos = DynamicBoard::Pos;
+    using PosHasher = DynamicBoard::PosHasher;
+    using PosVec = DynamicBoard::PosVec;
+    using GraphEdge = DynamicBoard::GraphEdge;
+    using GraphEdgeVec = DynamicBoard::GraphEdgeVec;
+
+    TiledBoard() : TiledBoard(0, 0) {}
+
+    // All-Clear board, which costs no tile storage at all
+    TiledBoard(int rows, int cols, unsigned tile_shift = DEFAULT_TILE_SHIFT) : version_(0) {
+        tiled_detail::check_tile_shift(tile_shift);
+        tiled_detail::check_dimensions(rows, cols);
+        rows_ = rows;
+        cols_ = cols;
+        tile_shift_ = tile_shift;
+        tile_mask_ = (1u << tile_shift) - 1;
+        tile_cols_ = tiled_detail::tiles_along(cols, tile_shift);
+        make_uniform_tiles();
+        tiles_.assign(static_cast<size_t>(tiled_detail::tiles_along(rows, tile_shift)) * tile_cols_,
+                      uniform_tile(BoardSquare::Clear));
+        owned_.resize(tiles_.size());
+    }
+
+    // Copies any board, one tile at a time
+    template<typename BOARD>
+    static TiledBoard from_board(const BOARD &board, unsigned tile_shift = DEFAULT_TILE_SHIFT) {
+        TiledBoard tiled(board.rows(), board.cols(), tile_shift);
+        tiled_detail::for_each_tile(board, tile_shift, [&](uint32_t tr, uint32_t tc, bool uniform,
+                                                           BoardSquare first, const std::vector<uint8_t> &packed) {
+            const auto t = tr * tiled.tile_cols_ + tc;
+            if (uniform) {
+                tiled.tiles_[t] = tiled.uniform_tile(first);
+            } else {
+                tiled.owned_[t] = tiled.new_tile(packed.data());
+                tiled.tiles_[t] = tiled.owned_[t].get();
+            }
+        });
+        if (board.teleports) {
+            tiled.teleports = std::make_pair(Pos(board.teleports->first.x, board.teleports->first.y),
+                                             Pos(board.teleports->second.x, board.teleports->second.y));
+        }
+        return tiled;
+    }
+
+    // Maps a tiled file read-only, reading only its header and directory
+    static TiledBoard map_file(const std::string &file_name) {
+        auto file = std::make_shared<MappedFile>(file_name);
+        if (file->size() < sizeof(TiledBoardHeader)) {
+            throw std::runtime_error("Not a tiled board file: " + file_name);
+        }
+        TiledBoardHeader header;
+        std::copy(file->data(), file->data() + sizeof(header), reinterpret_cast<char *>(&header));
+
+        if (!std::equal(TILED_BOARD_MAGIC, TILED_BOARD_MAGIC + 4, header.magic) ||
+            header.format_version != TILED_BOARD_FORMAT_VERSION ||
+            header.tile_shift < MIN_TILE_SHIFT || header.tile_shift > MAX_TILE_SHIFT ||
+            header.rows < 0 || header.cols < 0 ||
+            (header.num_portals != 0 && header.num_portals != 2)) {
+            throw std::runtime_error("Not a tiled board file: " + file_name);
+        }
+
+        TiledBoard board(header.rows, header.cols, header.tile_shift);
+        const uint64_t portal_bytes = header.num_portals * sizeof(uint32_t);
+        const uint64_t directory_bytes = board.tiles_.size() * sizeof(uint32_t);
+        const uint64_t tile_bytes = board.tile_bytes();
+        if (file->size() != sizeof(header) + portal_bytes + directory_bytes + header.num_stored_tiles * tile_bytes) {
+            throw std::runtime_error("Truncated tiled board file: " + file_name);
+        }
+
+        const char *directory = file->data() + sizeof(header) + portal_bytes;
+        const auto stored = reinterpret_cast<const uint8_t *>(directory + directory_bytes);
+        for (size_t t = 0; t < board.tiles_.size(); t++) {
+            uint32_t entry;
+            std::copy(directory + t * sizeof(entry), directory + (t + 1) * sizeof(entry),
+                      reinterpret_cast<char *>(&entry));
+            if (entry & UNIFORM_TILE) {
+                if ((entry & ~UNIFORM_TILE) > static_cast<uint32_t>(BoardSquare::Lava)) {
+                    throw std::runtime_error("Invalid tile directory in " + file_name);
+                }
+                board.tiles_[t] = board.uniform_tile(static_cast<BoardSquare>(entry & ~UNIFORM_TILE));
+            } else if (entry < header.num_stored_tiles) {
+                board.tiles_[t] = stored + entry * tile_bytes;
+            } else {
+                throw std::runtime_error("Invalid tile directory in " + file_name);
+            }
+        }
+        board.file_ = file;
+
+        if (header.num_portals) {
+            uint32_t portals[2];
+            std::copy(file->data() + sizeof(header), file->data() + sizeof(header) + sizeof(portals),
+                      reinterpret_cast<char *>(portals));
+            if (portals[0] >= board.num_squares() || portals[1] >= board.num_squares() ||
+                board.square(board.pos_at(portals[0])) != BoardSquare::Teleport ||
+                board.square(board.pos_at(portals[1])) != BoardSquare::Teleport) {
+                throw std::runtime_error("Invalid teleport portals in " + file_name);
+            }
+            board.teleports = std::make_pair(board.pos_at(portals[0]), board.pos_at(portals[1]));
+        }
+        return board;
+    }
+
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    uint32_t num_squares() const { return static_cast<uint32_t>(rows_) * static_cast<uint32_t>(cols_); }
+    unsigned tile_shift() const { return tile_shift_; }
+
+    uint32_t index_of(const Pos &pos) const { return row_major_index(*this, pos); }
+
+    Pos pos_at(uint32_t index) const { return row_major_pos(*this, index); }
+
+    BoardSquare square(const Pos &pos) const {
+        const auto x = static_cast<uint32_t>(pos.x);
+        const auto y = static_cast<uint32_t>(pos.y);
+        const uint8_t *tile = tiles_[(x >> tile_shift_) * tile_cols_ + (y >> tile_shift_)];
+        const auto k = ((x & tile_mask_) << tile_shift_) | (y & tile_mask_);
+        return static_cast<BoardSquare>((tile[k / 2] >> (4 * (k % 2))) & 0xf);
+    }
+
+    // Bumps the board version, see Board<N>::set_square. Like there,
+    // portals can only be changed through set_teleports().
+    void set_square(const Pos &pos, BoardSquare sq) {
+        if ((sq == BoardSquare::Teleport) != (square(pos) == BoardSquare::Teleport)) {
+            throw std::invalid_argument("Portals can only be changed through set_teleports()");
+        }
+        change(pos, sq);
+    }
+
+    // Moves the pair of portals, or removes it with nullopt. Squares that
+    // stop being portals become Clear.
+    void set_teleports(const std::experimental::optional<std::pair<Pos, Pos>> &portals) {
+        if (portals && portals->first == portals->second) {
+            throw std::invalid_argument("The two portals must be different squares");
+        }
+        if (teleports) {
+            change(teleports->first, BoardSquare::Clear);
+            change(teleports->second, BoardSquare::Clear);
+        }
+        if (portals) {
+            change(portals->first, BoardSquare::Teleport);
+            change(portals->second, BoardSquare::Teleport);
+        }
+        teleports = portals;
+    }
+
+    uint64_t version() const { return version_; }
+
+    // Swaps the tiles we own that became uniform for the shared ones
+    void compact() {
+        for (size_t t = 0; t < tiles_.size(); t++) {
+            if (!owned_[t]) {
+                continue;
+            }
+            const auto tr = static_cast<uint32_t>(t / tile_cols_);
+            const auto tc = static_cast<uint32_t>(t % tile_cols_);
+            const auto first = square({static_cast<int>(tr << tile_shift_), static_cast<int>(tc << tile_shift_)});
+            bool uniform = true;
+            const auto x_end = std::min<uint32_t>((tr + 1) << tile_shift_, rows_);
+            const auto y_end = std::min<uint32_t>((tc + 1) << tile_shift_, cols_);
+            for (uint32_t x = tr << tile_shift_; uniform && x < x_end; x++) {
+                for (uint32_t y = tc << tile_shift_; uniform && y < y_end; y++) {
+                    uniform = square({static_cast<int>(x), static_cast<int>(y)}) == first;
+                }
+            }
+            if (uniform) {
+                tiles_[t] = uniform_tile(first);
+                owned_[t].reset();
+            }
+        }
+    }
+
+    // Tiles actually stored, either in memory or in the mapped file
+    size_t num_stored_tiles() const {
+        return static_cast<size_t>(std::count_if(tiles_.begin(), tiles_.end(), [this](const uint8_t *tile) {
+            return tile < uniform_->data() || tile >= uniform_->data() + uniform_->size();
+        }));
+    }
+
+    // Heap memory for the directory and the tiles we own (mapped tiles aren't counted)
+    size_t bytes() const {
+        size_t owned = static_cast<size_t>(std::count_if(owned_.begin(), owned_.end(),
+                                                         [](const std::shared_ptr<uint8_t> &tile) {
+                                                             return static_cast<bool>(tile);
+                                                         }));
+        return tiles_.size() * (sizeof(tiles_[0]) + sizeof(owned_[0])) + uniform_->size() + owned * tile_bytes();
+    }
+
+    // Optional pair of teleport portals
+    std::experimental::optional<std::pair<Pos, Pos>> teleports;
+
+    bool is_within_bounds(const Pos &pos) const { return is_within_board(*this, pos); }
+
+    GraphEdgeVec adjacent_positions(const Pos &origin, const bool is_teleport_dest = false) const {
+        return knight_adjacent_positions(*this, origin, is_teleport_dest);
+    }
+
+    bool is_valid_step(const Pos &begin, const Pos &end) const {
+        return is_valid_knight_step(*this, begin, end);
+    }
+
+    std::ostream &print(std::ostream &out,
+                        std::experimental::optional<Pos> knight_pos = std::experimental::nullopt) const {
+        return print_board(*this, out, knight_pos);
+    }
+
+private:
+    void change(const Pos &pos, BoardSquare sq) {
+        version_++;
+        if (square(pos) == sq) {
+            return;
+        }
+        const auto t = tile_of(pos);
+        // Copy on first write, unless the tile is already ours alone
+        if (!owned_[t] || owned_[t].use_count() > 1) {
+            owned_[t] = new_tile(tiles_[t]);
+            tiles_[t] = owned_[t].get();
+        }
+        const auto k = ((static_cast<uint32_t>(pos.x) & tile_mask_) << tile_shift_) |
+                       (static_cast<uint32_t>(pos.y) & tile_mask_);
+        auto &byte = owned_[t].get()[k / 2];
+        byte = static_cast<uint8_t>((byte & ~(0xf << (4 * (k % 2)))) | (static_cast<uint8_t>(sq) << (4 * (k % 2))));
+    }
+
+    size_t tile_bytes() const { return (static_cast<size_t>(1) << (2 * tile_shift_)) / 2; }
+
+    size_t tile_of(const Pos &pos) const {
+        return (static_cast<uint32_t>(pos.x) >> tile_shift_) * tile_cols_ + (static_cast<uint32_t>(pos.y) >> tile_shift_);
+    }
+
+    const uint8_t *uniform_tile(BoardSquare sq) const {
+        return uniform_->data() + static_cast<size_t>(sq) * tile_bytes();
+    }
+
+    void make_uniform_tiles() {
+        /* One tile per square kind, each byte holding two copies of it */
+        const auto kinds = static_cast<size_t>(BoardSquare::Lava) + 1;
+        auto uniform = std::make_shared<std::vector<uint8_t>>(kinds * tile_bytes());
+        for (size_t sq = 0; sq < kinds; sq++) {
+            std::fill(uniform->begin() + sq * tile_bytes(), uniform->begin() + (sq + 1) * tile_bytes(),
+                      static_cast<uint8_t>(sq | (sq << 4)));
+        }
+        uniform_ = uniform;
+    }
+
+    std::shared_ptr<uint8_t> new_tile(const uint8_t *contents) const {
+        std::shared_ptr<uint8_t> tile(new uint8_t[tile_bytes()], std::default_delete<uint8_t[]>());
+        std::copy(contents, contents + tile_bytes(), tile.get());
+        return tile;
+    }
+
+    int rows_;
+    int cols_;
+    unsigned tile_shift_;
+    uint32_t tile_mask_;
+    uint32_t tile_cols_;
+    uint64_t version_;
+    // Where the squares of each tile are, row-major: a uniform tile, one of
+    // owned_ or a tile in the mapped file
+    std::vector<const uint8_t *> tiles_;
+    // Tiles copied on write, shared between copies of the board
+    std::vector<std::shared_ptr<uint8_t>> owned_;
+    std::shared_ptr<const std::vector<uint8_t>> uniform_;
+    std::shared_ptr<const MappedFile> file_;
+};
+
+inline std::ostream &operator<<(std::ostream &out, const TiledBoard &board) {
+    return board.print(out);
+}
@@ -0,0 +1,140 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#include "knightboard.h"
+#include "binary_board.h"
+#include "board_generator.h"
+#include "tiled_board.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+ * Writes a procedurally generated board, for testing at scale:
+ *
+ *   generate_board ROWS COLS [options] > board.txt
+ *
+ * Options:
+ *   --seed N                 same seed, same board (default: 1)
+ *   --rock DENSITY[:CLUSTER] fraction of rock squares, and how clustered
+ *   --lava DENSITY[:CLUSTER]   they are (0 to 1, default 0)
+ *   --water DENSITY[:CLUSTER]
+ *   --walls SPACING          barrier walls every SPACING rows/columns, on
+ *                            average (default: none)
+ *   --wall-segment N         squares of wall between gaps (default: 16)
+ *   --wall-gap N             width of the gaps (default: 2)
+ *   --teleports N            pairs of portals, 0 or 1 (default: 0)
+ *   --format FORMAT          text, binary4, binary8 or tiled (default: text)
+ *   --output FILE            write there instead of stdout
+ *
+ * The board is streamed out as it's generated, so it's never in memory.
+ */
+
+namespace {
+
+struct Options {
+    BoardGeneratorOptions board;
+    std::string format = "text";
+    std::string output;
+};
+
+void usage() {
+    std::cerr << "Usage: generate_board ROWS COLS [--seed N] [--rock D[:C]] [--lava D[:C]] [--water D[:C]] "
+              << "[--walls SPACING] [--wall-segment N] [--wall-gap N] [--teleports N] "
+              << "[--format text|binary4|binary8|tiled] [--output FILE]" << std::endl;
+}
+
+// DENSITY[:CLUSTERING]
+TerrainLayer parse_layer(const std::string &arg) {
+    TerrainLayer layer;
+    auto colon = arg.find(':');
+    layer.density = std::strtod(arg.substr(0, colon).c_str(), nullptr);
+    if (colon != std::string::npos) {
+        layer.clustering = std::strtod(arg.substr(colon + 1).c_str(), nullptr);
+    }
+    return layer;
+}
+
+bool parse_options(int argc, char **argv, Options &options) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--seed" && has_value) {
+            options.board.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--rock" && has_value) {
+            options.board.rock = parse_layer(argv[++i]);
+        } else if (arg == "--lava" && has_value) {
+            options.board.lava = parse_layer(argv[++i]);
+        } else if (arg == "--water" && has_value) {
+            options.board.water = parse_layer(argv[++i]);
+        } else if (arg == "--walls" && has_value) {
+            options.board.wall_spacing = std::atoi(argv[++i]);
+        } else if (arg == "--wall-segment" && has_value) {
+            options.board.wall_segment = std::atoi(argv[++i]);
+        } else if (arg == "--wall-gap" && has_value) {
+            options.board.wall_gap = std::atoi(argv[++i]);
+        } else if (arg == "--teleports" && has_value) {
+            options.board.teleport_pairs = std::atoi(argv[++i]);
+        } else if (arg == "--format" && has_value) {
+            options.format = argv[++i];
+        } else if (arg == "--output" && has_value) {
+            options.output = argv[++i];
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            return false;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (positional.size() != 2 ||
+        (options.format != "text" && options.format != "binary4" && options.format != "binary8" &&
+         options.format != "tiled")) {
+        return false;
+    }
+    options.board.rows = std::atoi(positional[0].c_str());
+    options.board.cols = std::atoi(positional[1].c_str());
+    return true;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+
+    try {
+        const BoardGenerator generator(options.board);
+
+        std::ofstream file;
+        if (!options.output.empty()) {
+            file.open(options.output, std::ios::binary);
+            if (!file.is_open()) {
+                std::cerr << "Failed opening " << options.output << std::endl;
+                return 1;
+            }
+        }
+        std::ostream &out = options.output.empty() ? std::cout : file;
+
+        if (options.format == "text") {
+            save_board_text(generator, out);
+        } else if (options.format == "tiled") {
+            save_tiled_board(generator, out);
+        } else {
+            save_binary_board(generator, out, options.format == "binary4" ? 4 : 8);
+        }
+        out.flush();
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
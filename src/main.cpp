@@ -39,7 +39,17 @@ int main() {
 
     is_valid_step_sequence(board32, shortest_path_lvl4(board32, {9, 30}, {26, 0}), true);
 
-    // I haven't really tested the solution for Level 5
-    // Board<5> board5;
-    // std::cout << longest_path_dp(b) << std::endl;
+    //
+    // Level 5
+    // The exact search can't finish on this board, so give it a budget
+    LongestPathOptions options;
+    options.time_budget = std::chrono::seconds(1);
+    auto longest = longest_path_exact(board32, {0, 0}, std::experimental::optional<Pos32>({31, 31}), options);
+    cout << "Longest path found: " << longest.moves() << " moves"
+         << (longest.proven_optimal ? "" : " (not proven optimal)") << endl;
+
+    // The local search does a lot better in the same time
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    auto anytime = longest_path_anytime(board32, {0, 0}, std::experimental::optional<Pos32>({31, 31}), deadline);
+    cout << "Longest path found by local search: " << anytime.moves() << " moves" << endl;
 }
\ No newline at end of file
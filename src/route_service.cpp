@@ -0,0 +1,415 @@
+// Created by Nicolo' Valigi
+// 2016-10-06
+// License: MIT
+
+#include "knightboard.h"
+#include "dynamic_board.h"
+#include "compiled_graph.h"
+#include "search_workspace.h"
+#include "search_queues.h"
+#include "level3.h"
+#include "level4.h"
+#include "bidirectional.h"
+#include "landmarks.h"
+#include "reachability.h"
+#include "search_stats.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+ * Batch route query service: loads a board once, then resolves a stream of
+ * queries on a work-stealing thread pool.
+ *
+ *   route_service BOARD_FILE [QUERY_FILE] [options]
+ *
+ * Queries are read from QUERY_FILE (or stdin), one per line:
+ *
+ *   begin_x begin_y finish_x finish_y [algorithm]
+ *
+ * where algorithm is one of bfs, dijkstra, astar (the default), bidir or alt
+ * (A* with the landmark index, see --landmarks). Each query produces one
+ * line on stdout:
+ *
+ *   query_number cost x,y x,y ...
+ *
+ * with the full path, or just the cost with --costs-only. Unreachable
+ * destinations have cost -1, malformed queries produce "error" instead.
+ * A ReachabilityIndex built at startup answers those without searching.
+ *
+ * Options:
+ *   --threads N       number of workers (default: all cores)
+ *   --ordered         write results in the order of the queries
+ *   --costs-only      don't write out the paths
+ *   --landmarks FILE  landmark index for "alt", built and saved there if
+ *                     missing or outdated
+ *   --metrics         count the work done by each search, and report it by
+ *                     algorithm (see SearchMetrics)
+ *
+ * Throughput and latency percentiles, and the metrics, are reported on
+ * stderr at exit.
+ */
+
+using Graph = CompiledGraph<DynamicBoard>;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+enum class Algorithm { Bfs, Dijkstra, AStar, Bidirectional, Landmarks, Invalid };
+
+struct Query {
+    size_t number;
+    DynPos begin;
+    DynPos finish;
+    Algorithm algorithm;
+};
+
+struct Options {
+    std::string board_file;
+    std::string query_file;
+    std::string landmarks_file;
+    size_t threads = 0;
+    bool ordered = false;
+    bool costs_only = false;
+    bool metrics = false;
+};
+
+// Per-worker state, reused across queries
+struct WorkerState {
+    SearchWorkspace forward;
+    SearchWorkspace backward;
+};
+
+// Queries are read and resolved in batches, so memory stays bounded
+constexpr size_t BATCH_SIZE = 4096;
+
+/*
+ * Latency percentiles in constant memory: a histogram with logarithmic
+ * buckets 2% apart, from 0.1 us to over a minute. Percentiles are the
+ * bucket midpoints, so within 1% of the exact ones.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram() : counts_(NUM_BUCKETS, 0), total_(0) {}
+
+    void add(double us) {
+        auto bucket = us > MIN_US ? static_cast<size_t>(std::log(us / MIN_US) / std::log(RATIO)) + 1 : 0;
+        counts_[std::min(bucket, NUM_BUCKETS - 1)]++;
+        total_++;
+    }
+
+    double percentile(double p) const {
+        if (total_ == 0) {
+            return 0.0;
+        }
+        const auto rank = static_cast<uint64_t>(p * (total_ - 1));
+        uint64_t seen = 0;
+        size_t bucket = 0;
+        for (; bucket + 1 < NUM_BUCKETS; bucket++) {
+            seen += counts_[bucket];
+            if (seen > rank) {
+                break;
+            }
+        }
+        return bucket == 0 ? MIN_US : MIN_US * std::pow(RATIO, bucket - 0.5);
+    }
+
+private:
+    static constexpr double MIN_US = 0.1;
+    static constexpr double RATIO = 1.02;
+    static constexpr size_t NUM_BUCKETS = 1024;
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_;
+};
+
+constexpr double LatencyHistogram::MIN_US;
+constexpr double LatencyHistogram::RATIO;
+constexpr size_t LatencyHistogram::NUM_BUCKETS;
+
+void usage() {
+    std::cerr << "Usage: route_service BOARD_FILE [QUERY_FILE] [--threads N] [--ordered] "
+              << "[--costs-only] [--landmarks FILE] [--metrics]" << std::endl;
+}
+
+bool parse_options(int argc, char **argv, Options &options) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            options.threads = std::strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--landmarks" && i + 1 < argc) {
+            options.landmarks_file = argv[++i];
+        } else if (arg == "--ordered") {
+            options.ordered = true;
+        } else if (arg == "--costs-only") {
+            options.costs_only = true;
+        } else if (arg == "--metrics") {
+            options.metrics = true;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            return false;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (positional.empty() || positional.size() > 2) {
+        return false;
+    }
+    options.board_file = positional[0];
+    if (positional.size() == 2) {
+        options.query_file = positional[1];
+    }
+    return true;
+}
+
+Algorithm parse_algorithm(const std::string &name) {
+    if (name.empty() || name == "astar") {
+        return Algorithm::AStar;
+    } else if (name == "bfs") {
+        return Algorithm::Bfs;
+    } else if (name == "dijkstra") {
+        return Algorithm::Dijkstra;
+    } else if (name == "bidir") {
+        return Algorithm::Bidirectional;
+    } else if (name == "alt") {
+        return Algorithm::Landmarks;
+    }
+    return Algorithm::Invalid;
+}
+
+const char *algorithm_name(Algorithm algorithm) {
+    switch (algorithm) {
+        case Algorithm::Bfs:
+            return "bfs";
+        case Algorithm::Dijkstra:
+            return "dijkstra";
+        case Algorithm::AStar:
+            return "astar";
+        case Algorithm::Bidirectional:
+            return "bidir";
+        case Algorithm::Landmarks:
+            return "alt";
+        default:
+            return "invalid";
+    }
+}
+
+Query parse_query(size_t number, const std::string &line, const DynamicBoard &board) {
+    std::istringstream iss(line);
+    Query query{number, {0, 0}, {0, 0}, Algorithm::Invalid};
+    std::string algorithm;
+    if (!(iss >> query.begin.x >> query.begin.y >> query.finish.x >> query.finish.y)) {
+        return query;
+    }
+    iss >> algorithm;
+    if (board.is_within_bounds(query.begin) && board.is_within_bounds(query.finish)) {
+        query.algorithm = parse_algorithm(algorithm);
+    }
+    return query;
+}
+
+LandmarkIndex<Graph> load_landmarks(const Graph &graph, const std::string &path) {
+    // Map the saved index if it's there and for this very map...
+    std::ifstream probe(path);
+    if (probe.good()) {
+        try {
+            auto index = LandmarkIndex<Graph>::map_file(path);
+            if (index.matches(graph)) {
+                return index;
+            }
+            std::cerr << "Landmark index " << path << " is for a different map, rebuilding" << std::endl;
+        } catch (const std::runtime_error &e) {
+            std::cerr << "Unreadable landmark index (" << e.what() << "), rebuilding" << std::endl;
+        }
+    }
+
+    // ...otherwise pay for the preprocessing once
+    auto index = LandmarkIndex<Graph>::build(graph, 16);
+    try {
+        std::ofstream out(path, std::ios::binary);
+        index.save(out);
+    } catch (const std::runtime_error &e) {
+        std::cerr << "Failed saving the landmark index to " << path << ": " << e.what() << std::endl;
+    }
+    return index;
+}
+
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        usage();
+        return 1;
+    }
+
+    DynamicBoard board;
+    board.load_from_file(options.board_file);
+    const Graph graph(board);
+    const KnightDistanceHeuristic<Graph> knight_heuristic(graph);
+
+    LandmarkIndex<Graph> landmarks;
+    if (!options.landmarks_file.empty()) {
+        landmarks = load_landmarks(graph, options.landmarks_file);
+    }
+    const LandmarkHeuristic<Graph> landmark_heuristic(graph, landmarks);
+
+    const ReachabilityIndex<DynamicBoard> reachability(board, options.threads);
+
+    ThreadPool pool(options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<WorkerState> workers(pool.size());
+
+    std::ifstream query_file;
+    if (!options.query_file.empty()) {
+        query_file.open(options.query_file);
+        if (!query_file.is_open()) {
+            std::cerr << "Failed opening " << options.query_file << std::endl;
+            return 1;
+        }
+    }
+    std::istream &in = options.query_file.empty() ? std::cin : query_file;
+
+    SearchMetrics metrics;
+
+    auto resolve = [&](const Query &query, size_t worker) -> std::string {
+        std::ostringstream out;
+        out << query.number << ' ';
+
+        if (query.algorithm == Algorithm::Invalid ||
+            (query.algorithm == Algorithm::Landmarks && landmarks.num_landmarks() == 0)) {
+            out << "error";
+            return out.str();
+        }
+
+        auto &state = workers[worker];
+        auto search = [&](auto &observer) -> DynPosVec {
+            switch (query.algorithm) {
+                case Algorithm::Bfs:
+                    return shortest_path_simple(graph, query.begin, query.finish, state.forward, observer);
+                case Algorithm::Dijkstra:
+                    return shortest_path_lvl4<BucketQueue>(graph, query.begin, query.finish, state.forward, observer);
+                case Algorithm::AStar:
+                    return shortest_path_astar<BucketQueue>(graph, query.begin, query.finish, state.forward,
+                                                            knight_heuristic, observer);
+                case Algorithm::Bidirectional:
+                    return shortest_path_bidirectional_dijkstra<BucketQueue>(graph, query.begin, query.finish,
+                                                                             state.forward, state.backward,
+                                                                             observer);
+                case Algorithm::Landmarks:
+                    return shortest_path_astar(graph, query.begin, query.finish, state.forward, landmark_heuristic,
+                                               observer);
+                default:
+                    return DynPosVec();
+            }
+        };
+
+        // Counting only costs anything with --metrics
+        DynPosVec path;
+        SearchStats stats;
+        // No search at all when there's nothing to find
+        bool reached = reachability.reachable(query.begin, query.finish);
+        if (reached) {
+            try {
+                if (options.metrics) {
+                    StatsObserver observer(stats);
+                    path = search(observer);
+                } else {
+                    NullSearchObserver observer;
+                    path = search(observer);
+                }
+            } catch (const std::out_of_range &) {
+                reached = false;
+            }
+        }
+
+        if (options.metrics) {
+            metrics.record(algorithm_name(query.algorithm), stats);
+        }
+        if (!reached) {
+            out << -1;
+            return out.str();
+        }
+
+        // BFS paths are shortest in number of moves, report that
+        out << (query.algorithm == Algorithm::Bfs ? static_cast<int>(path.size()) - 1 : path_cost(board, path));
+        if (!options.costs_only) {
+            for (const auto &pos : path) {
+                out << ' ' << pos.x << ',' << pos.y;
+            }
+        }
+        return out.str();
+    };
+
+    // Latencies of the current batch, then folded into the histogram
+    std::vector<double> latencies;
+    LatencyHistogram latency_histogram;
+    std::vector<Query> batch;
+    std::vector<std::string> results;
+    std::mutex output_mutex;
+    std::string line;
+    size_t num_queries = 0;
+
+    const auto start = Clock::now();
+
+    while (in) {
+        batch.clear();
+        while (batch.size() < BATCH_SIZE && std::getline(in, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            batch.push_back(parse_query(num_queries++, line, board));
+        }
+        if (batch.empty()) {
+            break;
+        }
+
+        results.assign(batch.size(), std::string());
+        latencies.assign(batch.size(), 0.0);
+
+        pool.parallel_for(batch.size(), [&](size_t i, size_t worker) {
+            const auto query_start = Clock::now();
+            auto result = resolve(batch[i], worker);
+            latencies[i] = std::chrono::duration<double, std::micro>(Clock::now() - query_start).count();
+
+            if (options.ordered) {
+                results[i] = std::move(result);
+            } else {
+                // Stream out as soon as it's ready
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cout << result << '\n';
+            }
+        });
+
+        if (options.ordered) {
+            for (const auto &result : results) {
+                std::cout << result << '\n';
+            }
+        }
+        for (auto latency : latencies) {
+            latency_histogram.add(latency);
+        }
+    }
+    std::cout.flush();
+
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::cerr << num_queries << " queries on " << pool.size() << " threads in " << seconds << " s ("
+              << (seconds > 0 ? num_queries / seconds : 0.0) << " queries/s), latency p50 "
+              << latency_histogram.percentile(0.5) << " us, p99 " << latency_histogram.percentile(0.99) << " us" << std::endl;
+    if (options.metrics) {
+        metrics.dump(std::cerr);
+    }
+
+    return 0;
+}
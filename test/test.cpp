@@ -3,13 +3,35 @@
 // License: MIT
 
 #include <gtest/gtest.h>
+#include <fstream>
 #include <iostream>
+#include <set>
+#include <sstream>
+#include <thread>
 
 #include "knightboard.h"
 #include "level1.h"
 #include "level2.h"
 #include "level3.h"
 #include "level4.h"
+#include "level5.h"
+#include "dynamic_board.h"
+#include "compiled_graph.h"
+#include "search_workspace.h"
+#include "bidirectional.h"
+#include "bitboard_bfs.h"
+#include "flow_field.h"
+#include "many_to_many.h"
+#include "landmarks.h"
+#include "binary_board.h"
+#include "board_generator.h"
+#include "dstar_lite.h"
+#include "step_validator.h"
+#include "hierarchical.h"
+#include "contraction_hierarchy.h"
+#include "reachability.h"
+#include "tiled_board.h"
+#include "terrain_layers.h"
 
 class Board8Test : public ::testing::Test {
 protected:
@@ -30,6 +52,10 @@ TEST_F(Board8Test, individual_steps) {
 
     EXPECT_EQ(false, board.is_valid_step(Pos8(4, 4), Pos8(5, 5)));
     EXPECT_EQ(false, board.is_valid_step(Pos8(4, 4), Pos8(3, 3)));
+
+    // Off the board, on either end
+    EXPECT_EQ(false, board.is_valid_step(Pos8(7, 7), Pos8(9, 8)));
+    EXPECT_EQ(false, board.is_valid_step(Pos8(-2, 1), Pos8(0, 0)));
 }
 
 TEST_F(Board8Test, sequence) {
@@ -47,6 +73,62 @@ TEST_F(Board8Test, adjacent_positions) {
     EXPECT_EQ(v1, board.adjacent_positions({0, 0}));
 }
 
+// Computed by the compiler
+static_assert(KnightMoveTable<8>::value.in_bounds[0] == ((1 << 5) | (1 << 7)), "moves out of a corner");
+static_assert(KnightMoveTable<8>::value.target[0][7] == 2 * 8 + 1, "target of (+2, +1)");
+static_assert(KnightMoveTable<8>::value.mid[0][7] == 1 * 8 + 0, "long leg of (+2, +1)");
+static_assert(KnightMoveTable<8>::value.corner[0][5] == 0 * 8 + 2, "long leg of (+1, +2)");
+
+template<typename BOARD>
+void expect_table_moves_match_rules(BOARD &board) {
+    // Every kind of square, with a fixed pattern, plus a pair of portals
+    for (int i = 0; i < board.size; i++) {
+        for (int j = 0; j < board.size; j++) {
+            auto sq = static_cast<BoardSquare>((i * 7 + j * 13 + (i * j) % 5) % 6);
+            board.set_square({i, j}, sq == BoardSquare::Teleport ? BoardSquare::Clear : sq);
+        }
+    }
+    board.set_teleports(std::make_pair(typename BOARD::Pos(1, 2), typename BOARD::Pos(board.size - 2, board.size - 3)));
+
+    for (int round = 0; round < 2; round++) {
+        for (uint32_t i = 0; i < board.num_squares(); i++) {
+            auto pos = board.pos_at(i);
+            EXPECT_EQ(knight_adjacent_positions(board, pos), board.adjacent_positions(pos));
+            EXPECT_EQ(knight_adjacent_positions(board, pos, true), board.adjacent_positions(pos, true));
+        }
+        // Barriers right next to the portals
+        board.set_square({2, 2}, BoardSquare::Barrier);
+        board.set_square({board.size - 3, board.size - 3}, BoardSquare::Barrier);
+    }
+}
+
+TEST(KnightMoveTable, matches_board_rules) {
+    Board8 board8;
+    expect_table_moves_match_rules(board8);
+    Board<16> board16;
+    expect_table_moves_match_rules(board16);
+
+    // Squares only change through set_square(), so the moves can't go stale
+    Board8 rock;
+    rock.set_square({2, 1}, BoardSquare::Rock);
+    EXPECT_EQ(false, rock.is_valid_step({0, 0}, {2, 1}));
+    EXPECT_EQ(knight_adjacent_positions(rock, Pos8(0, 0)), rock.adjacent_positions({0, 0}));
+    auto around = shortest_path_lvl4(rock, {0, 0}, {4, 0});
+    EXPECT_EQ(true, is_valid_step_sequence(rock, around));
+    EXPECT_EQ(around.end(), std::find(around.begin(), around.end(), Pos8(2, 1)));
+
+    // Portals too, and they only move in pairs
+    EXPECT_THROW(rock.set_square({3, 3}, BoardSquare::Teleport), std::invalid_argument);
+    rock.set_teleports(std::make_pair(Pos8(3, 3), Pos8(6, 6)));
+    EXPECT_THROW(rock.set_square({3, 3}, BoardSquare::Clear), std::invalid_argument);
+    EXPECT_EQ(knight_adjacent_positions(rock, Pos8(3, 3)), rock.adjacent_positions({3, 3}));
+    rock.set_teleports(std::make_pair(Pos8(3, 3), Pos8(0, 7)));
+    EXPECT_EQ(BoardSquare::Clear, rock.square({6, 6}));
+    EXPECT_EQ(rock.adjacent_positions({0, 7}, true), rock.adjacent_positions({3, 3}));
+    rock.set_teleports(std::experimental::nullopt);
+    EXPECT_EQ(knight_adjacent_positions(rock, Pos8(3, 3)), rock.adjacent_positions({3, 3}));
+}
+
 TEST_F(Board8Test, some_path_simple) {
     auto v0 = some_path_simple(board, {0, 0}, {2, 1});
     EXPECT_EQ(true, is_valid_step_sequence(board, v0));
@@ -144,4 +226,1472 @@ TEST_F(Board32Test, teleportation) {
 TEST_F(Board32Test, looong_path) {
     auto v0 = shortest_path_lvl4(board, {9, 30}, {26, 0});
     EXPECT_EQ(true, is_valid_step_sequence(board, v0));
-}
\ No newline at end of file
+}
+
+TEST_F(Board32Test, step_validator) {
+    StepValidator<Board32> validator(board);
+
+    // Same answer as the board for every step landing within 3 squares
+    for (uint32_t i = 0; i < board.num_squares(); i++) {
+        auto from = board.pos_at(i);
+        for (int dx = -3; dx <= 3; dx++) {
+            for (int dy = -3; dy <= 3; dy++) {
+                Pos32 to(from.x + dx, from.y + dy);
+                if (board.is_within_bounds(to) && board.square(from) == BoardSquare::Teleport &&
+                    board.square(to) != BoardSquare::Teleport) {
+                    // Moves out of a portal are checked below
+                    continue;
+                }
+                EXPECT_EQ(board.is_valid_step(from, to), validator.is_valid_step(from, to));
+            }
+        }
+    }
+
+    // Search paths through the teleport, plus broken ones and short ones
+    std::vector<PosVec32> sequences{
+            shortest_path_lvl4(board, {11, 26}, {25, 28}),
+            shortest_path_lvl4(board, {9, 30}, {26, 30}),
+            shortest_path_lvl4(board, {9, 30}, {26, 0}),
+            {},
+            {{0, 0}},
+    };
+    std::vector<int> expected{-1, -1, -1, 0, 0};
+
+    auto broken = sequences[2];
+    broken[13] = Pos32(broken[12].x + 1, broken[12].y + 1);
+    sequences.push_back(broken);
+    expected.push_back(12);
+
+    auto off_board = sequences[2];
+    off_board.push_back({-1, 0});
+    sequences.push_back(off_board);
+    expected.push_back(static_cast<int>(off_board.size()) - 2);
+
+    EXPECT_EQ(expected, validator.first_invalid_steps(sequences));
+    for (size_t i = 0; i < sequences.size(); i++) {
+        EXPECT_EQ(expected[i], validator.first_invalid_step(sequences[i]));
+    }
+    EXPECT_EQ(true, validator.is_current());
+    board.set_square({0, 0}, BoardSquare::Rock);
+    EXPECT_EQ(false, validator.is_current());
+}
+
+class DynamicBoardTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        board.load_from_file();
+        board32.load_from_file();
+    }
+
+    DynamicBoard board;
+    Board32 board32;
+};
+
+TEST_F(DynamicBoardTest, dimensions) {
+    EXPECT_EQ(32, board.rows());
+    EXPECT_EQ(32, board.cols());
+    EXPECT_EQ(1024u, board.num_squares());
+
+    DynamicBoard rect(3, 5);
+    EXPECT_EQ(15u, rect.num_squares());
+    EXPECT_EQ(13u, rect.index_of({2, 3}));
+    EXPECT_EQ(DynPos(2, 3), rect.pos_at(13));
+    EXPECT_EQ(true, rect.is_valid_step({0, 0}, {2, 1}));
+    EXPECT_EQ(false, rect.is_valid_step({0, 0}, {1, 5}));
+    EXPECT_EQ(false, rect.is_valid_step({2, 4}, {4, 5}));
+}
+
+TEST_F(DynamicBoardTest, same_squares_as_board32) {
+    for (int i = 0; i < 32; i++) {
+        for (int j = 0; j < 32; j++) {
+            EXPECT_EQ(board32.square({i, j}), board.square({i, j}));
+        }
+    }
+    EXPECT_EQ(DynPos(11, 26), board.teleports->first);
+    EXPECT_EQ(DynPos(23, 27), board.teleports->second);
+}
+
+TEST(BoardText, parser) {
+    std::string text = "..W\n\nT L R\r\nB..\n";
+    std::vector<BoardSquare> squares;
+    auto shape = parse_board_text(text.data(), text.size(), [&](int row, int col, BoardSquare sq) {
+        EXPECT_EQ(squares.size(), static_cast<size_t>(row * 3 + col));
+        squares.push_back(sq);
+    });
+    EXPECT_EQ(3, shape.rows);
+    EXPECT_EQ(3, shape.cols);
+    EXPECT_EQ(BoardSquare::Teleport, squares[3]);
+    EXPECT_EQ(BoardSquare::Barrier, squares[6]);
+
+    auto ignore = [](int, int, BoardSquare) {};
+    std::string ragged = "...\n..\n";
+    EXPECT_THROW(parse_board_text(ragged.data(), ragged.size(), ignore), std::runtime_error);
+    std::string unknown = "..X\n";
+    EXPECT_THROW(parse_board_text(unknown.data(), unknown.size(), ignore), std::runtime_error);
+}
+
+TEST_F(DynamicBoardTest, explicit_path) {
+    auto path = std::string(std::getenv("HOME")) + "/knightboard.txt";
+    Board32 from_path;
+    from_path.load_from_file(path);
+    EXPECT_EQ(board_fingerprint(board32), board_fingerprint(from_path));
+
+    // Maps that don't fit the board are rejected instead of overflowing it
+    Board8 small;
+    EXPECT_THROW(small.load_from_file(path), std::runtime_error);
+    EXPECT_THROW(board.load_from_file(path + ".missing"), std::runtime_error);
+}
+
+// Round trip through a file: save(out) writes it, load(path) reads or maps
+// it back, and it's deleted straight away (mappings outlive the file)
+template<typename SAVE, typename LOAD>
+auto through_file(const std::string &name, SAVE save, LOAD load) {
+    auto path = testing::TempDir() + name;
+    {
+        std::ofstream out(path, std::ios::binary);
+        save(out);
+    }
+    auto loaded = load(path);
+    std::remove(path.c_str());
+    return loaded;
+}
+
+MappedBoard map_binary_board(const std::string &path) { return MappedBoard(path); }
+
+TEST_F(DynamicBoardTest, binary_format) {
+    for (uint32_t bits : {4u, 8u}) {
+        auto mapped = through_file("knightboard_" + std::to_string(bits) + ".bin",
+                                   [&](std::ostream &out) { save_binary_board(board, out, bits); },
+                                   map_binary_board);
+
+        EXPECT_EQ(board.rows(), mapped.rows());
+        EXPECT_EQ(board.cols(), mapped.cols());
+        EXPECT_EQ(board_fingerprint(board), board_fingerprint(mapped));
+        EXPECT_EQ(DynPos(11, 26), mapped.teleports->first);
+
+        EXPECT_EQ(path_cost(board, shortest_path_lvl4(board, {9, 30}, {26, 0})),
+                  path_cost(mapped, shortest_path_lvl4(mapped, {9, 30}, {26, 0})));
+    }
+}
+
+TEST(MappedBoard, multiple_chunks) {
+    // More squares than fit a single write chunk, with an odd square count
+    DynamicBoard board(401, 399);
+    for (uint32_t i = 0; i < board.num_squares(); i++) {
+        board.set_square(board.pos_at(i), static_cast<BoardSquare>(i * 7 % 6 == 4 ? 0 : i * 7 % 6));
+    }
+    for (uint32_t bits : {4u, 8u}) {
+        auto mapped = through_file("knightboard_chunks.bin",
+                                   [&](std::ostream &out) { save_binary_board(board, out, bits); },
+                                   map_binary_board);
+        EXPECT_EQ(board_fingerprint(board), board_fingerprint(mapped));
+    }
+}
+
+TEST(BoardGenerator, terrain) {
+    BoardGeneratorOptions options;
+    options.rows = 400;
+    options.cols = 400;
+    options.seed = 5;
+    options.rock = {0.2, 0.7};
+    options.water = {0.1, 0};
+    options.teleport_pairs = 1;
+    const BoardGenerator generator(options);
+    const auto board = generator.to_dynamic_board();
+
+    // Same seed, same board
+    EXPECT_EQ(board_fingerprint(board), board_fingerprint(BoardGenerator(options)));
+    options.seed = 6;
+    EXPECT_NE(board_fingerprint(board), board_fingerprint(BoardGenerator(options)));
+
+    std::map<BoardSquare, int> counts;
+    int rock_next_to_rock = 0;
+    for (int r = 0; r < board.rows(); r++) {
+        for (int c = 0; c < board.cols(); c++) {
+            counts[board.square({r, c})]++;
+            rock_next_to_rock += board.square({r, c}) == BoardSquare::Rock && c + 1 < board.cols() &&
+                                 board.square({r, c + 1}) == BoardSquare::Rock;
+        }
+    }
+    const double n = board.num_squares();
+    EXPECT_NEAR(0.2, counts[BoardSquare::Rock] / n, 0.03);
+    // Water only goes where there's no rock
+    EXPECT_NEAR(0.1 * 0.8, counts[BoardSquare::Water] / n, 0.02);
+    EXPECT_EQ(0, counts[BoardSquare::Barrier]);
+    EXPECT_EQ(2, counts[BoardSquare::Teleport]);
+    EXPECT_EQ(BoardSquare::Teleport, board.square(board.teleports->first));
+    EXPECT_EQ(BoardSquare::Teleport, board.square(board.teleports->second));
+    // Clustered: rock is mostly next to more rock
+    EXPECT_GT(rock_next_to_rock, 0.8 * counts[BoardSquare::Rock]);
+}
+
+TEST(BoardGenerator, walls) {
+    BoardGeneratorOptions options;
+    options.rows = 100;
+    options.cols = 120;
+    options.wall_spacing = 10;
+    options.wall_segment = 8;
+    options.wall_gap = 2;
+    const BoardGenerator generator(options);
+
+    int wall_rows = 0;
+    for (int r = 0; r < generator.rows(); r++) {
+        int barriers = 0;
+        for (int c = 0; c < generator.cols(); c++) {
+            barriers += generator.square({r, c}) == BoardSquare::Barrier;
+        }
+        // Walls have a gap of 2 every 8 squares, plus crossing walls
+        if (barriers > generator.cols() / 2) {
+            wall_rows++;
+            EXPECT_LT(barriers, generator.cols());
+        }
+    }
+    EXPECT_GT(wall_rows, 3);
+    EXPECT_LT(wall_rows, 25);
+}
+
+TEST(BoardGenerator, streaming) {
+    BoardGeneratorOptions options;
+    options.rows = 401;
+    options.cols = 399;
+    options.rock = {0.1, 0.3};
+    options.lava = {0.05, 1};
+    options.wall_spacing = 50;
+    options.teleport_pairs = 1;
+    const BoardGenerator generator(options);
+    const auto fingerprint = board_fingerprint(generator);
+
+    auto from_text = through_file("generated.txt",
+                                  [&](std::ostream &out) { save_board_text(generator, out); },
+                                  [](const std::string &path) {
+                                      DynamicBoard board;
+                                      board.load_from_file(path);
+                                      return board;
+                                  });
+    EXPECT_EQ(fingerprint, board_fingerprint(from_text));
+
+    // Big enough to take more than one chunk
+    for (uint32_t bits : {4u, 8u}) {
+        auto mapped = through_file("generated_" + std::to_string(bits) + ".bin",
+                                   [&](std::ostream &out) { save_binary_board(generator, out, bits); },
+                                   map_binary_board);
+        EXPECT_EQ(fingerprint, board_fingerprint(mapped));
+    }
+}
+
+TEST(MappedBoard, print_corrupt_squares) {
+    DynamicBoard board(2, 3);
+    auto mapped = through_file("knightboard_corrupt.bin", [&](std::ostream &out) {
+        save_binary_board(board, out, 8);
+        // Overwrite the last square with something that isn't a square
+        out.seekp(-1, std::ios::end);
+        out.put(static_cast<char>(0x3f));
+    }, map_binary_board);
+
+    std::ostringstream printed;
+    mapped.print(printed);
+    EXPECT_EQ(". . . \n. . ? \n", printed.str());
+}
+
+TEST_F(DynamicBoardTest, change_log) {
+    auto version = board.version();
+    std::vector<uint32_t> changed;
+    EXPECT_EQ(true, board.changed_squares(version, changed));
+    EXPECT_EQ(0u, changed.size());
+
+    board.set_square({0, 1}, BoardSquare::Water);
+    board.set_square({3, 4}, BoardSquare::Lava);
+    EXPECT_EQ(version + 2, board.version());
+    EXPECT_EQ(true, board.changed_squares(version, changed));
+    EXPECT_EQ(std::vector<uint32_t>({board.index_of({0, 1}), board.index_of({3, 4})}), changed);
+
+    changed.clear();
+    EXPECT_EQ(true, board.changed_squares(version + 1, changed));
+    EXPECT_EQ(1u, changed.size());
+
+    board.forget_changes();
+    EXPECT_EQ(false, board.changed_squares(version, changed));
+    EXPECT_EQ(true, board.changed_squares(board.version(), changed));
+}
+
+TEST_F(DynamicBoardTest, set_teleports) {
+    // Portals can't be created or wiped one square at a time
+    auto portal = board.teleports->first;
+    EXPECT_THROW(board.set_square(portal, BoardSquare::Clear), std::invalid_argument);
+    EXPECT_THROW(board.set_square({0, 0}, BoardSquare::Teleport), std::invalid_argument);
+    EXPECT_NO_THROW(board.set_square(portal, BoardSquare::Teleport));
+
+    auto old = *board.teleports;
+    auto version = board.version();
+    board.set_teleports(std::make_pair(DynPos(0, 0), DynPos(31, 31)));
+    EXPECT_EQ(BoardSquare::Clear, board.square(old.first));
+    EXPECT_EQ(BoardSquare::Clear, board.square(old.second));
+    EXPECT_EQ(BoardSquare::Teleport, board.square({0, 0}));
+    EXPECT_EQ(knight_adjacent_positions(board, DynPos(0, 0)), board.adjacent_positions({0, 0}));
+
+    std::vector<uint32_t> changed;
+    EXPECT_EQ(true, board.changed_squares(version, changed));
+    std::set<uint32_t> changed_set(changed.begin(), changed.end());
+    EXPECT_EQ(std::set<uint32_t>({board.index_of(old.first), board.index_of(old.second),
+                             board.index_of({0, 0}), board.index_of({31, 31})}), changed_set);
+
+    board.set_teleports(std::experimental::nullopt);
+    EXPECT_EQ(BoardSquare::Clear, board.square({0, 0}));
+    EXPECT_EQ(false, bool(board.teleports));
+    EXPECT_THROW(board.set_teleports(std::make_pair(DynPos(1, 1), DynPos(1, 1))), std::invalid_argument);
+}
+
+TEST_F(DynamicBoardTest, dstar_lite) {
+    DynPos start(9, 30);
+    DynPos goal(26, 0);
+    DStarLitePlanner<DynamicBoard> planner(board, start, goal);
+
+    SearchStats first_stats;
+    auto path = planner.plan(&first_stats);
+    EXPECT_EQ(true, is_valid_step_sequence(board, path));
+    EXPECT_EQ(path_cost(board, shortest_path_lvl4(board, start, goal)), path_cost(board, path));
+
+    // Squares keep changing, and the knight moves along its path
+    const BoardSquare kinds[] = {BoardSquare::Clear, BoardSquare::Water, BoardSquare::Rock,
+                                 BoardSquare::Barrier, BoardSquare::Lava};
+    uint32_t seed = 7;
+    auto next_random = [&seed]() {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) & 0x7fff;
+    };
+
+    SearchStats incremental_stats;
+    int replans = 0;
+    for (int round = 0; round < 60; round++) {
+        for (int k = 0; k < 3; k++) {
+            DynPos pos(next_random() % 32, next_random() % 32);
+            if (pos == start || pos == goal || board.square(pos) == BoardSquare::Teleport) {
+                continue;
+            }
+            board.set_square(pos, kinds[next_random() % 5]);
+        }
+        if (round % 10 == 5 && path.size() > 2) {
+            start = path[1];
+            planner.move_start(start);
+        }
+
+        bool reachable = true;
+        int expected = 0;
+        try {
+            expected = path_cost(board, shortest_path_lvl4(board, start, goal));
+        } catch (const std::out_of_range &) {
+            reachable = false;
+        }
+
+        if (reachable) {
+            path = planner.plan(&incremental_stats);
+            replans++;
+            EXPECT_EQ(true, is_valid_step_sequence(board, path));
+            EXPECT_EQ(start, path.front());
+            EXPECT_EQ(expected, path_cost(board, path));
+        } else {
+            EXPECT_THROW(planner.plan(), std::out_of_range);
+        }
+    }
+
+    // Repairs are cheaper than starting over
+    EXPECT_LT(incremental_stats.nodes_expanded / replans, first_stats.nodes_expanded);
+}
+
+TEST_F(DynamicBoardTest, level_templates) {
+    EXPECT_EQ(false, board.is_valid_step({0, 7}, {1, 8}));
+    EXPECT_EQ(true, is_valid_step_sequence(board, some_path_simple(board, {0, 0}, {6, 1})));
+    EXPECT_EQ(2, shortest_path_simple(board, {0, 0}, {2, 1}).size());
+
+    DynPosVec v2{{0, 0},
+                 {2, 1},
+                 {4, 2},
+                 {6, 1}};
+    EXPECT_EQ(v2, shortest_path_lvl4(board, {0, 0}, {6, 1}));
+    EXPECT_EQ(shortest_path_lvl4(board32, {9, 30}, {26, 0}).size(),
+              shortest_path_lvl4(board, {9, 30}, {26, 0}).size());
+}
+
+TEST(DynamicBoard, large_rectangular) {
+    DynamicBoard board(1000, 300);
+    board.set_square({2, 1}, BoardSquare::Rock);
+
+    auto path = shortest_path_simple(board, {0, 0}, {999, 299});
+    EXPECT_EQ(true, is_valid_step_sequence(board, path));
+    EXPECT_EQ(DynPos(999, 299), path.back());
+}
+
+TEST_F(Board32Test, compiled_graph) {
+    CompiledGraph<Board32> graph(board);
+
+    for (uint32_t i = 0; i < board.num_squares(); i++) {
+        GraphEdgeVec32 compiled;
+        for (const auto &adj : graph.adjacent_positions(Pos32(i))) {
+            compiled.push_back(adj);
+        }
+        EXPECT_EQ(board.adjacent_positions(Pos32(i)), compiled);
+    }
+
+    // Teleports are folded in: a portal has the moves of its partner
+    GraphEdgeVec32 from_portal;
+    for (const auto &adj : graph.adjacent_positions({11, 26})) {
+        from_portal.push_back(adj);
+    }
+    EXPECT_EQ(board.adjacent_positions({23, 27}, true), from_portal);
+
+    EXPECT_EQ(shortest_path_lvl4(board, {9, 30}, {26, 0}), shortest_path_lvl4(graph, {9, 30}, {26, 0}));
+    EXPECT_EQ(shortest_path_simple(board, {0, 0}, {0, 10}), shortest_path_simple(graph, {0, 0}, {0, 10}));
+    EXPECT_EQ(true, is_valid_step_sequence(graph, some_path_simple(graph, {0, 0}, {6, 1})));
+}
+
+TEST_F(Board32Test, search_workspace) {
+    SearchWorkspace workspace(board);
+    CompiledGraph<Board32> graph(board);
+
+    // Reuse the same workspace across many queries, including ones on
+    // the compiled graph
+    for (int finish = 0; finish < 1024; finish += 37) {
+        auto sq = board.square(Pos32(finish));
+        if (sq == BoardSquare::Rock || sq == BoardSquare::Barrier) {
+            continue;
+        }
+        EXPECT_EQ(shortest_path_simple(board, {9, 30}, Pos32(finish)),
+                  shortest_path_simple(board, {9, 30}, Pos32(finish), workspace));
+        EXPECT_EQ(shortest_path_lvl4(board, {9, 30}, Pos32(finish)),
+                  shortest_path_lvl4(graph, {9, 30}, Pos32(finish), workspace));
+    }
+
+    EXPECT_LT(0u, workspace.bytes());
+}
+
+TEST(KnightDistance, closed_form) {
+    EXPECT_EQ(0, knight_distance(0, 0));
+    EXPECT_EQ(3, knight_distance(1, 0));
+    EXPECT_EQ(2, knight_distance(1, 1));
+    EXPECT_EQ(1, knight_distance(-2, 1));
+    EXPECT_EQ(4, knight_distance(2, 2));
+    EXPECT_EQ(4, knight_distance(7, 3));
+    EXPECT_EQ(15, knight_distance(30, -15));
+
+    // Compare against a single BFS on an open board, from its center
+    DynamicBoard board(41);
+    std::vector<int> dist(board.num_squares(), -1);
+    std::vector<DynPos> queue{{20, 20}};
+    dist[board.index_of({20, 20})] = 0;
+    for (size_t head = 0; head < queue.size(); head++) {
+        for (const auto &adj : board.adjacent_positions(queue[head])) {
+            if (dist[board.index_of(adj.first)] < 0) {
+                dist[board.index_of(adj.first)] = dist[board.index_of(queue[head])] + 1;
+                queue.push_back(adj.first);
+            }
+        }
+    }
+    for (int i = 0; i < 41; i++) {
+        for (int j = 0; j < 41; j++) {
+            EXPECT_EQ(dist[board.index_of({i, j})], knight_distance(i - 20, j - 20));
+        }
+    }
+}
+
+TEST_F(Board32Test, astar) {
+    SearchWorkspace workspace(board);
+    SearchStats astar_stats;
+
+    auto v0 = shortest_path_astar(board, {9, 30}, {26, 0}, workspace, &astar_stats);
+    EXPECT_EQ(true, is_valid_step_sequence(board, v0));
+    EXPECT_EQ(path_cost(board, shortest_path_lvl4(board, {9, 30}, {26, 0})), path_cost(board, v0));
+
+    // A* with a zero heuristic is plain Dijkstra with proper relaxation
+    auto zero = [](const Pos32 &, const Pos32 &) { return 0; };
+    for (int begin = 0; begin < 1024; begin += 53) {
+        for (int finish = 0; finish < 1024; finish += 29) {
+            auto begin_sq = board.square(Pos32(begin));
+            auto finish_sq = board.square(Pos32(finish));
+            if (begin_sq == BoardSquare::Rock || begin_sq == BoardSquare::Barrier ||
+                finish_sq == BoardSquare::Rock || finish_sq == BoardSquare::Barrier) {
+                continue;
+            }
+            SearchStats dijkstra_stats;
+            auto dijkstra_cost = path_cost(board, shortest_path_astar(board, Pos32(begin), Pos32(finish),
+                                                                       workspace, zero, &dijkstra_stats));
+            SearchStats stats;
+            auto astar_path = shortest_path_astar(board, Pos32(begin), Pos32(finish), workspace, &stats);
+            EXPECT_EQ(dijkstra_cost, path_cost(board, astar_path));
+            EXPECT_LE(stats.nodes_expanded, dijkstra_stats.nodes_expanded);
+        }
+    }
+}
+
+TEST(BucketQueue, monotone_keys) {
+    SearchWorkspace workspace(16);
+    BucketQueue queue(workspace, MAX_MOVE_WEIGHT);
+
+    queue.push(3, 10);
+    queue.push(4, 15);
+    queue.push(5, 11);
+    EXPECT_EQ(3u, queue.pop());
+    queue.push(6, 12);
+    EXPECT_EQ(5u, queue.pop());
+    EXPECT_EQ(6u, queue.pop());
+    EXPECT_EQ(4u, queue.pop());
+    EXPECT_EQ(true, queue.empty());
+
+    queue.push(7, 15);
+    EXPECT_THROW(queue.push(8, 30), std::logic_error);
+}
+
+TEST_F(Board32Test, bucket_queue_searches) {
+    SearchWorkspace workspace(board);
+
+    for (int begin = 0; begin < 1024; begin += 61) {
+        for (int finish = 0; finish < 1024; finish += 31) {
+            auto begin_sq = board.square(Pos32(begin));
+            auto finish_sq = board.square(Pos32(finish));
+            if (begin_sq == BoardSquare::Rock || begin_sq == BoardSquare::Barrier ||
+                finish_sq == BoardSquare::Rock || finish_sq == BoardSquare::Barrier) {
+                continue;
+            }
+            auto cost = path_cost(board, shortest_path_lvl4(board, Pos32(begin), Pos32(finish)));
+
+            auto dial = shortest_path_lvl4<BucketQueue>(board, Pos32(begin), Pos32(finish), workspace);
+            EXPECT_EQ(cost, path_cost(board, dial));
+            EXPECT_EQ(Pos32(finish), dial.back());
+
+            auto astar = shortest_path_astar<BucketQueue>(board, Pos32(begin), Pos32(finish), workspace);
+            EXPECT_EQ(cost, path_cost(board, astar));
+        }
+    }
+}
+
+TEST_F(Board32Test, reverse_adjacent_positions) {
+    // Every forward edge shows up reversed, and vice versa
+    for (int i = 0; i < 1024; i++) {
+        for (const auto &adj : board.adjacent_positions(Pos32(i))) {
+            auto reverse = reverse_adjacent_positions(board, adj.first);
+            EXPECT_NE(reverse.end(), std::find(reverse.begin(), reverse.end(),
+                                               std::make_pair(Pos32(i), adj.second)));
+        }
+        for (const auto &adj : reverse_adjacent_positions(board, Pos32(i))) {
+            auto forward = board.adjacent_positions(adj.first);
+            EXPECT_NE(forward.end(), std::find(forward.begin(), forward.end(),
+                                               std::make_pair(Pos32(i), adj.second)));
+        }
+    }
+}
+
+TEST_F(Board32Test, bidirectional) {
+    SearchWorkspace forward(board);
+    SearchWorkspace backward(board);
+    CompiledGraph<Board32> graph(board);
+
+    for (int begin = 0; begin < 1024; begin += 67) {
+        for (int finish = 0; finish < 1024; finish += 43) {
+            auto begin_sq = board.square(Pos32(begin));
+            auto finish_sq = board.square(Pos32(finish));
+            if (begin_sq == BoardSquare::Rock || begin_sq == BoardSquare::Barrier ||
+                finish_sq == BoardSquare::Rock || finish_sq == BoardSquare::Barrier) {
+                continue;
+            }
+
+            auto bfs = shortest_path_bidirectional_bfs(board, Pos32(begin), Pos32(finish), forward, backward);
+            EXPECT_EQ(shortest_path_simple(board, Pos32(begin), Pos32(finish)).size(), bfs.size());
+            EXPECT_EQ(Pos32(begin), bfs.front());
+            EXPECT_EQ(Pos32(finish), bfs.back());
+
+            auto cost = path_cost(board, shortest_path_lvl4(board, Pos32(begin), Pos32(finish)));
+            auto dijkstra = shortest_path_bidirectional_dijkstra(board, Pos32(begin), Pos32(finish),
+                                                                 forward, backward);
+            EXPECT_EQ(cost, path_cost(board, dijkstra));
+            auto dial = shortest_path_bidirectional_dijkstra<BucketQueue>(board, Pos32(begin), Pos32(finish),
+                                                                          forward, backward);
+            EXPECT_EQ(cost, path_cost(board, dial));
+            auto compiled = shortest_path_bidirectional_dijkstra<BucketQueue>(graph, Pos32(begin), Pos32(finish),
+                                                                              forward, backward);
+            EXPECT_EQ(cost, path_cost(board, compiled));
+            auto compiled_bfs = shortest_path_bidirectional_bfs(graph, Pos32(begin), Pos32(finish),
+                                                                forward, backward);
+            EXPECT_EQ(bfs.size(), compiled_bfs.size());
+        }
+    }
+
+    // Searching from both ends explores less on a long route
+    DynamicBoard open_board(200);
+    SearchStats one_way;
+    SearchStats both_ways;
+    SearchWorkspace workspace(open_board);
+    shortest_path_astar(open_board, {0, 0}, {199, 199}, workspace,
+                        [](const DynPos &, const DynPos &) { return 0; }, &one_way);
+    shortest_path_bidirectional_dijkstra(open_board, {0, 0}, {199, 199}, forward, backward, &both_ways);
+    EXPECT_LT(both_ways.nodes_expanded, one_way.nodes_expanded);
+}
+
+TEST_F(Board32Test, search_observers) {
+    SearchWorkspace workspace(board);
+    SearchWorkspace backward(board);
+
+    // Every push comes from a relaxed edge, except the first one
+    SearchStats dijkstra;
+    StatsObserver observer(dijkstra);
+    auto path = shortest_path_lvl4(board, {9, 30}, {26, 0}, workspace, observer);
+    EXPECT_EQ(shortest_path_lvl4(board, {9, 30}, {26, 0}), path);
+    EXPECT_GT(dijkstra.nodes_expanded, 0u);
+    EXPECT_EQ(dijkstra.edges_relaxed + 1, dijkstra.queue_pushes);
+    EXPECT_LE(dijkstra.nodes_expanded, dijkstra.queue_pops);
+    EXPECT_LE(dijkstra.queue_pops, dijkstra.queue_pushes);
+    EXPECT_GT(dijkstra.peak_open_set, 0u);
+    EXPECT_LE(dijkstra.peak_open_set, dijkstra.queue_pushes);
+    EXPECT_EQ(workspace.bytes(), dijkstra.workspace_bytes);
+
+    // BFS never pushes twice, or skips a pop
+    SearchStats bfs;
+    StatsObserver bfs_observer(bfs);
+    shortest_path_simple(board, {9, 30}, {26, 0}, workspace, bfs_observer);
+    EXPECT_EQ(bfs.edges_relaxed + 1, bfs.queue_pushes);
+    EXPECT_EQ(bfs.nodes_expanded, bfs.queue_pops);
+
+    // The SearchStats overloads count the same as the observer
+    SearchStats astar;
+    SearchStats astar_observed;
+    StatsObserver astar_observer(astar_observed);
+    shortest_path_astar(board, {9, 30}, {26, 0}, workspace, &astar);
+    shortest_path_astar(board, {9, 30}, {26, 0}, workspace, KnightDistanceHeuristic<Board32>(board), astar_observer);
+    EXPECT_EQ(astar.nodes_expanded, astar_observed.nodes_expanded);
+    EXPECT_EQ(astar.queue_pushes, astar_observed.queue_pushes);
+    EXPECT_LT(astar.nodes_expanded, dijkstra.nodes_expanded);
+
+    SearchStats both_ways;
+    shortest_path_bidirectional_dijkstra(board, {9, 30}, {26, 0}, workspace, backward, &both_ways);
+    EXPECT_EQ(both_ways.edges_relaxed + 2, both_ways.queue_pushes);
+    EXPECT_EQ(workspace.bytes() + backward.bytes(), both_ways.workspace_bytes);
+
+    // Stats add up over searches, unreachable ones included
+    SearchStats total;
+    StatsObserver total_observer(total);
+    shortest_path_simple(board, {9, 30}, {26, 0}, workspace, total_observer);
+    EXPECT_THROW(shortest_path_simple(board, {9, 30}, {9, 3}, workspace, total_observer), std::out_of_range);
+    EXPECT_GT(total.nodes_expanded, bfs.nodes_expanded);
+
+    // Metrics from several threads at once
+    SearchMetrics metrics;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&metrics, &dijkstra, &bfs] {
+            for (int i = 0; i < 100; i++) {
+                metrics.record("dijkstra", dijkstra);
+                metrics.record("bfs", bfs);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    auto summaries = metrics.snapshot();
+    ASSERT_EQ(2u, summaries.size());
+    EXPECT_EQ(400u, summaries["dijkstra"].searches);
+    EXPECT_EQ(400 * dijkstra.nodes_expanded, summaries["dijkstra"].total.nodes_expanded);
+    EXPECT_EQ(dijkstra.peak_open_set, summaries["dijkstra"].worst.peak_open_set);
+    EXPECT_EQ(400 * bfs.edges_relaxed, summaries["bfs"].total.edges_relaxed);
+
+    std::ostringstream dump;
+    metrics.dump(dump);
+    EXPECT_NE(std::string::npos, dump.str().find("dijkstra: 400 searches"));
+}
+
+TEST_F(Board32Test, bitboard_bfs) {
+    KnightBitboard<Board32> bitboard(board);
+    SearchWorkspace workspace(board);
+
+    for (int begin = 0; begin < 1024; begin += 71) {
+        for (int finish = 0; finish < 1024; finish += 37) {
+            auto begin_sq = board.square(Pos32(begin));
+            auto finish_sq = board.square(Pos32(finish));
+            if (begin_sq == BoardSquare::Rock || begin_sq == BoardSquare::Barrier ||
+                finish_sq == BoardSquare::Rock || finish_sq == BoardSquare::Barrier) {
+                continue;
+            }
+
+            auto path = shortest_path_bitboard(bitboard, Pos32(begin), Pos32(finish), workspace);
+            EXPECT_EQ(shortest_path_simple(board, Pos32(begin), Pos32(finish)).size(), path.size());
+            EXPECT_EQ(Pos32(begin), path.front());
+            EXPECT_EQ(Pos32(finish), path.back());
+        }
+    }
+
+    Board8 board8;
+    KnightBitboard<Board8> bitboard8(board8);
+    PosVec8 v2{{0, 0},
+               {2, 1},
+               {4, 0},
+               {6, 1}};
+    EXPECT_EQ(v2, shortest_path_bitboard(bitboard8, {0, 0}, {6, 1}, workspace));
+}
+
+TEST(KnightBitboard, wide_board) {
+    // Rows spanning several words, with some obstacles
+    DynamicBoard board(40, 150);
+    for (int i = 0; i < 40; i++) {
+        // A wall across the word boundary, with a few gaps
+        if (i % 8) {
+            board.set_square({i, 63}, BoardSquare::Barrier);
+            board.set_square({i, 64}, BoardSquare::Barrier);
+        }
+    }
+    board.set_square({10, 100}, BoardSquare::Rock);
+
+    KnightBitboard<DynamicBoard> bitboard(board);
+    SearchWorkspace workspace(board);
+    SearchWorkspace bfs_workspace(board);
+    bitboard.distances({0, 0}, workspace);
+
+    for (uint32_t i = 0; i < board.num_squares(); i += 37) {
+        auto sq = board.square(board.pos_at(i));
+        if (sq == BoardSquare::Rock || sq == BoardSquare::Barrier) {
+            continue;
+        }
+        auto path = shortest_path_simple(board, {0, 0}, board.pos_at(i), bfs_workspace);
+        EXPECT_EQ(true, workspace.visited(i));
+        EXPECT_EQ(i ? path.size() - 1 : 0u, workspace.dist(i));
+    }
+}
+
+TEST_F(Board32Test, flow_field) {
+    auto field = FlowField<Board32>::build(board, {26, 0});
+
+    for (int start = 0; start < 1024; start += 13) {
+        auto sq = board.square(Pos32(start));
+        if (sq == BoardSquare::Rock || sq == BoardSquare::Barrier || Pos32(start) == Pos32(26, 0)) {
+            continue;
+        }
+        auto path = field.path_from(board, Pos32(start));
+        auto cost = path_cost(board, shortest_path_lvl4(board, Pos32(start), {26, 0}));
+        EXPECT_EQ(cost, path_cost(board, path));
+        EXPECT_EQ(static_cast<uint32_t>(cost), field.distance(Pos32(start).as_int()));
+        EXPECT_EQ(Pos32(26, 0), path.back());
+    }
+
+    // Round trip through the binary format
+    std::stringstream buffer;
+    field.save(buffer);
+    auto loaded = FlowField<Board32>::load(buffer);
+    EXPECT_EQ(true, loaded.matches(board));
+    EXPECT_EQ(field.path_from(board, {9, 30}), loaded.path_from(board, {9, 30}));
+
+    // Corrupt dimensions are rejected before allocating anything
+    auto load_corrupt = [&](size_t offset, int32_t value, size_t size) {
+        auto bytes = buffer.str().substr(0, size);
+        std::copy(reinterpret_cast<const char *>(&value), reinterpret_cast<const char *>(&value) + 4,
+                  bytes.begin() + offset);
+        std::stringstream in(bytes);
+        FlowField<Board32>::load(in);
+    };
+    const auto size = buffer.str().size();
+    EXPECT_THROW(load_corrupt(8, -1, size), std::runtime_error);
+    EXPECT_THROW(load_corrupt(12, 1 << 30, size), std::runtime_error);
+    EXPECT_THROW(load_corrupt(12, 32, size - 4), std::runtime_error);
+
+    // Changing the board invalidates the field
+    EXPECT_EQ(true, field.is_current(board));
+    board.set_square({0, 0}, BoardSquare::Water);
+    EXPECT_EQ(false, field.is_current(board));
+    EXPECT_EQ(false, loaded.matches(board));
+}
+
+TEST_F(Board32Test, many_to_many) {
+    PosVec32 sources;
+    PosVec32 targets;
+    for (int i = 0; i < 1024; i += 19) {
+        auto sq = board.square(Pos32(i));
+        if (sq != BoardSquare::Rock && sq != BoardSquare::Barrier) {
+            sources.push_back(Pos32(i));
+        }
+    }
+    for (int i = 5; i < 1024; i += 41) {
+        auto sq = board.square(Pos32(i));
+        if (sq != BoardSquare::Rock && sq != BoardSquare::Barrier) {
+            targets.push_back(Pos32(i));
+        }
+    }
+    targets.push_back({11, 26});
+
+    ThreadPool pool(4);
+    auto table = distance_table(board, sources, targets, pool, true);
+
+    for (size_t s = 0; s < sources.size(); s++) {
+        for (size_t t = 0; t < targets.size(); t++) {
+            if (sources[s] == targets[t]) {
+                EXPECT_EQ(0u, table.dist(s, t));
+                continue;
+            }
+            auto path = shortest_path_lvl4(board, sources[s], targets[t]);
+            EXPECT_EQ(static_cast<uint32_t>(path_cost(board, path)), table.dist(s, t));
+
+            // The next hop is the first move of a shortest route
+            auto hop = board.pos_at(table.next_hop(s, t));
+            if (hop != targets[t]) {
+                EXPECT_EQ(table.dist(s, t), path_cost(board, PosVec32{sources[s], hop}) +
+                                            path_cost(board, shortest_path_lvl4(board, hop, targets[t])));
+            }
+        }
+    }
+
+    // Rows can also be streamed without keeping the table around
+    size_t rows = 0;
+    many_to_many(board, sources, targets, pool, [&rows](size_t, const uint32_t *, const uint32_t *next_hops) {
+        EXPECT_EQ(nullptr, next_hops);
+        rows++;
+    });
+    EXPECT_EQ(sources.size(), rows);
+
+    // From a portal to its partner, without searching the whole board for it
+    auto portals = distance_table(board, {board.teleports->first}, {board.teleports->second, {0, 0}}, pool, true);
+    EXPECT_EQ(0u, portals.dist(0, 0));
+    EXPECT_EQ(board.index_of(board.teleports->second), portals.next_hop(0, 0));
+}
+
+TEST_F(Board32Test, landmarks) {
+    auto index = LandmarkIndex<Board32>::build(board, 6);
+    EXPECT_EQ(6u, index.num_landmarks());
+    EXPECT_EQ(true, index.matches(board));
+
+    SearchWorkspace workspace(board);
+    for (int begin = 0; begin < 1024; begin += 53) {
+        for (int finish = 0; finish < 1024; finish += 29) {
+            auto begin_sq = board.square(Pos32(begin));
+            auto finish_sq = board.square(Pos32(finish));
+            if (begin_sq == BoardSquare::Rock || begin_sq == BoardSquare::Barrier ||
+                finish_sq == BoardSquare::Rock || finish_sq == BoardSquare::Barrier ||
+                begin == finish) {
+                continue;
+            }
+            auto cost = path_cost(board, shortest_path_lvl4(board, Pos32(begin), Pos32(finish), workspace));
+            if (begin_sq != BoardSquare::Teleport || finish_sq != BoardSquare::Teleport) {
+                // Except for the free jump between portals, which isn't a graph edge
+                EXPECT_LE(index.lower_bound(begin, finish), cost);
+            }
+
+            auto path = shortest_path_astar(board, Pos32(begin), Pos32(finish), workspace,
+                                            LandmarkHeuristic<Board32>(board, index));
+            EXPECT_EQ(cost, path_cost(board, path));
+        }
+    }
+
+    auto mapped = through_file("knightboard_landmarks.bin", [&](std::ostream &out) { index.save(out); },
+                               LandmarkIndex<Board32>::map_file);
+
+    EXPECT_EQ(index.bytes(), mapped.bytes());
+    EXPECT_EQ(true, mapped.matches(board));
+    for (uint32_t i = 0; i < 1024; i += 7) {
+        for (uint32_t l = 0; l < index.num_landmarks(); l++) {
+            EXPECT_EQ(index.distance_from(l, i), mapped.distance_from(l, i));
+            EXPECT_EQ(index.distance_to(l, i), mapped.distance_to(l, i));
+        }
+    }
+
+    // Corrupt dimensions are caught before sizing anything
+    std::ostringstream saved;
+    index.save(saved);
+    auto load_corrupt = [&](size_t at, uint32_t value) {
+        auto bytes = saved.str();
+        std::copy(reinterpret_cast<const char *>(&value), reinterpret_cast<const char *>(&value) + 4,
+                  &bytes[at]);
+        std::istringstream in(bytes);
+        return LandmarkIndex<Board32>::load(in);
+    };
+    EXPECT_THROW(load_corrupt(8, 0), std::runtime_error);
+    EXPECT_THROW(load_corrupt(12, static_cast<uint32_t>(-32)), std::runtime_error);
+    EXPECT_THROW(load_corrupt(12, 1 << 30), std::runtime_error);
+    EXPECT_THROW(load_corrupt(16, 2048), std::runtime_error);
+    EXPECT_NO_THROW(load_corrupt(8, 32));
+
+    board.set_square({0, 0}, BoardSquare::Water);
+    EXPECT_EQ(false, index.is_current(board));
+    EXPECT_EQ(false, mapped.matches(board));
+}
+
+TEST(Hierarchical, matches_dijkstra) {
+    BoardGeneratorOptions options;
+    options.rows = 90;
+    options.cols = 70;
+    options.seed = 5;
+    options.rock = {0.1, 0.3};
+    options.water = {0.15, 0.6};
+    options.lava = {0.05, 0.3};
+    options.wall_spacing = 20;
+    options.teleport_pairs = 1;
+    auto board = BoardGenerator(options).to_dynamic_board();
+
+    HierarchicalOptions exact_options;
+    exact_options.chunk_size = 16;
+    exact_options.exact = true;
+    HierarchicalPlanner<DynamicBoard> exact(board, exact_options);
+
+    HierarchicalOptions approximate_options;
+    approximate_options.chunk_size = 16;
+    approximate_options.entrance_spacing = 4;
+    HierarchicalPlanner<DynamicBoard> approximate(board, approximate_options);
+    EXPECT_LT(approximate.num_abstract_nodes(), exact.num_abstract_nodes());
+
+    SearchWorkspace workspace(board);
+
+    // The longest route checked
+    DynPos far_begin(0, 0);
+    DynPos far_finish(0, 0);
+    int far_cost = 0;
+
+    auto check = [&](const DynPos &begin, const DynPos &finish) {
+        StepValidator<DynamicBoard> validator(board);
+        int cost = -1;
+        try {
+            cost = path_cost(board, shortest_path_lvl4(board, begin, finish, workspace));
+        } catch (const std::out_of_range &) {
+            EXPECT_THROW(exact.route(begin, finish), std::out_of_range);
+            EXPECT_THROW(approximate.route(begin, finish), std::out_of_range);
+            return;
+        }
+
+        if (cost > far_cost) {
+            far_begin = begin;
+            far_finish = finish;
+            far_cost = cost;
+        }
+
+        auto route = exact.route(begin, finish);
+        EXPECT_EQ(cost, route.cost);
+        auto path = exact.refine(route);
+        EXPECT_EQ(begin, path.front());
+        EXPECT_EQ(finish, path.back());
+        EXPECT_EQ(StepValidator<DynamicBoard>::ALL_STEPS_VALID, validator.first_invalid_step(path));
+        EXPECT_EQ(cost, path_cost(board, path));
+
+        // Never cheaper, and not much more expensive on this board
+        auto approximate_route = approximate.route(begin, finish);
+        EXPECT_LE(cost, approximate_route.cost);
+        EXPECT_LE(approximate_route.cost, cost + cost / 4 + 4);
+        auto approximate_path = approximate.refine(approximate_route);
+        EXPECT_EQ(StepValidator<DynamicBoard>::ALL_STEPS_VALID, validator.first_invalid_step(approximate_path));
+        EXPECT_EQ(approximate_route.cost, path_cost(board, approximate_path));
+    };
+
+    auto free = [&board](const DynPos &pos) {
+        return board.square(pos) != BoardSquare::Rock && board.square(pos) != BoardSquare::Barrier;
+    };
+    for (uint32_t begin = 0; begin < board.num_squares(); begin += 397) {
+        for (uint32_t finish = 11; finish < board.num_squares(); finish += 571) {
+            if (free(board.pos_at(begin)) && free(board.pos_at(finish))) {
+                check(board.pos_at(begin), board.pos_at(finish));
+            }
+        }
+    }
+
+    // Segments are refined one at a time
+    auto route = approximate.route(far_begin, far_finish);
+    ASSERT_GT(route.waypoints.size(), 4u);
+    auto first_leg = approximate.refine_segment(route, 0);
+    EXPECT_EQ(route.waypoints[0], first_leg.front());
+    EXPECT_EQ(route.waypoints[1], first_leg.back());
+
+    // A change in the middle of a chunk only rebuilds that chunk
+    DynPos middle(40, 40);
+    board.set_square(middle, board.square(middle) == BoardSquare::Rock ? BoardSquare::Clear : BoardSquare::Rock);
+    EXPECT_FALSE(exact.is_current());
+    EXPECT_EQ(1u, exact.update());
+    EXPECT_EQ(1u, approximate.update());
+    EXPECT_TRUE(exact.is_current());
+
+    // A wall along a chunk border changes the neighbours as well
+    for (int y = 10; y < 30; y++) {
+        board.set_square({32, y}, BoardSquare::Barrier);
+    }
+    EXPECT_LT(1u, exact.update());
+    approximate.update();
+
+    for (uint32_t begin = 5; begin < board.num_squares(); begin += 701) {
+        for (uint32_t finish = 3; finish < board.num_squares(); finish += 487) {
+            if (free(board.pos_at(begin)) && free(board.pos_at(finish))) {
+                check(board.pos_at(begin), board.pos_at(finish));
+            }
+        }
+    }
+
+    // Same as a planner built from scratch
+    HierarchicalPlanner<DynamicBoard> fresh(board, approximate_options);
+    EXPECT_EQ(fresh.num_abstract_nodes(), approximate.num_abstract_nodes());
+    EXPECT_EQ(fresh.route(far_begin, far_finish).cost, approximate.route(far_begin, far_finish).cost);
+
+    // Changes next to a portal change the moves of its partner, in another
+    // chunk
+    DynamicBoard small(12, 12);
+    small.set_teleports(std::make_pair(DynPos(1, 2), DynPos(9, 9)));
+    HierarchicalOptions small_options;
+    small_options.chunk_size = 4;
+    small_options.exact = true;
+    HierarchicalPlanner<DynamicBoard> small_planner(small, small_options);
+    std::mt19937 rng(3);
+    for (int round = 0; round < 60; round++) {
+        DynPos pos(rng() % 12, rng() % 12);
+        if (small.square(pos) != BoardSquare::Teleport) {
+            small.set_square(pos, rng() % 2 ? BoardSquare::Barrier : BoardSquare::Clear);
+        }
+        small_planner.update();
+        for (uint32_t begin = round % 5; begin < small.num_squares(); begin += 5) {
+            for (uint32_t finish = round % 7; finish < small.num_squares(); finish += 7) {
+                if (begin == finish) {
+                    continue;
+                }
+                int cost = -1;
+                try {
+                    cost = path_cost(small, shortest_path_lvl4(small, small.pos_at(begin), small.pos_at(finish)));
+                } catch (const std::out_of_range &) {
+                    continue;
+                }
+                EXPECT_EQ(cost, small_planner.route(small.pos_at(begin), small.pos_at(finish)).cost)
+                    << small.pos_at(begin) << " -> " << small.pos_at(finish) << " round " << round;
+            }
+        }
+    }
+}
+
+TEST_F(Board32Test, contraction_hierarchy) {
+    ContractionOptions options;
+    options.threads = 2;
+    auto hierarchy = ContractionHierarchy<Board32>::build(board, options);
+    EXPECT_EQ(true, hierarchy.matches(board));
+
+    // Same costs as Dijkstra, unpacked into valid steps, through the
+    // teleport too
+    StepValidator<Board32> validator(board);
+    SearchWorkspace workspace(board);
+    SearchWorkspace forward;
+    SearchWorkspace backward;
+    for (int begin = 0; begin < 1024; begin += 37) {
+        for (int finish = 0; finish < 1024; finish += 23) {
+            auto begin_sq = board.square(Pos32(begin));
+            auto finish_sq = board.square(Pos32(finish));
+            if (begin_sq == BoardSquare::Rock || begin_sq == BoardSquare::Barrier ||
+                finish_sq == BoardSquare::Rock || finish_sq == BoardSquare::Barrier ||
+                begin == finish) {
+                continue;
+            }
+            auto cost = path_cost(board, shortest_path_lvl4(board, Pos32(begin), Pos32(finish), workspace));
+            auto path = hierarchy.shortest_path(board, Pos32(begin), Pos32(finish), forward, backward);
+            EXPECT_EQ(cost, path_cost(board, path));
+            EXPECT_EQ(StepValidator<Board32>::ALL_STEPS_VALID, validator.first_invalid_step(path));
+            EXPECT_EQ(Pos32(begin), path.front());
+            EXPECT_EQ(Pos32(finish), path.back());
+        }
+    }
+
+    auto through_teleport = hierarchy.shortest_path(board, {11, 26}, {25, 28});
+    EXPECT_EQ(PosVec32({{11, 26}, {23, 27}, {25, 28}}), through_teleport);
+    EXPECT_THROW(hierarchy.shortest_path(board, {0, 0}, {9, 3}), std::out_of_range);
+
+    // A single thread gives the same distances
+    options.threads = 1;
+    auto serial = ContractionHierarchy<Board32>::build(board, options);
+    for (int finish = 0; finish < 1024; finish += 5) {
+        if (board.square(Pos32(finish)) == BoardSquare::Rock || board.square(Pos32(finish)) == BoardSquare::Barrier) {
+            continue;
+        }
+        EXPECT_EQ(path_cost(board, hierarchy.shortest_path(board, {9, 30}, Pos32(finish))),
+                  path_cost(board, serial.shortest_path(board, {9, 30}, Pos32(finish))));
+    }
+
+    auto mapped = through_file("knightboard_hierarchy.bin", [&](std::ostream &out) { hierarchy.save(out); },
+                               ContractionHierarchy<Board32>::map_file);
+
+    EXPECT_EQ(hierarchy.bytes(), mapped.bytes());
+    EXPECT_EQ(hierarchy.num_edges(), mapped.num_edges());
+    EXPECT_EQ(true, mapped.matches(board));
+    EXPECT_EQ(hierarchy.shortest_path(board, {9, 30}, {26, 0}), mapped.shortest_path(board, {9, 30}, {26, 0}));
+
+    // Corrupt sizes and offsets are caught before they're used
+    std::ostringstream saved;
+    hierarchy.save(saved);
+    auto load_corrupt = [&](size_t at, uint64_t value, size_t size) {
+        auto bytes = saved.str();
+        std::copy(reinterpret_cast<const char *>(&value), reinterpret_cast<const char *>(&value) + size,
+                  &bytes[at]);
+        std::istringstream in(bytes);
+        return ContractionHierarchy<Board32>::load(in);
+    };
+    EXPECT_THROW(load_corrupt(8, static_cast<uint32_t>(-32), 4), std::runtime_error);
+    EXPECT_THROW(load_corrupt(12, 1 << 30, 4), std::runtime_error);
+    EXPECT_THROW(load_corrupt(16, std::numeric_limits<uint64_t>::max() / 4, 8), std::runtime_error);
+    EXPECT_THROW(load_corrupt(48 + 4 * 5, std::numeric_limits<uint32_t>::max(), 4), std::runtime_error);
+    EXPECT_NO_THROW(load_corrupt(8, 32, 4));
+
+    board.set_square({0, 0}, BoardSquare::Water);
+    EXPECT_EQ(false, hierarchy.is_current(board));
+    EXPECT_EQ(false, mapped.matches(board));
+
+    // Stopping early leaves a core, which is searched like the rest
+    DynamicBoard same;
+    same.load_from_file();
+    options.core_degree = 12;
+    auto with_core = ContractionHierarchy<DynamicBoard>::build(same, options);
+    EXPECT_EQ(true, with_core.matches(same));
+    StepValidator<DynamicBoard> same_validator(same);
+    for (uint32_t finish = 0; finish < 1024; finish += 7) {
+        const auto finish_pos = same.pos_at(finish);
+        if (same.square(finish_pos) == BoardSquare::Rock || same.square(finish_pos) == BoardSquare::Barrier) {
+            continue;
+        }
+        auto path = with_core.shortest_path(same, {26, 0}, finish_pos, forward, backward);
+        EXPECT_EQ(path_cost(same, shortest_path_lvl4(same, {26, 0}, finish_pos)), path_cost(same, path));
+        EXPECT_EQ(StepValidator<DynamicBoard>::ALL_STEPS_VALID, same_validator.first_invalid_step(path));
+    }
+}
+
+TEST(Reachability, matches_flood_fill) {
+    BoardGeneratorOptions options;
+    options.rows = 48;
+    options.cols = 40;
+    options.seed = 9;
+    options.rock = {0.3, 0.4};
+    options.water = {0.1, 0.8};
+    options.wall_spacing = 12;
+    options.teleport_pairs = 1;
+    const auto board = BoardGenerator(options).to_dynamic_board();
+
+    const ReachabilityIndex<DynamicBoard> reachability(board, 2);
+    EXPECT_EQ(true, reachability.is_exact());
+    EXPECT_LT(1u, reachability.num_weak_components());
+    EXPECT_LE(reachability.num_weak_components(), reachability.num_strong_components());
+
+    // Everything the searches can reach, from a few squares (rocks too)
+    int unreachable = 0;
+    for (uint32_t begin = 0; begin < board.num_squares(); begin += 41) {
+        const auto begin_pos = board.pos_at(begin);
+        std::vector<bool> seen(board.num_squares(), false);
+        std::vector<DynPos> queue{begin_pos};
+        seen[begin] = true;
+        for (size_t head = 0; head < queue.size(); head++) {
+            for (const auto &adj : board.adjacent_positions(queue[head])) {
+                if (!seen[board.index_of(adj.first)]) {
+                    seen[board.index_of(adj.first)] = true;
+                    queue.push_back(adj.first);
+                }
+            }
+        }
+
+        for (uint32_t finish = 0; finish < board.num_squares(); finish++) {
+            const auto finish_pos = board.pos_at(finish);
+            const bool portals = board.square(begin_pos) == BoardSquare::Teleport &&
+                                 board.square(finish_pos) == BoardSquare::Teleport;
+            EXPECT_EQ(seen[finish] || portals, reachability.reachable(begin_pos, finish_pos));
+            unreachable += !seen[finish];
+        }
+    }
+    EXPECT_LT(0, unreachable);
+    EXPECT_EQ(false, reachability.reachable({0, 0}, {48, 0}));
+
+    // The searches give up straight away, or find the same path as usual
+    SearchWorkspace workspace;
+    for (uint32_t finish = 0; finish < board.num_squares(); finish += 13) {
+        const DynPos begin(20, 20);
+        const auto finish_pos = board.pos_at(finish);
+        auto path = try_shortest_path_lvl4(board, begin, finish_pos, workspace, reachability);
+        auto moves = try_shortest_path_simple(board, begin, finish_pos, workspace, reachability);
+        auto some = try_some_path_simple(board, begin, finish_pos, reachability);
+        EXPECT_EQ(reachability.reachable(begin, finish_pos), static_cast<bool>(path));
+        EXPECT_EQ(static_cast<bool>(path), static_cast<bool>(moves));
+        EXPECT_EQ(static_cast<bool>(path), static_cast<bool>(some));
+        if (path) {
+            EXPECT_EQ(*path, shortest_path_lvl4(board, begin, finish_pos, workspace));
+            EXPECT_EQ(moves->size(), shortest_path_simple(board, begin, finish_pos, workspace).size());
+        } else {
+            EXPECT_THROW(shortest_path_lvl4(board, begin, finish_pos, workspace), std::out_of_range);
+        }
+    }
+
+    // A non-const index works just the same
+    ReachabilityIndex<DynamicBoard> mutable_index(board, 1);
+    EXPECT_EQ(try_shortest_path_lvl4(board, {20, 20}, {30, 30}, workspace, reachability),
+              try_shortest_path_lvl4(board, {20, 20}, {30, 30}, workspace, mutable_index));
+    EXPECT_EQ(try_shortest_path_simple(board, {20, 20}, {30, 30}, workspace, reachability),
+              try_shortest_path_simple(board, {20, 20}, {30, 30}, workspace, mutable_index));
+    EXPECT_EQ(false, static_cast<bool>(try_some_path_simple(board, {0, 0}, {48, 0}, mutable_index)));
+}
+
+TEST(TiledBoard, sparse_storage) {
+    // All-Clear boards store no tiles at all
+    TiledBoard empty(4096, 4096);
+    EXPECT_EQ(0u, empty.num_stored_tiles());
+    EXPECT_LT(empty.bytes(), empty.num_squares() / 32);
+    empty.set_square({100, 200}, BoardSquare::Water);
+    EXPECT_EQ(BoardSquare::Water, empty.square({100, 200}));
+    EXPECT_EQ(BoardSquare::Clear, empty.square({100, 201}));
+    EXPECT_EQ(1u, empty.num_stored_tiles());
+    empty.set_square({100, 200}, BoardSquare::Clear);
+    empty.compact();
+    EXPECT_EQ(0u, empty.num_stored_tiles());
+
+    // Portals move in pairs, as on DynamicBoard
+    EXPECT_THROW(empty.set_square({5, 5}, BoardSquare::Teleport), std::invalid_argument);
+    empty.set_teleports(std::make_pair(DynPos(5, 5), DynPos(3000, 3000)));
+    EXPECT_THROW(empty.set_square({5, 5}, BoardSquare::Clear), std::invalid_argument);
+    EXPECT_EQ(empty.adjacent_positions({3000, 3000}, true), empty.adjacent_positions({5, 5}));
+    empty.set_teleports(std::experimental::nullopt);
+    EXPECT_EQ(BoardSquare::Clear, empty.square({3000, 3000}));
+    empty.compact();
+    EXPECT_EQ(0u, empty.num_stored_tiles());
+
+    BoardGeneratorOptions options;
+    options.rows = 300;
+    options.cols = 270;
+    options.seed = 4;
+    options.rock = {0.03, 1};
+    options.lava = {0.02, 1};
+    options.teleport_pairs = 1;
+    const auto board = BoardGenerator(options).to_dynamic_board();
+
+    const auto tiled = TiledBoard::from_board(board, 4);
+    EXPECT_EQ(board_fingerprint(board), board_fingerprint(tiled));
+    EXPECT_EQ(board.teleports->first, tiled.teleports->first);
+    EXPECT_LT(tiled.num_stored_tiles(), 19u * 17u);
+
+    const auto mapped = through_file("knightboard_tiled.bin",
+                                     [&](std::ostream &out) { save_tiled_board(board, out, 4); },
+                                     TiledBoard::map_file);
+    EXPECT_EQ(board_fingerprint(board), board_fingerprint(mapped));
+    EXPECT_EQ(tiled.num_stored_tiles(), mapped.num_stored_tiles());
+    EXPECT_LT(mapped.bytes(), board.num_squares() / 4);
+
+    auto cost = [](const auto &b, DynPos begin, DynPos finish) {
+        try {
+            auto path = shortest_path_lvl4(b, begin, finish);
+            EXPECT_EQ(true, is_valid_step_sequence(b, path));
+            return path_cost(b, path);
+        } catch (const std::out_of_range &) {
+            return -1;
+        }
+    };
+    for (int i = 0; i < 6; i++) {
+        DynPos begin(i * 47 % 300, i * 31 % 270);
+        DynPos finish(299 - i * 13 % 300, 269 - i * 59 % 270);
+        EXPECT_EQ(cost(board, begin, finish), cost(mapped, begin, finish));
+    }
+
+    // Writes copy the tile, and never touch the file or other copies
+    auto copy = mapped;
+    const auto version = copy.version();
+    copy.set_square({0, 0}, BoardSquare::Rock);
+    copy.set_square({150, 150}, BoardSquare::Lava);
+    EXPECT_EQ(version + 2, copy.version());
+    EXPECT_EQ(BoardSquare::Lava, copy.square({150, 150}));
+    EXPECT_EQ(board.square({150, 150}), mapped.square({150, 150}));
+    EXPECT_EQ(board_fingerprint(board), board_fingerprint(mapped));
+}
+
+TEST(TerrainLayers, match_board) {
+    BoardGeneratorOptions options;
+    options.rows = 70;
+    options.cols = 150;
+    options.seed = 12;
+    options.rock = {0.2, 0.3};
+    options.water = {0.1, 0.5};
+    options.lava = {0.1, 0.5};
+    options.wall_spacing = 10;
+    options.wall_gap = 1;
+    options.teleport_pairs = 1;
+    auto board = BoardGenerator(options).to_dynamic_board();
+    // A portal right across a barrier
+    board.set_teleports(std::make_pair(DynPos(30, 63), DynPos(32, 64)));
+    board.set_square({31, 64}, BoardSquare::Barrier);
+
+    TerrainLayers<DynamicBoard> layers(board);
+    EXPECT_EQ(0u, layers.update());
+    EXPECT_EQ(160u, layers.cost_stride());
+    EXPECT_EQ(3u, layers.words_per_row());
+
+    auto expect_match = [&] {
+        std::vector<uint64_t> row(layers.words_per_row());
+        for (int r = 0; r < board.rows(); r++) {
+            for (int d = 0; d < 8; d++) {
+                layers.valid_moves_row(d, r, row.data());
+                for (int c = 0; c < 64 * static_cast<int>(row.size()); c++) {
+                    DynPos to(r + KNIGHT_MOVES[d][0], c + KNIGHT_MOVES[d][1]);
+                    bool valid = c < board.cols() && board.is_valid_step({r, c}, to);
+                    EXPECT_EQ(valid, static_cast<bool>((row[c / 64] >> (c % 64)) & 1));
+                }
+            }
+            for (int c = 0; c < board.cols(); c++) {
+                auto sq = board.square({r, c});
+                bool can_land = sq != BoardSquare::Rock && sq != BoardSquare::Barrier;
+                EXPECT_EQ(can_land ? move_weight(sq) : 0, layers.cost({r, c}));
+                EXPECT_EQ(can_land, layers.passable({r, c}));
+                EXPECT_EQ(sq == BoardSquare::Barrier, layers.barrier({r, c}));
+            }
+        }
+        EXPECT_EQ(1, layers.portal(board.teleports->first));
+        EXPECT_EQ(2, layers.portal(board.teleports->second));
+    };
+    expect_match();
+
+    // Picks up changes through the change log
+    board.set_square({5, 5}, BoardSquare::Barrier);
+    board.set_square({5, 64}, BoardSquare::Lava);
+    board.set_square({69, 149}, BoardSquare::Rock);
+    EXPECT_EQ(false, layers.is_current());
+    EXPECT_EQ(3u, layers.update());
+    EXPECT_EQ(true, layers.is_current());
+    expect_match();
+}
+
+// Every step valid, and no square visited twice
+template<typename BOARD>
+bool is_simple_step_path(const BOARD &board, const typename BOARD::PosVec &path) {
+    std::set<uint32_t> seen;
+    for (size_t i = 0; i < path.size(); i++) {
+        if (!seen.insert(board.index_of(path[i])).second) {
+            return false;
+        }
+        if (i > 0 && !board.is_valid_step(path[i - 1], path[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Plain exhaustive search, for checking on tiny boards
+int longest_path_brute_force(const DynamicBoard &board, DynPos from, std::experimental::optional<DynPos> finish,
+                             std::vector<bool> &visited) {
+    int best = (!finish || from == *finish) ? 0 : -1;
+    if (finish && from == *finish) {
+        return best;
+    }
+    for (const auto &move : KNIGHT_MOVES) {
+        DynPos next(from.x + move[0], from.y + move[1]);
+        if (board.is_within_bounds(next) && !visited[board.index_of(next)] && board.is_valid_step(from, next)) {
+            visited[board.index_of(next)] = true;
+            auto rest = longest_path_brute_force(board, next, finish, visited);
+            visited[board.index_of(next)] = false;
+            if (rest >= 0) {
+                best = std::max(best, rest + 1);
+            }
+        }
+    }
+    return best;
+}
+
+TEST(LongestPath, knights_tour) {
+    Board8 board;
+    auto result = longest_path_exact(board, {0, 0}, std::experimental::nullopt);
+    EXPECT_EQ(63, result.moves());
+    EXPECT_EQ(true, result.proven_optimal);
+    EXPECT_EQ(true, is_simple_step_path(board, result.path));
+}
+
+TEST(LongestPath, matches_brute_force) {
+    DynamicBoard board(4, 5);
+    board.set_square({1, 2}, BoardSquare::Rock);
+    board.set_square({2, 0}, BoardSquare::Water);
+    board.set_square({3, 3}, BoardSquare::Barrier);
+
+    for (uint32_t f = 0; f < board.num_squares(); f++) {
+        auto finish = board.pos_at(f);
+        std::vector<bool> visited(board.num_squares(), false);
+        visited[0] = true;
+        auto expected = longest_path_brute_force(board, {0, 0}, finish, visited);
+
+        auto result = longest_path_exact(board, {0, 0}, finish);
+        EXPECT_EQ(true, result.proven_optimal);
+        EXPECT_EQ(expected, result.path.empty() ? -1 : result.moves());
+        if (!result.path.empty()) {
+            EXPECT_EQ(finish, result.path.back());
+            EXPECT_EQ(true, is_simple_step_path(board, result.path));
+        }
+    }
+
+    std::vector<bool> visited(board.num_squares(), false);
+    visited[0] = true;
+    auto result = longest_path_exact(board, {0, 0}, std::experimental::nullopt);
+    EXPECT_EQ(longest_path_brute_force(board, {0, 0}, std::experimental::nullopt, visited), result.moves());
+}
+
+TEST_F(Board32Test, longest_path_budget) {
+    LongestPathOptions options;
+    options.node_budget = 20000;
+    auto result = longest_path_exact(board, {0, 0}, std::experimental::optional<Pos32>({31, 31}), options);
+
+    EXPECT_EQ(false, result.proven_optimal);
+    EXPECT_GE(result.nodes, options.node_budget);
+    EXPECT_EQ(Pos32(31, 31), result.path.back());
+    EXPECT_EQ(true, is_simple_step_path(board, result.path));
+    // A lot longer than the shortest path
+    EXPECT_GT(result.path.size(), 10 * shortest_path_simple(board, {0, 0}, {31, 31}).size());
+}
+
+TEST(LongestPath, anytime_tour) {
+    Board8 board;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    auto result = longest_path_anytime(board, {0, 0}, std::experimental::nullopt, deadline);
+
+    // Warnsdorff finds a tour right away, and that's as good as it gets
+    EXPECT_EQ(63, result.moves());
+    EXPECT_EQ(true, result.proven_optimal);
+    EXPECT_LT(std::chrono::steady_clock::now(), deadline);
+    EXPECT_EQ(true, is_simple_step_path(board, result.path));
+
+    // There's no path from a square to itself
+    auto loop = longest_path_anytime(board, {3, 3}, std::experimental::optional<Pos8>({3, 3}), deadline);
+    EXPECT_EQ(true, loop.path.empty());
+    EXPECT_EQ(true, loop.proven_optimal);
+
+    // Nor out of a walled-in square
+    DynamicBoard walled(6, 6);
+    for (const auto &move : KNIGHT_MOVES) {
+        walled.set_square({2 + move[0], 2 + move[1]}, BoardSquare::Rock);
+    }
+    int improvements = 0;
+    auto stuck = longest_path_anytime(walled, {2, 2}, std::experimental::nullopt, deadline,
+                                      [&](const DynamicBoard::PosVec &) { improvements++; });
+    EXPECT_EQ(true, stuck.path.empty());
+    EXPECT_EQ(true, stuck.proven_optimal);
+    EXPECT_EQ(0, improvements);
+}
+
+TEST_F(Board32Test, longest_path_anytime) {
+    AnytimeLongestPathOptions options;
+    options.threads = 2;
+    std::vector<int> improvements;
+    auto on_improvement = [&](const Board32::PosVec &path) {
+        EXPECT_EQ(Pos32(31, 31), path.back());
+        EXPECT_EQ(true, is_simple_step_path(board, path));
+        improvements.push_back(static_cast<int>(path.size()) - 1);
+    };
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(300);
+    auto result = longest_path_anytime(board, {0, 0}, std::experimental::optional<Pos32>({31, 31}),
+                                       deadline, on_improvement, options);
+
+    EXPECT_EQ(Pos32(0, 0), result.path.front());
+    EXPECT_EQ(Pos32(31, 31), result.path.back());
+    EXPECT_EQ(true, is_simple_step_path(board, result.path));
+    EXPECT_EQ(false, improvements.empty());
+    EXPECT_EQ(true, std::is_sorted(improvements.begin(), improvements.end()));
+    EXPECT_EQ(improvements.end(), std::adjacent_find(improvements.begin(), improvements.end()));
+    EXPECT_EQ(improvements.back(), result.moves());
+    EXPECT_LT(std::chrono::steady_clock::now(), deadline + std::chrono::milliseconds(200));
+}
+
+TEST(LongestPath, anytime_weighted) {
+    DynamicBoard board(6, 6);
+    board.set_square({2, 2}, BoardSquare::Lava);
+    board.set_square({3, 4}, BoardSquare::Lava);
+    board.set_square({1, 3}, BoardSquare::Rock);
+    board.set_square({4, 1}, BoardSquare::Barrier);
+
+    AnytimeLongestPathOptions options;
+    options.weighted = true;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+    auto result = longest_path_anytime(board, {0, 0}, std::experimental::nullopt, deadline,
+                                       [](const DynamicBoard::PosVec &) {}, options);
+
+    EXPECT_EQ(true, is_simple_step_path(board, result.path));
+    EXPECT_EQ(false, result.proven_optimal);
+    // Both lava squares are worth going through
+    auto visits = [&](DynPos pos) { return std::count(result.path.begin(), result.path.end(), pos); };
+    EXPECT_EQ(1, visits({2, 2}));
+    EXPECT_EQ(1, visits({3, 4}));
+}